@@ -1,6 +1,11 @@
 #include <unistd.h>
-#include <sys/time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <map>
+#include <set>
+#include <algorithm>
 #include "asynctask.h"
 
 
@@ -9,54 +14,50 @@
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
 
-#include "util/inv_coredis.h"
+#include "tiny-redis/readthrough.h"
 #include "common/log.h"
 
 std::vector<ASyncTask*> ASyncTask::m_tasks;
-std::bitset<0x10000>    ASyncTask::m_filter;
+InflightTable           ASyncTask::m_inflight;
+MpmcQue<MissTask>*      ASyncTask::m_queue = NULL;
+sem_t                   ASyncTask::m_ready;
 
 ASyncTask::~ASyncTask()
 {
-    delete m_queue;
     delete m_mongoCli;
     delete m_redis;
 }
 
-int ASyncTask::init(int queSize, 
-        const std::string& url, const std::string& db, const std::string& collection,
+int ASyncTask::init(const std::string& url, const std::string& db, const std::string& collection,
         const std::string& redisIP, int redisPort, int redisTimeout)
 {
     m_stop = 0;
 
-    m_queue = new RingQue<MissTask>(queSize);
-    m_lockQue = PTHREAD_MUTEX_INITIALIZER;
-    m_condQue = PTHREAD_COND_INITIALIZER;
-
     m_mongoCli = new MongoCli(url, db, collection);
     int ret = m_mongoCli->init();
 
-    m_redis = new inv::INV_CoRedis;
-    m_redis->init(redisIP, redisPort, redisTimeout);
+    m_redis = new RedisCli(redisIP, redisPort, redisTimeout);
+    m_redis->init();
 
     return ret;
 }
 
-void ASyncTask::ExecMongoTask(const std::string& key)
+#define DATA_TYPE_CATEGORY 1
+#define DATA_TYPE_TAG 2
+#define DATA_TYPE_CATEGORY_STAT 3
+#define DATA_TYPE_TAG_STAT 4
+
+// [type&&uid&&version], 返回dataType, 不认识的key返回-1
+static int ParseMissKey(const std::string& key, std::string& uid, std::string& v)
 {
-    // [type&&uid&&version]
     std::vector<std::string> eles;
     Util::separate(key, "&&", eles);
     if (eles.size() < 2)
     {
-        ELOG("ASyncTask::ExecMongoTask Unknow key: %s", key.c_str());
-        return ;
+        ELOG("ASyncTask::ParseMissKey Unknow key: %s", key.c_str());
+        return -1;
     }
 
-    #define DATA_TYPE_CATEGORY 1
-    #define DATA_TYPE_TAG 2
-    #define DATA_TYPE_CATEGORY_STAT 3
-    #define DATA_TYPE_TAG_STAT 4
-
     int dataType = -1;
     if (eles[0] == "category")
         dataType = DATA_TYPE_CATEGORY;
@@ -66,251 +67,519 @@ void ASyncTask::ExecMongoTask(const std::string& key)
         dataType = DATA_TYPE_CATEGORY_STAT;
     else if (eles[0] == "tag_stat")
         dataType = DATA_TYPE_TAG_STAT;
-    else 
+    else
     {
-        ELOG("ASyncTask::ExecMongoTask Unkonw dataType! key: %s", key.c_str());
-        return ;
+        ELOG("ASyncTask::ParseMissKey Unkonw dataType! key: %s", key.c_str());
+        return -1;
     }
 
-    if (m_redis->exists(eles[1]) <= 0)
+    //统计类的key没有version
+    size_t expect = (dataType == DATA_TYPE_CATEGORY_STAT || dataType == DATA_TYPE_TAG_STAT) ? 2 : 3;
+    if (eles.size() != expect)
     {
-        DLOG("ASyncTask::ExecMongoTask no uid! key: %s, uid: %s", key.c_str(), eles[1].c_str());
-        return ;
+        ELOG("ASyncTask::ParseMissKey invalid key: %s", key.c_str());
+        return -1;
     }
 
-    int ret = 0;
-    std::string result;
-    std::string appInDB;
-    if (dataType == DATA_TYPE_CATEGORY)
+    //version会拼进投影的字段路径(category.<v>), 一批key共用一个投影:
+    //空的, 带'.'(路径冲突)或'$'(操作符)的version会让整批查询失败, 这里直接拒绝
+    if (eles[1].empty() ||
+        (expect == 3 && (eles[2].empty() || eles[2].find_first_of(std::string(".$\0", 3)) != std::string::npos)))
     {
-        if (eles.size() != 3)
-        {
-            ELOG("ASyncTask::ExecMongoTask invalid key: %s", key.c_str());
-            return ;
-        }
+        ELOG("ASyncTask::ParseMissKey invalid uid or version! key: %s", key.c_str());
+        return -1;
+    }
 
-        std::map<std::string, CategoryInfo> cgs;
-        std::map<std::string, TagInfo> tgs;
-        cgs[eles[2]] = CategoryInfo();
-        ret = m_mongoCli->query(eles[1], 0, appInDB, false, cgs, false, tgs);
-        if (ret < 0)
-        {
-            ELOG("ASyncTask::ExecMongoTask query failed! key: %s, ret: %d", key.c_str(), ret);
-            return ;
-        }
+    uid = eles[1];
+    if (expect == 3)
+        v = eles[2];
+    return dataType;
+}
 
-        CategoryInfo& cg = cgs[eles[2]];
-        rapidjson::StringBuffer buf;
-        rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
-        writer.SetMaxDecimalPlaces(3);
+// {"ts":..,"weighted":[{"tag":..,"weight":..}]}
+static std::string WeightedJson(time_t ts, const vector<WeightedInfo>& weighteds)
+{
+    rapidjson::StringBuffer buf;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
+    writer.SetMaxDecimalPlaces(3);
+    writer.StartObject();
+    writer.Key("ts");
+    writer.Int(ts);
+    writer.Key("weighted");
+    writer.StartArray();
+    for (vector<WeightedInfo>::const_iterator it = weighteds.begin(); it != weighteds.end(); ++it)
+    {
         writer.StartObject();
-        writer.Key("ts");
-        writer.Int(cg.ts);
-        writer.Key("weighted");
-        writer.StartArray();
-        for (vector<WeightedInfo>::iterator it = cg.weighteds.begin(); it != cg.weighteds.end(); ++it)
-        {
-            writer.StartObject();
-            writer.Key("tag");
-            writer.String(it->key.c_str());
-            writer.Key("weight");
-            writer.Double(it->weighted);
-            writer.EndObject();
-        }
-        writer.EndArray();
+        writer.Key("tag");
+        writer.String(it->key.c_str());
+        writer.Key("weight");
+        writer.Double(it->weighted);
         writer.EndObject();
-        result = buf.GetString();
     }
-    else if (dataType == DATA_TYPE_TAG)
+    writer.EndArray();
+    writer.EndObject();
+    return buf.GetString();
+}
+
+// {"ts":..,"data":<doc[field]>}, 没有文档或者文档不完整时miss的key为"{}",
+// 整文档回填的兄弟key为""(不回填)
+static std::string StatJson(const std::string& key, const std::string& doc, const char* field, bool missed = true)
+{
+    if (doc.empty())
+        return missed ? "{}" : "";
+
+    rapidjson::Document d;
+    d.Parse(doc.c_str());
+    if (d.HasParseError() || !d.HasMember("ts") || !d["ts"].IsInt() || !d.HasMember(field))
+    {
+        if (!missed)
+            return "";
+        ELOG("ASyncTask::StatJson invalid queried data! key: %s, data: %s", key.c_str(), doc.c_str());
+        return "{}";
+    }
+
+    rapidjson::StringBuffer buf;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
+    writer.StartObject();
+    writer.Key("ts");
+    writer.Int(d["ts"].GetInt());
+    writer.Key("data");
+    d[field].Accept(writer);
+    writer.EndObject();
+    return buf.GetString();
+}
+
+//回填的一个key; missed为false的是整文档回填顺带生成的兄弟key
+typedef struct FillEntry {
+    std::string key;
+    int slot;
+    bool missed;
+    std::string result;
+} FillEntry;
+
+static bool FillEntryBySlot(const FillEntry* a, const FillEntry* b)
+{
+    return a->slot < b->slot;
+}
+
+//按slot分组写入, 每个slot只加一次写锁. miss的key覆盖写;
+//兄弟key只在不存在时写入, 不覆盖客户端写进来的更新的值
+static void FillEntries(std::vector<FillEntry>& entries)
+{
+    //淘汰可能锁任意slot, 必须在加锁之前. 整批只在写之前淘汰一次, 和一条命令一样
+    //写完可以超过maxmemory; 逐slot淘汰会把这一批前面刚写进去的key(包括有GET
+    //在等的miss key)又淘汰掉. 内存不足时放弃整批回填(计入oom_rejects)
+    if (entries.empty() || freeMemoryIfNeeded(NULL) != C_OK)
+        return ;
+
+    std::vector<FillEntry*> sorted;
+    sorted.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].slot >= 0 && entries[i].slot < g_redisDB->dbnum)
+            sorted.push_back(&entries[i]);
+    }
+    std::sort(sorted.begin(), sorted.end(), FillEntryBySlot);
+
+    std::vector<robj*> keys, vals;
+    size_t i = 0;
+    while (i < sorted.size())
     {
-        if (eles.size() != 3)
+        int slot = sorted[i]->slot;
+        size_t j = i;
+
+        //大文档在加锁之前压缩, 避免在写锁内做deflate
+        keys.clear();
+        vals.clear();
+        for (; j < sorted.size() && sorted[j]->slot == slot; j++)
         {
-            ELOG("ASyncTask::ExecMongoTask invalid key: %s", key.c_str());
-            return ;
+            keys.push_back(createStringObject(sorted[j]->key.c_str(), sorted[j]->key.size()));
+            vals.push_back(tryObjectCompression(createStringObject(sorted[j]->result.c_str(), sorted[j]->result.size())));
         }
 
-        std::map<std::string, CategoryInfo> cgs;
-        std::map<std::string, TagInfo> tgs;
-        tgs[eles[2]] = TagInfo();
-        ret = m_mongoCli->query(eles[1], 0, appInDB, false, cgs, false, tgs);
-        if (ret < 0)
+        redisDb* db = &g_redisDB->db[slot];
+        long long filled = 0, prefilled = 0;
+
+        dbWriteLock(db);
+        for (size_t k = 0; k < keys.size(); k++)
         {
-            ELOG("ASyncTask::ExecMongoTask query failed! key: %s, ret: %d", key.c_str(), ret);
-            return ;
+            if (sorted[i + k]->missed)
+            {
+                setKey(db, keys[k], vals[k], (7 * 24 * 60 * 60 * 1000));
+                filled++;
+            }
+            else if (lookupKeyWrite(db, keys[k]) == NULL)
+            {
+                setKey(db, keys[k], vals[k], (7 * 24 * 60 * 60 * 1000));
+                prefilled++;
+            }
         }
+        db->dirty += filled + prefilled;
+        dbWriteUnlock(db);
 
-        TagInfo& tg = tgs[eles[2]];
-        rapidjson::StringBuffer buf;
-        rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
-        writer.SetMaxDecimalPlaces(3);
-        writer.StartObject();
-        writer.Key("ts");
-        writer.Int(tg.ts);
-        writer.Key("weighted");
-        writer.StartArray();
-        for (vector<WeightedInfo>::iterator it = tg.weighteds.begin(); it != tg.weighteds.end(); ++it)
+        if (filled)
+            __atomic_add_fetch(&g_redisDB->stat_async_filled, filled, __ATOMIC_RELAXED);
+        if (prefilled)
+            __atomic_add_fetch(&g_redisDB->stat_async_prefilled, prefilled, __ATOMIC_RELAXED);
+
+        for (size_t k = 0; k < keys.size(); k++)
         {
-            writer.StartObject();
-            writer.Key("tag");
-            writer.String(it->key.c_str());
-            writer.Key("weight");
-            writer.Double(it->weighted);
-            writer.EndObject();
+            decrRefCount(keys[k]);
+            decrRefCount(vals[k]);
         }
-        writer.EndArray();
-        writer.EndObject();
-        result = buf.GetString();
+        i = j;
+    }
+}
+
+static void AddFillEntry(std::vector<FillEntry>& entries, const std::string& key, int slot,
+        bool missed, const std::string& result)
+{
+    entries.push_back(FillEntry());
+    FillEntry& e = entries.back();
+    e.key = key;
+    e.slot = slot >= 0 ? slot : (int)keyHashSlot(key.data(), key.size());
+    e.missed = missed;
+    e.result = result;
+}
+
+//uid的文档能生成的所有key: category&&tok&&*, tag&&tok&&*, category_stat&&tok, tag_stat&&tok;
+//文档里没有统计字段时不生成对应的统计key.
+//tok是miss key里uid那一段的原样(可能带{uid}这样的hash tag)
+static void AddDocumentEntries(std::vector<FillEntry>& entries, const std::string& tok,
+        UserDoc& doc, const std::set<std::string>& missed)
+{
+    std::string key;
+    for (std::map<std::string, CategoryInfo>::iterator it = doc.categorys.begin(); it != doc.categorys.end(); ++it)
+    {
+        key = "category&&" + tok + "&&" + it->first;
+        if (!missed.count(key))
+            AddFillEntry(entries, key, -1, false, WeightedJson(it->second.ts, it->second.weighteds));
+    }
+
+    for (std::map<std::string, TagInfo>::iterator it = doc.tags.begin(); it != doc.tags.end(); ++it)
+    {
+        key = "tag&&" + tok + "&&" + it->first;
+        if (!missed.count(key))
+            AddFillEntry(entries, key, -1, false, WeightedJson(it->second.ts, it->second.weighteds));
+    }
+
+    std::string result;
+    key = "category_stat&&" + tok;
+    if (!missed.count(key) && !(result = StatJson(key, doc.json, "category_stat", false)).empty())
+        AddFillEntry(entries, key, -1, false, result);
+
+    key = "tag_stat&&" + tok;
+    if (!missed.count(key) && !(result = StatJson(key, doc.json, "tag_stat", false)).empty())
+        AddFillEntry(entries, key, -1, false, result);
+}
+
+//{uid} -> uid, 用hash tag把一个uid的key放进同一个slot时, 查询还是用原uid
+static std::string StripHashTag(const std::string& tok)
+{
+    if (tok.size() > 2 && tok[0] == '{' && tok[tok.size() - 1] == '}')
+        return tok.substr(1, tok.size() - 2);
+    return tok;
+}
+
+void ASyncTask::ExecMongoBatch(std::vector<MissTask>& batch)
+{
+    size_t n = batch.size();
+    std::vector<int> types(n, -1);
+    std::vector<std::string> toks(n), uids(n), vs(n);
+    bool document = (g_redisDB->async_fill_policy == ASYNC_FILL_DOCUMENT);
+
+    //所有key先解析出uid, 去重后的uid用一个pipeline一次往返查redis;
+    //存在的uid进queryUids, 各key要的字段合并成一个投影
+    std::map<std::string, int> uidIndex;
+    std::vector<std::string> checkUids;
+    std::vector<int> uidExists;
+    std::vector<std::string> queryUids;
+    std::map<std::string, std::set<std::string> > uidFields;
+    std::set<std::string> failedUids;
+    std::set<std::string> missed;
+    std::map<std::string, std::string> uidToks;
+    bool json = document;
+    int nkeys = 0, nexistsKeys = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        types[i] = ParseMissKey(batch[i].key, toks[i], vs[i]);
+        if (types[i] < 0)
+            continue;
+        uids[i] = StripHashTag(toks[i]);
+
+        nexistsKeys++;
+        if (uidIndex.insert(std::make_pair(uids[i], (int)checkUids.size())).second)
+            checkUids.push_back(uids[i]);
     }
-    else if (dataType == DATA_TYPE_CATEGORY_STAT)
+
+    if (checkUids.empty())
+        return ;
+
+    int ret = m_redis->exists(checkUids, uidExists);
+    if (ret < 0)
+    {
+        ELOG("ASyncTask::ExecMongoBatch exists failed! uids: %d, keys: %d, first: %s, ret: %d",
+                (int)checkUids.size(), nexistsKeys, checkUids[0].c_str(), ret);
+    }
+
+    __atomic_add_fetch(&g_redisDB->stat_async_exists_keys, nexistsKeys, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_redisDB->stat_async_exists_calls, 1, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < n; i++)
     {
-        if (eles.size() != 2)
+        if (types[i] < 0)
+            continue;
+
+        if (!uidExists[uidIndex[uids[i]]])
         {
-            ELOG("ASyncTask::ExecMongoTask invalid key: %s", key.c_str());
-            return ;
+            DLOG("ASyncTask::ExecMongoBatch no uid! key: %s, uid: %s", batch[i].key.c_str(), uids[i].c_str());
+            types[i] = -1;
+            continue;
         }
 
-        std::string condition = "{\"_id\":\"" + eles[1] + "\"}";
-        std::string opt = "{\"projection\":{\"_id\":0,\"tag_stat\":1,\"ts\":1}}";
-        std::vector<std::string> vecRs;
-        ret = m_mongoCli->query(condition, opt, vecRs);
-        if (ret < 0)
+        if (uidToks.insert(std::make_pair(uids[i], toks[i])).second)
+            queryUids.push_back(uids[i]);
+        missed.insert(batch[i].key);
+        nkeys++;
+
+        std::set<std::string>& fields = uidFields[uids[i]];
+        if (document)
         {
-            ELOG("ASyncTask::ExecMongoTask query failed! key: %s, ret: %d", key.c_str(), ret);
-            return ;
+            //整文档回填: 一次取回所有category/tag/统计
+            fields.insert("category");
+            fields.insert("tag");
+            fields.insert("category_stat");
+            fields.insert("tag_stat");
+            fields.insert("ts");
         }
-
-        if (vecRs.size() == 0)
+        else if (types[i] == DATA_TYPE_CATEGORY)
+        {
+            fields.insert("category." + vs[i]);
+        }
+        else if (types[i] == DATA_TYPE_TAG)
         {
-            result = "{}";
+            fields.insert("tag." + vs[i]);
         }
         else
         {
-            rapidjson::Document d;
-            d.Parse(vecRs[0].c_str());
-            if (d.HasParseError() || !d.HasMember("ts") || !d["ts"].IsInt() || !d.HasMember("category_stat"))
+            fields.insert(types[i] == DATA_TYPE_CATEGORY_STAT ? "category_stat" : "tag_stat");
+            fields.insert("ts");
+            json = true;
+        }
+    }
+
+    if (queryUids.empty())
+        return ;
+
+    std::set<std::string> fields;
+    for (std::map<std::string, std::set<std::string> >::iterator it = uidFields.begin(); it != uidFields.end(); ++it)
+        fields.insert(it->second.begin(), it->second.end());
+
+    std::map<std::string, UserDoc> docs;
+    std::vector<std::string> projection(fields.begin(), fields.end());
+    ret = m_mongoCli->query(queryUids, projection, json, docs);
+    int nqueries = 1;
+
+    //整批失败时逐个uid用它自己的投影重查, 一个uid的问题不连累同批的其他uid
+    if (ret < 0)
+    {
+        ELOG("ASyncTask::ExecMongoBatch query failed! uids: %d, keys: %d, first: %s, ret: %d",
+                (int)queryUids.size(), nkeys, queryUids[0].c_str(), ret);
+
+        for (size_t i = 0; i < queryUids.size(); i++)
+        {
+            if (queryUids.size() == 1)
             {
-                ELOG("ASyncTask::ExecMongoTask invalid queried data! key: %s, data: %s", key.c_str(), vecRs[0].c_str());
-                result = "{}";
+                failedUids.insert(queryUids[i]);
+                break;
             }
-            else
+
+            std::vector<std::string> one(1, queryUids[i]);
+            std::set<std::string>& f = uidFields[queryUids[i]];
+            std::vector<std::string> p(f.begin(), f.end());
+            ret = m_mongoCli->query(one, p, json, docs);
+            nqueries++;
+            if (ret < 0)
             {
-                rapidjson::Value& category_stat = d["category_stat"];
-                d.AddMember("data", category_stat, d.GetAllocator());
-                d.RemoveMember("category_stat");
-                rapidjson::StringBuffer buf;
-                rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
-                d.Accept(writer);
-                result = buf.GetString();
+                ELOG("ASyncTask::ExecMongoBatch query failed! uid: %s, ret: %d", queryUids[i].c_str(), ret);
+                failedUids.insert(queryUids[i]);
             }
         }
     }
-    else if (dataType == DATA_TYPE_TAG_STAT)
+
+    __atomic_add_fetch(&g_redisDB->stat_async_mongo_queries, nqueries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_redisDB->stat_async_mongo_keys, nkeys, __ATOMIC_RELAXED);
+
+    //没查到文档的uid按空文档回填, 和逐个查询时一样
+    UserDoc empty;
+    std::vector<FillEntry> entries;
+    for (size_t i = 0; i < n; i++)
     {
-        if (eles.size() != 2)
+        if (types[i] < 0 || failedUids.count(uids[i]))
+            continue;
+
+        std::map<std::string, UserDoc>::iterator it = docs.find(uids[i]);
+        UserDoc& doc = (it != docs.end()) ? it->second : empty;
+
+        //文档里没有这个version时回填空的weighted; 用find, 不往doc里插空项
+        std::string result;
+        if (types[i] == DATA_TYPE_CATEGORY)
         {
-            ELOG("ASyncTask::ExecMongoTask invalid key: %s", key.c_str());
-            return ;
+            std::map<std::string, CategoryInfo>::iterator cg = doc.categorys.find(vs[i]);
+            result = (cg != doc.categorys.end()) ? WeightedJson(cg->second.ts, cg->second.weighteds)
+                                                 : WeightedJson(0, vector<WeightedInfo>());
         }
-        
-        std::string condition = "{\"_id\":\"" + eles[1] + "\"}";
-        std::string opt = "{\"projection\":{\"_id\":0,\"tag_stat\":1,\"ts\":1}}";
-        std::vector<std::string> vecRs;
-        ret = m_mongoCli->query(condition, opt, vecRs);
-        if (ret < 0)
+        else if (types[i] == DATA_TYPE_TAG)
         {
-            ELOG("ASyncTask::ExecMongoTask query failed! key: %s, ret: %d", key.c_str(), ret);
-            return ;
+            std::map<std::string, TagInfo>::iterator tg = doc.tags.find(vs[i]);
+            result = (tg != doc.tags.end()) ? WeightedJson(tg->second.ts, tg->second.weighteds)
+                                            : WeightedJson(0, vector<WeightedInfo>());
         }
-
-        if (vecRs.size() == 0)
+        else if (types[i] == DATA_TYPE_CATEGORY_STAT)
         {
-            result = "{}";
+            result = StatJson(batch[i].key, doc.json, "category_stat");
         }
         else
         {
-            rapidjson::Document d;
-            d.Parse(vecRs[0].c_str());
-            if (d.HasParseError() || !d.HasMember("ts") || !d["ts"].IsInt() || !d.HasMember("tag_stat"))
-            {
-                ELOG("ASyncTask::ExecMongoTask invalid queried data! key: %s, data: %s", key.c_str(), vecRs[0].c_str());
-                result = "{}";
-            }
-            else
-            {
-                rapidjson::Value& category_stat = d["tag_stat"];
-                d.AddMember("data", category_stat, d.GetAllocator());
-                d.RemoveMember("tag_stat");
-                rapidjson::StringBuffer buf;
-                rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
-                d.Accept(writer);
-                result = buf.GetString();
-            }
+            result = StatJson(batch[i].key, doc.json, "tag_stat");
+        }
+
+        AddFillEntry(entries, batch[i].key, batch[i].slot, true, result);
+    }
+
+    if (document)
+    {
+        for (std::map<std::string, UserDoc>::iterator it = docs.begin(); it != docs.end(); ++it)
+        {
+            AddDocumentEntries(entries, uidToks[it->first], it->second, missed);
         }
     }
-    else 
+
+    FillEntries(entries);
+}
+
+bool ASyncTask::PopTask(MissTask& task)
+{
+    //每个post对应一个已发布的任务(或一次stop); 排在它前面的位置可能被
+    //还没写完的生产者占着, 这时TryPop会暂时失败, 让一让再试
+    while (m_queue->TryPop(task) < 0)
     {
-        ELOG("ASyncTask::ExecMongoTask Unknow key: %s", key.c_str());
+        if (__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE))
+        {
+            //拿到的可能是别的线程的stop post(GatherBatch也会sem_trywait),
+            //还回去, 否则那个线程会一直阻塞在sem_wait, Stop()的join挂住
+            sem_post(&m_ready);
+            return false;
+        }
+        sched_yield();
+    }
+    return true;
+}
+
+void ASyncTask::GatherBatch(std::vector<MissTask>& batch)
+{
+    int max = g_redisDB->async_batch_size;
+    long long linger = g_redisDB->async_batch_linger_us;
+    struct timespec deadline;
+
+    if ((int)batch.size() >= max)
         return ;
+
+    if (linger > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += linger / 1000000;
+        deadline.tv_nsec += (linger % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
     }
 
-    unsigned int slot = keyHashSlot(key.c_str(), (int)key.size());
-    if ((int)slot < g_redisDB->dbnum)
+    while ((int)batch.size() < max)
     {
-        robj* objKey = createStringObject(key.c_str(), key.size());
-        robj* objVal = createStringObject(result.c_str(), result.size());
-        
+        //队列里已有的任务直接拿, 空了再等到deadline
+        if (sem_trywait(&m_ready) != 0)
         {
-            pthread_rwlock_wrlock(&g_redisDB->db[slot].rwlock);
-            setKey(&g_redisDB->db[slot], objKey, objVal, (7 * 24 * 60 * 60 * 1000));
-            g_redisDB->db[slot].dirty++;
-            pthread_rwlock_unlock(&g_redisDB->db[slot].rwlock);
+            if (linger <= 0)
+                break;
+            if (sem_timedwait(&m_ready, &deadline) != 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
         }
 
-        decrRefCount(objKey);
-        decrRefCount(objVal);
+        batch.push_back(MissTask());
+        if (!PopTask(batch.back()))
+        {
+            batch.pop_back();
+            break;
+        }
     }
 }
 
 void ASyncTask::run()
 {
-    struct timespec timeout;
-    struct timeval now;
-    pthread_mutex_lock(&m_lockQue);
-    while (!m_stop)
+    std::vector<MissTask> batch;
+
+    while (!__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE))
     {
-        //10ms 扫描一次
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec;
-        timeout.tv_nsec = (now.tv_usec + (10 * 1000)) * 1000;
-        pthread_cond_timedwait(&m_condQue, &m_lockQue, &timeout); 
-        
-        MissTask task;
-        while (!m_stop && m_queue->Pop(task) >= 0) 
+        //阻塞到有任务或者stop(), 不再定时轮询
+        if (sem_wait(&m_ready) != 0)
+            continue;
+
+        batch.clear();
+        batch.push_back(MissTask());
+        if (!PopTask(batch.back()))
+            return;
+
+        GatherBatch(batch);
+
+        DLOG("To Deal ASync Task! key: %s, batch: %d", batch[0].key.c_str(), (int)batch.size());
+        long long start = ustime();
+        ExecMongoBatch(batch);
+
+        long long waitus = 0;
+        for (size_t i = 0; i < batch.size(); i++)
         {
-            DLOG("To Deal ASync Task! key: %s", task.key.c_str());
-            ExecMongoTask(task.key);
+            m_inflight.Release(batch[i].key, batch[i].ms);
 
-            uint16_t h = crc16(task.key.c_str(), task.key.size()) % m_filter.size();
-            m_filter.reset(h);
-        } 
+            //唤醒等待这个key的read-through GET, 回填失败时它们回复nil
+            readThroughNotify(batch[i].key.data(), batch[i].key.size());
+
+            waitus += start - (long long)batch[i].ms * 1000;
+        }
+
+        __atomic_add_fetch(&g_redisDB->stat_async_us, ustime() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_redisDB->stat_async_wait_us, waitus, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_redisDB->stat_async_done, (long long)batch.size(), __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(&m_lockQue);
 }
 
 void ASyncTask::stop()
 {
-    m_stop = 1;
-    pthread_cond_signal(&m_condQue);
+    __atomic_store_n(&m_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&m_ready);
 }
 
 int ASyncTask::Start(int n, int queSize, 
         const std::string& url, const std::string& db, const std::string& collection,
-        const std::string& redisIP, int redisPort, int redisTimeout)
+        const std::string& redisIP, int redisPort, int redisTimeout,
+        const int* cpus, int ncpus)
 {
+    m_queue = new MpmcQue<MissTask>(queSize * (n > 0 ? n : 1));
+    sem_init(&m_ready, 0, 0);
+
     for (int i = 0; i < n; i++)
     {
         ASyncTask* t = new ASyncTask;
-        t->init(queSize, url, db, collection, redisIP, redisPort, redisTimeout);
+        t->init(url, db, collection, redisIP, redisPort, redisTimeout);
+        if (cpus && ncpus > 0)
+            t->setAffinity(cpus, ncpus);
         m_tasks.push_back(t);
     }
 
@@ -322,9 +591,15 @@ int ASyncTask::Start(int n, int queSize,
 
 void ASyncTask::Stop()
 {
+    //先让所有线程都看到m_stop再post, 被别的线程拿走的post不会让谁空等自己的stop
     for (int i = 0; i < (int)m_tasks.size(); i++)
     {
-        m_tasks[i]->stop();
+        __atomic_store_n(&m_tasks[i]->m_stop, 1, __ATOMIC_RELEASE);
+    }
+
+    for (int i = 0; i < (int)m_tasks.size(); i++)
+    {
+        sem_post(&m_ready);
     }
 
     for (int i = 0; i < (int)m_tasks.size(); i++)
@@ -334,46 +609,49 @@ void ASyncTask::Stop()
     }
 
     m_tasks.clear();
+
+    delete m_queue;
+    m_queue = NULL;
+    sem_destroy(&m_ready);
 }
 
-int ASyncTask::PushTask(const char* key)
+int ASyncTask::PushTask(const char* key, size_t len, int slot)
 {
     MissTask task;
     
     if (m_tasks.size() == 0)
         return -101;
     
-    uint16_t h = crc16(key, strlen(key)) % m_filter.size();
-    if (m_filter.test(h))
+    task.ms = Util::ms();
+    task.key.assign(key, len);
+    task.slot = slot;
+
+    int acquired = m_inflight.Acquire(task.key, task.ms, g_redisDB->async_inflight_max_age);
+    if (acquired < 0)
     {
-        DLOG("ASyncTask::PushTask A Task(%u) Is Running!", h);
+        DLOG("ASyncTask::PushTask A Task Is Running! key: %s", task.key.c_str());
+        __atomic_add_fetch(&g_redisDB->stat_async_deduped, 1, __ATOMIC_RELAXED);
         return -100;
     }
-    m_filter.set(h);
-
-    task.ms = Util::ms();
-    task.key = key;
-
-    int index = rand() % m_tasks.size();
-    int minIndex = index;
-    uint32_t minLen = (uint32_t)(-1);
-    for (int i = 0; i < (int)m_tasks.size(); i++, index = (index + 1) % m_tasks.size())
+    else if (acquired > 0)
     {
-        if (m_tasks[index] && m_tasks[index]->m_queue->Len() < minLen)
-        {
-            minIndex = index;
-            minLen = m_tasks[index]->m_queue->Len();
-        }
-
-        if (minLen == 0)
-            break;
+        ELOG("ASyncTask::PushTask take over a stuck task! key: %s", task.key.c_str());
+        __atomic_add_fetch(&g_redisDB->stat_async_stuck, 1, __ATOMIC_RELAXED);
     }
 
-    int ret = m_tasks[minIndex]->m_queue->Push(task);
-    pthread_cond_signal(&m_tasks[minIndex]->m_condQue);
+    //失败时task不会被move, key还可以用来Release
+    int ret = m_queue->Push(std::move(task));
     if (ret < 0)
-        m_filter.reset(h);
-    DLOG("ASyncTask::PushTask id: %d, h: %u, key: %s, ret: %d", minIndex, h, key, ret);
+    {
+        m_inflight.Release(task.key, task.ms);
+        __atomic_add_fetch(&g_redisDB->stat_async_dropped, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        sem_post(&m_ready);
+        __atomic_add_fetch(&g_redisDB->stat_async_pushed, 1, __ATOMIC_RELAXED);
+    }
+    DLOG("ASyncTask::PushTask key: %.*s, ret: %d", (int)len, key, ret);
     
     return ret;
 }
@@ -4,33 +4,31 @@
 #include "util/thread.h"
 #include "util/lock.h"
 #include "util/util.h"
-#include "util/ringque.h"
+#include "util/mpmcque.h"
+#include "util/inflight.h"
 
 #include "common/mongo_cli.h"
+#include "common/redis_cli.h"
 
 #include <string>
 #include <vector>
-#include <bitset>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "tiny-redis/server.h"
 
 typedef struct MissTask {
     uint64_t ms;
     std::string key;
+    int slot;           /* keyHashSlot(key), computed by the worker */
 } MissTask;
 
-namespace inv {
-    class INV_CoRedis;
-}
-
 class ASyncTask : public ThreadBase
 {
 public:
     virtual ~ASyncTask();
 
-    int init(int queSize, 
-            const std::string& url, const std::string& db, const std::string& collection,
+    int init(const std::string& url, const std::string& db, const std::string& collection,
             const std::string& redisIP, int redisPort, int redisTimeout);
 
     virtual void run();
@@ -39,33 +37,44 @@ public:
 
 protected:
 
-    void ExecMongoTask(const std::string& key);
+    //从共用队列取出一个sem_wait到的任务, stop()时返回false
+    bool PopTask(MissTask& task);
+
+    //已经取到batch[0]之后, 继续取到async-batch-size个任务, 最多等async-batch-linger-us
+    void GatherBatch(std::vector<MissTask>& batch);
+
+    //按uid合并成一次$in查询, 再把结果分发回每个key;
+    //async-fill-policy为document时顺带回填uid文档能生成的所有key, 同一slot的key一次加锁写入
+    void ExecMongoBatch(std::vector<MissTask>& batch);
 
 protected:
     ASyncTask() {}
 
     int m_stop;
 
-    RingQue<MissTask>*  m_queue;
-    pthread_mutex_t     m_lockQue;
-    pthread_cond_t      m_condQue;
-
     MongoCli*           m_mongoCli;
-    inv::INV_CoRedis*   m_redis;
+    RedisCli*           m_redis;
 
 public:
     static int Start(int n, int queSize, 
             const std::string& url, const std::string& db, const std::string& collection,
-            const std::string& redisIP, int redisPort, int redisTimeout);
+            const std::string& redisIP, int redisPort, int redisTimeout,
+            const int* cpus = NULL, int ncpus = 0);
 
     static void Stop();
 
-    static int PushTask(const char* key);
+    //slot由调用方传入(即c->db->id), 不再重复计算crc16
+    static int PushTask(const char* key, size_t len, int slot);
 
 protected:
     static std::vector<ASyncTask*>  m_tasks;
 
-    static std::bitset<0x10000>     m_filter;
+    //所有ASyncTask共用的任务队列, 每Push一个任务post一次m_ready
+    static MpmcQue<MissTask>*       m_queue;
+    static sem_t                    m_ready;
+
+    //正在回填的key, 同一个key同时只有一个回填任务
+    static InflightTable            m_inflight;
 };
 
 #endif
@@ -587,6 +587,99 @@ int MongoCli::query(const string& uid, int version, string& app,
     return ret;
 }
 
+int MongoCli::query(const vector<string>& uids, const vector<string>& fields, bool json,
+                map<string, UserDoc>& docs)
+{
+    int ret = 0;
+    if (uids.empty())
+        return 0;
+
+    if (!m_collection)
+    {
+        init();
+        if (!m_collection)
+        {
+            FDLOG("error") << "MongoCli::query uids: " << uids.size() << ", collection is NULL!" << endl;
+            return -1;
+        }
+    }
+
+    bson_error_t error;
+    bson_t qb, idb, inb;
+    bson_init(&qb);
+    BSON_APPEND_DOCUMENT_BEGIN(&qb, "_id", &idb);
+    BSON_APPEND_ARRAY_BEGIN(&idb, "$in", &inb);
+    for (size_t i = 0; i < uids.size(); i++)
+    {
+        char buf[16];
+        const char* idx = NULL;
+        bson_uint32_to_string((uint32_t)i, &idx, buf, sizeof(buf));
+        bson_append_utf8(&inb, idx, -1, uids[i].c_str(), (int)uids[i].size());
+    }
+    bson_append_array_end(&idb, &inb);
+    bson_append_document_end(&qb, &idb);
+
+    //_id保留, 用来把结果对应回uid
+    bson_t optb, fb;
+    bson_init(&optb);
+    BSON_APPEND_DOCUMENT_BEGIN(&optb, "projection", &fb);
+
+    BSON_APPEND_BOOL(&fb, "v", true);
+    BSON_APPEND_BOOL(&fb, "app", true);
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        BSON_APPEND_INT32(&fb, fields[i].c_str(), true);
+    }
+
+    bson_append_document_end(&optb, &fb);
+
+    bool have = false;
+    const bson_t* doc = NULL;
+    mongoc_cursor_t* cursor = mongoc_collection_find_with_opts(m_collection, &qb, &optb, NULL);
+    while (mongoc_cursor_next(cursor, &doc))
+    {
+        bson_iter_t iter;
+        if (!doc || !bson_iter_init_find(&iter, doc, "_id") || !BSON_ITER_HOLDS_UTF8(&iter))
+        {
+            continue;
+        }
+
+        uint32_t len = 0;
+        const char* id = bson_iter_utf8(&iter, &len);
+        string uid(id, len);
+
+        UserDoc& ud = docs[uid];
+        ParseODoc(uid, *doc, ud.version, ud.app, ud.categorys, ud.tags);
+        if (json)
+        {
+            char* str = bson_as_json(doc, NULL);
+            if (str)
+            {
+                ud.json = str;
+                bson_free(str);
+            }
+        }
+        ret++;
+        have = true;
+    }
+
+    if (mongoc_cursor_error(cursor, &error))
+    {
+        FDLOG("error") << " MongoCli::query error! uids: " << uids.size() << ", first: " << uids[0]
+            << ", have: " << have << ", err: " << error.message << endl;
+        if (!have)
+            ret = -2;
+    }
+
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+
+    bson_destroy(&qb);
+    bson_destroy(&optb);
+
+    return ret;
+}
+
 /*
  *  {
  *      "v" : 1,
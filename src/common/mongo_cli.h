@@ -47,6 +47,16 @@ typedef struct TagInfo {
     TagInfo(const string& c, time_t t, const vector<WeightedInfo>& w) : config(c), ts(t), weighteds(w) {}
     TagInfo() : config(""), ts(0) {}
 } TagInfo;
+
+typedef struct UserDoc {
+    int                         version;
+    string                      app;
+    map<string, CategoryInfo>   categorys;
+    map<string, TagInfo>        tags;
+    string                      json;       //投影后的整个文档, 只在要求时生成
+
+    UserDoc() : version(0) {}
+} UserDoc;
 /**************************************/
 
 class MongoCli {
@@ -73,6 +83,11 @@ public:
                 bool allCategorys, map<string, CategoryInfo>& categorys,
                 bool allTags, map<string, TagInfo>& tags);
 
+    //一次find({_id: {$in: uids}})查出多个uid, 投影为v, app加上fields的并集;
+    //查到的文档按_id放进docs, json为true时同时保存文档的json. 返回查到的文档数
+    int query(const vector<string>& uids, const vector<string>& fields, bool json,
+                map<string, UserDoc>& docs);
+
 public:
     string GetUrl() { return m_url; }
     string GetDBName() { return m_dbName; }
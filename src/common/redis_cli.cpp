@@ -0,0 +1,106 @@
+#include <sys/time.h>
+
+#include "common/log.h"
+#include "redis_cli.h"
+
+RedisCli::RedisCli(const string& ip, int port, int timeoutMs)
+{
+    m_ip = ip;
+    m_port = port;
+    m_timeoutMs = timeoutMs;
+
+    m_ctx = NULL;
+}
+
+RedisCli::~RedisCli()
+{
+    close();
+}
+
+void RedisCli::close()
+{
+    if (m_ctx)
+    {
+        redisFree(m_ctx);
+        m_ctx = NULL;
+    }
+}
+
+int RedisCli::init()
+{
+    if (m_ctx)
+        return 0;
+
+    struct timeval tv;
+    tv.tv_sec = m_timeoutMs / 1000;
+    tv.tv_usec = (m_timeoutMs % 1000) * 1000;
+
+    m_ctx = redisConnectWithTimeout(m_ip.c_str(), m_port, tv);
+    if (!m_ctx || m_ctx->err)
+    {
+        FDLOG("error") << "RedisCli::init connect failed! ip: " << m_ip << ", port: " << m_port
+            << ", err: " << (m_ctx ? m_ctx->errstr : "can't allocate redis context") << endl;
+        close();
+        return -1;
+    }
+
+    //连接超时之外, 读写也用同一个超时, 一批回填不会卡在一个慢的redis上
+    if (redisSetTimeout(m_ctx, tv) != REDIS_OK)
+    {
+        FDLOG("error") << "RedisCli::init redisSetTimeout failed! ip: " << m_ip << ", port: " << m_port
+            << ", err: " << m_ctx->errstr << endl;
+        close();
+        return -2;
+    }
+
+    return 0;
+}
+
+int RedisCli::exists(const vector<string>& keys, vector<int>& found)
+{
+    found.assign(keys.size(), 0);
+    if (keys.empty())
+        return 0;
+
+    if (!m_ctx && init() < 0)
+        return -1;
+
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (redisAppendCommand(m_ctx, "EXISTS %b", keys[i].data(), keys[i].size()) != REDIS_OK)
+        {
+            FDLOG("error") << "RedisCli::exists redisAppendCommand failed! keys: " << keys.size()
+                << ", err: " << m_ctx->errstr << endl;
+            close();
+            return -2;
+        }
+    }
+
+    //第一个redisGetReply把攒下的命令一次写出去, 之后的只是读
+    int ret = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        redisReply* reply = NULL;
+        if (redisGetReply(m_ctx, (void**)&reply) != REDIS_OK)
+        {
+            FDLOG("error") << "RedisCli::exists redisGetReply failed! keys: " << keys.size()
+                << ", replied: " << i << ", err: " << m_ctx->errstr << endl;
+            close();
+            return -3;
+        }
+
+        if (reply->type == REDIS_REPLY_INTEGER)
+        {
+            found[i] = reply->integer > 0 ? 1 : 0;
+        }
+        else
+        {
+            FDLOG("error") << "RedisCli::exists unexpected reply! key: " << keys[i]
+                << ", type: " << reply->type << endl;
+            ret = -4;
+        }
+        freeReplyObject(reply);
+    }
+
+    return ret;
+}
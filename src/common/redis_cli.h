@@ -0,0 +1,35 @@
+#ifndef __REDIS_CLI_H__
+#define __REDIS_CLI_H__
+
+#include <hiredis.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RedisCli {
+public:
+    RedisCli(const string& ip, int port, int timeoutMs);
+
+    virtual ~RedisCli();
+
+    int init();
+
+    //一次往返查多个key: 所有EXISTS先写进输出缓冲, 一次发出去再依次读回复;
+    //found[i]为keys[i]的EXISTS结果, 没拿到回复的key为0(按不存在处理).
+    //成功返回0, 出错返回<0; 连接出错时断开, 下次调用时重连
+    int exists(const vector<string>& keys, vector<int>& found);
+
+protected:
+    void close();
+
+protected:
+    string                  m_ip;
+    int                     m_port;
+    int                     m_timeoutMs;
+
+    redisContext*           m_ctx;
+};
+
+#endif
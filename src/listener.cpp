@@ -14,6 +14,7 @@ int Listener::init(char* bindaddr, int port)
         return -1;
     }
     m_listenFd = fd;
+    m_rr = 0;
 
     m_el = aeCreateEventLoop(32, NULL);
     aeCreateFileEvent(m_el, fd, AE_READABLE, Listener::AcceptHandler, this);
@@ -24,6 +25,7 @@ int Listener::init(char* bindaddr, int port)
 int Listener::AddWorker(Worker* w)
 {
     m_workers.push_back(w);
+    m_procs.push_back(w->redis());
 
     return (int)m_workers.size();
 }
@@ -36,8 +38,6 @@ void Listener::AcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask)
     UNUSED(el);
     UNUSED(mask);
 
-    static uint64_t index = 0;
-
     Listener* l = (Listener*)privdata;
 
     while(max--) {
@@ -50,10 +50,13 @@ void Listener::AcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask)
         }
         DLOG("Accepted %s:%d", cip, cport);
 
-        NotifyInfo info;
-        info.fd = cfd;
-        info.ms = 0;
-        write(l->m_workers[index++ % l->m_workers.size()]->redis()->notify_fd_write, (void*)&info, sizeof(info));
+        TinyRedisProc* proc = selectTinyRedisProc(&l->m_procs[0], (int)l->m_procs.size(), 
+                g_redisDB->placement, &l->m_rr);
+        if (postNotify(proc, acceptNotifyHandler, cfd, NULL) != C_OK)
+        {
+            ELOG("worker inbox full, drop %s:%d", cip, cport);
+            close(cfd);
+        }
     }
 }
 
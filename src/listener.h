@@ -25,6 +25,8 @@ protected:
     aeEventLoop*            m_el;
 
     vector<Worker*>         m_workers; 
+    vector<TinyRedisProc*>  m_procs;
+    uint64_t                m_rr;
 };
 
 #endif
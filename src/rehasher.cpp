@@ -10,40 +10,47 @@ int ReHasher::init(TinyRedisDB* db)
     return 0;
 }
 
+/*
+ * 只处理写线程标记过的slot(rehash_dirty位图), 不再每轮遍历全部dbnum.
+ * 每个slot每次最多持有写锁rehash-hold-us微秒, 还有剩余工作时由dbWriteUnlock重新置位,
+ * 下一轮继续. 有工作时每轮之间只让出rehash-hold-us, 空闲时休眠时间倍增到100ms.
+ */
 void ReHasher::run()
 {
+    int words = (m_redisDB->dbnum + 63) / 64;
+    long long idleSleep = REHASH_IDLE_SLEEP_MIN_US;
+
     while (!m_stop)
     {
-        for (int i = 0; i < m_redisDB->dbnum; i++)
+        int busy = 0;
+
+        for (int w = 0; w < words && !m_stop && m_redisDB->activerehashing; w++)
         {
-            /*
-            long long size, used;
-            size = dictSlots(m_redisDB->db[i].d);
-            used = dictSize(m_redisDB->db[i].d);
-            if (used)
-                DLOG("db: %d, size: %d, used: %d, rate: %d", i, size, used, size ? used*100/size: 0);
-            */
-
-            if (!dictIsRehashing(m_redisDB->db[i].d) && htNeedsResize(m_redisDB->db[i].d))
-            {
-                pthread_rwlock_wrlock(&m_redisDB->db[i].rwlock);
-                dictResize(m_redisDB->db[i].d);
-                pthread_rwlock_unlock(&m_redisDB->db[i].rwlock);
-            }
+            uint64_t bits = __atomic_exchange_n(&m_redisDB->rehash_dirty[w], 0, __ATOMIC_ACQ_REL);
 
-            if (dictIsRehashing(m_redisDB->db[i].d))
+            while (bits)
             {
-                DLOG("do rehash for db: %d", i);
-                pthread_rwlock_wrlock(&m_redisDB->db[i].rwlock);
-                dictRehashMilliseconds(m_redisDB->db[i].d, 1);
-                pthread_rwlock_unlock(&m_redisDB->db[i].rwlock);
-            }
+                int slot = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
 
-            //hashmap 的rehash 在hashmap的写操作中完成
+                if (dbRehashStep(&m_redisDB->db[slot], m_redisDB->rehash_hold_us))
+                    busy = 1;
+            }
         }
 
-        //休眠200ms
-        usleep(2000000);
+        if (busy)
+        {
+            //让写线程拿到锁
+            idleSleep = REHASH_IDLE_SLEEP_MIN_US;
+            usleep(m_redisDB->rehash_hold_us);
+        }
+        else
+        {
+            usleep(idleSleep);
+            idleSleep *= 2;
+            if (idleSleep > REHASH_IDLE_SLEEP_MAX_US)
+                idleSleep = REHASH_IDLE_SLEEP_MAX_US;
+        }
     }
 }
 
@@ -51,5 +58,3 @@ void ReHasher::stop()
 {
     m_stop = 1;
 }
-
-
@@ -1,48 +1,117 @@
+#include <set>
 #include "listener.h"
 #include "worker.h"
 #include "rehasher.h"
 #include "asynctask.h"
 
 #include "common/log.h"
+#include "util/util.h"
 
 #include "tiny-redis/server.h"
 
+static void reportThread(const char* name, int i, const std::vector<int>& cpus)
+{
+    //NUMA节点去重, 按节点号升序输出
+    std::set<int> nodeSet;
+    for (size_t j = 0; j < cpus.size(); j++)
+        nodeSet.insert(Util::cpuNode(cpus[j]));
+
+    std::string nodes;
+    for (std::set<int>::iterator it = nodeSet.begin(); it != nodeSet.end(); ++it)
+        nodes += (nodes.empty() ? "" : ",") + Util::tostr(*it);
+
+    ILOG("topology: %s[%d] cpus: %s, numa node: %s", 
+            name, i, Util::cpulist(cpus).c_str(), nodes.empty() ? "any" : nodes.c_str());
+}
 
 int main(int argc, char* argv[])
 {
-    UNUSED(argc);
-    UNUSED(argv);
-
     FDLOG("icache") << "start" << endl;
 
     g_redisDB = CreateTinyRedisDB();
+    if (argc >= 2)
+        loadServerConfig(argv[1], NULL);
 
-    Listener l;
-    l.init((char*)"0.0.0.0", 10000);
-
-    Worker w[4];
-    for (int i = 0; i < 4; i++)
+    int nworkers = g_redisDB->workers;
+    Worker* w = new Worker[nworkers];
+    for (int i = 0; i < nworkers; i++)
     {
+        //每个worker独占一个cpu, proc在绑核后的worker线程里创建,
+        //它和之后分配的内存按first-touch落在该cpu的NUMA节点上
+        if (g_redisDB->worker_ncpus > 0)
+            w[i].setAffinity(&g_redisDB->worker_cpus[i % g_redisDB->worker_ncpus], 1);
         w[i].init(g_redisDB);
-        l.AddWorker(&w[i]);
-        w[i].start();   
+        if (w[i].start() != 0)
+        {
+            ELOG("worker %d start failed", i);
+            return -1;
+        }
     }
 
-    l.start();
+    //优先每个worker各自监听(SO_REUSEPORT), 失败时回退到单独的Listener线程
+    bool reuseport = (g_redisDB->reuseport != 0);
+    for (int i = 0; reuseport && i < nworkers; i++)
+    {
+        if (w[i].listen((char*)"0.0.0.0", 10000) != 0)
+        {
+            ELOG("SO_REUSEPORT listen failed on worker %d, fallback to listener", i);
+            reuseport = false;
+        }
+    }
+
+    Listener l;
+    if (!reuseport)
+    {
+        for (int i = 0; i < nworkers; i++)
+            w[i].unlisten();
+
+        l.init((char*)"0.0.0.0", 10000);
+        for (int i = 0; i < nworkers; i++)
+            l.AddWorker(&w[i]);
+        l.setAffinity(g_redisDB->background_cpus, g_redisDB->background_ncpus);
+    }
 
     ReHasher h;
     h.init(g_redisDB);
+    h.setAffinity(g_redisDB->background_cpus, g_redisDB->background_ncpus);
+
+    ILOG("topology: %d online cpus, %d workers, %d async tasks, accept by %s", 
+            Util::cpus(), nworkers, g_redisDB->async_tasks, reuseport ? "workers" : "listener");
+    //SO_REUSEPORT由内核分配连接, placement-policy只在Listener模式下生效
+    if (reuseport)
+        ILOG("topology: connections placed by the kernel, placement-policy unused, client-migrate %s",
+                g_redisDB->client_migrate ? "yes" : "no");
+    for (int i = 0; i < nworkers; i++)
+        reportThread("worker", i, w[i].affinity());
+    if (!reuseport)
+        reportThread("listener", 0, l.affinity());
+    reportThread("rehasher", 0, h.affinity());
+    std::vector<int> asyncCpus(g_redisDB->async_task_cpus, 
+            g_redisDB->async_task_cpus + g_redisDB->async_task_ncpus);
+    for (int i = 0; i < g_redisDB->async_tasks; i++)
+        reportThread("asynctask", i, asyncCpus);
+
+    for (int i = 0; i < nworkers; i++)
+        w[i].go();
+
+    if (!reuseport)
+        l.start();
+
     h.start();
 
-    ASyncTask::Start(2, 1024, 
+    ASyncTask::Start(g_redisDB->async_tasks, 1024, 
             "mongodb://192.168.1.235:10000/?connectTimeoutMS=100&socketTimeoutMS=5000", "ufs", "user",
-            "192.168.1.17", 8888, 200);
+            "192.168.1.17", 8888, 200,
+            g_redisDB->async_task_cpus, g_redisDB->async_task_ncpus);
 
-    pthread_join(l.getid(), NULL);
-    for (int i = 0; i < 4; i++)
+    if (!reuseport)
+        pthread_join(l.getid(), NULL);
+    for (int i = 0; i < nworkers; i++)
         pthread_join(w[i].getid(), NULL);
     pthread_join(h.getid(), NULL);
     ASyncTask::Stop();
+
+    delete[] w;
     
     return 0;
 }
@@ -50,6 +50,29 @@ configEnum loglevel_enum[] = {
     {NULL,0}
 };
 
+configEnum placement_enum[] = {
+    {"roundrobin", PLACEMENT_ROUNDROBIN},
+    {"leastconn", PLACEMENT_LEASTCONN},
+    {"leastlatency", PLACEMENT_LEASTLATENCY},
+    {"p2c", PLACEMENT_P2C},
+    {NULL,0}
+};
+
+configEnum maxmemory_policy_enum[] = {
+    {"volatile-ttl", MAXMEMORY_VOLATILE_TTL},
+    {"allkeys-lru", MAXMEMORY_ALLKEYS_LRU},
+    {"allkeys-lfu", MAXMEMORY_ALLKEYS_LFU},
+    {"allkeys-random", MAXMEMORY_ALLKEYS_RANDOM},
+    {"noeviction", MAXMEMORY_NO_EVICTION},
+    {NULL, 0}
+};
+
+configEnum async_fill_policy_enum[] = {
+    {"key", ASYNC_FILL_KEY},
+    {"document", ASYNC_FILL_DOCUMENT},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -86,6 +109,16 @@ const char *configEnumGetNameOrUnknown(configEnum *ce, int val) {
     return name ? name : "unknown";
 }
 
+/* Name of a MAXMEMORY_* policy, for INFO. */
+const char *maxmemoryPolicyName(int policy) {
+    return configEnumGetNameOrUnknown(maxmemory_policy_enum,policy);
+}
+
+/* Name of an ASYNC_FILL_* policy, for INFO. */
+const char *asyncFillPolicyName(int policy) {
+    return configEnumGetNameOrUnknown(async_fill_policy_enum,policy);
+}
+
 
 /*-----------------------------------------------------------------------------
  * Config file parsing
@@ -97,6 +130,48 @@ int yesnotoi(char *s) {
     else return -1;
 }
 
+/* Parse a cpu list such as "0-7,16,18-19" into a zmalloc'ed array. The
+ * special value "none" clears the list. Returns C_ERR on syntax errors. */
+static int parseCpuList(const char *s, int **cpus, int *ncpus) {
+    int *list = NULL, n = 0;
+    const char *p = s;
+
+    zfree(*cpus);
+    *cpus = NULL;
+    *ncpus = 0;
+    if (!strcasecmp(s,"none")) return C_OK;
+
+    while (*p) {
+        char *end;
+        long first, last, j;
+
+        first = last = strtol(p,&end,10);
+        if (end == p || first < 0) goto err;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p,&end,10);
+            if (end == p || last < first) goto err;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) goto err;
+        if (*p == ',') p++;
+        else if (*p != '\0') goto err;
+
+        list = (int*)zrealloc(list,sizeof(int)*(n+last-first+1));
+        for (j = first; j <= last; j++) list[n++] = (int)j;
+    }
+    if (n == 0) goto err;
+
+    *cpus = list;
+    *ncpus = n;
+    return C_OK;
+
+err:
+    zfree(list);
+    return C_ERR;
+}
+
 void loadServerConfigFromString(char *config) {
     const char *err = NULL;
     int linenum = 0, totlines, i;
@@ -134,6 +209,144 @@ void loadServerConfigFromString(char *config) {
             if (g_redisDB->tcpkeepalive < 0) {
                 err = "Invalid tcp-keepalive value"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"reuseport") && argc == 2) {
+            if ((g_redisDB->reuseport = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"placement-policy") && argc == 2) {
+            /* Only used by the Listener thread, that is with reuseport no
+             * or when a worker fails to open its SO_REUSEPORT socket. With
+             * reuseport yes the kernel picks the worker of every connection
+             * and client-migrate is the only rebalancing left. */
+            g_redisDB->placement = configEnumGetValue(placement_enum,argv[1]);
+            if (g_redisDB->placement == INT_MIN) {
+                err = "Invalid placement policy. "
+                      "Must be one of roundrobin, leastconn, leastlatency, p2c";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"client-migrate") && argc == 2) {
+            if ((g_redisDB->client_migrate = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"client-migrate-ratio") && argc == 2) {
+            g_redisDB->client_migrate_ratio = atoi(argv[1]);
+            if (g_redisDB->client_migrate_ratio <= 100) {
+                err = "client-migrate-ratio must be greater than 100"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lockfree-reads") && argc == 2) {
+            if ((g_redisDB->lockfree_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"read-through") && argc == 2) {
+            if ((g_redisDB->readthrough = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"read-through-timeout") && argc == 2) {
+            g_redisDB->readthrough_timeout = strtoll(argv[1],NULL,10);
+            if (g_redisDB->readthrough_timeout <= 0) {
+                err = "read-through-timeout must be greater than 0"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire") && argc == 2) {
+            if ((g_redisDB->active_expire = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"activerehashing") && argc == 2) {
+            if ((g_redisDB->activerehashing = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rehash-hold-us") && argc == 2) {
+            g_redisDB->rehash_hold_us = atoi(argv[1]);
+            if (g_redisDB->rehash_hold_us <= 0) {
+                err = "rehash-hold-us must be 1 or greater"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"compression") && argc == 2) {
+            if ((g_redisDB->compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"compression-threshold") && argc == 2) {
+            long long threshold = memtoll(argv[1],NULL);
+            if (threshold < CONFIG_MIN_COMPRESSION_THRESHOLD) {
+                err = "compression-threshold is too small"; goto loaderr;
+            }
+            g_redisDB->compression_threshold = threshold;
+        } else if (!strcasecmp(argv[0],"compression-level") && argc == 2) {
+            g_redisDB->compression_level = atoi(argv[1]);
+            if (g_redisDB->compression_level < 1 ||
+                g_redisDB->compression_level > 9) {
+                err = "compression-level must be between 1 and 9"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"compression-dict") && argc == 2) {
+            /* A sample of typical values, used as zlib preset dictionary.
+             * Only the last 32k are used by zlib. */
+            FILE *fp;
+            char buf[1024];
+            size_t n;
+
+            if ((fp = fopen(argv[1],"r")) == NULL) {
+                err = sdscatprintf(sdsempty(),
+                    "Can't open the compression dictionary: %s", strerror(errno));
+                goto loaderr;
+            }
+            sdsfree(g_redisDB->compression_dict);
+            g_redisDB->compression_dict = sdsempty();
+            while ((n = fread(buf,1,sizeof(buf),fp)) > 0)
+                g_redisDB->compression_dict = sdscatlen(g_redisDB->compression_dict,buf,n);
+            fclose(fp);
+            if (sdslen(g_redisDB->compression_dict) > 32*1024)
+                sdsrange(g_redisDB->compression_dict,-32*1024,-1);
+            if (sdslen(g_redisDB->compression_dict) == 0) {
+                sdsfree(g_redisDB->compression_dict);
+                g_redisDB->compression_dict = NULL;
+            }
+        } else if (!strcasecmp(argv[0],"workers") && argc == 2) {
+            g_redisDB->workers = atoi(argv[1]);
+            if (g_redisDB->workers < 1 ||
+                g_redisDB->workers > CONFIG_MAX_THREADS) {
+                err = "Invalid number of workers"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-tasks") && argc == 2) {
+            g_redisDB->async_tasks = atoi(argv[1]);
+            if (g_redisDB->async_tasks < 0 ||
+                g_redisDB->async_tasks > CONFIG_MAX_THREADS) {
+                err = "Invalid number of async tasks"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"worker-cpus") && argc == 2) {
+            if (parseCpuList(argv[1],&g_redisDB->worker_cpus,
+                    &g_redisDB->worker_ncpus) == C_ERR) {
+                err = "Invalid cpu list"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-inflight-max-age") && argc == 2) {
+            g_redisDB->async_inflight_max_age = strtoll(argv[1],NULL,10);
+            if (g_redisDB->async_inflight_max_age <= 0) {
+                err = "async-inflight-max-age must be greater than 0"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-batch-size") && argc == 2) {
+            g_redisDB->async_batch_size = atoi(argv[1]);
+            if (g_redisDB->async_batch_size < 1) {
+                err = "async-batch-size must be 1 or greater"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-batch-linger-us") && argc == 2) {
+            g_redisDB->async_batch_linger_us = strtoll(argv[1],NULL,10);
+            if (g_redisDB->async_batch_linger_us < 0) {
+                err = "Invalid async-batch-linger-us"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-fill-policy") && argc == 2) {
+            g_redisDB->async_fill_policy =
+                configEnumGetValue(async_fill_policy_enum,argv[1]);
+            if (g_redisDB->async_fill_policy == INT_MIN) {
+                err = "Invalid async fill policy. Must be one of key, document";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"async-task-cpus") && argc == 2) {
+            if (parseCpuList(argv[1],&g_redisDB->async_task_cpus,
+                    &g_redisDB->async_task_ncpus) == C_ERR) {
+                err = "Invalid cpu list"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"background-cpus") && argc == 2) {
+            if (parseCpuList(argv[1],&g_redisDB->background_cpus,
+                    &g_redisDB->background_ncpus) == C_ERR) {
+                err = "Invalid cpu list"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"loglevel") && argc == 2) {
             g_redisDB->verbosity = configEnumGetValue(loglevel_enum,argv[1]);
             if (g_redisDB->verbosity == INT_MIN) {
@@ -169,6 +382,45 @@ void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             g_redisDB->maxmemory = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
+            g_redisDB->maxmemory_policy =
+                configEnumGetValue(maxmemory_policy_enum,argv[1]);
+            if (g_redisDB->maxmemory_policy == INT_MIN) {
+                err = "Invalid maxmemory policy. Must be one of volatile-ttl, "
+                      "allkeys-lru, allkeys-lfu, allkeys-random, noeviction";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pipeline-batch") && argc == 2) {
+            g_redisDB->pipeline_batch = atoi(argv[1]);
+            if (g_redisDB->pipeline_batch < 0) {
+                err = "pipeline-batch must be 0 or greater"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") && argc == 2) {
+            g_redisDB->slowlog_log_slower_than = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"slowlog-max-len") && argc == 2) {
+            long long len = strtoll(argv[1],NULL,10);
+            if (len <= 0) {
+                err = "slowlog-max-len must be 1 or greater"; goto loaderr;
+            }
+            g_redisDB->slowlog_max_len = len;
+        } else if (!strcasecmp(argv[0],"maxmemory-samples") && argc == 2) {
+            g_redisDB->maxmemory_samples = atoi(argv[1]);
+            if (g_redisDB->maxmemory_samples <= 0) {
+                err = "maxmemory-samples must be 1 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lfu-log-factor") && argc == 2) {
+            g_redisDB->lfu_log_factor = atoi(argv[1]);
+            if (g_redisDB->lfu_log_factor < 0) {
+                err = "lfu-log-factor must be 0 or greater";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lfu-decay-time") && argc == 2) {
+            g_redisDB->lfu_decay_time = atoi(argv[1]);
+            if (g_redisDB->lfu_decay_time < 0) {
+                err = "lfu-decay-time must be 0 or greater";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-entries") && argc == 2) {
             g_redisDB->hash_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
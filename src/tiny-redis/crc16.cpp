@@ -79,10 +79,46 @@ static const uint16_t crc16tab[256]= {
     0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
 
+/* Slicing-by-8 tables: crc16slice[k][b] is the CRC of the byte b followed
+ * by k zero bytes, crc16slice[0] is crc16tab. Built from crc16tab before
+ * main() runs. */
+static uint16_t crc16slice[8][256];
+
+static int crc16InitSlices(void) {
+    int k, b;
+
+    for (b = 0; b < 256; b++) crc16slice[0][b] = crc16tab[b];
+    for (k = 1; k < 8; k++) {
+        for (b = 0; b < 256; b++) {
+            uint16_t prev = crc16slice[k-1][b];
+            crc16slice[k][b] = (prev<<8) ^ crc16tab[prev>>8];
+        }
+    }
+    return 1;
+}
+
+static int crc16_slices_ready = crc16InitSlices();
+
+/* Process 8 bytes per step with one lookup per byte, all independent of
+ * each other, instead of a chain of 8 dependent lookups. */
 uint16_t crc16(const char *buf, int len) {
-    int counter;
+    const unsigned char *p = (const unsigned char*)buf;
     uint16_t crc = 0;
-    for (counter = 0; counter < len; counter++)
-            crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
+
+    (void)crc16_slices_ready;
+    while (len >= 8) {
+        crc = crc16slice[7][p[0] ^ (crc>>8)] ^
+              crc16slice[6][p[1] ^ (crc&0xFF)] ^
+              crc16slice[5][p[2]] ^
+              crc16slice[4][p[3]] ^
+              crc16slice[3][p[4]] ^
+              crc16slice[2][p[5]] ^
+              crc16slice[1][p[6]] ^
+              crc16slice[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *p++)&0x00FF];
     return crc;
 }
@@ -40,7 +40,18 @@
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
-    dictEntry *de = dictFind(db->d,key->ptr);
+    dictEntry *de = dictFindRaw(db->d,key->ptr);
+    if (de && dictIsExpired(de,mstime())) {
+        /* The key is logically expired. Only callers holding the slot
+         * write lock may remove it, readers leave it to the active expire
+         * cycle or to the next write. */
+        __atomic_add_fetch(&g_redisDB->stat_expired_stale_hits,1,__ATOMIC_RELAXED);
+        if (flags & LOOKUP_WRITE) {
+            dictDeleteEntry(db->d,de);
+            __atomic_add_fetch(&g_redisDB->stat_expiredkeys,1,__ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
     if (de) {
         robj *val = (robj*)dictGetVal(de);
 
@@ -49,7 +60,10 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
          * a copy on write madness. */
         if (!(flags & LOOKUP_NOTOUCH))
         {
-            val->lru = LRU_CLOCK();
+            if (g_redisDB->maxmemory_policy & MAXMEMORY_FLAG_LFU)
+                updateLFU(val);
+            else
+                val->lru = LRU_CLOCK();
         }
         return val;
     } else {
@@ -97,11 +111,34 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    return lookupKey(db,key,LOOKUP_NONE);
+    return lookupKey(db,key,LOOKUP_WRITE);
+}
+
+/* The slot holding 'key'. While processMultiSlotCommand() runs a command
+ * spanning slots c->db is only the first slot it locked, commands flagged
+ * "x" look up every key with this instead. */
+redisDb *keyDb(client *c, robj *key) {
+    if (!(c->flags & CLIENT_MULTISLOT)) return c->db;
+    return &c->proc->db->db[keyHashSlot((const char*)key->ptr,
+                                        sdslen((sds)key->ptr))];
+}
+
+/* Like lookupKeyRead(), accounting the lookup in the keyspace hit ratio of
+ * the proc serving the client. */
+robj *lookupKeyReadClient(client *c, robj *key) {
+    robj *o = lookupKeyRead(keyDb(c,key), key);
+
+    if (o)
+        __atomic_store_n(&c->proc->stat_keyspace_hits,
+            c->proc->stat_keyspace_hits+1,__ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&c->proc->stat_keyspace_misses,
+            c->proc->stat_keyspace_misses+1,__ATOMIC_RELAXED);
+    return o;
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
-    robj *o = lookupKeyRead(c->db, key);
+    robj *o = lookupKeyReadClient(c, key);
     if (!o) addReply(c,reply);
     return o;
 }
@@ -112,16 +149,33 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
     return o;
 }
 
+/* File the entry in the expire index of the slot, or move it there after
+ * its expire time changed. Needs the slot write lock. */
+void dbIndexExpire(redisDb *db, dictEntry *de) {
+    if (dictGetExpire(de) <= 0) {
+        dictEntryUnlinkWheel(de);
+        return;
+    }
+    if (db->wheel == NULL)
+        __atomic_store_n(&db->wheel,twCreate(mstime()),__ATOMIC_RELEASE);
+    twAdd(db->wheel,de);
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
  * counter of the value if needed.
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val, int64_t expireMs) {
     sds copy = sdsdup((sds)key->ptr);
-    int retval = dictAdd(db->d, copy, val, expireMs);
+    dictEntry *de = dictAddRaw(db->d, copy);
 
-    serverAssertWithInfo(NULL,key,retval == DICT_OK);
- }
+    serverAssertWithInfo(NULL,key,de != NULL);
+    dictSetVal(db->d, de, val);
+    dictSetExpire(db->d, de, expireMs);
+    dbIndexExpire(db,de);
+    db->bytes += sizeof(dictEntry)+zmalloc_size(sdsAllocPtr(copy))+
+                 objectApproxBytes(val);
+}
 
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
@@ -129,10 +183,28 @@ void dbAdd(redisDb *db, robj *key, robj *val, int64_t expireMs) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val, int64_t expireMs) {
-    dictEntry *de = dictFind(db->d,key->ptr);
+    dictEntry *de = dictFindRaw(db->d,key->ptr);
+
+    dictEntry auxentry;
 
     serverAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->d, key->ptr, val, expireMs);
+    /* The old value is subtracted by its destructor */
+    db->bytes += objectApproxBytes(val);
+    /* Replace the value in place rather than with dictReplace(): its
+     * dictAdd() runs a rehash step, which frees 'de' if it expired since
+     * the caller's lookup, and would then store the caller's key sds. Set
+     * the new value before freeing the old one, they may be the same. */
+    auxentry = *de;
+    dictSetVal(db->d, de, val);
+    dictFreeVal(db->d, &auxentry);
+    dictSetExpire(db->d, de, expireMs);
+    if (expireMs > 0) dbIndexExpire(db,de);
+}
+
+/* Account a value that a write command changed in place. 'oldbytes' is
+ * objectApproxBytes() of the value before the change. */
+void dbUpdateValueBytes(redisDb *db, robj *val, size_t oldbytes) {
+    db->bytes += (long long)objectApproxBytes(val)-(long long)oldbytes;
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -140,7 +212,10 @@ void dbOverwrite(redisDb *db, robj *key, robj *val, int64_t expireMs) {
  *
  * 1) The ref count of the value object is incremented.
  * 2) clients WATCHing for the destination key notified.
- * 3) The expire time of the key is reset (the key is made persistent). */
+ * 3) The expire time of the key is reset (the key is made persistent).
+ *
+ * The value is stored as is. Callers compress large values before taking
+ * the slot lock, see compressCommandValues(). */
 void setKey(redisDb *db, robj *key, robj *val, int64_t expireMs) {
     if (lookupKeyWrite(db,key) == NULL) {
         dbAdd(db,key,val, expireMs);
@@ -203,12 +278,82 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     return o;
 }
 
+/*-----------------------------------------------------------------------------
+ * Active expire
+ *
+ * Read commands never remove expired keys since they may run under the read
+ * lock, or no lock at all. Every proc instead calls activeExpireCycle()
+ * from its cron. The procs share a slot cursor, so each slot is visited by
+ * one proc at a time. Keys with an expire are indexed in the timing wheel
+ * of their slot, so a visit only touches the keys that are due.
+ *----------------------------------------------------------------------------*/
+
+static void expireWheelCallback(void *privdata, dictEntry *de) {
+    redisDb *db = (redisDb*)privdata;
+
+    /* The entry is already out of the wheel. It must be removed as is:
+     * dictDelete() would run a rehash step first, which frees the expired
+     * entries it moves, possibly this one and its key. */
+    dictDeleteEntry(db->d,de);
+}
+
+/* Remove the due keys of 'db', ACTIVE_EXPIRE_CYCLE_MAX_BATCH keys per write
+ * lock hold, until none is left or 'deadline' is reached. Returns the number
+ * of keys removed. */
+static long long activeExpireSlot(redisDb *db, long long deadline) {
+    long long expired = 0;
+    unsigned long n;
+
+    do {
+        dbWriteLock(db);
+        n = twExpire(db->wheel,mstime(),ACTIVE_EXPIRE_CYCLE_MAX_BATCH,
+            expireWheelCallback,db);
+        db->dirty += n;
+        dbWriteUnlock(db);
+        expired += n;
+    } while (n == ACTIVE_EXPIRE_CYCLE_MAX_BATCH && ustime() < deadline);
+
+    return expired;
+}
+
+/* Called from procCron(). Visits this proc's share of the slots, or less
+ * if ACTIVE_EXPIRE_CYCLE_TIME_PERC of the cron period is consumed. */
+void activeExpireCycle(TinyRedisProc *proc) {
+    TinyRedisDB *db = proc->db;
+    long long start = ustime(), deadline, now = start/1000;
+    long long expired = 0;
+    int slots, j;
+
+    deadline = start + PROC_CRON_PERIOD_MS*1000LL*ACTIVE_EXPIRE_CYCLE_TIME_PERC/100;
+    slots = db->dbnum / (db->nprocs > 0 ? db->nprocs : 1) + 1;
+
+    for (j = 0; j < slots && ustime() < deadline; j++) {
+        unsigned long slot = __atomic_fetch_add(&db->expire_slot_cursor,1,
+            __ATOMIC_RELAXED) % db->dbnum;
+        redisDb *rdb = &db->db[slot];
+        timeWheel *tw = __atomic_load_n(&rdb->wheel,__ATOMIC_ACQUIRE);
+
+        /* Unlocked peek: no wheel means no key ever had an expire, and a
+         * wheel already at the current tick has nothing due. */
+        if (tw == NULL || !twHasDue(tw,now)) continue;
+        expired += activeExpireSlot(rdb,deadline);
+    }
+
+    if (expired)
+        __atomic_add_fetch(&db->stat_expiredkeys,expired,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&db->stat_expire_cycle_us,ustime()-start,__ATOMIC_RELAXED);
+}
+
 void delCommand(client *c) {
     int deleted = 0, j;
 
     for (j = 1; j < c->argc; j++) {
-        if (dbDelete(c->db,c->argv[j])) {
-            c->db->dirty++;
+        redisDb *db = keyDb(c,c->argv[j]);
+
+        /* An expired key does not count as deleted. */
+        if (lookupKeyWrite(db,c->argv[j]) == NULL) continue;
+        if (dbDelete(db,c->argv[j])) {
+            db->dirty++;
             deleted++;
         }
     }
@@ -222,7 +367,7 @@ void existsCommand(client *c) {
     int j;
 
     for (j = 1; j < c->argc; j++) {
-        if (dbExists(c->db,c->argv[j])) count++;
+        if (dbExists(keyDb(c,c->argv[j]),c->argv[j])) count++;
     }
     addReplyLongLong(c,count);
 }
@@ -290,7 +435,8 @@ void expireGenericCommand(client *c, long long basetime, int unit)
         return;
     }
 
-    de->expire = when;
+    dictSetExpireAt(c->db->d, de, when);
+    dbIndexExpire(c->db,de);
     c->db->dirty++;
     if (when <= mstime())
     {
@@ -90,58 +90,87 @@ uint32_t dictGetHashFunctionSeed(void) {
     return dict_hash_function_seed;
 }
 
-/* MurmurHash2, by Austin Appleby
- * Note - This code makes a few assumptions about how your machine behaves -
- * 1. We can read a 4-byte value from any address without crashing
- * 2. sizeof(int) == 4
- *
- * And it has a few limitations -
- *
- * 1. It will not work incrementally.
- * 2. It will not produce the same results on little-endian and big-endian
- *    machines.
- */
-unsigned int dictGenHashFunction(const void *key, int len) {
-    /* 'm' and 'r' are mixing constants generated offline.
-     They're not really 'magic', they just happen to work well.  */
-    uint32_t seed = dict_hash_function_seed;
-    const uint32_t m = 0x5bd1e995;
-    const int r = 24;
-
-    /* Initialize the hash to a 'random' value */
-    uint32_t h = seed ^ len;
+/* wyhash (final version 4), by Wang Yi, public domain. A keyed hash that
+ * reads the key 8 or 16 bytes at a time and mixes with 64x64->128 bit
+ * multiplications, much cheaper per byte than MurmurHash2 on the short
+ * keys we hash on every lookup. The seed is dict_hash_function_seed. */
+static const uint64_t _wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void _wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
 
-    /* Mix 4 bytes at a time into the hash */
-    const unsigned char *data = (const unsigned char *)key;
+static inline uint64_t _wymix(uint64_t a, uint64_t b) {
+    _wymum(&a,&b);
+    return a^b;
+}
 
-    while(len >= 4) {
-        uint32_t k = *(uint32_t*)data;
+static inline uint64_t _wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,8);
+    return v;
+}
 
-        k *= m;
-        k ^= k >> r;
-        k *= m;
+static inline uint64_t _wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+}
 
-        h *= m;
-        h ^= k;
+static inline uint64_t _wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0])<<16)|(((uint64_t)p[k>>1])<<8)|p[k-1];
+}
 
-        data += 4;
-        len -= 4;
+static uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t*)key;
+    uint64_t a, b;
+
+    seed ^= _wymix(seed^_wyp[0],_wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_wyr4(p)<<32)|_wyr4(p+((len>>3)<<2));
+            b = (_wyr4(p+len-4)<<32)|_wyr4(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = _wyr3(p,len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = _wymix(_wyr8(p)^_wyp[1],_wyr8(p+8)^seed);
+                see1 = _wymix(_wyr8(p+16)^_wyp[2],_wyr8(p+24)^see1);
+                see2 = _wymix(_wyr8(p+32)^_wyp[3],_wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1^see2;
+        }
+        while (i > 16) {
+            seed = _wymix(_wyr8(p)^_wyp[1],_wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _wyr8(p+i-16);
+        b = _wyr8(p+i-8);
     }
+    a ^= _wyp[1];
+    b ^= seed;
+    _wymum(&a,&b);
+    return _wymix(a^_wyp[0]^len,b^_wyp[1]);
+}
 
-    /* Handle the last few bytes of the input array  */
-    switch(len) {
-    case 3: h ^= data[2] << 16;
-    case 2: h ^= data[1] << 8;
-    case 1: h ^= data[0]; h *= m;
-    };
-
-    /* Do a few final mixes of the hash to ensure the last few
-     * bytes are well-incorporated. */
-    h ^= h >> 13;
-    h *= m;
-    h ^= h >> 15;
-
-    return (unsigned int)h;
+unsigned int dictGenHashFunction(const void *key, int len) {
+    return (unsigned int)wyhash(key,(size_t)len,dict_hash_function_seed);
 }
 
 /* And a case insensitive hash function (based on djb hash) */
@@ -185,6 +214,7 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->expires = 0;
     return DICT_OK;
 }
 
@@ -268,6 +298,7 @@ int dictRehash(dict *d, int n) {
             /* 删除过期的数据 */
             if (dictGetExpire(de) > 0 && dictGetExpire(de) <= now)
             {
+                dictEntryReleaseExpire(d, de);
                 dictFreeKey(d, de);
                 dictFreeVal(d, de);
                 zfree(de);
@@ -321,6 +352,24 @@ int dictRehashMilliseconds(dict *d, int ms) {
     return rehashes;
 }
 
+static long long timeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Like dictRehashMilliseconds() with a finer budget, for callers that hold
+ * a lock other threads wait for. Returns 1 if there is more to rehash. */
+int dictRehashMicroseconds(dict *d, long long us) {
+    long long start = timeInMicroseconds();
+
+    while(dictRehash(d,100)) {
+        if (timeInMicroseconds()-start > us) return 1;
+    }
+    return 0;
+}
+
 /* This function performs just a step of rehashing, and only if there are
  * no safe iterators bound to our hash table. When we have iterators in the
  * middle of a rehashing we can't mess with the two hash tables otherwise
@@ -380,6 +429,8 @@ dictEntry *dictAddRaw(dict *d, void *key)
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
     entry = (dictEntry*)zmalloc(sizeof(*entry));
     entry->expire = 0;
+    entry->wheel_next = NULL;
+    entry->wheel_pprev = NULL;
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -401,8 +452,9 @@ int dictReplace(dict *d, void *key, void *val, int64_t expireMs)
      * does not exists dictAdd will suceed. */
     if (dictAdd(d, key, val, expireMs) == DICT_OK)
         return 1;
-    /* It already exists, get the entry */
-    entry = dictFind(d, key);
+    /* It already exists, get the entry. It may be logically expired, that
+     * dictFind() would hide. */
+    entry = dictFindRaw(d, key);
     /* Set the new value and free the old one. Note that it is important
      * to do that in this order, as the value may just be exactly the same
      * as the previous one. In this context, think to reference counting,
@@ -453,6 +505,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
                     prevHe->next = he->next;
                 else
                     d->ht[table].table[idx] = he->next;
+                dictEntryReleaseExpire(d, he);
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
@@ -473,6 +526,44 @@ int dictDelete(dict *ht, const void *key) {
     return dictGenericDelete(ht,key,0);
 }
 
+/* Remove and free 'de', an entry the caller already holds, e.g. one found by
+ * dictFindRaw(), dictGetRandomKey() or an expire index. Unlike dictDelete()
+ * no rehash step runs first: a step frees the expired entries it moves, and
+ * could free 'de' itself, or the key the lookup would compare. */
+int dictDeleteEntry(dict *d, dictEntry *de) {
+    unsigned int h, idx;
+    dictEntry *he, *prevHe;
+    int table;
+
+    if (d->ht[0].size == 0) return DICT_ERR;
+    h = dictHashKey(d, de->key);
+
+    for (table = 0; table <= 1; table++) {
+        if (d->ht[table].size == 0) break;
+        idx = h & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        prevHe = NULL;
+        while(he) {
+            if (he == de) {
+                if (prevHe)
+                    prevHe->next = he->next;
+                else
+                    d->ht[table].table[idx] = he->next;
+                dictEntryReleaseExpire(d, he);
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+                d->ht[table].used--;
+                return DICT_OK;
+            }
+            prevHe = he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not in this dict */
+}
+
 int dictDeleteNoFree(dict *ht, const void *key) {
     return dictGenericDelete(ht,key,1);
 }
@@ -490,6 +581,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
+            dictEntryReleaseExpire(d, he);
             dictFreeKey(d, he);
             dictFreeVal(d, he);
             zfree(he);
@@ -512,7 +604,9 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
-dictEntry *dictFind(dict *d, const void *key)
+/* Like dictFind() but also returns entries whose expire time is reached,
+ * for callers that want to remove them. */
+dictEntry *dictFindRaw(dict *d, const void *key)
 {
     dictEntry *he;
     unsigned int h, idx, table;
@@ -524,12 +618,7 @@ dictEntry *dictFind(dict *d, const void *key)
         he = d->ht[table].table[idx];
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key))
-            {
-                /* 过期的数据不返回 */
-                if (dictGetExpire(he) > 0 && mstime() >= dictGetExpire(he))
-                    return NULL;
                 return he;
-            }
             he = he->next;
         }
         if (!dictIsRehashing(d)) return NULL;
@@ -537,6 +626,16 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+dictEntry *dictFind(dict *d, const void *key)
+{
+    dictEntry *he = dictFindRaw(d, key);
+
+    /* 过期的数据不返回 */
+    if (he && dictIsExpired(he, mstime()))
+        return NULL;
+    return he;
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
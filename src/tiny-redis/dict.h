@@ -54,6 +54,10 @@ typedef struct dictEntry {
         double d;
     } v;
     struct dictEntry *next;
+    /* Intrusive link of the expire index, see timewheel.h. NULL when the
+     * entry is not indexed. */
+    struct dictEntry *wheel_next;
+    struct dictEntry **wheel_pprev;
 } dictEntry;
 
 typedef struct dictType {
@@ -80,6 +84,7 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+    unsigned long expires; /* entries with an expire set */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -138,14 +143,39 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
         (key1) == (key2))
 
 #define dictSetExpire(d, entry, expireMs) do { \
-    if (expireMs > 0)   \
+    if (expireMs > 0) { \
+        if ((entry)->expire <= 0) (d)->expires++; \
         entry->expire = mstime() + expireMs; \
+    } \
+} while(0)
+
+/* Set an absolute unix time in milliseconds, 0 makes the entry persistent */
+#define dictSetExpireAt(d, entry, whenMs) do { \
+    if ((entry)->expire <= 0 && (whenMs) > 0) (d)->expires++; \
+    else if ((entry)->expire > 0 && (whenMs) <= 0) (d)->expires--; \
+    (entry)->expire = (whenMs); \
 } while(0)
 
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
 #define dictGetKey(he) ((he)->key)
 #define dictGetVal(he) ((he)->v.val)
 #define dictGetExpire(he) ((he)->expire)
+#define dictIsExpired(he, now) (dictGetExpire(he) > 0 && (now) >= dictGetExpire(he))
+#define dictEntryInWheel(he) ((he)->wheel_pprev != NULL)
+#define dictEntryUnlinkWheel(he) do { \
+    if ((he)->wheel_pprev) { \
+        *(he)->wheel_pprev = (he)->wheel_next; \
+        if ((he)->wheel_next) \
+            (he)->wheel_next->wheel_pprev = (he)->wheel_pprev; \
+        (he)->wheel_next = NULL; \
+        (he)->wheel_pprev = NULL; \
+    } \
+} while(0)
+/* The entry is leaving the dict: out of the wheel and the expires count */
+#define dictEntryReleaseExpire(d, he) do { \
+    dictEntryUnlinkWheel(he); \
+    if ((he)->expire > 0) (d)->expires--; \
+} while(0)
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
@@ -153,6 +183,7 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictH0Slots(d) (((dict*)(d))->ht[0].size)
 #define dictH1Slots(d) (((dict*)(d))->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictExpires(d) ((d)->expires)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
 /* API */
@@ -164,8 +195,10 @@ int dictReplace(dict *d, void *key, void *val, int64_t expireMs = 0);
 dictEntry *dictReplaceRaw(dict *d, void *key);
 int dictDelete(dict *d, const void *key);
 int dictDeleteNoFree(dict *d, const void *key);
+int dictDeleteEntry(dict *d, dictEntry *de);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
+dictEntry *dictFindRaw(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -182,6 +215,7 @@ void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
+int dictRehashMicroseconds(dict *d, long long us);
 void dictSetHashFunctionSeed(unsigned int initval);
 unsigned int dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
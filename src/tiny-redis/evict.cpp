@@ -0,0 +1,411 @@
+/* Maxmemory directive handling (LRU, LFU, TTL and random eviction).
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2016, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* ----------------------------------------------------------------------------
+ * Data structures
+ * --------------------------------------------------------------------------*/
+
+/* To improve the quality of the LRU approximation we take a set of keys
+ * that are good candidate for eviction across freeMemoryIfNeeded() calls.
+ *
+ * Entries inside the eviction pool are taken ordered by idle time, putting
+ * greater idle times to the right (ascending order).
+ *
+ * When an LFU policy is used instead, a reverse frequency indication is used
+ * instead of the idle time, so that we still evict by larger value (larger
+ * inverse frequency means to evict keys with the least frequent accesses).
+ *
+ * The keyspace is split in slots, each with its own lock, so an entry
+ * remembers the slot of its key. Keys are copied: the entry may outlive the
+ * key, it is looked up again under the slot write lock before the eviction.
+ *
+ * Empty entries have the key pointer set to NULL. */
+struct evictionPoolEntry {
+    unsigned long long idle;    /* Object idle time (inverse frequency for LFU) */
+    sds key;                    /* Key name. */
+    int slot;                   /* Slot of the key. */
+};
+
+/* ----------------------------------------------------------------------------
+ * Implementation of eviction, aging and LFU
+ * --------------------------------------------------------------------------*/
+
+/* Create a new eviction pool. */
+evictionPoolEntry *evictionPoolAlloc(void) {
+    evictionPoolEntry *ep;
+    int j;
+
+    ep = (evictionPoolEntry*)zmalloc(sizeof(*ep)*EVPOOL_SIZE);
+    for (j = 0; j < EVPOOL_SIZE; j++) {
+        ep[j].idle = 0;
+        ep[j].key = NULL;
+        ep[j].slot = 0;
+    }
+    return ep;
+}
+
+void evictionPoolFree(evictionPoolEntry *pool) {
+    int j;
+
+    for (j = 0; j < EVPOOL_SIZE; j++) sdsfree(pool[j].key);
+    zfree(pool);
+}
+
+/* Score of an object for the current policy, larger is a better candidate.
+ * Returns 0 and sets *skip for entries the policy must not evict. */
+static unsigned long long evictionScore(int policy, dictEntry *de, int *skip) {
+    robj *o = (robj*)dictGetVal(de);
+
+    *skip = 0;
+    if (policy & MAXMEMORY_FLAG_LRU) {
+        return estimateObjectIdleTime(o);
+    } else if (policy & MAXMEMORY_FLAG_LFU) {
+        /* When we use an LRU policy, we sort the keys by idle time
+         * so that we expire keys starting from greater idle time.
+         * However when the policy is an LFU one, we have a frequency
+         * estimation, and we want to evict keys with lower frequency
+         * first. So inside the pool we put objects using the inverted
+         * frequency subtracting the actual frequency to the maximum
+         * frequency of 255. */
+        return 255-LFUDecrAndReturn(o);
+    } else if (policy == MAXMEMORY_VOLATILE_TTL) {
+        /* In this case the sooner the expire the better. */
+        if (dictGetExpire(de) <= 0) {
+            *skip = 1;
+            return 0;
+        }
+        return ULLONG_MAX - (unsigned long long)dictGetExpire(de);
+    }
+    serverPanic("Unknown eviction policy in evictionScore()");
+    return 0;
+}
+
+/* This is an helper function for freeMemoryIfNeeded(), it is used in order
+ * to populate the evictionPool with a few entries every time we want to
+ * expire a key. Keys with idle time smaller than one of the current
+ * keys are added. Keys are always added if there are free entries.
+ *
+ * We insert keys on place in ascending order, so keys with the smaller
+ * idle time are on the left, and keys with the higher idle time on the
+ * right.
+ *
+ * The samples are taken under the read lock of 'slot': dictGetSomeKeys()
+ * does not modify the dict, and the scores are only a hint. */
+static void evictionPoolPopulate(redisDb *db, evictionPoolEntry *pool, int policy) {
+    int j, k, count, skip;
+    int samples = g_redisDB->maxmemory_samples;
+    dictEntry *stackbuf[EVPOOL_SIZE];
+    dictEntry **samplebuf;
+
+    if (samples <= EVPOOL_SIZE) {
+        samplebuf = stackbuf;
+    } else {
+        samplebuf = (dictEntry**)zmalloc(sizeof(samplebuf[0])*samples);
+    }
+
+    pthread_rwlock_rdlock(&db->rwlock);
+    count = dictGetSomeKeys(db->d,samplebuf,samples);
+    for (j = 0; j < count; j++) {
+        unsigned long long idle;
+        dictEntry *de = samplebuf[j];
+        sds key = (sds)dictGetKey(de);
+
+        idle = evictionScore(policy,de,&skip);
+        if (skip) continue;
+
+        /* Insert the element inside the pool.
+         * First, find the first empty bucket or the first populated
+         * bucket that has an idle time smaller than our idle time. */
+        k = 0;
+        while (k < EVPOOL_SIZE &&
+               pool[k].key &&
+               pool[k].idle < idle) k++;
+        if (k == 0 && pool[EVPOOL_SIZE-1].key != NULL) {
+            /* Can't insert if the element is < the worst element we have
+             * and there are no empty buckets. */
+            continue;
+        } else if (k < EVPOOL_SIZE && pool[k].key == NULL) {
+            /* Inserting into empty position. No setup needed before insert. */
+        } else {
+            /* Inserting in the middle. Now k points to the first element
+             * greater than the element to insert.  */
+            if (pool[EVPOOL_SIZE-1].key == NULL) {
+                /* Free space on the right? Insert at k shifting
+                 * all the elements from k to end to the right. */
+                memmove(pool+k+1,pool+k,
+                    sizeof(pool[0])*(EVPOOL_SIZE-k-1));
+            } else {
+                /* No free space on right? Insert at k-1 */
+                k--;
+                /* Shift all elements on the left of k (included) to the
+                 * left, so we discard the element with smaller idle time. */
+                sdsfree(pool[0].key);
+                memmove(pool,pool+1,sizeof(pool[0])*k);
+            }
+        }
+        pool[k].key = sdsdup(key);
+        pool[k].idle = idle;
+        pool[k].slot = db->id;
+    }
+    pthread_rwlock_unlock(&db->rwlock);
+
+    if (samplebuf != stackbuf) zfree(samplebuf);
+}
+
+/* Pick a random non empty slot, or NULL if none was found after a few
+ * tries. The size check is a racy peek, the caller locks the slot. */
+static redisDb *evictionRandomSlot(void) {
+    int j;
+
+    for (j = 0; j < EVICTION_SLOT_TRIES; j++) {
+        redisDb *db = &g_redisDB->db[random() % g_redisDB->dbnum];
+        if (dictSize(db->d)) return db;
+    }
+    return NULL;
+}
+
+/* Evict the best candidate of the pool. Returns 1 if a key was deleted. */
+static int evictFromPool(evictionPoolEntry *pool, int policy) {
+    int k;
+
+    /* Go backward from best to worst element to evict. */
+    for (k = EVPOOL_SIZE-1; k >= 0; k--) {
+        redisDb *db;
+        dictEntry *de;
+        int deleted = 0;
+
+        if (pool[k].key == NULL) continue;
+        db = &g_redisDB->db[pool[k].slot];
+
+        dbWriteLock(db);
+        /* The key may be gone, or for volatile-ttl may have lost its TTL
+         * since it was sampled. */
+        de = dictFindRaw(db->d,pool[k].key);
+        if (de && (policy != MAXMEMORY_VOLATILE_TTL || dictGetExpire(de) > 0)) {
+            dictDeleteEntry(db->d,de);
+            db->dirty++;
+            deleted = 1;
+        }
+        dbWriteUnlock(db);
+
+        /* Remove the entry from the pool. */
+        sdsfree(pool[k].key);
+        pool[k].key = NULL;
+        pool[k].idle = 0;
+        if (deleted) return 1;
+    }
+    return 0;
+}
+
+/* Delete a random key of a random slot, for allkeys-random. */
+static int evictRandom(void) {
+    redisDb *db = evictionRandomSlot();
+    dictEntry *de;
+    int deleted = 0;
+
+    if (db == NULL) return 0;
+    dbWriteLock(db);
+    if ((de = dictGetRandomKey(db->d)) != NULL) {
+        /* Not dictDelete(): its rehash step could free 'de' and its key */
+        dictDeleteEntry(db->d,de);
+        db->dirty++;
+        deleted = 1;
+    }
+    dbWriteUnlock(db);
+    return deleted;
+}
+
+/* This function is periodically called to see if there is memory to free
+ * according to the current "maxmemory" settings. In case we are over the
+ * memory limit, the function will try to free some memory to return back
+ * under the limit.
+ *
+ * The function returns C_OK if we are under the memory limit or if we
+ * were over the limit, but the attempt to free memory was successful.
+ * Otehrwise if we are over the memory limit, but not enough memory
+ * was freed to return back under the limit, the function returns C_ERR.
+ *
+ * Victims are taken from any slot, so the caller must not hold a slot
+ * lock. 'pool' keeps the candidates across calls, NULL uses a temporary
+ * one. */
+int freeMemoryIfNeeded(evictionPoolEntry *pool) {
+    TinyRedisDB *db = g_redisDB;
+    int policy = db->maxmemory_policy;
+    evictionPoolEntry *tmppool = NULL;
+    long long start, evicted = 0;
+    int j, ret = C_OK;
+
+    if (db->maxmemory == 0 || zmalloc_used_memory() <= db->maxmemory)
+        return C_OK;
+    if (policy == MAXMEMORY_NO_EVICTION)
+        return C_ERR; /* We need to free memory, but policy forbids. */
+
+    start = ustime();
+    if (pool == NULL && policy != MAXMEMORY_ALLKEYS_RANDOM)
+        pool = tmppool = evictionPoolAlloc();
+
+    while (zmalloc_used_memory() > db->maxmemory) {
+        int deleted;
+
+        if (policy == MAXMEMORY_ALLKEYS_RANDOM) {
+            deleted = evictRandom();
+        } else {
+            for (j = 0; j < EVICTION_SAMPLE_SLOTS; j++) {
+                redisDb *rdb = evictionRandomSlot();
+                if (rdb) evictionPoolPopulate(rdb,pool,policy);
+            }
+            deleted = evictFromPool(pool,policy);
+        }
+
+        /* Nothing to free... */
+        if (!deleted) {
+            ret = C_ERR;
+            break;
+        }
+        evicted++;
+    }
+
+    if (tmppool) evictionPoolFree(tmppool);
+    if (evicted)
+        __atomic_add_fetch(&db->stat_evictedkeys,evicted,__ATOMIC_RELAXED);
+    if (ret == C_ERR)
+        __atomic_add_fetch(&db->stat_oom_rejects,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&db->stat_evict_us,ustime()-start,__ATOMIC_RELAXED);
+    return ret;
+}
+
+/* ----------------------------------------------------------------------------
+ * LFU (Least Frequently Used) implementation.
+
+ * We have 24 total bits of space in each object in order to implement
+ * an LFU (Least Frequently Used) eviction policy, since we re-use the
+ * LRU field for this purpose.
+ *
+ * We split the 24 bits into two fields:
+ *
+ *          16 bits      8 bits
+ *     +----------------+--------+
+ *     + Last decr time | LOG_C  |
+ *     +----------------+--------+
+ *
+ * LOG_C is a logarithmic counter that provides an indication of the access
+ * frequency. However this field must also be decremented otherwise what used
+ * to be a frequently accessed key in the past, will remain ranked like that
+ * forever, while we want the algorithm to adapt to access pattern changes.
+ *
+ * So the remaining 16 bits are used in order to store the "decrement time",
+ * a reduced-precision Unix time (we take 16 bits of the time converted
+ * in minutes since we don't care about wrapping around) where the LOG_C
+ * counter is halved if it has an high value, or just decremented if it
+ * has a low value.
+ * --------------------------------------------------------------------------*/
+
+/* Return the current time in minutes, just taking the least significant
+ * 16 bits. The returned time is suitable to be stored as LDT (last decrement
+ * time) for the LFU implementation. */
+unsigned long LFUGetTimeInMinutes(void) {
+    return (mstime()/1000/60) & 65535;
+}
+
+/* Given an object last access time, compute the minimum number of minutes
+ * that elapsed since the last access. Handle overflow (ldt greater than
+ * the current 16 bits minutes time) considering the time as wrapping
+ * exactly once. */
+unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Every worker bumps counters on its reads, so each thread draws from its
+ * own xorshift state instead of contending on the lock inside rand(). */
+static __thread uint32_t lfu_rand_state = 0;
+
+static double LFURandom(void) {
+    uint32_t x = lfu_rand_state;
+
+    if (x == 0) x = (uint32_t)ustime() | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    lfu_rand_state = x;
+    return (double)x/UINT32_MAX;
+}
+
+/* Logarithmically increment a counter. The greater is the current counter
+ * value the less likely is that it gets really implemented. Saturate it
+ * at 255. */
+uint8_t LFULogIncr(uint8_t counter) {
+    if (counter == 255) return 255;
+    double r = LFURandom();
+    double baseval = counter - LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    double p = 1.0/(baseval*g_redisDB->lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* If the object decrement time is reached decrement the LFU counter but
+ * do not update LFU fields of the object, we update the access time
+ * and counter in an explicit way when the object is really accessed.
+ * And we will times halve the counter according to the times of
+ * elapsed time than lfu_decay_time.
+ * Return the object frequency counter. */
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long num_periods = g_redisDB->lfu_decay_time ?
+        LFUTimeElapsed(ldt) / g_redisDB->lfu_decay_time : 0;
+    if (num_periods)
+        counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+/* Update LFU when an object is accessed.
+ * Firstly, decrement the counter if the decrement time is reached.
+ * Then logarithmically increment the counter, and update the access time. */
+void updateLFU(robj *val) {
+    unsigned long counter = LFUDecrAndReturn(val);
+    counter = LFULogIncr(counter);
+    val->lru = (LFUGetTimeInMinutes()<<8) | counter;
+}
+
+/* Initial value of the lru field of a new object for the current policy.
+ * The shared objects are created by CreateTinyRedisDB() before g_redisDB is
+ * set, they are never evicted so any value does. */
+unsigned int objectInitialLRU(void) {
+    if (g_redisDB && g_redisDB->maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    return LRU_CLOCK();
+}
@@ -0,0 +1,218 @@
+/* Per proc latency histograms of the commands, see latency.h.
+ *
+ * LATENCY HISTOGRAM [command ...] replies, for every command called at
+ * least once (or only for the given ones), with its number of calls and,
+ * for both the lock wait and the execution, the count, p50, p99, p99.9 and
+ * max in microseconds and a cumulative histogram whose buckets are powers
+ * of two microseconds, like the one of redis 7.
+ */
+
+#include "server.h"
+
+double latency_ns_per_tick = 1;
+
+#define LATENCY_CALIBRATE_NS 10000000  /* Spin 10ms to calibrate the TSC */
+
+static uint64_t monotonicNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/* Calibrate latencyTicks() against CLOCK_MONOTONIC. Called once by the
+ * main thread before the procs start. */
+void latencyInit(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t start, now, t0, t1;
+
+    start = monotonicNs();
+    t0 = latencyTicks();
+    do {
+        now = monotonicNs();
+    } while (now-start < LATENCY_CALIBRATE_NS);
+    t1 = latencyTicks();
+    if (t1 > t0) latency_ns_per_tick = (double)(now-start)/(t1-t0);
+#endif
+}
+
+static int latencyBucketIndex(uint64_t ns) {
+    int msb;
+
+    if (ns < LATENCY_HIST_SUB) return (int)ns;
+    msb = 63-__builtin_clzll(ns);
+    if (msb >= LATENCY_HIST_MAX_BITS) return LATENCY_HIST_BUCKETS-1;
+    return (msb-LATENCY_HIST_SUB_BITS+1)*LATENCY_HIST_SUB +
+           (int)((ns>>(msb-LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB-1));
+}
+
+uint64_t latencyBucketLow(int idx) {
+    int msb;
+
+    if (idx < LATENCY_HIST_SUB) return idx;
+    msb = idx/LATENCY_HIST_SUB+LATENCY_HIST_SUB_BITS-1;
+    return (uint64_t)(LATENCY_HIST_SUB+idx%LATENCY_HIST_SUB) <<
+           (msb-LATENCY_HIST_SUB_BITS);
+}
+
+uint64_t latencyBucketHigh(int idx) {
+    if (idx == LATENCY_HIST_BUCKETS-1) return UINT64_MAX;
+    return latencyBucketLow(idx+1)-1;
+}
+
+/* Only called by the owner of 'h'. The stores are atomic so that other
+ * threads can merge the histogram while it is updated. */
+void latencyHistogramAdd(latencyHistogram *h, uint64_t ns) {
+    int idx = latencyBucketIndex(ns);
+
+    __atomic_store_n(&h->buckets[idx],h->buckets[idx]+1,__ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum,h->sum+ns,__ATOMIC_RELAXED);
+    if (ns > h->max) __atomic_store_n(&h->max,ns,__ATOMIC_RELAXED);
+    __atomic_store_n(&h->count,h->count+1,__ATOMIC_RELAXED);
+}
+
+void latencyHistogramMerge(latencyHistogram *dst, const latencyHistogram *src) {
+    uint64_t max = __atomic_load_n(&src->max,__ATOMIC_RELAXED);
+    int j;
+
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++)
+        dst->buckets[j] += __atomic_load_n(&src->buckets[j],__ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum,__ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count,__ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+/* Upper bound of the bucket holding the 'pct' percentile, in nanoseconds.
+ * Never more than the max recorded value. */
+uint64_t latencyHistogramPercentile(const latencyHistogram *h, double pct) {
+    uint64_t total = 0, target, seen = 0, high;
+    int j;
+
+    /* The buckets are summed again, a merged count may lag behind them */
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) total += h->buckets[j];
+    if (total == 0) return 0;
+    target = (uint64_t)(total*pct/100);
+    if (target == 0) target = 1;
+
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= target) break;
+    }
+    high = latencyBucketHigh(j < LATENCY_HIST_BUCKETS ? j : LATENCY_HIST_BUCKETS-1);
+    return high < h->max ? high : h->max;
+}
+
+static void addReplyLatencyHistogram(client *c, const latencyHistogram *h) {
+    void *replylen;
+    uint64_t cumulative = 0, bucket = 0;
+    long len = 0;
+    int j;
+
+    addReplyMultiBulkLen(c,12);
+    addReplyBulkCString(c,"count");
+    addReplyLongLong(c,h->count);
+    addReplyBulkCString(c,"p50_usec");
+    addReplyDouble(c,(double)latencyHistogramPercentile(h,50)/1000);
+    addReplyBulkCString(c,"p99_usec");
+    addReplyDouble(c,(double)latencyHistogramPercentile(h,99)/1000);
+    addReplyBulkCString(c,"p999_usec");
+    addReplyDouble(c,(double)latencyHistogramPercentile(h,99.9)/1000);
+    addReplyBulkCString(c,"max_usec");
+    addReplyDouble(c,(double)h->max/1000);
+    addReplyBulkCString(c,"histogram_usec");
+
+    /* Fold the fine buckets into powers of two microseconds: a bucket is
+     * filed under the first power of two above its lower bound. */
+    replylen = addDeferredMultiBulkLength(c);
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        uint64_t us, next;
+
+        if (h->buckets[j] == 0) continue;
+        us = latencyBucketLow(j)/1000;
+        next = us ? (uint64_t)1 << (64-__builtin_clzll(us)) : 1;
+        if (next != bucket && cumulative) {
+            addReplyLongLong(c,bucket);
+            addReplyLongLong(c,cumulative);
+            len += 2;
+        }
+        bucket = next;
+        cumulative += h->buckets[j];
+    }
+    if (cumulative) {
+        addReplyLongLong(c,bucket);
+        addReplyLongLong(c,cumulative);
+        len += 2;
+    }
+    setDeferredMultiBulkLength(c,replylen,len);
+}
+
+static void addReplyCommandLatency(client *c, struct redisCommand *cmd) {
+    TinyRedisDB *db = c->proc->db;
+    commandLatency *merged;
+    int j;
+
+    merged = (commandLatency*)zcalloc(sizeof(*merged));
+    for (j = 0; j < db->nprocs; j++) {
+        commandLatency *cl = &db->procs[j]->latency[cmd->id];
+
+        latencyHistogramMerge(&merged->wait,&cl->wait);
+        latencyHistogramMerge(&merged->exec,&cl->exec);
+    }
+
+    addReplyBulkCString(c,cmd->name);
+    addReplyMultiBulkLen(c,6);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,merged->exec.count);
+    addReplyBulkCString(c,"wait");
+    addReplyLatencyHistogram(c,&merged->wait);
+    addReplyBulkCString(c,"exec");
+    addReplyLatencyHistogram(c,&merged->exec);
+    zfree(merged);
+}
+
+static int commandCalled(TinyRedisDB *db, struct redisCommand *cmd) {
+    int j;
+
+    for (j = 0; j < db->nprocs; j++) {
+        if (__atomic_load_n(&db->procs[j]->latency[cmd->id].exec.count,
+                            __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+/* LATENCY HISTOGRAM [command ...] */
+void latencyCommand(client *c) {
+    TinyRedisDB *db = c->proc->db;
+    struct redisCommand *cmd;
+    long len = 0;
+    void *replylen;
+    int j;
+
+    if (strcasecmp((const char*)c->argv[1]->ptr,"histogram")) {
+        addReplyError(c,"Unknown LATENCY subcommand or wrong number of arguments");
+        return;
+    }
+
+    replylen = addDeferredMultiBulkLength(c);
+    if (c->argc == 2) {
+        dictIterator *di = dictGetIterator(db->commands);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            cmd = (struct redisCommand*)dictGetVal(de);
+            if (!commandCalled(db,cmd)) continue;
+            addReplyCommandLatency(c,cmd);
+            len += 2;
+        }
+        dictReleaseIterator(di);
+    } else {
+        for (j = 2; j < c->argc; j++) {
+            cmd = lookupCommand(c->proc,(sds)c->argv[j]->ptr);
+            if (cmd == NULL || !commandCalled(db,cmd)) continue;
+            addReplyCommandLatency(c,cmd);
+            len += 2;
+        }
+    }
+    setDeferredMultiBulkLength(c,replylen,len);
+}
@@ -0,0 +1,67 @@
+/* latency.h - Per proc latency histograms of the commands
+ *
+ * Every proc keeps, for each command, one histogram of the time spent
+ * waiting for the slot lock and one of the time spent in the command proc.
+ * Only the owner thread writes its histograms, so recording is a few plain
+ * increments. LATENCY HISTOGRAM merges the histograms of all the procs on
+ * demand, reading them with relaxed atomic loads.
+ *
+ * The buckets are log-linear like HDR histograms: values below
+ * LATENCY_HIST_SUB nanoseconds have a bucket each, above that every power
+ * of two is split in LATENCY_HIST_SUB buckets, so a bucket is never wider
+ * than 1/LATENCY_HIST_SUB of its lower bound (12.5%).
+ *
+ * Time is read from the TSC on x86, converted to nanoseconds with a factor
+ * calibrated against CLOCK_MONOTONIC by latencyInit(), and from
+ * CLOCK_MONOTONIC elsewhere.
+ */
+
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define LATENCY_HIST_SUB_BITS 3
+#define LATENCY_HIST_SUB (1<<LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_BITS 40    /* 2^40ns, about 18 minutes */
+#define LATENCY_HIST_BUCKETS \
+    ((LATENCY_HIST_MAX_BITS-LATENCY_HIST_SUB_BITS+1)*LATENCY_HIST_SUB)
+
+typedef struct latencyHistogram {
+    uint64_t count;
+    uint64_t sum;                   /* Nanoseconds */
+    uint64_t max;
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+} latencyHistogram;
+
+typedef struct commandLatency {
+    latencyHistogram wait;          /* Slot lock acquisition */
+    latencyHistogram exec;          /* The command proc */
+} commandLatency;
+
+extern double latency_ns_per_tick;
+
+void latencyInit(void);
+void latencyHistogramAdd(latencyHistogram *h, uint64_t ns);
+void latencyHistogramMerge(latencyHistogram *dst, const latencyHistogram *src);
+uint64_t latencyHistogramPercentile(const latencyHistogram *h, double pct);
+uint64_t latencyBucketLow(int idx);
+uint64_t latencyBucketHigh(int idx);
+
+static inline uint64_t latencyTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t latencyTicksToNs(uint64_t ticks) {
+    return (uint64_t)(ticks*latency_ns_per_tick);
+}
+
+#endif
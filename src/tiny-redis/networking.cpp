@@ -30,6 +30,7 @@
 #include "server.h"
 #include <sys/uio.h>
 #include <math.h>
+#include "readthrough.h"
 
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t) - 1)
@@ -52,6 +53,7 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     switch(o->encoding) {
     case OBJ_ENCODING_RAW: return sdsZmallocSize((sds)o->ptr);
     case OBJ_ENCODING_EMBSTR: return zmalloc_size(o)-sizeof(robj);
+    case OBJ_ENCODING_COMPRESSED: return sdsZmallocSize((sds)o->ptr);
     default: return 0; /* Just integer encoding for now. */
     }
 }
@@ -65,6 +67,11 @@ int listMatchObjects(void *a, void *b) {
     return equalStringObjects((robj*)a,(robj*)b);
 }
 
+/* Publish the number of connected clients for the other threads. */
+static void updateClientsStat(TinyRedisProc *proc) {
+    __atomic_store_n(&proc->stat_clients,listLength(proc->clients),__ATOMIC_RELAXED);
+}
+
 client *createClient(int fd, TinyRedisProc* proc) {
     client *c = (client*)zmalloc(sizeof(client));
 
@@ -96,6 +103,7 @@ client *createClient(int fd, TinyRedisProc* proc) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->zargv = NULL;
     c->cmd = c->lastcmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
@@ -108,13 +116,22 @@ client *createClient(int fd, TinyRedisProc* proc) {
     listSetFreeMethod(c->reply,decrRefCountVoid);
     listSetDupMethod(c->reply,dupClientReplyValue);
     c->peerid = NULL;
+    c->lock_wait_ns = 0;
+    c->async_key = NULL;
+    c->async_deadline = 0;
+    c->async_node = NULL;
+    c->async_rest = NULL;
+    c->async_rest_len = 0;
     c->proc = proc;
     
     c->valid = 1;
     c->async_hold = 0;
     c->used = 0;
 
-    if (fd != -1) listAddNodeTail(proc->clients,c);
+    if (fd != -1) {
+        listAddNodeTail(proc->clients,c);
+        updateClientsStat(proc);
+    }
     return c;
 }
 
@@ -225,9 +242,11 @@ void _addReplyObjectToList(client *c, robj *o) {
     } else {
         tail = (robj*)listNodeValue(listLast(c->reply));
 
-        /* Append to this object when possible. */
+        /* Append to this object when possible. Large values are always
+         * queued by reference and flushed with writev(). */
         if (tail->ptr != NULL &&
-            tail->encoding == OBJ_ENCODING_RAW &&
+            tail->encoding == OBJ_ENCODING_RAW && tail->refcount == 1 &&
+            sdslen((sds)o->ptr) < PROTO_REPLY_ZEROCOPY_MIN &&
             sdslen((sds)tail->ptr)+sdslen((sds)o->ptr) <= PROTO_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= sdsZmallocSize((sds)tail->ptr);
@@ -261,6 +280,7 @@ void _addReplySdsToList(client *c, sds s) {
 
         /* Append to this object when possible. */
         if (tail->ptr != NULL && tail->encoding == OBJ_ENCODING_RAW &&
+            tail->refcount == 1 &&
             sdslen((sds)tail->ptr)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= sdsZmallocSize((sds)tail->ptr);
@@ -291,6 +311,7 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
 
         /* Append to this object when possible. */
         if (tail->ptr != NULL && tail->encoding == OBJ_ENCODING_RAW &&
+            tail->refcount == 1 &&
             sdslen((sds)tail->ptr)+len <= PROTO_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= sdsZmallocSize((sds)tail->ptr);
@@ -315,6 +336,25 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
 void addReply(client *c, robj *obj) {
     if (prepareClientToWrite(c) != C_OK) return;
 
+    /* Compressed values are inflated, unless the client negotiated to
+     * receive them as stored: then the sds is sent like a RAW one. */
+    if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        if (c->flags & CLIENT_COMPRESSED_REPLY) {
+            __atomic_add_fetch(&c->proc->db->stat_compressed_passthrough,1,
+                __ATOMIC_RELAXED);
+            if (sdslen((sds)obj->ptr) >= PROTO_REPLY_ZEROCOPY_MIN ||
+                _addReplyToBuffer(c,(char*)obj->ptr,sdslen((sds)obj->ptr)) != C_OK)
+                _addReplyObjectToList(c,obj);
+        } else {
+            obj = decompressStringObject(obj);
+            if (sdslen((sds)obj->ptr) >= PROTO_REPLY_ZEROCOPY_MIN ||
+                _addReplyToBuffer(c,(char*)obj->ptr,sdslen((sds)obj->ptr)) != C_OK)
+                _addReplyObjectToList(c,obj);
+            decrRefCount(obj);
+        }
+        return;
+    }
+
     /* This is an important place where we can avoid copy-on-write
      * when there is a saving child running, avoiding touching the
      * refcount field of the object if it's not needed.
@@ -323,7 +363,11 @@ void addReply(client *c, robj *obj) {
      * we'll be able to send the object to the client without
      * messing with its page. */
     if (sdsEncodedObject(obj)) {
-        if (_addReplyToBuffer(c,(char*)obj->ptr,sdslen((sds)obj->ptr)) != C_OK)
+        /* Large values, typically stored documents, are not copied: the
+         * reply list takes a reference and writeToClient() sends them
+         * straight from the keyspace object. */
+        if (sdslen((sds)obj->ptr) >= PROTO_REPLY_ZEROCOPY_MIN ||
+            _addReplyToBuffer(c,(char*)obj->ptr,sdslen((sds)obj->ptr)) != C_OK)
             _addReplyObjectToList(c,obj);
     } else if (obj->encoding == OBJ_ENCODING_INT) {
         /* Optimization: if there is room in the static buffer for 32 bytes
@@ -521,6 +565,9 @@ void addReplyBulkLen(client *c, robj *obj) {
 
     if (sdsEncodedObject(obj)) {
         len = sdslen((sds)obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        len = (c->flags & CLIENT_COMPRESSED_REPLY) ?
+            sdslen((sds)obj->ptr) : compressedObjectRawLen(obj);
     } else {
         long n = (long)obj->ptr;
 
@@ -645,46 +692,144 @@ void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             return;
         }
         serverLog(LL_VERBOSE,"Accepted %s:%d", cip, cport);
-        NotifyInfo info;
-        info.fd = cfd;
-        info.ms = 0;
-        write(proc->notify_fd_write, (void*)&info, sizeof(info));
+        /* The listening socket is owned by this proc's own event loop
+         * (SO_REUSEPORT mode), so the client is registered right here
+         * instead of being handed over through the notify pipe. */
+        acceptCommonHandler(cfd, 0, cip, proc);
     }
 }
 
-void NotifyHandle(aeEventLoop *el, int fd, void *privdata, int mask) {
-    int max = MAX_ACCEPTS_PER_CALL;
-    UNUSED(el);
-    UNUSED(mask);
+/* Post a message to 'proc' from any thread. The handler is called later by
+ * NotifyHandle() in the event loop owning 'proc'. Returns C_ERR if the
+ * inbox is full, in which case the caller still owns 'fd' and 'data'. */
+int postNotify(TinyRedisProc *proc, notifyProc *handler, int fd, void *data) {
+    NotifyInfo info;
+    info.proc = handler;
+    info.fd = fd;
+    info.ms = 0;
+    info.data = data;
+    return proc->inbox->Push(info) == 0 ? C_OK : C_ERR;
+}
 
-    TinyRedisProc* proc = (TinyRedisProc*)privdata;
+/* Handoff of a connection accepted by another thread. */
+void acceptNotifyHandler(TinyRedisProc *proc, NotifyInfo *info) {
+    acceptCommonHandler(info->fd, 0, NULL, proc);
+}
 
-    while(max--) {
-        NotifyInfo info;
-        int nread = read(fd, (void*)&info, sizeof(info));
-        if (nread < 0)
-        {
-            if (errno == EAGAIN)
-                return ;
-            else
-                exit(-1);
-        }
-        else if (nread == 0)
-        {
-            exit(-1);
+/* Handoff of a client migrated from an overloaded proc, see
+ * migrateClientsIfNeeded(). The client has no buffered input or output,
+ * so it is enough to start watching its socket in our event loop. */
+void migrateNotifyHandler(TinyRedisProc *proc, NotifyInfo *info) {
+    client *c = (client*)info->data;
+
+    c->proc = proc;
+    listAddNodeTail(proc->clients,c);
+    updateClientsStat(proc);
+    if (aeCreateFileEvent(proc->el,c->fd,AE_READABLE,
+        readQueryFromClient, c) == AE_ERR)
+    {
+        serverLog(LL_WARNING,
+            "Error registering fd event for the migrated client: %s (fd=%d)",
+            strerror(errno),c->fd);
+        freeClient(c);
+    }
+}
+
+/* A client can be moved to another event loop only between commands,
+ * when nothing is buffered on either side. */
+static int clientIsMigratable(client *c) {
+    return c->fd != -1 &&
+           c != c->proc->current_client &&
+           !(c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP|
+                         CLIENT_PENDING_WRITE)) &&
+           !c->async_hold &&
+           !clientHasPendingReplies(c) &&
+           sdslen(c->querybuf) == 0 &&
+           c->argc == 0 && c->multibulklen == 0;
+}
+
+/* Called from procCron(). If this proc serves clearly more clients than the
+ * average for CLIENT_MIGRATE_TICKS crons in a row, idle clients are handed
+ * over to the least loaded proc through its inbox. */
+void migrateClientsIfNeeded(TinyRedisProc *proc) {
+    TinyRedisDB *db = proc->db;
+    TinyRedisProc *target = NULL;
+    unsigned long total = 0, avg, mine, least = ULONG_MAX;
+    int j, moved = 0, max;
+    listIter li;
+    listNode *ln;
+
+    if (db->nprocs < 2) return;
+
+    for (j = 0; j < db->nprocs; j++) {
+        unsigned long n = __atomic_load_n(&db->procs[j]->stat_clients,__ATOMIC_RELAXED);
+
+        total += n;
+        if (db->procs[j] != proc && n < least) {
+            least = n;
+            target = db->procs[j];
         }
-        else if (nread != sizeof(info))
-        {
-            exit(-1);
+    }
+    avg = total/db->nprocs;
+    mine = listLength(proc->clients);
+
+    if (mine < least+2 || mine*100 <= avg*db->client_migrate_ratio) {
+        proc->imbalance_ticks = 0;
+        return;
+    }
+    if (++proc->imbalance_ticks < CLIENT_MIGRATE_TICKS) return;
+    proc->imbalance_ticks = 0;
+
+    /* Move half of the gap with the least loaded proc. */
+    max = (int)((mine-least)/2);
+    if (max > CLIENT_MIGRATE_MAX_PER_CRON) max = CLIENT_MIGRATE_MAX_PER_CRON;
+
+    listRewind(proc->clients,&li);
+    while(moved < max && (ln = listNext(&li)) != NULL) {
+        client *c = (client*)listNodeValue(ln);
+
+        if (!clientIsMigratable(c)) continue;
+
+        /* Detach from our loop, the target proc takes ownership. */
+        aeDeleteFileEvent(proc->el,c->fd,AE_READABLE|AE_WRITABLE);
+        listDelNode(proc->clients,ln);
+        if (postNotify(target,migrateNotifyHandler,c->fd,c) != C_OK) {
+            /* Target inbox is full: keep serving the client here. */
+            listAddNodeTail(proc->clients,c);
+            if (aeCreateFileEvent(proc->el,c->fd,AE_READABLE,
+                readQueryFromClient, c) == AE_ERR) freeClient(c);
+            break;
         }
-        acceptCommonHandler(info.fd, 0, NULL, proc);
+        moved++;
     }
+    updateClientsStat(proc);
 
-    printf("end notify!");
+    if (moved)
+        serverLog(LL_VERBOSE,"Migrated %d clients from proc %d to proc %d",
+            moved, proc->id, target->id);
+}
+
+/* Inbox doorbell handler: a single wakeup drains every message queued
+ * since the last one. */
+void NotifyHandle(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+
+    TinyRedisProc* proc = (TinyRedisProc*)privdata;
+    NotifyInfo info;
+
+    proc->inbox->Ack();
+    while (proc->inbox->Pop(info) == 0)
+        info.proc(proc, &info);
 }
 
 static void freeClientArgv(client *c) {
     int j;
+    if (c->zargv) {
+        freeCommandValues(c->zargv,c->argc);
+        c->zargv = NULL;
+    }
     for (j = 0; j < c->argc; j++)
         decrRefCount(c->argv[j]);
     c->argc = 0;
@@ -708,6 +853,7 @@ void unlinkClient(client *c) {
         ln = listSearchKey(c->proc->clients,c);
         serverAssert(ln != NULL);
         listDelNode(c->proc->clients,ln);
+        updateClientsStat(c->proc);
 
         /* Unregister async I/O handlers and close the socket. */
         aeDeleteFileEvent(c->proc->el,c->fd,AE_READABLE);
@@ -736,6 +882,9 @@ void freeClient(client *c) {
     listRelease(c->reply);
     freeClientArgv(c);
 
+    /* Stop waiting for a read-through fill */
+    readThroughUnlink(c);
+
     /* Unlink the client: this will close the socket, remove the I/O
      * handlers, and remove references of the client from different
      * places where active clients may be referenced. */
@@ -780,48 +929,102 @@ void freeClientsInAsyncFreeQueue(TinyRedisProc* proc) {
 
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed. */
+/* Account 'nwritten' bytes sent by writeToClient(), releasing the static
+ * buffer and the reply objects that were fully transmitted. */
+static void consumeClientReplies(client *c, size_t nwritten) {
+    size_t objlen, objmem, n;
+    robj *o;
+
+    if (c->bufpos > 0) {
+        n = c->bufpos-c->sentlen;
+        if (n > nwritten) n = nwritten;
+        c->sentlen += n;
+        nwritten -= n;
+
+        /* If the buffer was sent, set bufpos to zero to continue with
+         * the remainder of the reply. */
+        if ((int)c->sentlen < c->bufpos) return;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+
+    while(listLength(c->reply)) {
+        o = (robj*)listNodeValue(listFirst(c->reply));
+        objlen = sdslen((sds)o->ptr);
+        objmem = getStringObjectSdsUsedMemory(o);
+
+        if (objlen > 0) {
+            if (nwritten == 0) break;
+            n = objlen-c->sentlen;
+            if (n > nwritten) n = nwritten;
+            c->sentlen += n;
+            nwritten -= n;
+
+            /* Stop at the first object that is only partially sent */
+            if (c->sentlen < objlen) break;
+        }
+        listDelNode(c->reply,listFirst(c->reply));
+        c->sentlen = 0;
+        c->reply_bytes -= objmem;
+    }
+}
+
+/* Write the pending output of the client. The static buffer and the objects
+ * of the reply list are gathered into one iovec array, so a reply made of
+ * many chunks, or of large values referenced from the keyspace, costs a
+ * single writev() per round. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    size_t objmem;
+    struct iovec iov[NET_MAX_IOV];
+    size_t iovlen, offset, objlen;
+    int iovcnt;
+    listIter li;
+    listNode *ln;
     robj *o;
 
     while(clientHasPendingReplies(c)) {
+        iovcnt = 0;
+        iovlen = 0;
+        offset = c->sentlen;
+
         if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = (robj*)listNodeValue(listFirst(c->reply));
-            objlen = sdslen((sds)o->ptr);
-            objmem = getStringObjectSdsUsedMemory(o);
+            iov[iovcnt].iov_base = c->buf+offset;
+            iov[iovcnt].iov_len = c->bufpos-offset;
+            iovlen += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
 
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->reply_bytes -= objmem;
-                continue;
-            }
+        listRewind(c->reply,&li);
+        while(iovcnt < NET_MAX_IOV && iovlen < NET_MAX_WRITES_PER_EVENT &&
+              (ln = listNext(&li)) != NULL)
+        {
+            o = (robj*)listNodeValue(ln);
+            objlen = sdslen((sds)o->ptr);
+            if (objlen == 0) continue;
 
-            nwritten = write(fd, ((char*)o->ptr)+c->sentlen,objlen-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+            iov[iovcnt].iov_base = ((char*)o->ptr)+offset;
+            iov[iovcnt].iov_len = objlen-offset;
+            iovlen += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objmem;
-            }
+        /* Only empty objects left in the reply list. */
+        if (iovcnt == 0) {
+            consumeClientReplies(c,0);
+            continue;
         }
+
+        if (iovcnt == 1)
+            nwritten = write(fd,iov[0].iov_base,iov[0].iov_len);
+        else
+            nwritten = writev(fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+        consumeClientReplies(c,(size_t)nwritten);
+
+        /* The socket buffer is full, another call would just fail. */
+        if ((size_t)nwritten < iovlen) break;
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -1125,6 +1328,9 @@ int processMultibulkBuffer(client *c) {
 }
 
 void processInputBuffer(client *c) {
+    TinyRedisProc *proc = c->proc;
+    int batch = proc->batch != NULL;
+
     c->proc->current_client = c;
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
@@ -1134,6 +1340,9 @@ void processInputBuffer(client *c) {
          * this flag has been set (i.e. don't process more commands). */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) break;
 
+        /* A parked read-through GET replies first, see readthrough.h */
+        if (c->async_hold) break;
+
         /* Determine request type when unknown. */
         if (!c->reqtype) {
             if (c->querybuf[0] == '*') {
@@ -1154,6 +1363,16 @@ void processInputBuffer(client *c) {
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             resetClient(c);
+        } else if (batch) {
+            /* Parse the whole pipeline first, see processCommandBatch() */
+            batchAddCommand(c);
+            c->reqtype = 0;
+            c->multibulklen = 0;
+            c->bulklen = -1;
+            if (proc->batch_len == proc->db->pipeline_batch) {
+                processCommandBatch(c);
+                if (proc->current_client == NULL) break;
+            }
         } else {
             /* Only reset the client when the command was executed. */
             if (processCommand(c) == C_OK)
@@ -1163,7 +1382,10 @@ void processInputBuffer(client *c) {
             if (c->proc->current_client == NULL) break;
         }
     }
-    c->proc->current_client = NULL;
+    /* Run the rest of the pipeline. Nothing is left queued when the client
+     * was freed, processCommandBatch() empties the queue first. */
+    if (proc->batch_len) processCommandBatch(c);
+    proc->current_client = NULL;
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1424,3 +1646,23 @@ void asyncCloseClientOnOutputBufferLimitReached(client *c) {
     }
 }
 
+
+/* CLIENT COMPRESSION ON|OFF
+ *
+ * Let the connection receive compressed values exactly as stored, see the
+ * layout described in object.cpp, instead of having them inflated. */
+void clientCommand(client *c) {
+    if (!strcasecmp((const char*)c->argv[1]->ptr,"compression") && c->argc == 3) {
+        if (!strcasecmp((const char*)c->argv[2]->ptr,"on")) {
+            c->flags |= CLIENT_COMPRESSED_REPLY;
+            addReply(c,c->proc->db->shared.ok);
+        } else if (!strcasecmp((const char*)c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_COMPRESSED_REPLY;
+            addReply(c,c->proc->db->shared.ok);
+        } else {
+            addReply(c,c->proc->db->shared.syntaxerr);
+        }
+    } else {
+        addReplyError(c, "Syntax error, try CLIENT (COMPRESSION)");
+    }
+}
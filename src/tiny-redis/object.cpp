@@ -31,6 +31,7 @@
 #include "server.h"
 #include <math.h>
 #include <ctype.h>
+#include <zlib.h>
 
 #ifdef __CYGWIN__
 #define strtold(a,b) ((long double)strtod((a),(b)))
@@ -43,8 +44,9 @@ robj *createObject(int type, void *ptr) {
     o->ptr = ptr;
     o->refcount = 1;
 
-    /* Set the LRU to the current lruclock (minutes resolution). */
-    o->lru = LRU_CLOCK();
+    /* Set the LRU to the current lruclock (minutes resolution), or
+     * alternatively the LFU counter. */
+    o->lru = objectInitialLRU();
     return o;
 }
 
@@ -65,7 +67,7 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
-    o->lru = LRU_CLOCK();
+    o->lru = objectInitialLRU();
 
     sh->len = len;
     sh->alloc = len;
@@ -171,6 +173,15 @@ robj *dupStringObject(robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_COMPRESSED:
+        d = createObject(OBJ_STRING,sdsdup((sds)o->ptr));
+        d->encoding = OBJ_ENCODING_COMPRESSED;
+        __atomic_add_fetch(&g_redisDB->stat_compressed_objects,1,__ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_redisDB->stat_compressed_raw_bytes,
+            compressedObjectRawLen(o),__ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_redisDB->stat_compressed_bytes,
+            sdslen((sds)o->ptr),__ATOMIC_RELAXED);
+        return d;
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -187,6 +198,13 @@ robj *createHashObject(void) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree((sds)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        __atomic_sub_fetch(&g_redisDB->stat_compressed_objects,1,__ATOMIC_RELAXED);
+        __atomic_sub_fetch(&g_redisDB->stat_compressed_raw_bytes,
+            compressedObjectRawLen(o),__ATOMIC_RELAXED);
+        __atomic_sub_fetch(&g_redisDB->stat_compressed_bytes,
+            sdslen((sds)o->ptr),__ATOMIC_RELAXED);
+        sdsfree((sds)o->ptr);
     }
 }
 
@@ -217,24 +235,42 @@ void freeHashObject(robj *o) {
     }
 }
 
+/* Values stored in the keyspace may be referenced by the reply lists of
+ * clients living in other procs, and released there after the slot lock
+ * is gone, so the reference count is updated atomically. Shared objects
+ * are never freed and skip the update entirely, see makeObjectShared(). */
 void incrRefCount(robj *o) {
-    o->refcount++;
+    if (o->refcount == OBJ_SHARED_REFCOUNT) return;
+    __atomic_add_fetch(&o->refcount,1,__ATOMIC_RELAXED);
 }
 
 void decrRefCount(robj *o) {
-    if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
-    if (o->refcount == 1) {
+    int refcount;
+
+    if (o->refcount == OBJ_SHARED_REFCOUNT) return;
+    refcount = __atomic_sub_fetch(&o->refcount,1,__ATOMIC_ACQ_REL);
+    if (refcount < 0) serverPanic("decrRefCount against refcount <= 0");
+    if (refcount == 0) {
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_HASH: freeHashObject(o); break;
         default: serverPanic("Unknown object type"); break;
         }
         zfree(o);
-    } else {
-        o->refcount--;
     }
 }
 
+/* Set a special refcount in the object to make it "shared":
+ * incrRefCount and decrRefCount() will test for this special refcount
+ * and will not touch the object. This way it is free to access shared
+ * objects such as small integers from different threads without any
+ * cache line bouncing. */
+robj *makeObjectShared(robj *o) {
+    serverAssert(o->refcount == 1);
+    o->refcount = OBJ_SHARED_REFCOUNT;
+    return o;
+}
+
 /* This variant of decrRefCount() gets its argument as void, and is useful
  * as free method in data structures that expect a 'void free_object(void*)'
  * prototype for the free method. */
@@ -343,6 +379,135 @@ robj *tryObjectEncoding(robj *o) {
     return o;
 }
 
+/* -----------------------------------------------------------------------------
+ * Compressed string values
+ *
+ * Large string values (the JSON documents filled by ASyncTask) are highly
+ * repetitive, so when "compression" is enabled the values longer than
+ * "compression-threshold" are stored deflated. The object keeps an sds
+ * with the following layout:
+ *
+ *   +------+------+------------------+---------------------------+
+ *   | 0x00 | 'Z'  | raw len (u32 LE) | zlib stream               |
+ *   +------+------+------------------+---------------------------+
+ *
+ * The zlib stream may use the preset dictionary set with "compression-dict".
+ * Replies inflate the value, unless the client asked with CLIENT
+ * COMPRESSION ON to receive the stored bytes as they are.
+ * -------------------------------------------------------------------------- */
+
+#define OBJ_COMPRESSED_HDR_LEN 6
+
+size_t compressedObjectRawLen(robj *o) {
+    const unsigned char *p = (const unsigned char*)o->ptr;
+
+    return (size_t)p[2] | ((size_t)p[3] << 8) |
+           ((size_t)p[4] << 16) | ((size_t)p[5] << 24);
+}
+
+/* Try to store a RAW string value compressed. Like tryObjectEncoding() the
+ * object is converted in place, so it is only done for unshared objects.
+ * Values that do not shrink by at least 1/8 are left untouched. */
+robj *tryObjectCompression(robj *o) {
+    TinyRedisDB *db = g_redisDB;
+    size_t len;
+    long long start;
+    z_stream zs;
+    uLong bound;
+    sds dst;
+    int ret;
+
+    if (!db->compression) return o;
+    if (o->type != OBJ_STRING || o->encoding != OBJ_ENCODING_RAW) return o;
+    if (o->refcount != 1) return o;
+    len = sdslen((sds)o->ptr);
+    if (len < db->compression_threshold || len > UINT32_MAX) return o;
+
+    start = ustime();
+    memset(&zs,0,sizeof(zs));
+    if (deflateInit(&zs,db->compression_level) != Z_OK) return o;
+    if (db->compression_dict &&
+        deflateSetDictionary(&zs,(const Bytef*)db->compression_dict,
+            sdslen(db->compression_dict)) != Z_OK)
+    {
+        deflateEnd(&zs);
+        return o;
+    }
+
+    bound = deflateBound(&zs,len);
+    dst = sdsnewlen(NULL,OBJ_COMPRESSED_HDR_LEN+bound);
+    dst[0] = '\0';
+    dst[1] = 'Z';
+    dst[2] = len & 0xff;
+    dst[3] = (len >> 8) & 0xff;
+    dst[4] = (len >> 16) & 0xff;
+    dst[5] = (len >> 24) & 0xff;
+
+    zs.next_in = (Bytef*)o->ptr;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)dst+OBJ_COMPRESSED_HDR_LEN;
+    zs.avail_out = bound;
+    ret = deflate(&zs,Z_FINISH);
+    deflateEnd(&zs);
+    __atomic_add_fetch(&db->stat_compress_us,ustime()-start,__ATOMIC_RELAXED);
+
+    if (ret != Z_STREAM_END ||
+        OBJ_COMPRESSED_HDR_LEN+zs.total_out > len-len/8)
+    {
+        sdsfree(dst);
+        __atomic_add_fetch(&db->stat_compress_rejected,1,__ATOMIC_RELAXED);
+        return o;
+    }
+    sdssetlen(dst,OBJ_COMPRESSED_HDR_LEN+zs.total_out);
+    dst = sdsRemoveFreeSpace(dst);
+
+    sdsfree((sds)o->ptr);
+    o->ptr = dst;
+    o->encoding = OBJ_ENCODING_COMPRESSED;
+
+    __atomic_add_fetch(&db->stat_compressed_objects,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&db->stat_compressed_raw_bytes,len,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&db->stat_compressed_bytes,sdslen(dst),__ATOMIC_RELAXED);
+    return o;
+}
+
+/* Return a new RAW string object with the inflated content of 'o'. */
+robj *decompressStringObject(robj *o) {
+    TinyRedisDB *db = g_redisDB;
+    sds src = (sds)o->ptr;
+    size_t len = compressedObjectRawLen(o);
+    long long start = ustime();
+    z_stream zs;
+    sds dst;
+    int ret;
+
+    serverAssertWithInfo(NULL,o,o->encoding == OBJ_ENCODING_COMPRESSED);
+
+    dst = sdsnewlen(NULL,len);
+    memset(&zs,0,sizeof(zs));
+    zs.next_in = (Bytef*)src+OBJ_COMPRESSED_HDR_LEN;
+    zs.avail_in = sdslen(src)-OBJ_COMPRESSED_HDR_LEN;
+    zs.next_out = (Bytef*)dst;
+    zs.avail_out = len;
+
+    ret = inflateInit(&zs);
+    if (ret == Z_OK) {
+        ret = inflate(&zs,Z_FINISH);
+        if (ret == Z_NEED_DICT && db->compression_dict) {
+            ret = inflateSetDictionary(&zs,(const Bytef*)db->compression_dict,
+                sdslen(db->compression_dict));
+            if (ret == Z_OK) ret = inflate(&zs,Z_FINISH);
+        }
+        inflateEnd(&zs);
+    }
+    if (ret != Z_STREAM_END || zs.total_out != len)
+        serverPanic("Corrupted compressed string value");
+
+    __atomic_add_fetch(&db->stat_decompressions,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&db->stat_decompress_us,ustime()-start,__ATOMIC_RELAXED);
+    return createObject(OBJ_STRING,dst);
+}
+
 /* Get a decoded version of an encoded object (returned as a new object).
  * If the object is already raw-encoded just increment the ref count. */
 robj *getDecodedObject(robj *o) {
@@ -358,6 +523,8 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_COMPRESSED) {
+        return decompressStringObject(o);
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -380,6 +547,16 @@ int compareStringObjectsWithFlags(robj *a, robj *b, int flags) {
     size_t alen, blen, minlen;
 
     if (a == b) return 0;
+    if (a->encoding == OBJ_ENCODING_COMPRESSED ||
+        b->encoding == OBJ_ENCODING_COMPRESSED)
+    {
+        robj *da = getDecodedObject(a), *db = getDecodedObject(b);
+        int cmp = compareStringObjectsWithFlags(da,db,flags);
+
+        decrRefCount(da);
+        decrRefCount(db);
+        return cmp;
+    }
     if (sdsEncodedObject(a)) {
         astr = (char*)a->ptr;
         alen = sdslen(astr);
@@ -435,11 +612,35 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen((sds)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        return compressedObjectRawLen(o);
     } else {
         return sdigits10((long)o->ptr);
     }
 }
 
+/* Approximate memory used by a value, for the per-slot accounting. The
+ * result only depends on state that write commands change, so the amount
+ * added when the value is stored is the one subtracted when it is freed.
+ * Fields of hash tables are counted at a fixed per field cost. */
+size_t objectApproxBytes(robj *o) {
+    if (o->type == OBJ_STRING) {
+        switch(o->encoding) {
+        case OBJ_ENCODING_EMBSTR: return zmalloc_size(o);
+        case OBJ_ENCODING_RAW:
+        case OBJ_ENCODING_COMPRESSED:
+            return sizeof(robj)+zmalloc_size(sdsAllocPtr((sds)o->ptr));
+        default: return sizeof(robj);
+        }
+    } else if (o->type == OBJ_HASH) {
+        if (o->encoding == OBJ_ENCODING_ZIPLIST)
+            return sizeof(robj)+ziplistBlobLen((unsigned char*)o->ptr);
+        return sizeof(robj)+sizeof(dict)+dictSize((dict*)o->ptr)*
+            (sizeof(dictEntry)+sizeof(dictEntry*)+2*sizeof(robj));
+    }
+    return sizeof(robj);
+}
+
 int getDoubleFromObject(robj *o, double *target) {
     double value;
     char *eptr;
@@ -460,6 +661,9 @@ int getDoubleFromObject(robj *o, double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+            /* Only values longer than any number get compressed */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -498,6 +702,9 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+            /* Only values longer than any number get compressed */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -531,6 +738,9 @@ int getLongLongFromObject(robj *o, long long *target) {
             if (string2ll((const char*)o->ptr,sdslen((sds)o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+            /* Only values longer than any number get compressed */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -578,6 +788,7 @@ const char *strEncoding(int encoding) {
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_COMPRESSED: return "compressed";
     default: return "unknown";
     }
 }
@@ -0,0 +1,224 @@
+/* Read-through GET, see readthrough.h.
+ *
+ * Everything here runs in the event loop of the proc owning the clients,
+ * but readThroughNotify() called by the ASyncTask threads. A fill that
+ * sets the key takes the slot write lock, which waits for the GET that
+ * parked the client to release the slot, so the ASyncTask always sees
+ * proc->readthrough_waiting of a client parked before the key landed.
+ */
+
+#include "server.h"
+#include "readthrough.h"
+
+static void readThroughNotifyHandler(TinyRedisProc *proc, NotifyInfo *info);
+static int readThroughTimer(struct aeEventLoop *el, long long id, void *clientData);
+
+/* Park 'c' on the fill of the key of its GET. The caller queues the fill
+ * and replies nothing. */
+void readThroughPark(client *c) {
+    TinyRedisProc *proc = c->proc;
+    sds key = (sds)c->argv[1]->ptr;
+    dictEntry *de = dictFind(proc->readthrough_keys,key);
+    list *waiters;
+
+    if (de) {
+        waiters = (list*)dictGetVal(de);
+    } else {
+        waiters = listCreate();
+        dictAdd(proc->readthrough_keys,sdsdup(key),waiters);
+    }
+    listAddNodeTail(waiters,c);
+
+    c->async_key = sdsdup(key);
+    c->async_deadline = mstime()+proc->db->readthrough_timeout;
+    listAddNodeTail(proc->readthrough_clients,c);
+    c->async_node = listLast(proc->readthrough_clients);
+    c->async_hold = 1;
+
+    __atomic_store_n(&proc->readthrough_waiting,proc->readthrough_waiting+1,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&proc->stat_readthrough_parked,
+                     proc->stat_readthrough_parked+1,__ATOMIC_RELAXED);
+
+    /* The deadlines follow the parking order, one timer serves them all */
+    if (proc->readthrough_timer == -1)
+        proc->readthrough_timer = aeCreateTimeEvent(proc->el,
+            proc->db->readthrough_timeout,readThroughTimer,proc,NULL);
+}
+
+/* Forget the parking of 'c', whose key list is already handled. */
+static void readThroughUnpark(client *c) {
+    TinyRedisProc *proc = c->proc;
+
+    listDelNode(proc->readthrough_clients,c->async_node);
+    sdsfree(c->async_key);
+    c->async_key = NULL;
+    c->async_node = NULL;
+    c->async_hold = 0;
+    __atomic_store_n(&proc->readthrough_waiting,proc->readthrough_waiting-1,
+                     __ATOMIC_RELAXED);
+}
+
+/* Remove 'c' from the clients waiting on its key, then unpark it. */
+static void readThroughUnwait(client *c) {
+    TinyRedisProc *proc = c->proc;
+    dictEntry *de = dictFind(proc->readthrough_keys,c->async_key);
+
+    if (de) {
+        list *waiters = (list*)dictGetVal(de);
+        listNode *ln = listSearchKey(waiters,c);
+
+        if (ln) listDelNode(waiters,ln);
+        if (listLength(waiters) == 0) {
+            listRelease(waiters);
+            dictDelete(proc->readthrough_keys,c->async_key);
+        }
+    }
+    readThroughUnpark(c);
+}
+
+/* Called by freeClient(). */
+void readThroughUnlink(client *c) {
+    TinyRedisProc *proc = c->proc;
+
+    if (c->async_hold) readThroughUnwait(c);
+    if (listLength(proc->readthrough_resume)) {
+        listNode *ln = listSearchKey(proc->readthrough_resume,c);
+
+        if (ln) listDelNode(proc->readthrough_resume,ln);
+    }
+    batchDiscard(c);
+}
+
+/* The GET of 'c' replied: run the rest of its pipeline and what it sent
+ * while parked, as processInputBuffer() would have. */
+static void readThroughResume(client *c) {
+    TinyRedisProc *proc = c->proc;
+
+    proc->current_client = c;
+    batchResume(c);
+    if (proc->current_client == NULL) return;  /* Freed */
+    proc->current_client = NULL;
+    if (!c->async_hold && sdslen(c->querybuf)) processInputBuffer(c);
+}
+
+/* Resume the woken clients one by one. A client freed meanwhile leaves the
+ * list in readThroughUnlink(). */
+static void readThroughResumeClients(TinyRedisProc *proc) {
+    listNode *ln;
+
+    while ((ln = listFirst(proc->readthrough_resume)) != NULL) {
+        client *c = (client*)listNodeValue(ln);
+
+        listDelNode(proc->readthrough_resume,ln);
+        readThroughResume(c);
+    }
+}
+
+/* A fill of the key in info->data is done. Reply to the clients parked on
+ * it with what the keyspace holds now, under one hold of the slot. */
+static void readThroughNotifyHandler(TinyRedisProc *proc, NotifyInfo *info) {
+    sds key = (sds)info->data;
+    dictEntry *de = dictFind(proc->readthrough_keys,key);
+    list *waiters;
+    listIter li;
+    listNode *ln;
+    redisDb *db;
+    robj keyobj, *o;
+    int optimistic;
+
+    if (de == NULL) {
+        sdsfree(key);
+        return;
+    }
+    waiters = (list*)dictGetVal(de);
+    dictDelete(proc->readthrough_keys,key);
+
+    db = &proc->db->db[keyHashSlot(key,sdslen(key))];
+    initStaticStringObject(keyobj,key);
+    optimistic = proc->db->lockfree_reads && dbTryOptimisticRead(proc,db);
+    if (!optimistic) pthread_rwlock_rdlock(&db->rwlock);
+
+    o = lookupKeyRead(db,&keyobj);
+    listRewind(waiters,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = (client*)listNodeValue(ln);
+
+        if (o == NULL)
+            addReply(c,proc->db->shared.nullbulk);
+        else if (o->type != OBJ_STRING)
+            addReply(c,proc->db->shared.wrongtypeerr);
+        else
+            addReplyBulk(c,o);
+        readThroughUnpark(c);
+        listAddNodeTail(proc->readthrough_resume,c);
+    }
+
+    if (optimistic)
+        dbEndOptimisticRead(proc);
+    else
+        pthread_rwlock_unlock(&db->rwlock);
+
+    __atomic_store_n(&proc->stat_readthrough_filled,
+                     proc->stat_readthrough_filled+listLength(waiters),
+                     __ATOMIC_RELAXED);
+    listRelease(waiters);
+    sdsfree(key);
+    readThroughResumeClients(proc);
+}
+
+/* Reply nil to the clients whose deadline passed. */
+static int readThroughTimer(struct aeEventLoop *el, long long id, void *clientData) {
+    TinyRedisProc *proc = (TinyRedisProc*)clientData;
+    long long now = mstime(), left;
+    listNode *ln;
+    UNUSED(el);
+    UNUSED(id);
+
+    while ((ln = listFirst(proc->readthrough_clients)) != NULL) {
+        client *c = (client*)listNodeValue(ln);
+
+        if (c->async_deadline > now) break;
+        readThroughUnwait(c);
+        addReply(c,proc->db->shared.nullbulk);
+        listAddNodeTail(proc->readthrough_resume,c);
+        __atomic_store_n(&proc->stat_readthrough_timeouts,
+                         proc->stat_readthrough_timeouts+1,__ATOMIC_RELAXED);
+    }
+    readThroughResumeClients(proc);
+
+    if ((ln = listFirst(proc->readthrough_clients)) != NULL) {
+        left = ((client*)listNodeValue(ln))->async_deadline-mstime();
+        return left > 0 ? left : 1;
+    }
+    proc->readthrough_timer = -1;
+    return AE_NOMORE;
+}
+
+/* Called by an ASyncTask once the fill of 'key' is done, whatever its
+ * outcome. Procs with no parked client are skipped. A full inbox is retried
+ * for a short while, as the proc drains it every loop; if it is still full
+ * the wakeup is counted as dropped and the clients reply at their deadline. */
+void readThroughNotify(const char *key, size_t len) {
+    TinyRedisDB *db = g_redisDB;
+    int j, tries;
+
+    if (!db->readthrough) return;
+    for (j = 0; j < db->nprocs; j++) {
+        TinyRedisProc *proc = db->procs[j];
+        sds k;
+
+        if (__atomic_load_n(&proc->readthrough_waiting,__ATOMIC_ACQUIRE) == 0)
+            continue;
+        k = sdsnewlen(key,len);
+        for (tries = 0; tries < READTHROUGH_NOTIFY_TRIES; tries++) {
+            if (postNotify(proc,readThroughNotifyHandler,-1,k) == C_OK) break;
+            usleep(READTHROUGH_NOTIFY_RETRY_US);
+        }
+        if (tries == READTHROUGH_NOTIFY_TRIES) {
+            sdsfree(k);
+            __atomic_add_fetch(&proc->stat_readthrough_notify_dropped,1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+}
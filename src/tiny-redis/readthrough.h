@@ -0,0 +1,27 @@
+/* readthrough.h - GET waiting for the async fill of a missing key
+ *
+ * With read-through enabled a GET that misses does not reply nil: the
+ * client is parked in its proc while an ASyncTask loads the key, and it
+ * stops reading commands until it is woken up. The clients parked on a key
+ * are kept in proc->readthrough_keys, so every GET of the key on the proc
+ * shares the one fill queued by the first of them.
+ *
+ * Once a fill is done, successful or not, the ASyncTask posts the key to
+ * the inbox of every proc with parked clients. The proc looks the key up
+ * again and replies the value, or nil. A client still parked after
+ * read-through-timeout milliseconds replies nil. Pipelined commands parsed
+ * after the GET wait with it, see batchPark().
+ */
+
+#ifndef __READTHROUGH_H__
+#define __READTHROUGH_H__
+
+/* Posts of a wakeup to a full proc inbox, READTHROUGH_NOTIFY_RETRY_US apart */
+#define READTHROUGH_NOTIFY_TRIES 10
+#define READTHROUGH_NOTIFY_RETRY_US 100
+
+void readThroughPark(client *c);
+void readThroughUnlink(client *c);
+void readThroughNotify(const char *key, size_t len);
+
+#endif
@@ -28,6 +28,7 @@
  */
 
 #include "server.h"
+#include "slowlog.h"
 
 #include <string.h>
 #include <strings.h>
@@ -51,6 +52,7 @@
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #include <locale.h>
+#include <sched.h>
 #include <sys/socket.h>
 
 /*================================= Globals ================================= */
@@ -108,34 +110,52 @@ TinyRedisDB* g_redisDB;
  *    its execution as long as the kernel scheduler is giving us time.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
+ * o: Optimistic read: the command only looks up its keys and copies the
+ *    result to the client, so it can run without the slot rwlock, see
+ *    dbTryOptimisticRead().
+ * x: The keys may span slots: the command looks every key up in its own
+ *    slot with keyDb(), see processMultiSlotCommand().
+ * z: Stores values taken from its arguments. Large ones are compressed
+ *    before the slot lock is taken, see compressCommandValues().
+ * n: Keyless: the command only reads server and proc state, with atomic
+ *    loads where other threads write it. It runs without a slot lock,
+ *    like QUIT, see processCommand().
  */
 struct redisCommand redisCommandTable[] = {
-    {"get",getCommand,2,"rF",0,1,1,1,0,0},
-    {"set",setCommand,-3,"wm",0,1,1,1,0,0},
-    {"setnx",setnxCommand,3,"wmF",0,1,1,1,0,0},
-    {"setex",setexCommand,4,"wm",0,1,1,1,0,0},
-    {"append",appendCommand,3,"wm",0,1,1,1,0,0},
-    {"strlen",strlenCommand,2,"rF",0,1,1,1,0,0},
-    {"del",delCommand,-2,"w",0,1,-1,1,0,0},
-    {"exists",existsCommand,-2,"rF",0,1,-1,1,0,0},
+    {"get",getCommand,2,"rFo",0,1,1,1,0,0,0},
+    {"set",setCommand,-3,"wmz",0,1,1,1,0,0,0},
+    {"setnx",setnxCommand,3,"wmFz",0,1,1,1,0,0,0},
+    {"setex",setexCommand,4,"wmz",0,1,1,1,0,0,0},
+    {"append",appendCommand,3,"wm",0,1,1,1,0,0,0},
+    {"strlen",strlenCommand,2,"rF",0,1,1,1,0,0,0},
+    {"mget",mgetCommand,-2,"rox",0,1,-1,1,0,0,0},
+    {"mset",msetCommand,-3,"wmxz",0,1,-1,2,0,0,0},
+    {"msetnx",msetnxCommand,-3,"wmxz",0,1,-1,2,0,0,0},
+    {"del",delCommand,-2,"wx",0,1,-1,1,0,0,0},
+    {"exists",existsCommand,-2,"rFox",0,1,-1,1,0,0,0},
     
-	{"hset",hsetCommand,4,"wmF",0,1,1,1,0,0},
-    {"hsetnx",hsetnxCommand,4,"wmF",0,1,1,1,0,0},
-    {"hget",hgetCommand,3,"rF",0,1,1,1,0,0},
-    {"hmset",hmsetCommand,-4,"wm",0,1,1,1,0,0},
-    {"hmget",hmgetCommand,-3,"r",0,1,1,1,0,0},
-    {"hdel",hdelCommand,-3,"wF",0,1,1,1,0,0},
-    {"hlen",hlenCommand,2,"rF",0,1,1,1,0,0},
-    {"hstrlen",hstrlenCommand,3,"rF",0,1,1,1,0,0},
-    {"hkeys",hkeysCommand,2,"rS",0,1,1,1,0,0},
-    {"hvals",hvalsCommand,2,"rS",0,1,1,1,0,0},
-    {"hgetall",hgetallCommand,2,"r",0,1,1,1,0,0},
-    {"hexists",hexistsCommand,3,"rF",0,1,1,1,0,0},
-
-    {"ttl",ttlCommand,2,"rF",0,1,1,1,0,0},
-    {"expire",expireCommand,3,"wF",0,1,1,1,0,0},
-
-    {"cluster",clusterCommand,-2,"a",0,0,0,0,0,0}
+	{"hset",hsetCommand,4,"wmF",0,1,1,1,0,0,0},
+    {"hsetnx",hsetnxCommand,4,"wmF",0,1,1,1,0,0,0},
+    {"hget",hgetCommand,3,"rFo",0,1,1,1,0,0,0},
+    {"hmset",hmsetCommand,-4,"wm",0,1,1,1,0,0,0},
+    {"hmget",hmgetCommand,-3,"r",0,1,1,1,0,0,0},
+    {"hdel",hdelCommand,-3,"wF",0,1,1,1,0,0,0},
+    {"hlen",hlenCommand,2,"rF",0,1,1,1,0,0,0},
+    {"hstrlen",hstrlenCommand,3,"rF",0,1,1,1,0,0,0},
+    {"hkeys",hkeysCommand,2,"rS",0,1,1,1,0,0,0},
+    {"hvals",hvalsCommand,2,"rS",0,1,1,1,0,0,0},
+    {"hgetall",hgetallCommand,2,"r",0,1,1,1,0,0,0},
+    {"hexists",hexistsCommand,3,"rF",0,1,1,1,0,0,0},
+
+    {"ttl",ttlCommand,2,"rFo",0,1,1,1,0,0,0},
+    {"expire",expireCommand,3,"wF",0,1,1,1,0,0,0},
+
+    {"client",clientCommand,-2,"asn",0,0,0,0,0,0,0},
+    {"info",infoCommand,-1,"ltn",0,0,0,0,0,0,0},
+    {"latency",latencyCommand,-2,"altn",0,0,0,0,0,0,0},
+    {"slowlog",slowlogCommand,-2,"an",0,0,0,0,0,0,0},
+
+    {"cluster",clusterCommand,-2,"a",0,0,0,0,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -248,6 +268,25 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree((sds)val);
 }
 
+/* The keyspace dicts have their redisDb as privdata, so every way a key
+ * leaves the slot (DEL, expire, eviction, rehash, flush) is accounted. */
+static void dbDictKeyDestructor(void *privdata, void *key)
+{
+    redisDb *db = (redisDb*)privdata;
+
+    if (db) db->bytes -= sizeof(dictEntry)+zmalloc_size(sdsAllocPtr((sds)key));
+    sdsfree((sds)key);
+}
+
+static void dbDictValDestructor(void *privdata, void *val)
+{
+    redisDb *db = (redisDb*)privdata;
+
+    if (val == NULL) return;
+    if (db) db->bytes -= objectApproxBytes((robj*)val);
+    decrRefCount((robj*)val);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -315,8 +354,8 @@ dictType dbDictType = {
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    dbDictKeyDestructor,        /* key destructor */
+    dbDictValDestructor         /* val destructor */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -330,6 +369,17 @@ dictType commandTableDictType = {
 };
 
 /* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Keys parked read-through GETs wait for, sds -> list of clients. The lists
+ * are released by readthrough.cpp. */
+dictType readThroughDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
 dictType hashDictType = {
     dictEncObjHash,             /* hash function */
     NULL,                       /* key dup */
@@ -390,14 +440,70 @@ void updateCachedTime(TinyRedisProc* proc) {
     proc->mstime = mstime();
 }
 
+/* This is our timer interrupt, called every PROC_CRON_PERIOD_MS in the
+ * event loop of every TinyRedisProc. */
+int procCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    TinyRedisProc *proc = (TinyRedisProc*)clientData;
+    UNUSED(eventLoop);
+    UNUSED(id);
+
+    updateCachedTime(proc);
+
+    /* Close clients that need to be closed asynchronous */
+    freeClientsInAsyncFreeQueue(proc);
+
+    /* Rebalance clients across procs if this one stays overloaded */
+    if (proc->db->client_migrate) migrateClientsIfNeeded(proc);
+
+    /* Reclaim expired keys */
+    if (proc->db->active_expire) activeExpireCycle(proc);
+
+    /* Sample the global expire and eviction rates */
+    if (proc->id == 0 && proc->mstime - proc->db->stat_expired_last_ms >= 1000) {
+        TinyRedisDB *db = proc->db;
+        long long total = __atomic_load_n(&db->stat_expiredkeys,__ATOMIC_RELAXED);
+        long long evicted = __atomic_load_n(&db->stat_evictedkeys,__ATOMIC_RELAXED);
+
+        if (db->stat_expired_last_ms) {
+            long long elapsed = proc->mstime-db->stat_expired_last_ms;
+
+            db->stat_expired_per_sec = (total-db->stat_expired_last)*1000/elapsed;
+            db->stat_evicted_per_sec = (evicted-db->stat_evicted_last)*1000/elapsed;
+        }
+        db->stat_expired_last = total;
+        db->stat_evicted_last = evicted;
+        db->stat_expired_last_ms = proc->mstime;
+    }
+
+    return PROC_CRON_PERIOD_MS;
+}
+
 /* This function gets called every time Redis is entering the
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
 void beforeSleep(struct aeEventLoop *eventLoop) {
-    UNUSED(eventLoop);
+    TinyRedisProc *proc = (TinyRedisProc*)eventLoop->clientData;
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites((TinyRedisProc*)eventLoop->clientData);
+    handleClientsWithPendingWrites(proc);
+
+    /* Account the time spent since we woke up, used by the listener to
+     * place new connections on the least busy loop. */
+    if (proc->loop_wake_us) {
+        long long busy = ustime() - proc->loop_wake_us;
+        long long avg = proc->stat_loop_busy_us;
+
+        if (busy < 0) busy = 0;
+        __atomic_store_n(&proc->stat_loop_busy_us, (avg*7+busy)/8, __ATOMIC_RELAXED);
+    }
+}
+
+/* This function is called just after the event loop returned from
+ * polling for ready file descriptors. */
+void afterSleep(struct aeEventLoop *eventLoop) {
+    TinyRedisProc *proc = (TinyRedisProc*)eventLoop->clientData;
+
+    proc->loop_wake_us = ustime();
 }
 
 /* =========================== Server initialization ======================== */
@@ -490,20 +596,38 @@ void InitSharedObjects(TinyRedisDB* db) {
      * string in string comparisons for the ZRANGEBYLEX command. */
     db->shared.minstring = createStringObject("minstring",9);
     db->shared.maxstring = createStringObject("maxstring",9);
+
+    /* Every member of the struct is a robj pointer: pin them all so that
+     * the procs never write to their refcount. */
+    robj **objs = (robj**)&db->shared;
+    for (j = 0; j < (int)(sizeof(db->shared)/sizeof(robj*)); j++)
+        makeObjectShared(objs[j]);
 }
 
 TinyRedisDB* CreateTinyRedisDB()
 {
+    /* Objects and buffers are allocated and freed by different threads. */
+    zmalloc_enable_thread_safeness();
+
+    /* Keyed dict hashing, before the first dict is created. */
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    dictSetHashFunctionSeed(tv.tv_sec^tv.tv_usec^getpid());
+
     TinyRedisDB* db = (TinyRedisDB*)zmalloc(sizeof(TinyRedisDB));
     db->dbnum = CONFIG_DEFAULT_DBNUM;
     db->db  = (redisDb*)zmalloc(sizeof(redisDb) * db->dbnum);
     for (int i = 0; i < db->dbnum; i++)
     {
-        db->db[i].d = dictCreate(&dbDictType, NULL);
+        db->db[i].d = dictCreate(&dbDictType, &db->db[i]);
         db->db[i].id = i;
         db->db[i].avg_ttl = 0;
+        db->db[i].dirty = 0;
+        db->db[i].bytes = 0;
 
         db->db[i].rwlock = PTHREAD_RWLOCK_INITIALIZER;
+        db->db[i].seq = 0;
+        db->db[i].wheel = NULL;
     }
     
     InitSharedObjects(db);
@@ -513,7 +637,80 @@ TinyRedisDB* CreateTinyRedisDB()
     db->verbosity = LL_DEBUG;
     db->logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     db->maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
+    db->reuseport = CONFIG_DEFAULT_REUSEPORT;
+    db->placement = CONFIG_DEFAULT_PLACEMENT;
+    db->client_migrate = CONFIG_DEFAULT_CLIENT_MIGRATE;
+    db->client_migrate_ratio = CONFIG_DEFAULT_CLIENT_MIGRATE_RATIO;
+    db->lockfree_reads = CONFIG_DEFAULT_LOCKFREE_READS;
+    db->readthrough = CONFIG_DEFAULT_READ_THROUGH;
+    db->readthrough_timeout = CONFIG_DEFAULT_READ_THROUGH_TIMEOUT;
+    db->active_expire = CONFIG_DEFAULT_ACTIVE_EXPIRE;
+    db->compression = CONFIG_DEFAULT_COMPRESSION;
+    db->compression_threshold = CONFIG_DEFAULT_COMPRESSION_THRESHOLD;
+    db->compression_level = CONFIG_DEFAULT_COMPRESSION_LEVEL;
+    db->compression_dict = NULL;
+    db->stat_compressed_objects = 0;
+    db->stat_compressed_raw_bytes = 0;
+    db->stat_compressed_bytes = 0;
+    db->stat_compress_rejected = 0;
+    db->stat_compress_us = 0;
+    db->stat_decompressions = 0;
+    db->stat_decompress_us = 0;
+    db->stat_compressed_passthrough = 0;
+    db->stat_expiredkeys = 0;
+    db->stat_expired_stale_hits = 0;
+    db->stat_expire_cycle_us = 0;
+    db->stat_expired_per_sec = 0;
+    db->stat_expired_last = 0;
+    db->stat_expired_last_ms = 0;
+    db->expire_slot_cursor = 0;
+    db->workers = CONFIG_DEFAULT_WORKERS;
+    db->async_tasks = CONFIG_DEFAULT_ASYNC_TASKS;
+    db->async_inflight_max_age = CONFIG_DEFAULT_ASYNC_INFLIGHT_MAX_AGE;
+    db->async_batch_size = CONFIG_DEFAULT_ASYNC_BATCH_SIZE;
+    db->async_batch_linger_us = CONFIG_DEFAULT_ASYNC_BATCH_LINGER_US;
+    db->async_fill_policy = CONFIG_DEFAULT_ASYNC_FILL_POLICY;
+    db->worker_cpus = NULL;
+    db->worker_ncpus = 0;
+    db->async_task_cpus = NULL;
+    db->async_task_ncpus = 0;
+    db->background_cpus = NULL;
+    db->background_ncpus = 0;
+    db->activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+    db->rehash_hold_us = CONFIG_DEFAULT_REHASH_HOLD_US;
+    db->rehash_dirty = (uint64_t*)zcalloc(sizeof(uint64_t)*((db->dbnum+63)/64));
+    db->stat_rehash_us = 0;
+    db->stat_rehash_locks = 0;
+    db->stat_rehash_completed = 0;
     db->maxmemory = CONFIG_DEFAULT_MAXMEMORY;
+    db->maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
+    db->maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    db->pipeline_batch = CONFIG_DEFAULT_PIPELINE_BATCH;
+    db->slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
+    db->slowlog_max_len = CONFIG_DEFAULT_SLOWLOG_MAX_LEN;
+    db->slowlog_entry_id = 0;
+    db->slowlog_reset_id = 0;
+    db->lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
+    db->lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
+    db->stat_evictedkeys = 0;
+    db->stat_evict_us = 0;
+    db->stat_oom_rejects = 0;
+    db->stat_evicted_per_sec = 0;
+    db->stat_evicted_last = 0;
+    db->stat_async_pushed = 0;
+    db->stat_async_deduped = 0;
+    db->stat_async_dropped = 0;
+    db->stat_async_done = 0;
+    db->stat_async_filled = 0;
+    db->stat_async_us = 0;
+    db->stat_async_wait_us = 0;
+    db->stat_async_stuck = 0;
+    db->stat_async_mongo_queries = 0;
+    db->stat_async_mongo_keys = 0;
+    db->stat_async_exists_keys = 0;
+    db->stat_async_exists_calls = 0;
+    db->stat_async_prefilled = 0;
+    db->stat_starttime = time(NULL);
     db->hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
     db->hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
 
@@ -528,29 +725,43 @@ TinyRedisDB* CreateTinyRedisDB()
      * redis.conf using the rename-command directive. */
     db->commands = dictCreate(&commandTableDictType,NULL);
     populateCommandTable(db);
+    latencyInit();
     
     /* Debugging */
     db->assert_failed = "<no assertion failed>";
     db->assert_file = "<no file>";
     db->assert_line = 0;
 
+    db->procs = NULL;
+    db->nprocs = 0;
+
     return db;
 }
 
-TinyRedisProc* CreateTinyRedisProc(TinyRedisDB* db, int read_fd, int write_fd)
+TinyRedisProc* CreateTinyRedisProc(TinyRedisDB* db)
 {
     TinyRedisProc* proc = (TinyRedisProc*)zmalloc(sizeof(TinyRedisProc));
-    proc->notify_fd_read = read_fd;
-    proc->notify_fd_write = write_fd;
+    proc->inbox = new MpscQue<NotifyInfo>(PROC_INBOX_LEN);
     proc->el = aeCreateEventLoop(db->maxclients + CONFIG_FDSET_INCR, proc);
-    if (aeCreateFileEvent(proc->el, read_fd, AE_READABLE, NotifyHandle, proc) == AE_ERR)
+    if (proc->inbox->Fd() < 0 ||
+        aeCreateFileEvent(proc->el, proc->inbox->Fd(), AE_READABLE, NotifyHandle, proc) == AE_ERR)
     {
-        zfree(proc->el);
+        aeDeleteEventLoop(proc->el);
+        delete proc->inbox;
+        zfree(proc);
+        return NULL;
+    }
+
+    if (aeCreateTimeEvent(proc->el, 1, procCron, proc, NULL) == AE_ERR)
+    {
+        aeDeleteEventLoop(proc->el);
+        delete proc->inbox;
         zfree(proc);
         return NULL;
     }
 
     aeSetBeforeSleepProc(proc->el, beforeSleep);
+    aeSetAfterSleepProc(proc->el, afterSleep);
 
     proc->current_client = NULL;
     proc->clients = listCreate();
@@ -560,11 +771,94 @@ TinyRedisProc* CreateTinyRedisProc(TinyRedisDB* db, int read_fd, int write_fd)
     
     updateCachedTime(proc);
 
+    proc->stat_clients = 0;
+    proc->stat_loop_busy_us = 0;
+    proc->loop_wake_us = 0;
+    proc->imbalance_ticks = 0;
+    proc->reading = NULL;
+    proc->stat_keyspace_hits = 0;
+    proc->stat_keyspace_misses = 0;
+    proc->evpool = evictionPoolAlloc();
+    proc->latency = (commandLatency*)zcalloc(sizeof(commandLatency)*db->numcommands);
+    proc->slowlog = slowlogCreate(db);
+    proc->slowlog_next = 0;
+    proc->batch = db->pipeline_batch > 1 ?
+        (batchedCommand*)zmalloc(sizeof(batchedCommand)*db->pipeline_batch) : NULL;
+    proc->batch_len = 0;
+    proc->stat_batch_runs = 0;
+    proc->stat_batch_commands = 0;
+    proc->stat_multislot_commands = 0;
+    proc->stat_multislot_slots = 0;
+    proc->readthrough_keys = dictCreate(&readThroughDictType,NULL);
+    proc->readthrough_clients = listCreate();
+    proc->readthrough_resume = listCreate();
+    proc->readthrough_timer = -1;
+    proc->readthrough_waiting = 0;
+    proc->stat_readthrough_parked = 0;
+    proc->stat_readthrough_filled = 0;
+    proc->stat_readthrough_timeouts = 0;
+    proc->stat_readthrough_notify_dropped = 0;
+
     proc->db = db;
 
+    /* Every worker creates its proc in its own pinned thread, but one at a
+     * time while the main thread waits (see Worker::start()), and before
+     * any event loop runs, so the registry needs no locking. */
+    proc->id = db->nprocs;
+    db->procs = (TinyRedisProc**)zrealloc(db->procs, sizeof(TinyRedisProc*)*(db->nprocs+1));
+    db->procs[db->nprocs++] = proc;
+
     return proc;
 }
 
+/* Pick the proc that should serve a new connection according to 'policy'.
+ * Load counters are read without locks, a slightly stale view is fine.
+ * 'rr' is the caller's round robin cursor. */
+TinyRedisProc* selectTinyRedisProc(TinyRedisProc** procs, int n, int policy, uint64_t* rr)
+{
+    TinyRedisProc *best = NULL;
+    int j;
+
+    if (n <= 0) return NULL;
+    if (n == 1) return procs[0];
+
+    switch(policy) {
+    case PLACEMENT_LEASTCONN:
+    case PLACEMENT_LEASTLATENCY: {
+        /* Start from the round robin cursor so that ties are spread. */
+        unsigned long long bestload = ULLONG_MAX;
+        uint64_t start = (*rr)++;
+
+        for (j = 0; j < n; j++) {
+            TinyRedisProc *p = procs[(start+j) % n];
+            unsigned long long load = (policy == PLACEMENT_LEASTCONN) ?
+                __atomic_load_n(&p->stat_clients, __ATOMIC_RELAXED) :
+                __atomic_load_n(&p->stat_loop_busy_us, __ATOMIC_RELAXED);
+            if (load < bestload) {
+                bestload = load;
+                best = p;
+            }
+        }
+        return best;
+    }
+    case PLACEMENT_P2C: {
+        /* Power of two choices: compare two random procs by connections,
+         * breaking ties with the loop latency. */
+        TinyRedisProc *a = procs[rand() % n];
+        TinyRedisProc *b = procs[rand() % n];
+        unsigned long ca = __atomic_load_n(&a->stat_clients, __ATOMIC_RELAXED);
+        unsigned long cb = __atomic_load_n(&b->stat_clients, __ATOMIC_RELAXED);
+
+        if (ca != cb) return ca < cb ? a : b;
+        return __atomic_load_n(&a->stat_loop_busy_us, __ATOMIC_RELAXED) <=
+               __atomic_load_n(&b->stat_loop_busy_us, __ATOMIC_RELAXED) ? a : b;
+    }
+    case PLACEMENT_ROUNDROBIN:
+    default:
+        return procs[(*rr)++ % n];
+    }
+}
+
 /* Populates the Redis Command Table starting from the hard coded list
  * we have on top of redis.c file. */
 void populateCommandTable(TinyRedisDB* db) {
@@ -591,14 +885,22 @@ void populateCommandTable(TinyRedisDB* db) {
             case 'M': c->flags |= CMD_SKIP_MONITOR; break;
             case 'k': c->flags |= CMD_ASKING; break;
             case 'F': c->flags |= CMD_FAST; break;
+            case 'o': c->flags |= CMD_OPTIMISTIC; break;
+            case 'x': c->flags |= CMD_MULTISLOT; break;
+            case 'z': c->flags |= CMD_STORE_VALUES; break;
+            case 'n': c->flags |= CMD_NOSLOT; break;
             default: serverPanic("Unsupported command flag"); break;
             }
             f++;
         }
+        if (c->firstkey > 0 && c->firstkey == c->lastkey)
+            c->flags |= CMD_SINGLE_KEY;
 
+        c->id = j;
         retval = dictAdd(db->commands, sdsnew(c->name), c);
         serverAssert(retval == DICT_OK);
     }
+    db->numcommands = numcommands;
 }
 
 void resetCommandTableStats(void) {
@@ -656,7 +958,8 @@ struct redisCommand *lookupCommand(TinyRedisProc* proc, sds name) {
  *
  */
 void call(client *c) {
-    long long dirty, start, duration;
+    long long dirty;
+    uint64_t start, duration;
 	
     /* Initialization: clear the flags that must be set by the command on
      * demand, and initialize the array for additional commands propagation. */
@@ -664,28 +967,27 @@ void call(client *c) {
 
     /* Call the command. */
     dirty = c->db->dirty;
-    start = ustime();
+    start = latencyTicks();
     c->cmd->proc(c);
-    duration = ustime()-start;
+    duration = latencyTicksToNs(latencyTicks()-start);
+    latencyHistogramAdd(&c->proc->latency[c->cmd->id].exec,duration);
+    slowlogPushEntryIfNeeded(c,duration,c->lock_wait_ns);
     dirty = c->db->dirty-dirty;
     if (dirty < 0) dirty = 0;
-
-    c->lastcmd->microseconds += duration;
-    c->lastcmd->calls++;
 }
 
 unsigned int keyHashSlot(const char *key, int keylen) {
+    const char *open, *close;
     int s, e; /* start-end indexes of { and } */
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
-
     /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    open = (const char*)memchr(key,'{',keylen);
+    if (open == NULL) return crc16(key,keylen) & 0x3FFF;
+    s = open-key;
 
     /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+    close = (const char*)memchr(open+1,'}',keylen-s-1);
+    e = close ? close-key : keylen;
 
     /* No '}' or nothing betweeen {} ? Hash the whole key. */
     if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
@@ -695,58 +997,143 @@ unsigned int keyHashSlot(const char *key, int keylen) {
     return crc16(key+s+1,e-s-1) & 0x3FFF;
 }
 
-int* getKeysFromCommand(struct redisCommand *cmd,robj **argv, int argc, int *numkeys) {
-    int j, i = 0, last, *keys;
-    UNUSED(argv);
+/* Last argv index holding a key of 'cmd' called with 'argc' arguments, the
+ * keys being at firstkey, firstkey+keystep... up to it. The positions only
+ * depend on the command table and argc, so no array of them is built. */
+static inline int commandLastKey(struct redisCommand *cmd, int argc) {
+    int last = cmd->lastkey;
 
-    if (cmd->firstkey == 0) {
-        *numkeys = 0;
-        return NULL;
-    }
-
-    last = cmd->lastkey;
     if (last < 0) last = argc+last;
-    keys = (int*)zmalloc(sizeof(int)*((last - cmd->firstkey)+1));
-    for (j = cmd->firstkey; j <= last; j += cmd->keystep) {
-        if (j >= argc) {
-            serverPanic("Redis built-in command declared keys positions not matching the arity requirements.");
-        }
-        keys[i++] = j;
+    if (last >= argc) {
+        serverPanic("Redis built-in command declared keys positions not matching the arity requirements.");
     }
-    *numkeys = i;
-    return keys;
+    return last;
+}
+
+static inline int argvKeySlot(robj *key) {
+    return keyHashSlot((const char*)key->ptr,sdslen((sds)key->ptr));
 }
 
 int getDBIndex(client *c, struct redisCommand *cmd, robj **argv, int argc) 
 {
     UNUSED(c);
 
-    int i, slot = -1;
-    int *keyindex, numkeys;
-
-    keyindex = getKeysFromCommand(cmd, argv, argc, &numkeys);
-    for (i = 0; i < numkeys; i++) {
-        robj *thiskey = argv[keyindex[i]];
-        int thisslot = keyHashSlot((const char*)thiskey->ptr,
-                sdslen((sds)thiskey->ptr));
-        if (slot >= 0 && thisslot != slot)
-        {
-            slot = -2;
-            break;
+    int j, last, slot = -1;
+
+    /* GET, SET, HGET... hash their only key directly. */
+    if (cmd->flags & CMD_SINGLE_KEY)
+        return argvKeySlot(argv[cmd->firstkey]);
+
+    if (cmd->firstkey) {
+        last = commandLastKey(cmd, argc);
+        for (j = cmd->firstkey; j <= last; j += cmd->keystep) {
+            int thisslot = argvKeySlot(argv[j]);
+
+            if (slot >= 0 && thisslot != slot) return -2;
+            slot = thisslot;
         }
-        slot = thisslot;
     }
 
     /* 0x4000定义为配置数据库 */
-    if (numkeys == 0)
+    if (slot < 0)
         slot = 0x4000;
 
-    if (keyindex)
-        zfree(keyindex);
-
     return slot;
 }
 
+/* ====================== Keyspace slot locking ============================= */
+
+/* Every redisDb slot is protected by its rwlock. On top of that commands
+ * flagged "o" may read a slot without touching the shared lock:
+ *
+ * - The reader publishes the slot in its own proc->reading (a cache line
+ *   no other proc writes), then checks that db->seq is even.
+ * - A writer takes the rwlock exclusively, makes db->seq odd and waits
+ *   until no proc is reading the slot before modifying anything.
+ *
+ * Both sides store then load with sequentially consistent ordering, so
+ * either the reader sees the odd seq and retries, or the writer sees the
+ * reader and waits for it to leave. A reader therefore never observes a
+ * half updated dict or freed memory, and pays one fence on a private
+ * cache line instead of two atomic RMWs on the shared rwlock. */
+void dbWriteLock(redisDb *db) {
+    int j;
+
+    pthread_rwlock_wrlock(&db->rwlock);
+    __atomic_add_fetch(&db->seq,1,__ATOMIC_SEQ_CST);
+
+    for (j = 0; j < g_redisDB->nprocs; j++) {
+        TinyRedisProc *p = g_redisDB->procs[j];
+        int spins = 0;
+
+        while (__atomic_load_n(&p->reading,__ATOMIC_SEQ_CST) == db) {
+            if (++spins < 1000) cpu_relax();
+            else sched_yield();
+        }
+    }
+}
+
+void dbWriteUnlock(redisDb *db) {
+    /* Hand the rehashing of the slot to the ReHasher. The bit is only set
+     * once per rehash, the common case is a plain load. */
+    if (dictIsRehashing(db->d) || htNeedsResize(db->d)) {
+        uint64_t *word = &g_redisDB->rehash_dirty[db->id/64];
+        uint64_t bit = 1ULL << (db->id%64);
+
+        if (!(__atomic_load_n(word,__ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(word,bit,__ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&db->seq,1,__ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&db->rwlock);
+}
+
+/* Rehash 'db' holding its write lock for at most about 'us' microseconds.
+ * Starts the shrinking of a mostly empty dict. Returns 1 if there is work
+ * left. Called by the ReHasher thread. */
+int dbRehashStep(redisDb *db, long long us) {
+    TinyRedisDB *rdb = g_redisDB;
+    long long start = ustime();
+    int more, completed = 0;
+
+    dbWriteLock(db);
+    if (!dictIsRehashing(db->d) && htNeedsResize(db->d))
+        dictResize(db->d);
+    if (dictIsRehashing(db->d))
+        completed = !dictRehashMicroseconds(db->d,us);
+    more = dictIsRehashing(db->d) || htNeedsResize(db->d);
+    dbWriteUnlock(db);
+
+    __atomic_add_fetch(&rdb->stat_rehash_us,ustime()-start,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&rdb->stat_rehash_locks,1,__ATOMIC_RELAXED);
+    if (completed)
+        __atomic_add_fetch(&rdb->stat_rehash_completed,1,__ATOMIC_RELAXED);
+    return more;
+}
+
+/* Enter 'db' for a lock free read. Returns 1 on success, the caller must
+ * then call dbEndOptimisticRead(). Returns 0 if a writer kept the slot busy
+ * for OPTIMISTIC_READ_RETRIES attempts, the caller should use the rwlock. */
+int dbTryOptimisticRead(TinyRedisProc *proc, redisDb *db) {
+    int j;
+
+    for (j = 0; j < OPTIMISTIC_READ_RETRIES; j++) {
+        __atomic_store_n(&proc->reading,db,__ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&db->seq,__ATOMIC_SEQ_CST) & 1) == 0) return 1;
+
+        /* A write overlaps: step back so the writer can proceed. */
+        __atomic_store_n(&proc->reading,(redisDb*)NULL,__ATOMIC_RELEASE);
+        while (__atomic_load_n(&db->seq,__ATOMIC_RELAXED) & 1) {
+            if (++j >= OPTIMISTIC_READ_RETRIES) return 0;
+            cpu_relax();
+        }
+    }
+    return 0;
+}
+
+void dbEndOptimisticRead(TinyRedisProc *proc) {
+    __atomic_store_n(&proc->reading,(redisDb*)NULL,__ATOMIC_RELEASE);
+}
+
 /* If this function gets called we already read a whole
  * command, arguments are in the client argv/argc fields.
  * processCommand() execute the command or prepare the
@@ -755,21 +1142,21 @@ int getDBIndex(client *c, struct redisCommand *cmd, robj **argv, int argc)
  * If C_OK is returned the client is still alive and valid and
  * other operations can be performed by the caller. Otherwise
  * if C_ERR is returned the client was destroyed (i.e. after QUIT). */
+static int processCommandOnSlot(client *c);
+static int processMultiSlotCommand(client *c);
+
 int processCommand(client *c) {
-    /* The QUIT command is handled separately. Normal command procs will
-     * go through checking for replication and QUIT will cause trouble
-     * when FORCE_REPLICATION is enabled and would be implemented in
-     * a regular command proc. */
-    if (!strcasecmp((const char*)c->argv[0]->ptr,"quit")) {
-        addReply(c,c->proc->db->shared.ok);
-        c->flags |= CLIENT_CLOSE_AFTER_REPLY;
-        return C_ERR;
-    }
-    
-    /* Now lookup the command and check ASAP about trivial error conditions
+    /* Lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
     c->cmd = c->lastcmd = lookupCommand(c->proc, (sds)c->argv[0]->ptr);
     if (!c->cmd) {
+        /* The QUIT command is handled separately, it is not in the
+         * command table so the common case pays no extra compare. */
+        if (!strcasecmp((const char*)c->argv[0]->ptr,"quit")) {
+            addReply(c,c->proc->db->shared.ok);
+            c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+            return C_ERR;
+        }
         serverLog(LL_DEBUG, "return unknow command '%s'", (char*)c->argv[0]->ptr);
         addReplyErrorFormat(c,"unknown command '%s'",
             (char*)c->argv[0]->ptr);
@@ -783,6 +1170,8 @@ int processCommand(client *c) {
 
 
     int dbIndex = getDBIndex(c, c->cmd, c->argv, c->argc);
+    if (dbIndex == -2 && (c->cmd->flags & CMD_MULTISLOT))
+        return processMultiSlotCommand(c);
     if (dbIndex < 0 || dbIndex >= c->proc->db->dbnum)
     {
         addReplyErrorFormat(c,"unknown operate db '%d'", dbIndex);
@@ -790,16 +1179,823 @@ int processCommand(client *c) {
     }
     c->db = &c->proc->db->db[dbIndex];
 
+    /* INFO, CLIENT...: c->db is the config slot for call(), but its lock
+     * is not taken, so they never wait for the commands that use it. */
+    if (c->cmd->flags & CMD_NOSLOT) {
+        c->lock_wait_ns = 0;
+        latencyHistogramAdd(&c->proc->latency[c->cmd->id].wait,0);
+        call(c);
+        return C_OK;
+    }
+
+    return processCommandOnSlot(c);
+}
+
+/* Second half of processCommand(): c->cmd and c->db are resolved. */
+static int processCommandOnSlot(client *c) {
+    /* Handle the maxmemory directive. Eviction may lock any slot, so it
+     * runs before this command takes its own. */
+    if (c->proc->db->maxmemory && (c->cmd->flags & CMD_DENYOOM) &&
+        freeMemoryIfNeeded(c->proc->evpool) == C_ERR)
+    {
+        addReply(c, c->proc->db->shared.oomerr);
+        return C_OK;
+    }
+
+    /* Compress the values to store before the lock, not under it. A
+     * batched command may already have them. */
+    if ((c->cmd->flags & CMD_STORE_VALUES) && c->zargv == NULL)
+        c->zargv = compressCommandValues(c->cmd,c->argv,c->argc);
+
+    if ((c->cmd->flags & CMD_OPTIMISTIC) && c->proc->db->lockfree_reads &&
+        dbTryOptimisticRead(c->proc, c->db))
+    {
+        c->lock_wait_ns = 0;
+        latencyHistogramAdd(&c->proc->latency[c->cmd->id].wait,0);
+        call(c);
+        dbEndOptimisticRead(c->proc);
+        return C_OK;
+    }
+
+    uint64_t waitstart = latencyTicks();
     if (c->cmd->flags & CMD_WRITE)
-        pthread_rwlock_wrlock(&c->db->rwlock);
+        dbWriteLock(c->db);
     else
         pthread_rwlock_rdlock(&c->db->rwlock);
+    c->lock_wait_ns = latencyTicksToNs(latencyTicks()-waitstart);
+    latencyHistogramAdd(&c->proc->latency[c->cmd->id].wait,c->lock_wait_ns);
     call(c);
-    pthread_rwlock_unlock(&c->db->rwlock);
+    if (c->cmd->flags & CMD_WRITE)
+        dbWriteUnlock(c->db);
+    else
+        pthread_rwlock_unlock(&c->db->rwlock);
     
     return C_OK;
 }
 
+/* ======================== Commands spanning slots ========================= */
+
+/* MGET, MSET, MSETNX, DEL and EXISTS accept keys of any slot. The slots of
+ * the keys are locked in ascending order, each one once, then the command
+ * runs with CLIENT_MULTISLOT set and finds the slot of every key with
+ * keyDb(), so the reply keeps the order of the request. Every other path
+ * holds a single slot lock at a time, so the ordering is enough to rule
+ * out deadlocks, and the command is atomic like on a single slot.
+ *
+ * Reads take the read locks: a proc publishes only one slot for optimistic
+ * reads, so the lock free path stays for the single slot case. */
+
+static int slotCompare(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+static int processMultiSlotCommand(client *c) {
+    TinyRedisProc *proc = c->proc;
+    int stackslots[MULTISLOT_STACK_SLOTS], *slots = stackslots;
+    int numkeys, last, nslots = 0, write, j;
+    uint64_t waitstart;
+
+    /* Eviction may lock any slot, see processCommandOnSlot() */
+    if (proc->db->maxmemory && (c->cmd->flags & CMD_DENYOOM) &&
+        freeMemoryIfNeeded(proc->evpool) == C_ERR)
+    {
+        addReply(c, proc->db->shared.oomerr);
+        return C_OK;
+    }
+
+    if (c->cmd->flags & CMD_STORE_VALUES)
+        c->zargv = compressCommandValues(c->cmd,c->argv,c->argc);
+
+    last = commandLastKey(c->cmd, c->argc);
+    numkeys = (last-c->cmd->firstkey)/c->cmd->keystep+1;
+    if (numkeys > MULTISLOT_STACK_SLOTS)
+        slots = (int*)zmalloc(sizeof(int)*numkeys);
+    for (j = 0; j < numkeys; j++)
+        slots[j] = argvKeySlot(c->argv[c->cmd->firstkey+j*c->cmd->keystep]);
+
+    qsort(slots, numkeys, sizeof(int), slotCompare);
+    for (j = 0; j < numkeys; j++) {
+        if (nslots == 0 || slots[j] != slots[nslots-1])
+            slots[nslots++] = slots[j];
+    }
+
+    write = (c->cmd->flags & CMD_WRITE) != 0;
+    waitstart = latencyTicks();
+    for (j = 0; j < nslots; j++) {
+        redisDb *db = &proc->db->db[slots[j]];
+
+        if (write)
+            dbWriteLock(db);
+        else
+            pthread_rwlock_rdlock(&db->rwlock);
+    }
+    c->lock_wait_ns = latencyTicksToNs(latencyTicks()-waitstart);
+    latencyHistogramAdd(&proc->latency[c->cmd->id].wait,c->lock_wait_ns);
+
+    c->db = &proc->db->db[slots[0]];
+    c->flags |= CLIENT_MULTISLOT;
+    call(c);
+    c->flags &= ~CLIENT_MULTISLOT;
+
+    for (j = nslots-1; j >= 0; j--) {
+        redisDb *db = &proc->db->db[slots[j]];
+
+        if (write)
+            dbWriteUnlock(db);
+        else
+            pthread_rwlock_unlock(&db->rwlock);
+    }
+
+    __atomic_store_n(&proc->stat_multislot_commands,
+        proc->stat_multislot_commands+1,__ATOMIC_RELAXED);
+    __atomic_store_n(&proc->stat_multislot_slots,
+        proc->stat_multislot_slots+nslots,__ATOMIC_RELAXED);
+    if (slots != stackslots)
+        zfree(slots);
+    return C_OK;
+}
+
+/* ======================== Pipelined batches =============================== */
+
+/* With pipeline-batch > 1, processInputBuffer() parses every complete
+ * command of the query buffer first, up to pipeline-batch of them, and
+ * processCommandBatch() runs them in order. Consecutive commands on the
+ * same slot share one acquisition of the slot lock, so a pipeline of GETs
+ * on a few hot slots pays a handful of rwlock round trips instead of one
+ * per command. Replies are still appended in the original order.
+ *
+ * Only commands with keys join a run. Errors, QUIT and keyless commands go
+ * through processCommand() alone, at their place in the pipeline. */
+
+/* Resolve the command and slot of a parsed command, without replying. */
+static void batchResolve(TinyRedisProc *proc, batchedCommand *bc) {
+    struct redisCommand *cmd;
+    int slot;
+
+    bc->cmd = NULL;
+    bc->slot = -1;
+    cmd = lookupCommand(proc,(sds)bc->argv[0]->ptr);
+    if (cmd == NULL || cmd->firstkey == 0 ||
+        (cmd->arity > 0 && cmd->arity != bc->argc) ||
+        (bc->argc < -cmd->arity)) return;
+
+    slot = getDBIndex(NULL,cmd,bc->argv,bc->argc);
+    if (slot < 0 || slot >= proc->db->dbnum) return;
+    bc->cmd = cmd;
+    bc->slot = slot;
+}
+
+/* Queue the command just parsed in c->argv. The client gives up its argv
+ * array, that is freed once the command ran. */
+void batchAddCommand(client *c) {
+    batchedCommand *bc = &c->proc->batch[c->proc->batch_len++];
+
+    bc->argv = c->argv;
+    bc->argc = c->argc;
+    bc->zargv = NULL;
+    batchResolve(c->proc,bc);
+    c->argv = NULL;
+    c->argc = 0;
+}
+
+static void batchInstall(client *c, batchedCommand *bc) {
+    c->argv = bc->argv;
+    c->argc = bc->argc;
+    c->zargv = bc->zargv;
+}
+
+/* Like resetClient(), also releasing the argv array of the command */
+static void batchReset(client *c) {
+    resetClient(c);
+    zfree(c->argv);
+    c->argv = NULL;
+}
+
+static void batchFree(batchedCommand *bc) {
+    int j;
+
+    if (bc->zargv) freeCommandValues(bc->zargv,bc->argc);
+    for (j = 0; j < bc->argc; j++)
+        decrRefCount(bc->argv[j]);
+    zfree(bc->argv);
+}
+
+/* Run 'n' > 1 resolved commands of the same slot under one lock hold.
+ * Returns how many ran, fewer than 'n' if a read-through GET parked the
+ * client. */
+static int processCommandRun(client *c, batchedCommand *run, int n) {
+    TinyRedisProc *proc = c->proc;
+    redisDb *db = &proc->db->db[run[0].slot];
+    int write = 0, denyoom = 0, optimistic = 1, oom = 0, k;
+    uint64_t waitns = 0;
+
+    for (k = 0; k < n; k++) {
+        int flags = run[k].cmd->flags;
+
+        write |= flags & CMD_WRITE;
+        denyoom |= flags & CMD_DENYOOM;
+        optimistic &= (flags & CMD_OPTIMISTIC) != 0;
+        /* Compressed outside the lock, kept if the run is parked */
+        if ((flags & CMD_STORE_VALUES) && run[k].zargv == NULL)
+            run[k].zargv = compressCommandValues(run[k].cmd,run[k].argv,
+                                                 run[k].argc);
+    }
+
+    /* Eviction may lock any slot, it can't run under ours */
+    if (proc->db->maxmemory && denyoom)
+        oom = freeMemoryIfNeeded(proc->evpool) == C_ERR;
+
+    optimistic = optimistic && proc->db->lockfree_reads &&
+                 dbTryOptimisticRead(proc,db);
+    if (!optimistic) {
+        uint64_t waitstart = latencyTicks();
+
+        if (write)
+            dbWriteLock(db);
+        else
+            pthread_rwlock_rdlock(&db->rwlock);
+        waitns = latencyTicksToNs(latencyTicks()-waitstart);
+    }
+
+    for (k = 0; k < n; k++) {
+        batchInstall(c,&run[k]);
+        c->cmd = c->lastcmd = run[k].cmd;
+        c->db = db;
+        if (oom && (c->cmd->flags & CMD_DENYOOM)) {
+            addReply(c,proc->db->shared.oomerr);
+        } else {
+            /* The wait is charged to the command that took the lock */
+            c->lock_wait_ns = k ? 0 : waitns;
+            latencyHistogramAdd(&proc->latency[c->cmd->id].wait,c->lock_wait_ns);
+            call(c);
+        }
+        batchReset(c);
+        if (c->async_hold) {
+            n = k+1;
+            break;
+        }
+    }
+
+    if (optimistic)
+        dbEndOptimisticRead(proc);
+    else if (write)
+        dbWriteUnlock(db);
+    else
+        pthread_rwlock_unlock(&db->rwlock);
+
+    __atomic_store_n(&proc->stat_batch_runs,proc->stat_batch_runs+1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&proc->stat_batch_commands,proc->stat_batch_commands+n,
+                     __ATOMIC_RELAXED);
+    return n;
+}
+
+/* Run the commands queued by batchAddCommand() for 'c', in order. */
+void processCommandBatch(client *c) {
+    TinyRedisProc *proc = c->proc;
+    batchedCommand *b = proc->batch;
+    int n = proc->batch_len, i = 0, j;
+
+    proc->batch_len = 0;
+    while (i < n) {
+        /* The client may be gone, or closing after QUIT */
+        if (proc->current_client == NULL ||
+            (c->flags & CLIENT_CLOSE_AFTER_REPLY)) break;
+
+        /* A read-through GET parked the client, the rest runs after it */
+        if (c->async_hold) {
+            batchPark(c,b+i,n-i);
+            return;
+        }
+
+        j = i+1;
+        if (b[i].cmd) {
+            while (j < n && b[j].cmd && b[j].slot == b[i].slot) j++;
+        }
+
+        if (j-i > 1) {
+            j = i+processCommandRun(c,b+i,j-i);
+        } else if (b[i].cmd) {
+            batchInstall(c,&b[i]);
+            c->cmd = c->lastcmd = b[i].cmd;
+            c->db = &proc->db->db[b[i].slot];
+            processCommandOnSlot(c);
+            batchReset(c);
+        } else {
+            /* Replies the error, or keeps the argv of QUIT in the client */
+            batchInstall(c,&b[i]);
+            if (processCommand(c) == C_OK) batchReset(c);
+        }
+        i = j;
+    }
+
+    for (; i < n; i++) batchFree(&b[i]);
+}
+
+/* Keep the 'n' commands of the pipeline that follow a parked read-through
+ * GET until the client is woken up. */
+void batchPark(client *c, batchedCommand *rest, int n) {
+    c->async_rest = (batchedCommand*)zmalloc(sizeof(batchedCommand)*n);
+    memcpy(c->async_rest,rest,sizeof(batchedCommand)*n);
+    c->async_rest_len = n;
+}
+
+/* Run the commands kept by batchPark(), once the GET replied. They may park
+ * the client again. The caller sets current_client. */
+void batchResume(client *c) {
+    TinyRedisProc *proc = c->proc;
+    int n = c->async_rest_len;
+
+    if (n == 0) return;
+    memcpy(proc->batch,c->async_rest,sizeof(batchedCommand)*n);
+    proc->batch_len = n;
+    zfree(c->async_rest);
+    c->async_rest = NULL;
+    c->async_rest_len = 0;
+    processCommandBatch(c);
+}
+
+/* Drop the commands kept by batchPark(), the client is being freed. */
+void batchDiscard(client *c) {
+    int j;
+
+    for (j = 0; j < c->async_rest_len; j++) batchFree(&c->async_rest[j]);
+    zfree(c->async_rest);
+    c->async_rest = NULL;
+    c->async_rest_len = 0;
+}
+
+/* ============================ INFO command ================================ */
+
+#define INFO_LOAD(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
+#define INFO_KEYSPACE_TOP_SLOTS 10  /* Heaviest slots listed by INFO keyspace */
+
+/* Convert an amount of bytes into a human readable string in the form
+ * of 100B, 2G, 100M, 4K, and so forth. */
+static void bytesToHuman(char *s, unsigned long long n) {
+    double d;
+
+    if (n < 1024) {
+        /* Bytes */
+        sprintf(s,"%lluB",n);
+    } else if (n < (1024*1024)) {
+        d = (double)n/(1024);
+        sprintf(s,"%.2fK",d);
+    } else if (n < (1024LL*1024*1024)) {
+        d = (double)n/(1024*1024);
+        sprintf(s,"%.2fM",d);
+    } else if (n < (1024LL*1024*1024*1024)) {
+        d = (double)n/(1024LL*1024*1024);
+        sprintf(s,"%.2fG",d);
+    } else {
+        d = (double)n/(1024LL*1024*1024*1024);
+        sprintf(s,"%.2fT",d);
+    }
+}
+
+#if defined(USE_JEMALLOC)
+/* Allocator view of the heap, refreshed on every call. */
+static void jemallocStats(size_t *allocated, size_t *active, size_t *resident,
+                          size_t *mapped) {
+    uint64_t epoch = 1;
+    size_t sz = sizeof(epoch);
+
+    je_mallctl("epoch",&epoch,&sz,&epoch,sz);
+    *allocated = *active = *resident = *mapped = 0;
+    sz = sizeof(size_t);
+    je_mallctl("stats.allocated",allocated,&sz,NULL,0);
+    je_mallctl("stats.active",active,&sz,NULL,0);
+    je_mallctl("stats.resident",resident,&sz,NULL,0);
+    je_mallctl("stats.mapped",mapped,&sz,NULL,0);
+}
+#endif
+
+static sds infoSlotLine(sds info, redisDb *db) {
+    dict *d = db->d;
+
+    return sdscatprintf(info,
+        "slot%d:keys=%lu,expires=%lu,bytes=%lld,dirty=%llu\r\n",
+        db->id,
+        INFO_LOAD(d->ht[0].used)+INFO_LOAD(d->ht[1].used),
+        INFO_LOAD(d->expires),
+        INFO_LOAD(db->bytes),
+        (unsigned long long)INFO_LOAD(db->dirty));
+}
+
+/* Create the string returned by the INFO command. 'section' selects a
+ * single section. NULL and "default" return the usual sections, "all" adds
+ * commandstats. The per slot listing is only returned by "slots".
+ *
+ * Nothing is locked: every counter is read with a relaxed load, so the
+ * numbers of one reply may be a few operations apart. */
+sds genTinyRedisInfoString(TinyRedisDB *db, const char *section) {
+    sds info = sdsempty();
+    int allsections = 0, defsections = 0, sections = 0;
+
+    if (section == NULL) section = "default";
+    allsections = !strcasecmp(section,"all");
+    defsections = !strcasecmp(section,"default");
+
+    /* Server */
+    if (allsections || defsections || !strcasecmp(section,"server")) {
+        long long uptime = time(NULL)-db->stat_starttime;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Server\r\n"
+            "multiplexing_api:%s\r\n"
+            "process_id:%ld\r\n"
+            "uptime_in_seconds:%lld\r\n"
+            "uptime_in_days:%lld\r\n"
+            "workers:%d\r\n"
+            "async_tasks:%d\r\n"
+            "slots:%d\r\n"
+            "lockfree_reads:%s\r\n"
+            "pipeline_batch:%d\r\n",
+            aeGetApiName(),
+            (long)getpid(),
+            uptime, uptime/(3600*24),
+            db->nprocs,
+            db->async_tasks,
+            db->dbnum,
+            db->lockfree_reads ? "yes" : "no",
+            db->pipeline_batch);
+    }
+
+    /* Clients */
+    if (allsections || defsections || !strcasecmp(section,"clients")) {
+        unsigned long clients = 0;
+        int j;
+
+        for (j = 0; j < db->nprocs; j++)
+            clients += INFO_LOAD(db->procs[j]->stat_clients);
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Clients\r\n"
+            "connected_clients:%lu\r\n"
+            "maxclients:%u\r\n",
+            clients, db->maxclients);
+        for (j = 0; j < db->nprocs; j++) {
+            TinyRedisProc *proc = db->procs[j];
+
+            info = sdscatprintf(info,
+                "proc%d:clients=%lu,loop_busy_usec=%lld,"
+                "batch_runs=%lld,batch_commands=%lld,"
+                "multislot_commands=%lld,multislot_slots=%lld\r\n",
+                proc->id,
+                INFO_LOAD(proc->stat_clients),
+                INFO_LOAD(proc->stat_loop_busy_us),
+                INFO_LOAD(proc->stat_batch_runs),
+                INFO_LOAD(proc->stat_batch_commands),
+                INFO_LOAD(proc->stat_multislot_commands),
+                INFO_LOAD(proc->stat_multislot_slots));
+        }
+    }
+
+    /* Expire */
+    if (allsections || defsections || !strcasecmp(section,"expire")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Expire\r\n"
+            "active_expire:%s\r\n"
+            "expired_keys:%lld\r\n"
+            "expired_keys_per_sec:%lld\r\n"
+            "expired_stale_hits:%lld\r\n"
+            "expire_cycle_usec:%lld\r\n",
+            db->active_expire ? "yes" : "no",
+            INFO_LOAD(db->stat_expiredkeys),
+            INFO_LOAD(db->stat_expired_per_sec),
+            INFO_LOAD(db->stat_expired_stale_hits),
+            INFO_LOAD(db->stat_expire_cycle_us));
+    }
+
+    /* Memory */
+    if (allsections || defsections || !strcasecmp(section,"memory")) {
+        long long hits = 0, misses = 0;
+        char hmem[64], maxhmem[64];
+        int j;
+
+        for (j = 0; j < db->nprocs; j++) {
+            hits += INFO_LOAD(db->procs[j]->stat_keyspace_hits);
+            misses += INFO_LOAD(db->procs[j]->stat_keyspace_misses);
+        }
+        bytesToHuman(hmem,zmalloc_used_memory());
+        bytesToHuman(maxhmem,db->maxmemory);
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Memory\r\n"
+            "used_memory:%zu\r\n"
+            "used_memory_human:%s\r\n"
+            "maxmemory:%llu\r\n"
+            "maxmemory_human:%s\r\n"
+            "maxmemory_policy:%s\r\n"
+            "evicted_keys:%lld\r\n"
+            "evicted_keys_per_sec:%lld\r\n"
+            "evict_usec:%lld\r\n"
+            "oom_rejects:%lld\r\n"
+            "keyspace_hits:%lld\r\n"
+            "keyspace_misses:%lld\r\n"
+            "keyspace_hit_ratio:%.4f\r\n",
+            zmalloc_used_memory(), hmem,
+            db->maxmemory, maxhmem,
+            maxmemoryPolicyName(db->maxmemory_policy),
+            INFO_LOAD(db->stat_evictedkeys),
+            INFO_LOAD(db->stat_evicted_per_sec),
+            INFO_LOAD(db->stat_evict_us),
+            INFO_LOAD(db->stat_oom_rejects),
+            hits, misses,
+            hits+misses ? (double)hits/(hits+misses) : 0);
+
+        size_t rss = zmalloc_get_rss();
+        char hrss[64];
+
+        bytesToHuman(hrss,rss);
+        info = sdscatprintf(info,
+            "used_memory_rss:%zu\r\n"
+            "used_memory_rss_human:%s\r\n"
+            "mem_fragmentation_ratio:%.2f\r\n"
+            "mem_allocator:%s\r\n",
+            rss, hrss,
+            zmalloc_get_fragmentation_ratio(rss),
+            ZMALLOC_LIB);
+#if defined(USE_JEMALLOC)
+        size_t allocated, active, resident, mapped;
+
+        jemallocStats(&allocated,&active,&resident,&mapped);
+        info = sdscatprintf(info,
+            "allocator_allocated:%zu\r\n"
+            "allocator_active:%zu\r\n"
+            "allocator_resident:%zu\r\n"
+            "allocator_mapped:%zu\r\n"
+            "allocator_frag_ratio:%.2f\r\n",
+            allocated, active, resident, mapped,
+            allocated ? (double)active/allocated : 0);
+#endif
+    }
+
+    /* Compression */
+    if (allsections || defsections || !strcasecmp(section,"compression")) {
+        long long objects = INFO_LOAD(db->stat_compressed_objects);
+        long long raw = INFO_LOAD(db->stat_compressed_raw_bytes);
+        long long comp = INFO_LOAD(db->stat_compressed_bytes);
+        long long decs = INFO_LOAD(db->stat_decompressions);
+        long long decus = INFO_LOAD(db->stat_decompress_us);
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Compression\r\n"
+            "compression:%s\r\n"
+            "compression_threshold:%zu\r\n"
+            "compression_level:%d\r\n"
+            "compression_dict_len:%zu\r\n"
+            "compressed_objects:%lld\r\n"
+            "compressed_raw_bytes:%lld\r\n"
+            "compressed_bytes:%lld\r\n"
+            "compressed_saved_bytes:%lld\r\n"
+            "compression_ratio:%.2f\r\n"
+            "compress_rejected:%lld\r\n"
+            "compress_usec:%lld\r\n"
+            "decompressions:%lld\r\n"
+            "decompress_usec:%lld\r\n"
+            "decompress_usec_per_call:%.2f\r\n"
+            "compressed_passthrough:%lld\r\n",
+            db->compression ? "yes" : "no",
+            db->compression_threshold,
+            db->compression_level,
+            db->compression_dict ? sdslen(db->compression_dict) : 0,
+            objects, raw, comp, raw-comp,
+            comp ? (double)raw/comp : 0,
+            INFO_LOAD(db->stat_compress_rejected),
+            INFO_LOAD(db->stat_compress_us),
+            decs, decus,
+            decs ? (double)decus/decs : 0,
+            INFO_LOAD(db->stat_compressed_passthrough));
+    }
+
+    /* Rehash */
+    if (allsections || defsections || !strcasecmp(section,"rehash")) {
+        int dirty = 0, rehashing = 0, j;
+
+        for (j = 0; j < (db->dbnum+63)/64; j++)
+            dirty += __builtin_popcountll(INFO_LOAD(db->rehash_dirty[j]));
+        for (j = 0; j < db->dbnum; j++)
+            if (dictIsRehashing(db->db[j].d)) rehashing++;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Rehash\r\n"
+            "activerehashing:%s\r\n"
+            "rehash_hold_usec:%d\r\n"
+            "dirty_slots:%d\r\n"
+            "rehashing_slots:%d\r\n"
+            "rehash_usec:%lld\r\n"
+            "rehash_locks:%lld\r\n"
+            "rehash_completed:%lld\r\n",
+            db->activerehashing ? "yes" : "no",
+            db->rehash_hold_us,
+            dirty, rehashing,
+            INFO_LOAD(db->stat_rehash_us),
+            INFO_LOAD(db->stat_rehash_locks),
+            INFO_LOAD(db->stat_rehash_completed));
+
+        /* 不加锁读取, 只用于观察进度 */
+        for (j = 0; j < db->dbnum && rehashing; j++) {
+            dict *d = db->db[j].d;
+            long rehashidx = INFO_LOAD(d->rehashidx);
+            unsigned long used0, used1;
+
+            if (rehashidx == -1) continue;
+            used0 = INFO_LOAD(d->ht[0].used);
+            used1 = INFO_LOAD(d->ht[1].used);
+            info = sdscatprintf(info,
+                "slot%d:ht0_size=%lu,ht1_size=%lu,rehashidx=%ld,progress=%.2f\r\n",
+                j, INFO_LOAD(d->ht[0].size), INFO_LOAD(d->ht[1].size), rehashidx,
+                used0+used1 ? (double)used1/(used0+used1) : 0);
+            rehashing--;
+        }
+    }
+
+    /* Keyspace */
+    if (allsections || defsections || !strcasecmp(section,"keyspace")) {
+        redisDb *top[INFO_KEYSPACE_TOP_SLOTS];
+        long long bytes = 0, slotbytes;
+        unsigned long keys = 0, expires = 0, slotkeys;
+        char hbytes[64];
+        int ntop = 0, nonempty = 0, j, k;
+
+        for (j = 0; j < db->dbnum; j++) {
+            redisDb *slot = db->db+j;
+
+            slotkeys = INFO_LOAD(slot->d->ht[0].used)+INFO_LOAD(slot->d->ht[1].used);
+            if (slotkeys == 0) continue;
+            slotbytes = INFO_LOAD(slot->bytes);
+            nonempty++;
+            keys += slotkeys;
+            expires += INFO_LOAD(slot->d->expires);
+            bytes += slotbytes;
+
+            /* Keep the heaviest slots sorted by bytes, descending */
+            if (ntop == INFO_KEYSPACE_TOP_SLOTS &&
+                slotbytes <= INFO_LOAD(top[ntop-1]->bytes)) continue;
+            if (ntop < INFO_KEYSPACE_TOP_SLOTS) ntop++;
+            for (k = ntop-1; k > 0 && INFO_LOAD(top[k-1]->bytes) < slotbytes; k--)
+                top[k] = top[k-1];
+            top[k] = slot;
+        }
+        bytesToHuman(hbytes,bytes > 0 ? bytes : 0);
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Keyspace\r\n"
+            "keys:%lu\r\n"
+            "expires:%lu\r\n"
+            "keyspace_bytes:%lld\r\n"
+            "keyspace_bytes_human:%s\r\n"
+            "nonempty_slots:%d\r\n",
+            keys, expires, bytes, hbytes, nonempty);
+        for (k = 0; k < ntop; k++)
+            info = infoSlotLine(info,top[k]);
+    }
+
+    /* Every non empty slot, only on request since there are 16385 */
+    if (!strcasecmp(section,"slots")) {
+        int j;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info,"# Slots\r\n");
+        for (j = 0; j < db->dbnum; j++) {
+            if (INFO_LOAD(db->db[j].d->ht[0].used)+INFO_LOAD(db->db[j].d->ht[1].used))
+                info = infoSlotLine(info,db->db+j);
+        }
+    }
+
+    /* Async loader */
+    if (allsections || defsections || !strcasecmp(section,"async_loader")) {
+        long long pushed = INFO_LOAD(db->stat_async_pushed);
+        long long done = INFO_LOAD(db->stat_async_done);
+        long long filled = INFO_LOAD(db->stat_async_filled);
+        long long us = INFO_LOAD(db->stat_async_us);
+        long long waitus = INFO_LOAD(db->stat_async_wait_us);
+        long long queries = INFO_LOAD(db->stat_async_mongo_queries);
+        long long qkeys = INFO_LOAD(db->stat_async_mongo_keys);
+        long long ekeys = INFO_LOAD(db->stat_async_exists_keys);
+        long long ecalls = INFO_LOAD(db->stat_async_exists_calls);
+        long long calls;
+        long long rtparked = 0, rtfilled = 0, rttimeouts = 0, rtdropped = 0;
+        unsigned long rtwaiting = 0;
+        int j;
+
+        for (j = 0; j < db->nprocs; j++) {
+            TinyRedisProc *proc = db->procs[j];
+
+            rtwaiting += INFO_LOAD(proc->readthrough_waiting);
+            rtparked += INFO_LOAD(proc->stat_readthrough_parked);
+            rtfilled += INFO_LOAD(proc->stat_readthrough_filled);
+            rttimeouts += INFO_LOAD(proc->stat_readthrough_timeouts);
+            rtdropped += INFO_LOAD(proc->stat_readthrough_notify_dropped);
+        }
+
+        /* Round trips actually made: one EXISTS pipeline per batch, its
+         * Mongo query and the retries of a failed one. A key filled on its
+         * own would cost two. */
+        calls = ecalls+queries;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Async_loader\r\n"
+            "async_pushed:%lld\r\n"
+            "async_deduped:%lld\r\n"
+            "async_dropped:%lld\r\n"
+            "async_stuck:%lld\r\n"
+            "async_pending:%lld\r\n"
+            "async_done:%lld\r\n"
+            "async_filled:%lld\r\n"
+            "async_failed:%lld\r\n"
+            "async_usec:%lld\r\n"
+            "async_usec_per_task:%.2f\r\n"
+            "async_wait_usec_per_task:%.2f\r\n"
+            "async_batch_size:%d\r\n"
+            "async_mongo_queries:%lld\r\n"
+            "async_mongo_keys:%lld\r\n"
+            "async_keys_per_query:%.2f\r\n"
+            "async_exists_keys:%lld\r\n"
+            "async_exists_calls:%lld\r\n"
+            "async_backend_calls:%lld\r\n"
+            "async_keys_per_backend_call:%.2f\r\n"
+            "async_fill_policy:%s\r\n"
+            "async_prefilled:%lld\r\n"
+            "read_through:%s\r\n"
+            "read_through_timeout_ms:%lld\r\n"
+            "read_through_waiting:%lu\r\n"
+            "read_through_parked:%lld\r\n"
+            "read_through_filled:%lld\r\n"
+            "read_through_timeouts:%lld\r\n"
+            "read_through_notify_dropped:%lld\r\n",
+            pushed,
+            INFO_LOAD(db->stat_async_deduped),
+            INFO_LOAD(db->stat_async_dropped),
+            INFO_LOAD(db->stat_async_stuck),
+            pushed > done ? pushed-done : 0,
+            done, filled, done-filled,
+            us,
+            done ? (double)us/done : 0,
+            done ? (double)waitus/done : 0,
+            db->async_batch_size,
+            queries, qkeys,
+            queries ? (double)qkeys/queries : 0,
+            ekeys, ecalls, calls,
+            calls ? (double)ekeys/calls : 0,
+            asyncFillPolicyName(db->async_fill_policy),
+            INFO_LOAD(db->stat_async_prefilled),
+            db->readthrough ? "yes" : "no",
+            db->readthrough_timeout,
+            rtwaiting, rtparked, rtfilled, rttimeouts, rtdropped);
+    }
+
+    /* Command stats, summed over the latency histograms of the procs */
+    if (allsections || !strcasecmp(section,"commandstats")) {
+        dictIterator *di;
+        dictEntry *de;
+        int j;
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info,"# Commandstats\r\n");
+        di = dictGetIterator(db->commands);
+        while((de = dictNext(di)) != NULL) {
+            struct redisCommand *cmd = (struct redisCommand*)dictGetVal(de);
+            unsigned long long calls = 0, ns = 0, waitns = 0;
+
+            for (j = 0; j < db->nprocs; j++) {
+                commandLatency *cl = &db->procs[j]->latency[cmd->id];
+
+                calls += INFO_LOAD(cl->exec.count);
+                ns += INFO_LOAD(cl->exec.sum);
+                waitns += INFO_LOAD(cl->wait.sum);
+            }
+            if (!calls) continue;
+            info = sdscatprintf(info,
+                "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,"
+                "wait_usec=%llu,wait_usec_per_call=%.2f\r\n",
+                cmd->name, calls, ns/1000, (double)ns/1000/calls,
+                waitns/1000, (double)waitns/1000/calls);
+        }
+        dictReleaseIterator(di);
+    }
+    return info;
+}
+
+void infoCommand(client *c) {
+    const char *section = c->argc == 2 ? (const char*)c->argv[1]->ptr : NULL;
+
+    if (c->argc > 2) {
+        addReply(c,c->proc->db->shared.syntaxerr);
+        return;
+    }
+    addReplyBulkSds(c, genTinyRedisInfoString(c->proc->db,section));
+}
+
 void usage(void) {
     fprintf(stderr,"Usage: ./redis-server [/path/to/redis.conf] [options]\n");
     fprintf(stderr,"       ./redis-server - (read config from stdin)\n");
@@ -848,11 +2044,7 @@ int main(int argc, char **argv) {
     }
 
 
-    int p[2] = {-1, -1};
-    pipe(p);
-    anetNonBlock(NULL,p[0]);
-    anetNonBlock(NULL,p[1]);
-    TinyRedisProc* proc = CreateTinyRedisProc(g_redisDB, p[0], p[1]);
+    TinyRedisProc* proc = CreateTinyRedisProc(g_redisDB);
 
     int fd = anetTcpServer(proc->neterr, 10000, NULL, 10);
     aeEventLoop* el = aeCreateEventLoop(CONFIG_FDSET_INCR, NULL);
@@ -51,6 +51,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "ae.h"      /* Event driven programming library */
 #include "sds.h"     /* Dynamic safe strings */
 #include "dict.h"    /* Hash tables */
+#include "timewheel.h" /* Expire index */
+#include "latency.h" /* Command latency histograms */
 #include "adlist.h"  /* Linked lists */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
@@ -61,6 +63,8 @@ typedef long long mstime_t; /* millisecond time type. */
 /* Following includes allow test functions to be called from Redis main() */
 #include "crc64.h"
 
+#include "util/mpscque.h"
+
 /* Error codes */
 #define C_OK                    0
 #define C_ERR                   -1
@@ -70,9 +74,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_DBNUM        0x4001
 #define CONFIG_MAX_LINE    1024
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#define NET_MAX_IOV IOV_MAX /* Max buffers gathered by a single writev() */
 #define PROTO_SHARED_SELECT_CMDS 10
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
+#define OBJ_SHARED_REFCOUNT INT_MAX /* Refcount of never freed objects */
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages */
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
 #define CONFIG_DEFAULT_UNIX_SOCKET_PERM 0
@@ -81,16 +87,82 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_LOGFILE ""
 #define CONFIG_DEFAULT_MAXMEMORY 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
+#define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
+#define CONFIG_DEFAULT_PIPELINE_BATCH 128   /* Commands parsed before running */
+#define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
+#define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
+#define CONFIG_DEFAULT_LFU_DECAY_TIME 1
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_REHASH_HOLD_US 200
+#define REHASH_IDLE_SLEEP_MIN_US 1000       /* ReHasher backoff when idle */
+#define REHASH_IDLE_SLEEP_MAX_US 100000
+#define CONFIG_DEFAULT_REUSEPORT 1
+#define CONFIG_DEFAULT_PLACEMENT PLACEMENT_LEASTCONN
+#define CONFIG_DEFAULT_CLIENT_MIGRATE 0
+#define CONFIG_DEFAULT_CLIENT_MIGRATE_RATIO 125 /* Percent of the average */
+#define CONFIG_DEFAULT_LOCKFREE_READS 1
+#define CONFIG_DEFAULT_READ_THROUGH 0
+#define CONFIG_DEFAULT_READ_THROUGH_TIMEOUT 200  /* ms a GET waits for a fill */
+#define CONFIG_DEFAULT_COMPRESSION 0
+#define CONFIG_DEFAULT_COMPRESSION_THRESHOLD 1024
+#define CONFIG_DEFAULT_COMPRESSION_LEVEL 1
+#define CONFIG_MIN_COMPRESSION_THRESHOLD 64
+#define CONFIG_DEFAULT_WORKERS 4
+#define CONFIG_DEFAULT_ASYNC_TASKS 2
+#define CONFIG_DEFAULT_ASYNC_INFLIGHT_MAX_AGE 30000 /* ms before a fill is
+                                                       considered stuck */
+#define CONFIG_DEFAULT_ASYNC_BATCH_SIZE 32 /* Misses per Mongo query */
+#define CONFIG_DEFAULT_ASYNC_BATCH_LINGER_US 200 /* Wait for a batch to fill */
+#define CONFIG_DEFAULT_ASYNC_FILL_POLICY ASYNC_FILL_KEY
+#define CONFIG_MAX_THREADS 256      /* Upper bound for workers and async-tasks */
 #define NET_IP_STR_LEN 46 /* INET6_ADDRSTRLEN is 46, but we need to be sure */
 #define NET_PEER_ID_LEN (NET_IP_STR_LEN+32) /* Must be enough for ip:port */
 #define CONFIG_BINDADDR_MAX 16
 #define CONFIG_MIN_RESERVED_FDS 32
+#define PROC_INBOX_LEN (1024*4) /* Max pending cross-thread messages per proc */
+
+/* Proc cron and client migration */
+#define PROC_CRON_PERIOD_MS 100
+#define CLIENT_MIGRATE_TICKS 10     /* Imbalance must last this many crons */
+#define CLIENT_MIGRATE_MAX_PER_CRON 16
+
+/* Active expire */
+#define ACTIVE_EXPIRE_CYCLE_TIME_PERC 5 /* Max % of the cron period spent */
+#define ACTIVE_EXPIRE_CYCLE_MAX_BATCH 256 /* Max keys removed per lock hold */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE 1
+
+/* Redis maxmemory strategies. Instead of using just incremental number
+ * for this defines, we use a set of flags so that testing for certain
+ * properties common to multiple policies is faster. */
+#define MAXMEMORY_FLAG_LRU (1<<0)
+#define MAXMEMORY_FLAG_LFU (1<<1)
+#define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+
+#define MAXMEMORY_VOLATILE_TTL (2<<8)
+#define MAXMEMORY_ALLKEYS_LRU ((4<<8)|MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_NO_EVICTION (7<<8)
+
+#define EVPOOL_SIZE 16              /* Candidates kept across evictions */
+#define EVICTION_SAMPLE_SLOTS 4     /* Slots sampled per eviction */
+#define EVICTION_SLOT_TRIES 16      /* Random picks to find a non empty slot */
+#define LFU_INIT_VAL 5
+
+/* Optimistic reads */
+#define OPTIMISTIC_READ_RETRIES 64  /* Spins on a busy slot before rdlock */
+#define PROC_CACHELINE 64
+
+/* Commands spanning slots */
+#define MULTISLOT_STACK_SLOTS 64    /* Keys handled without a heap array */
 
 /* Protocol and I/O related defines */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_ZEROCOPY_MIN (4*1024) /* Larger values are referenced by
+                                             the reply list, not copied */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
@@ -120,6 +192,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CMD_SKIP_MONITOR 2048         /* "M" flag */
 #define CMD_ASKING 4096               /* "k" flag */
 #define CMD_FAST 8192                 /* "F" flag */
+#define CMD_OPTIMISTIC 16384          /* "o" flag */
+#define CMD_MULTISLOT 32768           /* "x" flag */
+#define CMD_SINGLE_KEY 65536          /* firstkey == lastkey, derived from
+                                         the key spec of the table entry */
+#define CMD_STORE_VALUES 131072       /* "z" flag */
+#define CMD_NOSLOT 262144             /* "n" flag */
 
 /* Object types */
 #define OBJ_STRING 0
@@ -137,6 +215,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
+#define OBJ_ENCODING_COMPRESSED 9 /* zlib compressed sds, see object.cpp */
 
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
@@ -169,6 +248,19 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_REPLY_SKIP (1<<24)  /* Don't send just this reply. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
+#define CLIENT_COMPRESSED_REPLY (1<<27) /* Compressed values are sent as-is */
+#define CLIENT_MULTISLOT (1<<28)  /* Running a command over several slots,
+                                     see keyDb() */
+
+/* Connection placement policies across TinyRedisProc instances */
+#define PLACEMENT_ROUNDROBIN 0
+#define PLACEMENT_LEASTCONN 1
+#define PLACEMENT_LEASTLATENCY 2
+#define PLACEMENT_P2C 3
+
+/* What an async fill stores for a missed key of a uid */
+#define ASYNC_FILL_KEY 0            /* Only the missed keys */
+#define ASYNC_FILL_DOCUMENT 1       /* Every key derived from the document */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -257,10 +349,28 @@ typedef struct redisDb {
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     uint64_t dirty;
+    long long bytes;            /* Approximate memory of the keys and values,
+                                   added by dbAdd()/dbOverwrite(), removed by
+                                   the destructors of dbDictType */
 
     pthread_rwlock_t rwlock;
+    uint64_t seq;               /* Odd while a writer owns the slot, see
+                                   dbWriteLock() and dbTryOptimisticRead() */
+    timeWheel *wheel;           /* Expire index of d, created on the first
+                                   key with an expire */
 } redisDb;
 
+/* A pipelined command parsed ahead of its execution, see
+ * processCommandBatch(). */
+typedef struct batchedCommand {
+    robj **argv;
+    int argc;
+    struct redisCommand *cmd;   /* NULL if it must run alone through
+                                   processCommand() */
+    int slot;
+    robj **zargv;               /* See compressCommandValues() */
+} batchedCommand;
+
 struct TinyRedisProc;
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
@@ -279,6 +389,8 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    robj **zargv;           /* Compressed copies of the values in argv, or
+                               NULL, see compressCommandValues() */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
@@ -291,6 +403,14 @@ typedef struct client {
     time_t lastinteraction; /* Time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
     int flags;              /* Client flags: CLIENT_* macros. */
+    uint64_t lock_wait_ns;  /* Slot lock wait of the current command */
+
+    /* Read-through GET parked until the fill of its key, see readthrough.h */
+    sds async_key;          /* The key, while async_hold is set */
+    long long async_deadline; /* mstime() at which it replies nil */
+    listNode *async_node;   /* In proc->readthrough_clients */
+    batchedCommand *async_rest; /* Pipelined commands parsed after the GET */
+    int async_rest_len;
  
     sds peerid;             /* Cached peer ID. */
 
@@ -338,9 +458,15 @@ typedef struct zset {
     zskiplist *zsl;
 } zset;
 
+/* A message posted to a TinyRedisProc from another thread. It is queued in
+ * the proc inbox and 'proc' is called from the owner's event loop. */
+struct NotifyInfo;
+typedef void notifyProc(struct TinyRedisProc *proc, struct NotifyInfo *info);
 typedef struct NotifyInfo {
+    notifyProc *proc;
     int fd;
     uint64_t ms;
+    void *data;
 } NotifyInfo;
 
 typedef struct clientBufferLimitsConfig {
@@ -356,24 +482,114 @@ typedef struct TinyRedisDB {
     int dbnum;                      /* Total number of configured DBs */
     
     dict *commands;             /* Command table */
+    int numcommands;            /* Entries of redisCommandTable */
     unsigned lruclock:LRU_BITS; /* Clock for LRU eviction */
 
     /* Configuration */
     int verbosity;                  /* Loglevel in redis.conf */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
+    int reuseport;                  /* Every worker accepts on its own
+                                       SO_REUSEPORT socket if non-zero. */
+    int placement;                  /* PLACEMENT_* used by the listener,
+                                       ignored in reuseport mode */
+    int client_migrate;             /* Move idle clients off overloaded procs */
+    int client_migrate_ratio;       /* Overload threshold, % of the average */
+    int lockfree_reads;             /* Serve "o" commands without the rwlock */
+    int readthrough;                /* GET misses wait for the async fill */
+    long long readthrough_timeout;  /* ms before a parked GET replies nil */
+    int pipeline_batch;             /* Commands parsed from the query buffer
+                                       before running them, <= 1 disables */
+    int active_expire;              /* Procs reclaim expired keys in cron */
+    int activerehashing;            /* ReHasher works through rehash_dirty */
+    int rehash_hold_us;             /* Max slot lock hold of one rehash step */
+    int workers;                    /* Number of worker threads (procs) */
+    int async_tasks;                /* Number of async fill threads */
+    long long async_inflight_max_age; /* ms a fill holds its key */
+    int async_batch_size;           /* Max misses an ASyncTask fills at once */
+    long long async_batch_linger_us; /* How long it waits for more misses */
+    int async_fill_policy;          /* ASYNC_FILL_* */
+    int *worker_cpus;               /* Worker i is pinned to worker_cpus[i%n] */
+    int worker_ncpus;               /* 0 means no pinning */
+    int *async_task_cpus;           /* CPU set shared by the async threads */
+    int async_task_ncpus;
+    int *background_cpus;           /* CPU set of listener and rehasher */
+    int background_ncpus;
+    int compression;                /* Compress large string values */
+    size_t compression_threshold;   /* Min value length to try compression */
+    int compression_level;          /* zlib level, 1 (fast) .. 9 (small) */
+    sds compression_dict;           /* zlib preset dictionary or NULL */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
 
     clientBufferLimitsConfig client_obuf_limits[CLIENT_TYPE_OBUF_COUNT];
  
     long long dirty;                /* Changes to DB from the last save */
 
+    /* Compression stats, updated atomically by every thread */
+    long long stat_compressed_objects;  /* Values currently compressed */
+    long long stat_compressed_raw_bytes;/* Their uncompressed length */
+    long long stat_compressed_bytes;    /* Their compressed length */
+    long long stat_compress_rejected;   /* Values not worth compressing */
+    long long stat_compress_us;         /* Time spent compressing */
+    long long stat_decompressions;      /* Values inflated for a reply */
+    long long stat_decompress_us;       /* Time spent decompressing */
+    long long stat_compressed_passthrough; /* Sent compressed to the client */
+
+    /* Expire stats */
+    long long stat_expiredkeys;         /* Keys removed because of their TTL */
+    long long stat_expired_stale_hits;  /* Lookups that found an expired key */
+    long long stat_expire_cycle_us;     /* Time spent in activeExpireCycle() */
+    long long stat_expired_per_sec;     /* Sampled by proc 0 every second */
+    long long stat_expired_last;        /* stat_expiredkeys at the last sample */
+    long long stat_expired_last_ms;     /* Time of the last sample */
+    unsigned long expire_slot_cursor;   /* Next slot for activeExpireCycle() */
+
+    /* Background rehashing. Writers flag the slots whose dict is rehashing
+     * or could shrink, the ReHasher thread clears the bits it is done with. */
+    uint64_t *rehash_dirty;             /* One bit per slot */
+    long long stat_rehash_us;           /* Time spent rehashing by ReHasher */
+    long long stat_rehash_locks;        /* Slot locks taken by ReHasher */
+    long long stat_rehash_completed;    /* Rehashes finished by ReHasher */
+
     /* Logging */
     char *logfile;                  /* Path of log file */
 
+    /* Slowlog, the entries live in the rings of the procs */
+    long long slowlog_log_slower_than;  /* Usecs of wait+exec, < 0 disables */
+    unsigned long slowlog_max_len;      /* Entries of every ring */
+    long long slowlog_entry_id;         /* Last id given out */
+    long long slowlog_reset_id;         /* Ids up to this one were reset */
+
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
-
+    int maxmemory_policy;           /* Policy for key eviction */
+    int maxmemory_samples;          /* Pricision of random sampling */
+    int lfu_log_factor;             /* LFU logarithmic counter factor. */
+    int lfu_decay_time;             /* LFU counter decay factor. */
+
+    /* Eviction stats */
+    long long stat_evictedkeys;     /* Keys removed to honour maxmemory */
+    long long stat_evict_us;        /* Time spent in freeMemoryIfNeeded() */
+    long long stat_oom_rejects;     /* Writes refused or fills dropped */
+    long long stat_evicted_per_sec; /* Sampled by proc 0 every second */
+    long long stat_evicted_last;    /* stat_evictedkeys at the last sample */
+
+    /* Async loader stats, updated atomically by workers and ASyncTask */
+    long long stat_async_pushed;    /* Misses queued for a fill */
+    long long stat_async_deduped;   /* Misses of a key already queued */
+    long long stat_async_dropped;   /* Misses dropped on a full queue */
+    long long stat_async_done;      /* Queued misses handled */
+    long long stat_async_filled;    /* Handled misses that stored a value */
+    long long stat_async_us;        /* Time spent handling them */
+    long long stat_async_wait_us;   /* Time they spent in the queue */
+    long long stat_async_stuck;     /* Fills taken over after max age */
+    long long stat_async_mongo_queries; /* Mongo round trips of the fills */
+    long long stat_async_mongo_keys; /* Misses those round trips served */
+    long long stat_async_exists_keys; /* Misses that needed the uid check */
+    long long stat_async_exists_calls; /* EXISTS pipelines, one per batch */
+    long long stat_async_prefilled; /* Sibling keys stored by document fills */
+
+    time_t stat_starttime;          /* Server start time */
 
     /* Zip structure config, see redis.conf for more information  */
     size_t hash_max_ziplist_entries;
@@ -390,6 +606,10 @@ typedef struct TinyRedisDB {
 	int bug_report_start; /* True if bug report header was already logged. */
 
     struct sharedObjectsStruct shared;
+
+    /* Event loops serving this DB, registered by CreateTinyRedisProc() */
+    struct TinyRedisProc **procs;
+    int nprocs;
 } TinyRedisDB;
 
 typedef struct TinyRedisProc {
@@ -409,9 +629,59 @@ typedef struct TinyRedisProc {
     time_t unixtime;        /* Unix time sampled every cron cycle. */
     long long mstime;       /* Like 'unixtime' but with milliseconds resolution. */
     
+    /* Load stats, written by the owner thread and read by other threads
+     * (listener placement, client migration) with atomic loads. */
+    unsigned long stat_clients;     /* listLength(clients) */
+    long long stat_loop_busy_us;    /* Moving average of the busy time of one
+                                       event loop iteration. */
+    long long loop_wake_us;         /* When the loop returned from polling */
+    int imbalance_ticks;            /* Consecutive crons found overloaded */
+
+    /* Slot this proc is reading without the rwlock, NULL otherwise. Each
+     * proc owns its cache line, writers only read it. */
+    char reading_pad0[PROC_CACHELINE];
+    struct redisDb *reading;
+    char reading_pad1[PROC_CACHELINE];
+
+    /* Keyspace hit ratio of the read commands served by this proc, written
+     * by the owner thread only. */
+    long long stat_keyspace_hits;
+    long long stat_keyspace_misses;
+
+    struct evictionPoolEntry *evpool;   /* Candidates of freeMemoryIfNeeded() */
+
+    /* Lock wait and execution time of every command served by this proc,
+     * indexed by redisCommand::id. Written by the owner thread only. */
+    commandLatency *latency;
+
+    /* Ring of the slow commands served by this proc, see slowlog.h */
+    struct slowlogEntry *slowlog;
+    unsigned long slowlog_next;     /* Written next, modulo slowlog_max_len */
+
+    /* Pipelined commands of current_client waiting to run */
+    batchedCommand *batch;
+    int batch_len;
+    long long stat_batch_runs;      /* Slot lock holds shared by commands */
+    long long stat_batch_commands;  /* Commands run in those holds */
+
+    long long stat_multislot_commands;  /* Commands spanning slots */
+    long long stat_multislot_slots;     /* Slots locked by those commands */
+
+    /* Clients parked by a read-through GET, see readthrough.h */
+    dict *readthrough_keys;         /* Key -> list of the clients waiting */
+    list *readthrough_clients;      /* All of them, by deadline */
+    list *readthrough_resume;       /* Woken, their pipeline runs next */
+    long long readthrough_timer;    /* Deadline time event, -1 if none */
+    unsigned long readthrough_waiting; /* Read by the ASyncTask threads */
+    long long stat_readthrough_parked;
+    long long stat_readthrough_filled;  /* Woken by the fill */
+    long long stat_readthrough_timeouts;
+    long long stat_readthrough_notify_dropped; /* Wakeups on a full inbox */
+
+    int             id;             /* Index in TinyRedisDB::procs */
     TinyRedisDB*    db;
-    int             notify_fd_read;
-    int             notify_fd_write;
+    MpscQue<NotifyInfo>* inbox; /* Messages from other threads, drained by
+                                   NotifyHandle() on the inbox eventfd. */
 } TinyRedisProc;
 
 
@@ -429,6 +699,7 @@ struct redisCommand {
     int lastkey;  /* The last argument that's a key */
     int keystep;  /* The step between first and last key */
     long long microseconds, calls;
+    int id;       /* Index in redisCommandTable, set by populateCommandTable() */
 };
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -456,13 +727,15 @@ extern TinyRedisDB* g_redisDB;
 extern dictType dbDictType;
 extern dictType shaScriptObjectDictType;
 extern dictType hashDictType;
+extern dictType readThroughDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
  *----------------------------------------------------------------------------*/
 
 TinyRedisDB* CreateTinyRedisDB();
-TinyRedisProc* CreateTinyRedisProc(TinyRedisDB* db, int read_fd, int write_fd);
+TinyRedisProc* CreateTinyRedisProc(TinyRedisDB* db);
+TinyRedisProc* selectTinyRedisProc(TinyRedisProc** procs, int n, int policy, uint64_t* rr);
 
 /* Utils */
 long long ustime(void);
@@ -471,6 +744,7 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 uint16_t crc16(const char *buf, int len); 
 
 unsigned int keyHashSlot(const char *key, int keylen); 
+int getDBIndex(client *c, struct redisCommand *cmd, robj **argv, int argc);
 
 /* networking.c -- Networking and Client related operations */
 client *createClient(int fd, TinyRedisProc* proc);
@@ -485,6 +759,25 @@ void processInputBuffer(client *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void NotifyHandle(aeEventLoop *el, int fd, void *privdata, int mask); 
+int postNotify(TinyRedisProc *proc, notifyProc *handler, int fd, void *data);
+void acceptNotifyHandler(TinyRedisProc *proc, NotifyInfo *info);
+void migrateNotifyHandler(TinyRedisProc *proc, NotifyInfo *info);
+void migrateClientsIfNeeded(TinyRedisProc *proc);
+void dbWriteLock(redisDb *db);
+void dbWriteUnlock(redisDb *db);
+int dbTryOptimisticRead(TinyRedisProc *proc, redisDb *db);
+void dbEndOptimisticRead(TinyRedisProc *proc);
+
+/* Pause hint for the spin loops of dbWriteLock() and dbTryOptimisticRead(). */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
@@ -535,6 +828,7 @@ void addReplyStatusFormat(client *c, const char *fmt, ...);
 void decrRefCount(robj *o);
 void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
+robj *makeObjectShared(robj *o);
 robj *resetRefCount(robj *obj);
 void freeStringObject(robj *o);
 void freeHashObject(robj *o);
@@ -545,8 +839,20 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(robj *o);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
+robj *tryObjectCompression(robj *o);
+robj *decompressStringObject(robj *o);
+size_t compressedObjectRawLen(robj *o);
+robj **compressCommandValues(struct redisCommand *cmd, robj **argv, int argc);
+void freeCommandValues(robj **zargv, int argc);
+
+/* The value to store for argument 'j': its compressed copy if there is one.
+ * c->argv itself is left as received, e.g. for the slow log. */
+static inline robj *commandValue(client *c, int j) {
+    return (c->zargv && c->zargv[j]) ? c->zargv[j] : c->argv[j];
+}
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+size_t objectApproxBytes(robj *o);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
 robj *createHashObject(void);
@@ -566,8 +872,22 @@ unsigned long long estimateObjectIdleTime(robj *o);
 
 
 /* Core functions */
-int freeMemoryIfNeeded(void);
+int freeMemoryIfNeeded(struct evictionPoolEntry *pool);
+struct evictionPoolEntry *evictionPoolAlloc(void);
+void evictionPoolFree(struct evictionPoolEntry *pool);
+unsigned long LFUGetTimeInMinutes(void);
+uint8_t LFULogIncr(uint8_t value);
+unsigned long LFUDecrAndReturn(robj *o);
+void updateLFU(robj *val);
+unsigned int objectInitialLRU(void);
+const char *maxmemoryPolicyName(int policy);
+const char *asyncFillPolicyName(int policy);
 int processCommand(client *c);
+void processCommandBatch(client *c);
+void batchAddCommand(client *c);
+void batchPark(client *c, batchedCommand *rest, int n);
+void batchResume(client *c);
+void batchDiscard(client *c);
 struct redisCommand *lookupCommand(TinyRedisProc* proc, sds name);
 void call(client *c);
 #ifdef __GNUC__
@@ -580,6 +900,7 @@ void serverLogRaw(int level, const char *msg);
 void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 int htNeedsResize(dict *dict);
+int dbRehashStep(redisDb *db, long long us);
 void populateCommandTable(TinyRedisDB* db);
 void resetCommandTableStats(void);
 void closeListeningSockets(int unlink_unix_socket);
@@ -609,6 +930,7 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 
 /* Configuration */
 void loadServerConfig(char *filename, char *options);
+void loadServerConfigFromString(char *config);
 
 
 /* db.c -- Keyspace access API */
@@ -616,16 +938,22 @@ robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
+robj *lookupKeyReadClient(client *c, robj *key);
+redisDb *keyDb(client *c, robj *key);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
+#define LOOKUP_WRITE (1<<1)     /* Caller holds the write lock, may expire */
+void dbIndexExpire(redisDb *db, dictEntry *de);
 void dbAdd(redisDb *db, robj *key, robj *val, int64_t expireMs = 0);
 void dbOverwrite(redisDb *db, robj *key, robj *val, int64_t expireMs = 0);
+void dbUpdateValueBytes(redisDb *db, robj *val, size_t oldbytes);
 void setKey(redisDb *db, robj *key, robj *val, int64_t expireMs = 0);
 int dbExists(redisDb *db, robj *key);
 int dbDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
+void activeExpireCycle(TinyRedisProc *proc);
 
 /* Commands prototypes */
 void setCommand(client *c);
@@ -635,6 +963,9 @@ void getCommand(client *c);
 void delCommand(client *c);
 void existsCommand(client *c);
 void appendCommand(client *c);
+void mgetCommand(client *c);
+void msetCommand(client *c);
+void msetnxCommand(client *c);
 void strlenCommand(client *c);
 
 void hsetCommand(client *c);
@@ -654,6 +985,11 @@ void ttlCommand(client* c);
 void expireCommand(client* c);
 
 void clusterCommand(client* c);
+void clientCommand(client *c);
+void infoCommand(client *c);
+void latencyCommand(client *c);
+void slowlogCommand(client *c);
+sds genTinyRedisInfoString(TinyRedisDB *db, const char *section);
 
 #if 0
 #if defined(__GNUC__)
@@ -0,0 +1,192 @@
+/* Per proc slowlog, see slowlog.h.
+ *
+ * SLOWLOG GET [count] replies with the most recent entries of all the procs,
+ * 10 by default, all of them with a negative count. Every entry is:
+ *
+ *   id, unix time, execution usec, arguments, client peer, slot, lock wait usec
+ *
+ * A command is logged when its execution plus lock wait time reaches
+ * slowlog-log-slower-than microseconds, a negative value disables the log.
+ */
+
+#include "server.h"
+#include "slowlog.h"
+
+slowlogEntry *slowlogCreate(TinyRedisDB *db) {
+    return (slowlogEntry*)zcalloc(sizeof(slowlogEntry)*db->slowlog_max_len);
+}
+
+void slowlogRelease(slowlogEntry *log) {
+    zfree(log);
+}
+
+/* Copy the arguments of 'c' in 'e', truncated like redis does. */
+static void slowlogCopyArgs(slowlogEntry *e, client *c) {
+    int j, slargc, pos = 0;
+
+    slargc = c->argc > SLOWLOG_ENTRY_MAX_ARGC ? SLOWLOG_ENTRY_MAX_ARGC : c->argc;
+    for (j = 0; j < slargc; j++) {
+        char *dst = e->argbuf+pos;
+        size_t room = SLOWLOG_ARGBUF_LEN-pos;
+        robj *o = c->argv[j];
+        int len;
+
+        if (slargc != c->argc && j == slargc-1) {
+            /* The last slot tells how many arguments are missing */
+            len = snprintf(dst,room,"... (%d more arguments)",c->argc-slargc+1);
+        } else if (sdsEncodedObject(o)) {
+            size_t slen = sdslen((sds)o->ptr);
+
+            len = slen > SLOWLOG_ENTRY_MAX_STRING ? SLOWLOG_ENTRY_MAX_STRING : slen;
+            memcpy(dst,o->ptr,len);
+            if (slen > (size_t)len)
+                len += snprintf(dst+len,room-len,"... (%lu more bytes)",
+                                (unsigned long)(slen-len));
+        } else if (o->encoding == OBJ_ENCODING_INT) {
+            len = ll2string(dst,room,(long)o->ptr);
+        } else {
+            len = snprintf(dst,room,"?");
+        }
+        e->arglen[j] = len;
+        pos += len;
+    }
+    e->argc = slargc;
+}
+
+/* Called by call() with the execution and lock wait time of the command
+ * that just ran, in nanoseconds. Only touches the ring of c->proc. */
+void slowlogPushEntryIfNeeded(client *c, uint64_t execns, uint64_t waitns) {
+    TinyRedisDB *db = c->proc->db;
+    long long duration = execns/1000, wait = waitns/1000;
+    slowlogEntry *e;
+    uint64_t seq;
+
+    if (db->slowlog_log_slower_than < 0 ||
+        duration+wait < db->slowlog_log_slower_than) return;
+
+    e = &c->proc->slowlog[c->proc->slowlog_next++ % db->slowlog_max_len];
+    seq = e->seq;
+    __atomic_store_n(&e->seq,seq+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->id = __atomic_add_fetch(&db->slowlog_entry_id,1,__ATOMIC_RELAXED);
+    e->time = c->proc->unixtime;
+    e->duration = duration;
+    e->wait = wait;
+    e->slot = c->db ? c->db->id : -1;
+    slowlogCopyArgs(e,c);
+    snprintf(e->peerid,sizeof(e->peerid),"%s",getClientPeerId(c));
+
+    __atomic_store_n(&e->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+/* Copy an entry of another proc. Returns 0 if it is unused, reset, or kept
+ * changing while it was copied. */
+static int slowlogReadEntry(slowlogEntry *e, slowlogEntry *copy, long long minid) {
+    int retry;
+
+    for (retry = 0; retry < SLOWLOG_READ_RETRIES; retry++) {
+        uint64_t seq = __atomic_load_n(&e->seq,__ATOMIC_ACQUIRE);
+
+        if (seq & 1) continue;
+        memcpy(copy,e,sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq,__ATOMIC_RELAXED) == seq)
+            return copy->id > minid;
+    }
+    return 0;
+}
+
+static int slowlogCompareId(const void *a, const void *b) {
+    long long ida = ((const slowlogEntry*)a)->id;
+    long long idb = ((const slowlogEntry*)b)->id;
+
+    return ida < idb ? 1 : (ida > idb ? -1 : 0);
+}
+
+/* Copy the visible entries of all the procs in a zmalloc'ed array, most
+ * recent first. */
+static slowlogEntry *slowlogCollect(TinyRedisDB *db, long *count) {
+    long long minid = __atomic_load_n(&db->slowlog_reset_id,__ATOMIC_RELAXED);
+    slowlogEntry *entries;
+    unsigned long j;
+    long n = 0;
+    int p;
+
+    entries = (slowlogEntry*)zmalloc(sizeof(slowlogEntry)*
+                                     db->nprocs*db->slowlog_max_len);
+    for (p = 0; p < db->nprocs; p++) {
+        for (j = 0; j < db->slowlog_max_len; j++) {
+            if (slowlogReadEntry(&db->procs[p]->slowlog[j],entries+n,minid))
+                n++;
+        }
+    }
+    qsort(entries,n,sizeof(slowlogEntry),slowlogCompareId);
+    *count = n;
+    return entries;
+}
+
+/* Entries newer than the last reset, without copying them */
+static long slowlogLen(TinyRedisDB *db) {
+    long long minid = __atomic_load_n(&db->slowlog_reset_id,__ATOMIC_RELAXED);
+    unsigned long j;
+    long n = 0;
+    int p;
+
+    for (p = 0; p < db->nprocs; p++) {
+        for (j = 0; j < db->slowlog_max_len; j++) {
+            if (__atomic_load_n(&db->procs[p]->slowlog[j].id,__ATOMIC_RELAXED) > minid)
+                n++;
+        }
+    }
+    return n;
+}
+
+static void addReplySlowlogEntry(client *c, slowlogEntry *e) {
+    int j, pos = 0;
+
+    addReplyMultiBulkLen(c,7);
+    addReplyLongLong(c,e->id);
+    addReplyLongLong(c,e->time);
+    addReplyLongLong(c,e->duration);
+    addReplyMultiBulkLen(c,e->argc);
+    for (j = 0; j < e->argc; j++) {
+        addReplyBulkCBuffer(c,e->argbuf+pos,e->arglen[j]);
+        pos += e->arglen[j];
+    }
+    addReplyBulkCString(c,e->peerid);
+    addReplyLongLong(c,e->slot);
+    addReplyLongLong(c,e->wait);
+}
+
+/* SLOWLOG GET [count] | LEN | RESET */
+void slowlogCommand(client *c) {
+    TinyRedisDB *db = c->proc->db;
+    const char *sub = (const char*)c->argv[1]->ptr;
+
+    if (c->argc == 2 && !strcasecmp(sub,"reset")) {
+        __atomic_store_n(&db->slowlog_reset_id,
+            __atomic_load_n(&db->slowlog_entry_id,__ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+        addReply(c,db->shared.ok);
+    } else if (c->argc == 2 && !strcasecmp(sub,"len")) {
+        addReplyLongLong(c,slowlogLen(db));
+    } else if ((c->argc == 2 || c->argc == 3) && !strcasecmp(sub,"get")) {
+        slowlogEntry *entries;
+        long count = 10, n, j;
+
+        if (c->argc == 3 &&
+            getLongFromObjectOrReply(c,c->argv[2],&count,NULL) != C_OK)
+            return;
+
+        entries = slowlogCollect(db,&n);
+        if (count < 0 || count > n) count = n;
+        addReplyMultiBulkLen(c,count);
+        for (j = 0; j < count; j++)
+            addReplySlowlogEntry(c,entries+j);
+        zfree(entries);
+    } else {
+        addReplyError(c,
+            "Unknown SLOWLOG subcommand or wrong # of args. Try GET, RESET, LEN.");
+    }
+}
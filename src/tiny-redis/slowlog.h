@@ -0,0 +1,42 @@
+/* slowlog.h - Per proc log of the slow commands
+ *
+ * Every proc owns a ring of slowlog-max-len entries and is the only one
+ * writing it. An entry is a flat struct, with the arguments copied and
+ * truncated in it, and guarded by a sequence number that is odd while the
+ * owner rewrites it. SLOWLOG GET and LEN, served by any proc, copy the
+ * entries of all the rings and retry or skip the ones that changed under
+ * them, so neither side ever takes a lock.
+ *
+ * Ids come from a counter shared by the procs, so the merged log is ordered
+ * by id. SLOWLOG RESET only moves the lowest visible id past the last one
+ * given out, the rings are overwritten later by their owners.
+ */
+
+#ifndef __SLOWLOG_H__
+#define __SLOWLOG_H__
+
+#define SLOWLOG_ENTRY_MAX_ARGC 16
+#define SLOWLOG_ENTRY_MAX_STRING 64
+/* Room for the longest arguments plus their "... (N more bytes)" suffix */
+#define SLOWLOG_ARGBUF_LEN (SLOWLOG_ENTRY_MAX_ARGC*(SLOWLOG_ENTRY_MAX_STRING+32))
+#define SLOWLOG_READ_RETRIES 3
+
+typedef struct slowlogEntry {
+    uint64_t seq;                   /* Odd while the owner writes the entry */
+    long long id;                   /* Unique id, 0 for a never used entry */
+    time_t time;                    /* Unix time the command was executed */
+    long long duration;             /* Execution time, in microseconds */
+    long long wait;                 /* Slot lock wait, in microseconds */
+    int slot;                       /* Slot of the command */
+    int argc;                       /* Arguments in argbuf */
+    uint16_t arglen[SLOWLOG_ENTRY_MAX_ARGC];
+    char argbuf[SLOWLOG_ARGBUF_LEN];/* The arguments, one after the other */
+    char peerid[NET_PEER_ID_LEN];
+} slowlogEntry;
+
+struct slowlogEntry *slowlogCreate(TinyRedisDB *db);
+void slowlogRelease(struct slowlogEntry *log);
+void slowlogPushEntryIfNeeded(client *c, uint64_t execns, uint64_t waitns);
+void slowlogCommand(client *c);
+
+#endif
@@ -470,10 +470,13 @@ void hashTypeConvert(robj *o, int enc) {
 
 void hsetCommand(client *c) {
     int update;
+    size_t bytes;
     robj *o;
 
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
+    bytes = objectApproxBytes(o);
     update = hashTypeSet(o,c->argv[2],c->argv[3]);
+    dbUpdateValueBytes(c->db,o,bytes);
     addReply(c, update ? c->proc->db->shared.czero : c->proc->db->shared.cone);
     c->db->dirty++;
 }
@@ -485,7 +488,10 @@ void hsetnxCommand(client *c) {
     if (hashTypeExists(o, c->argv[2])) {
         addReply(c, c->proc->db->shared.czero);
     } else {
+        size_t bytes = objectApproxBytes(o);
+
         hashTypeSet(o,c->argv[2],c->argv[3]);
+        dbUpdateValueBytes(c->db,o,bytes);
         addReply(c, c->proc->db->shared.cone);
         c->db->dirty++;
     }
@@ -493,6 +499,7 @@ void hsetnxCommand(client *c) {
 
 void hmsetCommand(client *c) {
     int i;
+    size_t bytes;
     robj *o;
 
     if ((c->argc % 2) == 1) {
@@ -501,9 +508,11 @@ void hmsetCommand(client *c) {
     }
 
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
+    bytes = objectApproxBytes(o);
     for (i = 2; i < c->argc; i += 2) {
         hashTypeSet(o,c->argv[i],c->argv[i+1]);
     }
+    dbUpdateValueBytes(c->db,o,bytes);
     addReply(c, c->proc->db->shared.ok);
     c->db->dirty++;
 }
@@ -562,7 +571,7 @@ void hmgetCommand(client *c) {
 
     /* Don't abort when the key cannot be found. Non-existing keys are empty
      * hashes, where HMGET should respond with a series of null bulks. */
-    o = lookupKeyRead(c->db, c->argv[1]);
+    o = lookupKeyReadClient(c, c->argv[1]);
     if (o != NULL && o->type != OBJ_HASH) {
         addReply(c, c->proc->db->shared.wrongtypeerr);
         return;
@@ -577,19 +586,25 @@ void hmgetCommand(client *c) {
 void hdelCommand(client *c) {
     robj *o;
     int j, deleted = 0;
+    size_t bytes;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],c->proc->db->shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
+    bytes = objectApproxBytes(o);
     for (j = 2; j < c->argc; j++) {
         if (hashTypeDelete(o,c->argv[j])) {
             deleted++;
             if (hashTypeLength(o) == 0) {
+                /* Account the shrink before the destructor sees it */
+                dbUpdateValueBytes(c->db,o,bytes);
                 dbDelete(c->db,c->argv[1]);
+                o = NULL;
                 break;
             }
         }
     }
+    if (o) dbUpdateValueBytes(c->db,o,bytes);
     if (deleted) {
         c->db->dirty += deleted;
     }
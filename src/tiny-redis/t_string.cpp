@@ -31,6 +31,7 @@
 #include <math.h> /* isnan(), isinf() */
 
 #include "asynctask.h"
+#include "readthrough.h"
 
 /*-----------------------------------------------------------------------------
  * String Commands
@@ -90,6 +91,48 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
     addReply(c, ok_reply ? ok_reply : c->proc->db->shared.ok);
 }
 
+/* Compressed copies of the large values a "z" command stores, made before
+ * the slot lock is taken so that no deflate runs under it. Returns an array
+ * parallel to 'argv', NULL where a value is left as is, or NULL if none
+ * was compressed. The arguments themselves are not touched. */
+robj **compressCommandValues(struct redisCommand *cmd, robj **argv, int argc) {
+    TinyRedisDB *db = g_redisDB;
+    robj **zargv = NULL;
+    int first = 2, step = 1, last = 2, j;
+
+    if (!db->compression) return NULL;
+    if (cmd->proc == setexCommand) {
+        first = last = 3;
+    } else if (cmd->proc == msetCommand || cmd->proc == msetnxCommand) {
+        step = 2;
+        last = argc-1;
+    }
+
+    for (j = first; j <= last && j < argc; j += step) {
+        robj *o = argv[j], *z;
+
+        if (o->encoding != OBJ_ENCODING_RAW ||
+            sdslen((sds)o->ptr) < db->compression_threshold) continue;
+        z = tryObjectCompression(createRawStringObject((const char*)o->ptr,
+                                                       sdslen((sds)o->ptr)));
+        if (z->encoding != OBJ_ENCODING_COMPRESSED) {
+            decrRefCount(z);
+            continue;
+        }
+        if (zargv == NULL) zargv = (robj**)zcalloc(sizeof(robj*)*argc);
+        zargv[j] = z;
+    }
+    return zargv;
+}
+
+void freeCommandValues(robj **zargv, int argc) {
+    int j;
+
+    for (j = 0; j < argc; j++)
+        if (zargv[j]) decrRefCount(zargv[j]);
+    zfree(zargv);
+}
+
 /* SET key value [NX] [XX] [EX <seconds>] [PX <milliseconds>] */
 void setCommand(client *c) {
     int j;
@@ -134,17 +177,17 @@ void setCommand(client *c) {
     }
 
     c->argv[2] = tryObjectEncoding(c->argv[2]);
-    setGenericCommand(c,flags,c->argv[1],c->argv[2],expire,unit,NULL,NULL);
+    setGenericCommand(c,flags,c->argv[1],commandValue(c,2),expire,unit,NULL,NULL);
 }
 
 void setnxCommand(client *c) {
     c->argv[2] = tryObjectEncoding(c->argv[2]);
-    setGenericCommand(c,OBJ_SET_NX,c->argv[1],c->argv[2],NULL,0,c->proc->db->shared.cone,c->proc->db->shared.czero);
+    setGenericCommand(c,OBJ_SET_NX,c->argv[1],commandValue(c,2),NULL,0,c->proc->db->shared.cone,c->proc->db->shared.czero);
 }
 
 void setexCommand(client *c) {
     c->argv[3] = tryObjectEncoding(c->argv[3]);
-    setGenericCommand(c,OBJ_SET_NO_FLAGS,c->argv[1],c->argv[3],c->argv[2],UNIT_SECONDS,NULL,NULL);
+    setGenericCommand(c,OBJ_SET_NO_FLAGS,c->argv[1],commandValue(c,3),c->argv[2],UNIT_SECONDS,NULL,NULL);
 }
 
 void psetexCommand(client *c) {
@@ -155,9 +198,22 @@ void psetexCommand(client *c) {
 int getGenericCommand(client *c) {
     robj *o;
 
-    if ((o = lookupKeyRead(c->db, c->argv[1])) == NULL)
+    if ((o = lookupKeyReadClient(c, c->argv[1])) == NULL)
     {
-        ASyncTask::PushTask((const char*)c->argv[1]->ptr);
+        /* Read-through: park the GET until the fill, see readthrough.h.
+         * It also waits when a fill of the key is already running (-100). */
+        if (c->proc->db->readthrough && c->cmd->proc == getCommand) {
+            int ret;
+
+            readThroughPark(c);
+            ret = ASyncTask::PushTask((const char*)c->argv[1]->ptr,
+                sdslen((sds)c->argv[1]->ptr), c->db->id);
+            if (ret >= 0 || ret == -100) return C_OK;
+            readThroughUnlink(c);
+        } else {
+            ASyncTask::PushTask((const char*)c->argv[1]->ptr,
+                sdslen((sds)c->argv[1]->ptr), c->db->id);
+        }
         addReply(c, c->proc->db->shared.nullbulk);
         return C_OK;
     }
@@ -187,7 +243,7 @@ void mgetCommand(client *c) {
 
     addReplyMultiBulkLen(c,c->argc-1);
     for (j = 1; j < c->argc; j++) {
-        robj *o = lookupKeyRead(c->db,c->argv[j]);
+        robj *o = lookupKeyReadClient(c,c->argv[j]);
         if (o == NULL) {
             addReply(c,c->proc->db->shared.nullbulk);
         } else {
@@ -211,7 +267,7 @@ void msetGenericCommand(client *c, int nx) {
      * set nothing at all if at least one already key exists. */
     if (nx) {
         for (j = 1; j < c->argc; j += 2) {
-            if (lookupKeyWrite(c->db,c->argv[j]) != NULL) {
+            if (lookupKeyWrite(keyDb(c,c->argv[j]),c->argv[j]) != NULL) {
                 busykeys++;
             }
         }
@@ -222,10 +278,12 @@ void msetGenericCommand(client *c, int nx) {
     }
 
     for (j = 1; j < c->argc; j += 2) {
+        redisDb *db = keyDb(c,c->argv[j]);
+
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
-        setKey(c->db,c->argv[j],c->argv[j+1]);
+        setKey(db,c->argv[j],commandValue(c,j+1));
+        db->dirty++;
     }
-    c->db->dirty += (c->argc-1)/2;
     addReply(c, nx ? c->proc->db->shared.cone : c->proc->db->shared.ok);
 }
 
@@ -296,7 +354,7 @@ void decrbyCommand(client *c) {
 }
 
 void appendCommand(client *c) {
-    size_t totlen;
+    size_t totlen, bytes;
     robj *o, *append;
 
     o = lookupKeyWrite(c->db,c->argv[1]);
@@ -319,7 +377,9 @@ void appendCommand(client *c) {
 
         /* Append the value */
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+        bytes = objectApproxBytes(o);
         o->ptr = sdscatlen((sds)o->ptr,append->ptr,sdslen((sds)append->ptr));
+        dbUpdateValueBytes(c->db,o,bytes);
         totlen = sdslen((sds)o->ptr);
     }
     c->db->dirty++;
@@ -0,0 +1,136 @@
+/* timewheel.cpp - Hierarchical timing wheel indexing dict entries by expire
+ *
+ * See timewheel.h for an overview.
+ */
+
+#include <string.h>
+#include "timewheel.h"
+#include "zmalloc.h"
+
+/* Tick of an expire time, rounded up so that an entry is never handed out
+ * before its expire time. */
+static long long twTickOf(long long expire) {
+    return (expire + TW_TICK_MS - 1) / TW_TICK_MS;
+}
+
+static void twLink(dictEntry **head, dictEntry *de) {
+    de->wheel_next = *head;
+    if (*head) (*head)->wheel_pprev = &de->wheel_next;
+    *head = de;
+    de->wheel_pprev = head;
+}
+
+/* File the entry in the bucket matching its distance from tw->cur. */
+static void twFile(timeWheel *tw, dictEntry *de) {
+    long long t = twTickOf(dictGetExpire(de));
+    long long delta;
+    int level;
+
+    if (t < tw->cur) t = tw->cur;
+    delta = t - tw->cur;
+
+    for (level = 0; level < TW_LEVELS-1; level++) {
+        if (delta < (1LL << (TW_BITS*(level+1)))) break;
+    }
+    if (delta >= (1LL << (TW_BITS*TW_LEVELS))) {
+        /* Too far away: park it, it is re-filed when cascaded. */
+        t = tw->cur + (1LL << (TW_BITS*TW_LEVELS)) - 1;
+    }
+    twLink(&tw->buckets[level][(t >> (TW_BITS*level)) & TW_MASK], de);
+}
+
+timeWheel *twCreate(long long nowms) {
+    timeWheel *tw = (timeWheel*)zmalloc(sizeof(*tw));
+
+    memset(tw->buckets,0,sizeof(tw->buckets));
+    tw->cur = nowms / TW_TICK_MS;
+    tw->cascaded = 0;
+    return tw;
+}
+
+/* The entries are not freed: they belong to the dict. */
+void twRelease(timeWheel *tw) {
+    int level, j;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (j = 0; j < TW_SLOTS; j++) {
+            dictEntry *de = tw->buckets[level][j];
+
+            while (de) {
+                dictEntry *next = de->wheel_next;
+                de->wheel_next = NULL;
+                de->wheel_pprev = NULL;
+                de = next;
+            }
+        }
+    }
+    zfree(tw);
+}
+
+/* Add the entry, or move it if its expire time changed. Entries without an
+ * expire time are just removed. */
+void twAdd(timeWheel *tw, dictEntry *de) {
+    dictEntryUnlinkWheel(de);
+    if (dictGetExpire(de) <= 0) return;
+    twFile(tw,de);
+}
+
+/* Move the entries of a bucket of 'level' to the lower levels. */
+static void twCascade(timeWheel *tw, int level) {
+    int idx = (tw->cur >> (TW_BITS*level)) & TW_MASK;
+    dictEntry *de = tw->buckets[level][idx];
+
+    tw->buckets[level][idx] = NULL;
+    while (de) {
+        dictEntry *next = de->wheel_next;
+
+        de->wheel_next = NULL;
+        de->wheel_pprev = NULL;
+        twFile(tw,de);
+        de = next;
+    }
+}
+
+/* Hand out the entries due at 'nowms' to 'proc', at most 'max' of them.
+ * The entries are removed from the wheel before 'proc' is called, so the
+ * callback is free to delete them from the dict. Returns the number of
+ * entries handed out; if it is 'max' there may be more to do. */
+unsigned long twExpire(timeWheel *tw, long long nowms, unsigned long max,
+                       twExpireProc *proc, void *privdata)
+{
+    long long now = nowms / TW_TICK_MS;
+    unsigned long count = 0;
+
+    while (tw->cur <= now) {
+        dictEntry **head = &tw->buckets[0][tw->cur & TW_MASK];
+
+        /* Entering a new bucket of level N+1 every TW_SLOTS^N ticks. */
+        if (!tw->cascaded) {
+            int level;
+
+            for (level = 1; level < TW_LEVELS; level++) {
+                if (tw->cur & ((1LL << (TW_BITS*level)) - 1)) break;
+                twCascade(tw,level);
+            }
+            tw->cascaded = 1;
+        }
+
+        while (*head) {
+            dictEntry *de = *head;
+
+            if (count == max) return count;
+            dictEntryUnlinkWheel(de);
+            if (dictGetExpire(de) > nowms) {
+                /* Can not happen for a level 0 bucket, be defensive
+                 * anyway: re-filing moves it to a later bucket. */
+                twFile(tw,de);
+                continue;
+            }
+            proc(privdata,de);
+            count++;
+        }
+        tw->cur++;
+        tw->cascaded = 0;
+    }
+    return count;
+}
@@ -0,0 +1,52 @@
+/* timewheel.h - Hierarchical timing wheel indexing dict entries by expire
+ *
+ * Every redisDb slot owns a wheel holding the entries of its dict that have
+ * an expire time, so that the active expire cycle only touches keys that
+ * are actually due instead of scanning the whole keyspace.
+ *
+ * The wheel is intrusive: entries are chained through the wheel_next and
+ * wheel_pprev fields of dictEntry, so adding, moving and removing an entry
+ * is O(1) and costs no allocation. dict.cpp unlinks an entry before freeing
+ * it, so deleting a key by any path keeps the wheel consistent. For the
+ * same reason the wheel keeps no entry count.
+ *
+ * Time is counted in ticks of TW_TICK_MS. There are TW_LEVELS levels of
+ * TW_SLOTS buckets each: level 0 holds the entries due in the next
+ * TW_SLOTS ticks, level 1 the ones due in the next TW_SLOTS^2 ticks and so
+ * on. When the wheel reaches the start of a bucket of a higher level, the
+ * entries of that bucket are cascaded to the lower levels. Entries further
+ * than TW_SLOTS^TW_LEVELS ticks are parked in the last bucket of the top
+ * level and re-filed when they are cascaded.
+ */
+
+#ifndef __TIMEWHEEL_H
+#define __TIMEWHEEL_H
+
+#include "dict.h"
+
+#define TW_TICK_MS 1000
+#define TW_BITS 5
+#define TW_SLOTS (1<<TW_BITS)
+#define TW_MASK (TW_SLOTS-1)
+#define TW_LEVELS 4             /* 32^4 ticks of 1s: about 12 days */
+
+typedef struct timeWheel {
+    long long cur;              /* Tick being processed: every entry due
+                                   before it was already handed out. */
+    int cascaded;               /* Higher levels already cascaded for cur */
+    dictEntry *buckets[TW_LEVELS][TW_SLOTS];
+} timeWheel;
+
+/* Called for every due entry, after it was removed from the wheel. */
+typedef void twExpireProc(void *privdata, dictEntry *de);
+
+timeWheel *twCreate(long long nowms);
+void twRelease(timeWheel *tw);
+void twAdd(timeWheel *tw, dictEntry *de);
+unsigned long twExpire(timeWheel *tw, long long nowms, unsigned long max,
+                       twExpireProc *proc, void *privdata);
+
+/* True if twExpire() has a tick to process at 'nowms'. */
+#define twHasDue(tw, nowms) ((tw)->cur <= (nowms)/TW_TICK_MS)
+
+#endif /* __TIMEWHEEL_H */
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <functional>
+
+#include "inflight.h"
+
+InflightTable::InflightTable(uint32_t stripes) : m_stripes(NULL), m_mask(0), m_size(0)
+{
+    uint32_t n = 1;
+    while (n < stripes)
+        n <<= 1;
+    m_mask = n - 1;
+
+    m_stripes = new Stripe[n];
+    for (uint32_t i = 0; i < n; i++)
+    {
+        int ret = pthread_mutex_init(&m_stripes[i].lock, NULL);
+        assert(ret == 0);
+        (void)ret;
+    }
+}
+
+InflightTable::~InflightTable()
+{
+    if (m_stripes)
+    {
+        for (uint32_t i = 0; i <= m_mask; i++)
+            pthread_mutex_destroy(&m_stripes[i].lock);
+        delete[] m_stripes;
+        m_stripes = NULL;
+    }
+}
+
+InflightTable::Stripe& InflightTable::StripeOf(const std::string& key)
+{
+    size_t h = std::hash<std::string>()(key);
+
+    //高位再混一次, 避免条带只由hash的低几位决定
+    return m_stripes[(h ^ (h >> 32) ^ (h >> 16)) & m_mask];
+}
+
+int InflightTable::Acquire(const std::string& key, uint64_t nowMs, uint64_t maxAgeMs)
+{
+    Stripe& s = StripeOf(key);
+    int ret = 0;
+
+    pthread_mutex_lock(&s.lock);
+    std::pair<Map::iterator, bool> r = s.keys.insert(Map::value_type(key, nowMs));
+    if (r.second)
+    {
+        __atomic_add_fetch(&m_size, 1, __ATOMIC_RELAXED);
+    }
+    else if (nowMs > r.first->second && nowMs - r.first->second > maxAgeMs)
+    {
+        r.first->second = nowMs;
+        ret = 1;
+    }
+    else
+    {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    return ret;
+}
+
+void InflightTable::Release(const std::string& key, uint64_t nowMs)
+{
+    Stripe& s = StripeOf(key);
+
+    pthread_mutex_lock(&s.lock);
+    Map::iterator it = s.keys.find(key);
+    if (it != s.keys.end() && it->second == nowMs)
+    {
+        s.keys.erase(it);
+        __atomic_sub_fetch(&m_size, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s.lock);
+}
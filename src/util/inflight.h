@@ -0,0 +1,55 @@
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+
+#define INFLIGHT_CACHELINE 64
+
+/*
+ * 正在回填的key的精确集合(single-flight表), 多个线程并发Acquire/Release.
+ *
+ * 按key的hash分成若干条带(stripe), 每个条带一把mutex和一张key->开始时间(ms)
+ * 的表, 条带之间隔开一个cache line, 不同key的操作基本不会争同一把锁.
+ *
+ * Acquire成功的调用方负责这次回填, 结束后用同一个时间戳Release.
+ * 超过maxAgeMs还没有Release的条目视为卡住, 下一次Acquire直接接管;
+ * 原持有者之后的Release因时间戳不匹配而不会删掉新条目.
+ */
+class InflightTable {
+public:
+    InflightTable(uint32_t stripes = 64);
+
+    virtual ~InflightTable();
+
+    /* 成功返回0并记录nowMs; key已在回填中返回-1; 接管卡住的条目返回1 */
+    int Acquire(const std::string& key, uint64_t nowMs, uint64_t maxAgeMs);
+
+    /* 只删除时间戳为nowMs的条目, 见Acquire */
+    void Release(const std::string& key, uint64_t nowMs);
+
+    /* 当前条目数, 近似值 */
+    uint64_t Size() { return __atomic_load_n(&m_size, __ATOMIC_RELAXED); }
+
+protected:
+    InflightTable(const InflightTable&);
+    InflightTable& operator= (const InflightTable&);
+
+    typedef std::unordered_map<std::string, uint64_t> Map;
+
+    typedef struct Stripe {
+        pthread_mutex_t lock;
+        Map             keys;
+        char            pad[INFLIGHT_CACHELINE];    /* 相邻条带不共享cache line */
+    } Stripe;
+
+    Stripe& StripeOf(const std::string& key);
+
+    Stripe*     m_stripes;
+    uint32_t    m_mask;
+    uint64_t    m_size;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef __MPMC_QUE_H__
+#define __MPMC_QUE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+
+#define MPMC_CACHELINE 64
+
+/*
+ * 有界无锁的多生产者/多消费者队列.
+ *
+ * 和MpscQue一样每个槽位带一个序号(seq): 生产者用CAS抢占写位置, 写完数据后
+ * 发布seq; 消费者同样用CAS抢占读位置, 读完把seq推进一圈交还给生产者.
+ * 读写位置各占一条cache line. 元素只移动不拷贝, Push失败时原对象不变.
+ *
+ * 队列本身不阻塞, 需要等待的消费者自己配一个信号量之类的门铃, 见ASyncTask.
+ */
+template <class T>
+class MpmcQue {
+public:
+    MpmcQue(uint32_t size);
+
+    virtual ~MpmcQue();
+
+    /* 任意线程调用. 成功返回0, 队列满返回-1 */
+    int Push(T&& o);
+
+    /* 任意线程调用. 成功返回0, 队列空返回-1.
+     * 有生产者抢到了位置但还没写完时也返回-1, 稍后重试即可 */
+    int TryPop(T& o);
+
+    uint32_t Len();
+
+    uint32_t Size() { return m_mask + 1; }
+
+protected:
+    MpmcQue(const MpmcQue&);
+    MpmcQue& operator= (const MpmcQue&);
+
+    typedef struct Cell {
+        uint64_t    seq;
+        T           data;
+    } Cell;
+
+    Cell*       m_buf;
+    uint32_t    m_mask;
+
+    char        m_pad0[MPMC_CACHELINE];
+    uint64_t    m_tail;     /* 生产者竞争的写位置 */
+    char        m_pad1[MPMC_CACHELINE - sizeof(uint64_t)];
+    uint64_t    m_head;     /* 消费者竞争的读位置 */
+    char        m_pad2[MPMC_CACHELINE - sizeof(uint64_t)];
+};
+
+template<class T>
+MpmcQue<T>::MpmcQue(uint32_t size) : m_buf(NULL), m_mask(0), m_tail(0), m_head(0)
+{
+    uint32_t n = 4;
+    while (n < size)
+        n <<= 1;
+    m_mask = n - 1;
+
+    m_buf = new Cell[n];
+    for (uint32_t i = 0; i < n; i++)
+        m_buf[i].seq = i;
+}
+
+template<class T>
+MpmcQue<T>::~MpmcQue()
+{
+    if (m_buf)
+    {
+        delete[] m_buf;
+        m_buf = NULL;
+    }
+}
+
+template<class T>
+int MpmcQue<T>::Push(T&& o)
+{
+    Cell* cell;
+    uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        cell = &m_buf[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)seq - (int64_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = std::move(o);
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+template<class T>
+int MpmcQue<T>::TryPop(T& o)
+{
+    Cell* cell;
+    uint64_t pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        cell = &m_buf[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)seq - (int64_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&m_head, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    o = std::move(cell->data);
+    __atomic_store_n(&cell->seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+template<class T>
+uint32_t MpmcQue<T>::Len()
+{
+    uint64_t h = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t t = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    return t > h ? (uint32_t)(t - h) : 0;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef __MPSC_QUE_H__
+#define __MPSC_QUE_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define MPSC_CACHELINE 64
+
+/*
+ * 有界无锁的多生产者/单消费者队列, 附带一个eventfd门铃.
+ *
+ * 每个槽位带一个序号(seq), 生产者用CAS抢占写位置, 写完数据后发布seq;
+ * 唯一的消费者按seq判断槽位是否可读, 读完把seq推进一圈, 交还给生产者.
+ *
+ * 门铃: 生产者Push成功后只有在门铃未被敲响时才写eventfd, 消费者被唤醒后
+ * 先Ack(读空eventfd并重新布防)再Pop到空, 这样一次唤醒可以处理任意多条消息.
+ */
+template <class T>
+class MpscQue {
+public:
+    MpscQue(uint32_t size);
+
+    virtual ~MpscQue();
+
+    /* 任意线程调用. 成功返回0, 队列满返回-1 */
+    int Push(const T& o);
+
+    /* 只能由唯一的消费者线程调用. 成功返回0, 队列空返回-1 */
+    int Pop(T& o);
+
+    uint32_t Len();
+
+    uint32_t Size() { return m_mask + 1; }
+
+    /* 门铃的fd, 注册到消费者的event loop上, 可读即表示有新消息 */
+    int Fd() { return m_efd; }
+
+    /* 消费者在Pop之前调用, 清空门铃并允许生产者再次敲响 */
+    void Ack();
+
+protected:
+    MpscQue(const MpscQue&);
+    MpscQue& operator= (const MpscQue&);
+
+    void Ring();
+
+    typedef struct Cell {
+        uint64_t    seq;
+        T           data;
+    } Cell;
+
+    Cell*       m_buf;
+    uint32_t    m_mask;
+    int         m_efd;
+
+    char        m_pad0[MPSC_CACHELINE];
+    uint64_t    m_tail;     /* 生产者竞争的写位置 */
+    char        m_pad1[MPSC_CACHELINE - sizeof(uint64_t)];
+    uint64_t    m_head;     /* 消费者独占的读位置 */
+    char        m_pad2[MPSC_CACHELINE - sizeof(uint64_t)];
+    int         m_armed;    /* 门铃是否已经敲响, 还未被消费者Ack */
+    char        m_pad3[MPSC_CACHELINE - sizeof(int)];
+};
+
+template<class T>
+MpscQue<T>::MpscQue(uint32_t size) : m_buf(NULL), m_mask(0), m_efd(-1), m_tail(0), m_head(0), m_armed(0)
+{
+    uint32_t n = 4;
+    while (n < size)
+        n <<= 1;
+    m_mask = n - 1;
+
+    m_buf = new Cell[n];
+    for (uint32_t i = 0; i < n; i++)
+        m_buf[i].seq = i;
+
+    m_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+template<class T>
+MpscQue<T>::~MpscQue()
+{
+    if (m_buf)
+    {
+        delete[] m_buf;
+        m_buf = NULL;
+    }
+
+    if (m_efd >= 0)
+    {
+        close(m_efd);
+        m_efd = -1;
+    }
+}
+
+template<class T>
+int MpscQue<T>::Push(const T& o)
+{
+    Cell* cell;
+    uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        cell = &m_buf[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)seq - (int64_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = o;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    Ring();
+
+    return 0;
+}
+
+template<class T>
+int MpscQue<T>::Pop(T& o)
+{
+    Cell* cell = &m_buf[m_head & m_mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if ((int64_t)seq - (int64_t)(m_head + 1) < 0)
+        return -1;
+
+    o = cell->data;
+    __atomic_store_n(&cell->seq, m_head + m_mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+template<class T>
+uint32_t MpscQue<T>::Len()
+{
+    uint64_t h = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t t = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    return t > h ? (uint32_t)(t - h) : 0;
+}
+
+template<class T>
+void MpscQue<T>::Ring()
+{
+    if (m_efd < 0)
+        return;
+
+    if (__atomic_exchange_n(&m_armed, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        uint64_t one = 1;
+        if (write(m_efd, &one, sizeof(one)) != sizeof(one))
+        {
+            /* 计数器溢出之前消费者一定会被唤醒, 忽略即可 */
+        }
+    }
+}
+
+template<class T>
+void MpscQue<T>::Ack()
+{
+    uint64_t v;
+    if (read(m_efd, &v, sizeof(v)) != sizeof(v))
+    {
+        /* EAGAIN: 门铃已经被读空 */
+    }
+
+    __atomic_store_n(&m_armed, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif
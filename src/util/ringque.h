@@ -4,12 +4,13 @@
 #include <stdint.h>
 #include <assert.h>
 
+/* 单线程的环形队列, 不做任何同步. 跨线程请用SpscQue/MpscQue/MpmcQue */
 template <class T>
 class RingQue {
 public:
     RingQue(uint32_t size);
 
-    RingQue(const RingQue& q) { *this = q; }
+    RingQue(const RingQue& q) : m_buf(NULL) { *this = q; }
 
     virtual ~RingQue();
 
@@ -45,7 +46,7 @@ RingQue<T>::~RingQue()
 {
     if (m_buf)
     {
-        delete m_buf;
+        delete[] m_buf;
         m_buf = NULL;
     }
 }
@@ -53,8 +54,11 @@ RingQue<T>::~RingQue()
 template<class T>
 RingQue<T>& RingQue<T>::operator= (const RingQue<T>& q)
 {
+    if (this == &q)
+        return *this;
+
     if (m_buf)
-        delete m_buf;
+        delete[] m_buf;
  
     m_size = q.m_size;
     m_read = q.m_read;
@@ -66,6 +70,8 @@ RingQue<T>& RingQue<T>::operator= (const RingQue<T>& q)
     {
         m_buf[i] = q.m_buf[i];
     }
+
+    return *this;
 }
 
 template<class T>
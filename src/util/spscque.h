@@ -0,0 +1,116 @@
+#ifndef __SPSC_QUE_H__
+#define __SPSC_QUE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+
+#define SPSC_CACHELINE 64
+
+/*
+ * 有界无锁的单生产者/单消费者队列.
+ *
+ * 写位置只由生产者修改, 读位置只由消费者修改, 各占一条cache line; 双方各自
+ * 缓存一份对方的位置, 只有看起来满了/空了才重新读取, 平时Push/Pop不碰对方
+ * 的cache line. 元素只移动不拷贝, Push失败时原对象不变.
+ */
+template <class T>
+class SpscQue {
+public:
+    SpscQue(uint32_t size);
+
+    virtual ~SpscQue();
+
+    /* 只能由唯一的生产者线程调用. 成功返回0, 队列满返回-1 */
+    int Push(T&& o);
+
+    /* 只能由唯一的消费者线程调用. 成功返回0, 队列空返回-1 */
+    int TryPop(T& o);
+
+    uint32_t Len();
+
+    uint32_t Size() { return m_mask + 1; }
+
+protected:
+    SpscQue(const SpscQue&);
+    SpscQue& operator= (const SpscQue&);
+
+    T*          m_buf;
+    uint32_t    m_mask;
+
+    char        m_pad0[SPSC_CACHELINE];
+    uint64_t    m_tail;         /* 生产者的写位置 */
+    uint64_t    m_headCache;    /* 生产者看到的读位置 */
+    char        m_pad1[SPSC_CACHELINE - 2 * sizeof(uint64_t)];
+    uint64_t    m_head;         /* 消费者的读位置 */
+    uint64_t    m_tailCache;    /* 消费者看到的写位置 */
+    char        m_pad2[SPSC_CACHELINE - 2 * sizeof(uint64_t)];
+};
+
+template<class T>
+SpscQue<T>::SpscQue(uint32_t size) : m_buf(NULL), m_mask(0), m_tail(0), m_headCache(0), m_head(0), m_tailCache(0)
+{
+    uint32_t n = 4;
+    while (n < size)
+        n <<= 1;
+    m_mask = n - 1;
+
+    m_buf = new T[n];
+}
+
+template<class T>
+SpscQue<T>::~SpscQue()
+{
+    if (m_buf)
+    {
+        delete[] m_buf;
+        m_buf = NULL;
+    }
+}
+
+template<class T>
+int SpscQue<T>::Push(T&& o)
+{
+    uint64_t t = m_tail;
+
+    if (t - m_headCache > m_mask)
+    {
+        m_headCache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        if (t - m_headCache > m_mask)
+            return -1;
+    }
+
+    m_buf[t & m_mask] = std::move(o);
+    __atomic_store_n(&m_tail, t + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+template<class T>
+int SpscQue<T>::TryPop(T& o)
+{
+    uint64_t h = m_head;
+
+    if (h == m_tailCache)
+    {
+        m_tailCache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        if (h == m_tailCache)
+            return -1;
+    }
+
+    o = std::move(m_buf[h & m_mask]);
+    __atomic_store_n(&m_head, h + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+template<class T>
+uint32_t SpscQue<T>::Len()
+{
+    uint64_t h = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t t = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    return t > h ? (uint32_t)(t - h) : 0;
+}
+
+#endif
@@ -10,6 +10,7 @@ static void* thread_func(void* arg)
     assert(arg);
 
     ThreadBase* pThread = (ThreadBase*)arg;
+    pThread->applyAffinity();
     pThread->run();
 
     return NULL;
@@ -26,3 +27,23 @@ int ThreadBase::start()
 
     return 0;
 }
+
+int ThreadBase::applyAffinity()
+{
+    if (m_cpus.empty())
+        return 0;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < m_cpus.size(); i++)
+        CPU_SET(m_cpus[i], &set);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        fprintf(stderr, "pthread_setaffinity_np failed! ret: %d, error: %s\n", ret, strerror(ret));
+        return ret;
+    }
+
+    return 0;
+}
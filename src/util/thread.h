@@ -2,6 +2,7 @@
 #define __THREAD_H__
 
 #include <pthread.h>
+#include <vector>
 
 class ThreadBase {
 public:
@@ -13,9 +14,18 @@ public:
 
     virtual int start();
 
+    /* 线程只在cpus上运行, 需要在start()之前设置, 为空表示不绑定 */
+    void setAffinity(const int* cpus, int n) { m_cpus.assign(cpus, cpus + n); }
+
+    const std::vector<int>& affinity() const { return m_cpus; }
+
+    /* 由新线程在run()之前调用, 使之后的内存分配都落在本地NUMA节点上 */
+    int applyAffinity();
+
 protected:
     pthread_t m_id;   
+
+    std::vector<int>    m_cpus;
 };
 
 #endif
-
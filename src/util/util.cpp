@@ -1,6 +1,10 @@
 #include <sys/time.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
 
 #include "util.h"
 
@@ -98,3 +102,55 @@ std::string Util::trim(const std::string& str, const char chs[])
     return str.substr(start, end - start);
 }
 
+
+int Util::cpus()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+int Util::cpuNode(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    int node = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9')
+        {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+std::string Util::cpulist(const std::vector<int>& cpus)
+{
+    std::string str;
+
+    for (size_t i = 0; i < cpus.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+
+        if (!str.empty())
+            str += ",";
+        str += tostr(cpus[i]);
+        if (j > i)
+            str += "-" + tostr(cpus[j]);
+
+        i = j + 1;
+    }
+
+    return str.empty() ? "any" : str;
+}
@@ -22,6 +22,15 @@ public:
 
     template<class T>
     static std::string tostr(const T& d);
+
+    /* 在线的cpu个数 */
+    static int cpus();
+
+    /* cpu所在的NUMA节点, 没有NUMA信息时返回0 */
+    static int cpuNode(int cpu);
+
+    /* 把cpu列表格式化成"0-3,8"的形式 */
+    static std::string cpulist(const std::vector<int>& cpus);
 };
 
 template<class T>
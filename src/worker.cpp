@@ -8,29 +8,86 @@ int Worker::init(TinyRedisDB* db)
     if (!db)
         return -1;
 
-    int fd[2] = {-1, -1};
-    if (pipe(fd) != 0)
+    m_db = db;
+    m_redis = NULL;
+    m_listenFd = -1;
+    sem_init(&m_ready, 0, 0);
+    sem_init(&m_go, 0, 0);
+
+    return 0;
+}
+
+int Worker::start()
+{
+    int ret = ThreadBase::start();
+    if (ret != 0)
+        return ret;
+
+    //worker一个一个地启动, db->procs的注册仍然是串行的
+    while (sem_wait(&m_ready) != 0 && errno == EINTR)
+        ;
+
+    if (!m_redis)
     {
-        ELOG("pipe failed! errno: %d, error: %s", errno, strerror(errno));
+        ELOG("CreateTinyRedisProc failed!");
+        pthread_join(m_id, NULL);
         return -2;
     }
 
-    anetNonBlock(NULL, fd[0]);
-    anetNonBlock(NULL, fd[1]);
+    return 0;
+}
 
-    m_redis = CreateTinyRedisProc(db, fd[0], fd[1]);
-    if (!m_redis)
+void Worker::go()
+{
+    sem_post(&m_go);
+}
+
+int Worker::listen(char* bindaddr, int port)
+{
+    assert(m_redis);
+
+    char err[ANET_ERR_LEN] = {0};
+
+    int fd = anetTcpReusePortServer(err, port, bindaddr, 511);
+    if (fd == ANET_ERR)
     {
-        ELOG("CreateTinyRedisProc failed!");
-        return -3;
+        ELOG("listen failed! addr: %s, port: %d, error: %s", 
+                bindaddr, port, err);
+        return -1;
+    }
+    anetNonBlock(NULL, fd);
+
+    if (aeCreateFileEvent(m_redis->el, fd, AE_READABLE, acceptTcpHandler, m_redis) == AE_ERR)
+    {
+        ELOG("aeCreateFileEvent failed! fd: %d", fd);
+        close(fd);
+        return -2;
     }
+    m_listenFd = fd;
 
     return 0;
 }
 
+void Worker::unlisten()
+{
+    if (m_listenFd < 0)
+        return;
+
+    aeDeleteFileEvent(m_redis->el, m_listenFd, AE_READABLE);
+    close(m_listenFd);
+    m_listenFd = -1;
+}
+
 void Worker::run()
 {
-    assert(m_redis);
+    //已经在applyAffinity()之后
+    m_redis = CreateTinyRedisProc(m_db);
+    sem_post(&m_ready);
+    if (!m_redis)
+        return;
+
+    while (sem_wait(&m_go) != 0 && errno == EINTR)
+        ;
 
     aeMain(m_redis->el);
 }
@@ -1,6 +1,8 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
+#include <semaphore.h>
+
 #include "util/thread.h"
 
 #include "tiny-redis/anet.h"
@@ -11,6 +13,19 @@ class Worker : public ThreadBase
 public:
     int init(TinyRedisDB* db);
 
+    /* 启动线程, 等它绑核后在本线程里创建TinyRedisProc再返回,
+     * 这样proc, event loop和各种缓冲区都first-touch在worker的NUMA节点上.
+     * 之后event loop不跑, 直到go() */
+    virtual int start();
+
+    /* listen()/Listener::AddWorker()之后调用, 开始aeMain */
+    void go();
+
+    /* 在worker自己的event loop上监听(SO_REUSEPORT), 由内核分发连接 */
+    int listen(char* bindaddr, int port);
+
+    void unlisten();
+
     virtual void run();
 
     virtual void stop();
@@ -18,7 +33,12 @@ public:
     TinyRedisProc* redis() { return m_redis; }
 
 protected:
+    TinyRedisDB*        m_db;
     TinyRedisProc*      m_redis;
+    int                 m_listenFd;
+
+    sem_t               m_ready;    /* proc已创建(或失败) */
+    sem_t               m_go;
 };
 
 #endif
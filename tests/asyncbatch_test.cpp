@@ -0,0 +1,508 @@
+/* Batched async fills: ExecMongoBatch() against stubbed backends.
+ *
+ * This file defines the MongoCli and RedisCli methods that asynctask.o
+ * calls, and the test links it without mongo_cli.o and redis_cli.o. The
+ * redis stub answers EXISTS from a set of known uids and records every
+ * pipeline. The Mongo stub serves documents from memory and records every
+ * query. For a batch of keys of several uids, types and hash tags:
+ *
+ *  - the distinct uids are checked once, in one EXISTS pipeline
+ *  - the existing uids are fetched in one query, with the fields of all
+ *    the keys in one projection
+ *  - every key of an existing uid is stored in its slot with the value of
+ *    its own type and version, and nothing for an unknown uid or a bad key
+ *  - a failed batch query is retried one uid at a time, and only the keys
+ *    of the uid that still fails are not stored
+ *  - INFO reports the backend calls made against the keys served
+ *
+ * With async-fill-policy document, for random documents, every key a
+ * document fill stores must be the value the per-key fill stores for that
+ * key, and no other key may appear. A batch filling past maxmemory must not
+ * evict the keys it has just stored.
+ *
+ * ./tests/asyncbatch_test */
+
+#include <set>
+#include <map>
+
+#include "testhelp.h"
+#include "asynctask.h"
+
+#define DOC_UIDS 200
+#define EVICT_UIDS 64
+
+/* ------------------------------- Backends -------------------------------- */
+
+typedef struct mongoQuery {
+    std::vector<std::string> uids, fields;
+    bool json;
+} mongoQuery;
+
+static std::set<std::string> knownUids;         /* EXISTS says 1 */
+static std::map<std::string,UserDoc> store;     /* Mongo documents by _id */
+static std::string failingUid;                  /* Queries with it fail */
+static bool redisDown = false;
+static std::vector<std::vector<std::string> > pipelines;
+static std::vector<mongoQuery> queries;
+
+MongoCli::MongoCli(const string& url, const string& db, const string& collection) {
+    m_url = url;
+    m_dbName = db;
+    m_collectionName = collection;
+    m_client = NULL;
+    m_db = NULL;
+    m_collection = NULL;
+}
+
+MongoCli::~MongoCli() {}
+
+int MongoCli::init() {
+    return 0;
+}
+
+int MongoCli::query(const vector<string>& uids, const vector<string>& fields, bool json,
+                    map<string, UserDoc>& docs)
+{
+    mongoQuery q;
+    int found = 0;
+
+    q.uids = uids;
+    q.fields = fields;
+    q.json = json;
+    queries.push_back(q);
+    for (size_t j = 0; j < uids.size(); j++)
+        if (uids[j] == failingUid) return -3;
+    for (size_t j = 0; j < uids.size(); j++) {
+        std::map<std::string,UserDoc>::iterator it = store.find(uids[j]);
+
+        if (it == store.end()) continue;
+        docs[uids[j]] = it->second;
+        if (!json) docs[uids[j]].json.clear();
+        found++;
+    }
+    return found;
+}
+
+RedisCli::RedisCli(const string& ip, int port, int timeoutMs) {
+    m_ip = ip;
+    m_port = port;
+    m_timeoutMs = timeoutMs;
+    m_ctx = NULL;
+}
+
+RedisCli::~RedisCli() {}
+
+int RedisCli::init() {
+    return 0;
+}
+
+int RedisCli::exists(const vector<string>& keys, vector<int>& found) {
+    pipelines.push_back(keys);
+    found.assign(keys.size(), 0);
+    if (redisDown) return -3;
+    for (size_t j = 0; j < keys.size(); j++) found[j] = knownUids.count(keys[j]) ? 1 : 0;
+    return 0;
+}
+
+/* ExecMongoBatch() is protected, the backends are the stubs above */
+class testTask : public ASyncTask {
+public:
+    testTask() {
+        m_stop = 0;
+        m_mongoCli = new MongoCli("mongodb://stub", "ufs", "user");
+        m_redis = new RedisCli("stub", 0, 0);
+    }
+    void exec(const std::vector<std::string>& keys) {
+        std::vector<MissTask> batch(keys.size());
+
+        for (size_t j = 0; j < keys.size(); j++) {
+            batch[j].ms = 1;
+            batch[j].key = keys[j];
+            batch[j].slot = keyHashSlot(keys[j].data(), keys[j].size());
+        }
+        ExecMongoBatch(batch);
+    }
+};
+
+/* ------------------------------- Fixtures -------------------------------- */
+
+static std::vector<WeightedInfo> weighted(const char *key, double w) {
+    return std::vector<WeightedInfo>(1, WeightedInfo(key, w));
+}
+
+static void addDocument(const char *uid, int ts) {
+    UserDoc& doc = store[uid];
+    char json[256];
+
+    doc.categorys["v1"] = CategoryInfo("c", ts, weighted("sports", 0.5));
+    doc.categorys["v2"] = CategoryInfo("c", ts+1, weighted("news", 0.25));
+    doc.tags["t1"] = TagInfo("t", ts+2, weighted("nba", 1.5));
+    snprintf(json, sizeof(json), "{\"_id\":\"%s\",\"ts\":%d,"
+        "\"category_stat\":{\"sports\":{\"num\":2,\"sum\":1.5}},"
+        "\"tag_stat\":{\"nba\":{\"num\":1,\"sum\":1.5}}}", uid, ts);
+    doc.json = json;
+}
+
+static std::string weightedJson(int ts, const char *key, const char *w) {
+    char buf[128];
+
+    if (!key) snprintf(buf, sizeof(buf), "{\"ts\":%d,\"weighted\":[]}", ts);
+    else snprintf(buf, sizeof(buf), "{\"ts\":%d,\"weighted\":[{\"tag\":\"%s\",\"weight\":%s}]}",
+        ts, key, w);
+    return buf;
+}
+
+static std::string statJson(int ts, const char *name) {
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "{\"ts\":%d,\"data\":{\"%s\":{\"num\":%d,\"sum\":1.5}}}",
+        ts, name, strcmp(name, "sports") ? 1 : 2);
+    return buf;
+}
+
+static std::string get(testClient *tc, const std::string& key) {
+    const char *argv[2] = {"GET", key.c_str()};
+    std::vector<std::string> r;
+
+    testAppendArgv(tc, 2, argv, NULL);
+    testRun(tc);
+    if (testRead(tc, 1, &r) != 1) return "no reply";
+    return r[0];
+}
+
+static std::string joined(const std::vector<std::string>& v) {
+    std::string s;
+
+    for (size_t j = 0; j < v.size(); j++) s += (j ? "," : "") + v[j];
+    return s;
+}
+
+/* Up to 4 category and 3 tag versions of up to 3 weights, and either,
+ * both or none of the stat fields */
+static void addRandomDocument(const std::string& uid, unsigned *seed) {
+    UserDoc& doc = store[uid];
+    int ts = 1000+rand_r(seed)%1000, stats = rand_r(seed)%4, n, j, k;
+    char name[32];
+    std::string json;
+
+    for (n = rand_r(seed)%5, j = 0; j < n; j++) {
+        std::vector<WeightedInfo> w;
+
+        for (k = rand_r(seed)%4; k > 0; k--) {
+            snprintf(name, sizeof(name), "c%d", rand_r(seed)%100);
+            w.push_back(WeightedInfo(name, (double)rand_r(seed)/RAND_MAX));
+        }
+        snprintf(name, sizeof(name), "v%d", j);
+        doc.categorys[name] = CategoryInfo("c", ts+j, w);
+    }
+    for (n = rand_r(seed)%4, j = 0; j < n; j++) {
+        snprintf(name, sizeof(name), "t%d", j);
+        doc.tags[name] = TagInfo("t", ts+10+j, weighted("tag", rand_r(seed)%1000/8.0));
+    }
+
+    snprintf(name, sizeof(name), "%d", ts);
+    json = "{\"_id\":\"" + uid + "\",\"ts\":" + name;
+    if (stats & 1) json += ",\"category_stat\":{\"c1\":{\"num\":3,\"sum\":0.75}}";
+    if (stats & 2) json += ",\"tag_stat\":{\"tag\":{\"num\":1,\"sum\":2}}";
+    doc.json = json + "}";
+}
+
+/* Every key the document of 'uid' holds, named with 'tok' */
+static std::vector<std::string> documentKeys(const std::string& tok, const std::string& uid) {
+    UserDoc& doc = store[uid];
+    std::vector<std::string> keys;
+
+    for (std::map<std::string,CategoryInfo>::iterator it = doc.categorys.begin();
+         it != doc.categorys.end(); ++it)
+        keys.push_back("category&&" + tok + "&&" + it->first);
+    for (std::map<std::string,TagInfo>::iterator it = doc.tags.begin(); it != doc.tags.end(); ++it)
+        keys.push_back("tag&&" + tok + "&&" + it->first);
+    if (doc.json.find("category_stat") != std::string::npos) keys.push_back("category_stat&&" + tok);
+    if (doc.json.find("tag_stat") != std::string::npos) keys.push_back("tag_stat&&" + tok);
+    return keys;
+}
+
+static long long dbKeys(void) {
+    long long n = 0;
+
+    for (int j = 0; j < g_redisDB->dbnum; j++) n += dictSize(g_redisDB->db[j].d);
+    return n;
+}
+
+static int hasKey(const std::string& key) {
+    redisDb *db = &g_redisDB->db[keyHashSlot(key.data(), key.size())];
+    sds k = sdsnewlen(key.data(), key.size());
+    int found = dictFind(db->d, k) != NULL;
+
+    sdsfree(k);
+    return found;
+}
+
+static void del(testClient *tc, const std::string& key) {
+    const char *argv[2] = {"DEL", key.c_str()};
+
+    testAppendArgv(tc, 2, argv, NULL);
+    testRun(tc);
+    CHECK(testRead(tc, 1, NULL) == 1, "DEL %s did not reply", key.c_str());
+}
+
+/* -------------------------------- Checks --------------------------------- */
+
+static void checkGrouping(testTask *task, testClient *tc) {
+    std::vector<std::string> keys;
+    long long ekeys = g_redisDB->stat_async_exists_keys;
+    long long ecalls = g_redisDB->stat_async_exists_calls;
+    long long mqueries = g_redisDB->stat_async_mongo_queries;
+    long long mkeys = g_redisDB->stat_async_mongo_keys;
+    long long filled = g_redisDB->stat_async_filled;
+    std::map<std::string,std::string> expect;
+    std::string fields;
+
+    expect["category&&u1&&v1"] = weightedJson(100, "sports", "0.5");
+    expect["tag&&u1&&t1"] = weightedJson(102, "nba", "1.5");
+    expect["category&&u1&&nov"] = weightedJson(0, NULL, NULL);
+    expect["category_stat&&u1"] = statJson(100, "sports");
+    expect["tag_stat&&{u2}"] = statJson(200, "nba");
+    expect["category&&{u2}&&v2"] = weightedJson(201, "news", "0.25");
+    expect["tag&&u4&&t1"] = weightedJson(0, NULL, NULL);
+    expect["category_stat&&u4"] = "{}";
+    for (std::map<std::string,std::string>::iterator it = expect.begin(); it != expect.end(); ++it)
+        keys.push_back(it->first);
+    keys.push_back("category&&u3&&v1");
+    keys.push_back("junk");
+    keys.push_back("category&&u1&&bad.version");
+
+    pipelines.clear();
+    queries.clear();
+    task->exec(keys);
+
+    CHECK(pipelines.size() == 1, "%zu EXISTS pipelines for one batch", pipelines.size());
+    if (pipelines.size() == 1) {
+        std::set<std::string> uids(pipelines[0].begin(), pipelines[0].end());
+
+        CHECK(pipelines[0].size() == 4 && uids.size() == 4 && uids.count("u1") &&
+            uids.count("u2") && uids.count("u3") && uids.count("u4"),
+            "EXISTS of %s, want u1,u2,u3,u4 once each", joined(pipelines[0]).c_str());
+    }
+
+    CHECK(queries.size() == 1, "%zu Mongo queries for one batch", queries.size());
+    if (queries.size() == 1) {
+        std::set<std::string> uids(queries[0].uids.begin(), queries[0].uids.end());
+
+        fields = joined(queries[0].fields);
+        CHECK(queries[0].uids.size() == 3 && uids.count("u1") && uids.count("u2") &&
+            uids.count("u4"), "query of %s, want u1,u2,u4", joined(queries[0].uids).c_str());
+        CHECK(fields == "category.nov,category.v1,category.v2,category_stat,tag.t1,tag_stat,ts",
+            "projection %s", fields.c_str());
+        CHECK(queries[0].json, "stat keys in the batch but no json asked");
+    }
+
+    for (std::map<std::string,std::string>::iterator it = expect.begin(); it != expect.end(); ++it) {
+        std::string r = get(tc, it->first);
+
+        CHECK(r == testBulk(it->second.c_str()), "%s: %s, want %s", it->first.c_str(),
+            r.c_str(), it->second.c_str());
+    }
+    CHECK(get(tc, "category&&u3&&v1") == TEST_NIL, "key of an unknown uid stored");
+    CHECK(get(tc, "category&&u1&&bad.version") == TEST_NIL, "key with a bad version stored");
+
+    CHECK(g_redisDB->stat_async_exists_keys == ekeys+9 &&
+        g_redisDB->stat_async_exists_calls == ecalls+1,
+        "uid check counted %lld keys in %lld calls", g_redisDB->stat_async_exists_keys-ekeys,
+        g_redisDB->stat_async_exists_calls-ecalls);
+    CHECK(g_redisDB->stat_async_mongo_queries == mqueries+1 &&
+        g_redisDB->stat_async_mongo_keys == mkeys+8,
+        "Mongo counted %lld keys in %lld queries", g_redisDB->stat_async_mongo_keys-mkeys,
+        g_redisDB->stat_async_mongo_queries-mqueries);
+    CHECK(g_redisDB->stat_async_filled == filled+8, "%lld keys filled",
+        g_redisDB->stat_async_filled-filled);
+    printf("[ok] %zu keys of 4 uids: 1 EXISTS pipeline, 1 query, every key of its own type\n",
+        keys.size());
+}
+
+static void checkFailedQuery(testTask *task, testClient *tc) {
+    std::vector<std::string> keys;
+    long long mqueries = g_redisDB->stat_async_mongo_queries;
+
+    knownUids.insert("u5");
+    knownUids.insert("u6");
+    addDocument("u5", 500);
+    addDocument("u6", 600);
+    failingUid = "u6";
+    keys.push_back("category&&u5&&v1");
+    keys.push_back("tag&&u6&&t1");
+    keys.push_back("category&&u1&&v2");
+
+    queries.clear();
+    task->exec(keys);
+    failingUid.clear();
+
+    CHECK(queries.size() == 4, "%zu queries, want the batch and one per uid", queries.size());
+    for (size_t j = 1; j < queries.size(); j++) {
+        std::string fields = joined(queries[j].fields);
+
+        CHECK(queries[j].uids.size() == 1, "retry %zu of %zu uids", j, queries[j].uids.size());
+        CHECK(queries[j].uids[0] != "u5" || fields == "category.v1",
+            "retry of u5 projects %s", fields.c_str());
+    }
+    CHECK(g_redisDB->stat_async_mongo_queries == mqueries+4, "%lld queries counted",
+        g_redisDB->stat_async_mongo_queries-mqueries);
+    CHECK(get(tc, "category&&u5&&v1") == testBulk(weightedJson(500, "sports", "0.5").c_str()),
+        "u5 not filled after the retry");
+    CHECK(get(tc, "category&&u1&&v2") == testBulk(weightedJson(101, "news", "0.25").c_str()),
+        "u1 not filled after the retry");
+    CHECK(get(tc, "tag&&u6&&t1") == TEST_NIL, "key of the failing uid stored");
+    printf("[ok] a failed batch query is retried per uid, the other uids are filled\n");
+}
+
+static void checkRedisDown(testTask *task, testClient *tc) {
+    std::vector<std::string> keys;
+
+    redisDown = true;
+    keys.push_back("category&&u1&&v1x");
+    keys.push_back("tag&&u2&&t1");
+    pipelines.clear();
+    queries.clear();
+    task->exec(keys);
+    redisDown = false;
+
+    CHECK(pipelines.size() == 1 && queries.empty(), "%zu pipelines, %zu queries with redis down",
+        pipelines.size(), queries.size());
+    CHECK(get(tc, "tag&&u2&&t1") == TEST_NIL, "filled without the uid check");
+    printf("[ok] without the uid check nothing is queried or filled\n");
+}
+
+/* The keys a document fill stores against the per-key fill of each */
+static void checkDocumentFill(testTask *task, testClient *tc) {
+    std::vector<std::string> misses, keys;
+    std::set<std::string> all;
+    std::map<std::string,std::string> byDocument;
+    long long before = dbKeys(), prefilled = g_redisDB->stat_async_prefilled;
+    unsigned seed = 1;
+    size_t j, diff = 0;
+    char uid[32], tok[32];
+
+    for (j = 0; j < DOC_UIDS; j++) {
+        snprintf(uid, sizeof(uid), "d%zu", j);
+        snprintf(tok, sizeof(tok), j % 2 ? "{d%zu}" : "d%zu", j);
+        knownUids.insert(uid);
+        addRandomDocument(uid, &seed);
+
+        std::vector<std::string> derived = documentKeys(tok, uid);
+        /* A key of the document, or one it does not have */
+        misses.push_back(derived.size() && j % 3 ? derived[rand_r(&seed) % derived.size()] :
+            std::string("category&&") + tok + "&&nov");
+        all.insert(derived.begin(), derived.end());
+        all.insert(misses.back());
+    }
+    keys.assign(all.begin(), all.end());
+
+    /* A value a client wrote is not overwritten by a sibling */
+    CHECK(testCommand(tc, "SET tag&&d0&&t0 client") == TEST_OK, "SET of a sibling");
+
+    g_redisDB->async_fill_policy = ASYNC_FILL_DOCUMENT;
+    task->exec(misses);
+    g_redisDB->async_fill_policy = ASYNC_FILL_KEY;
+
+    CHECK(dbKeys()-before == (long long)keys.size() + !all.count("tag&&d0&&t0"),
+        "document fill stored %lld keys, the documents hold %zu", dbKeys()-before, keys.size());
+    CHECK(g_redisDB->stat_async_prefilled-prefilled ==
+        (long long)(keys.size()-misses.size()-all.count("tag&&d0&&t0")), "%lld siblings counted", g_redisDB->stat_async_prefilled-prefilled);
+    if (all.count("tag&&d0&&t0"))
+        CHECK(get(tc, "tag&&d0&&t0") == testBulk("client"), "sibling overwrote a client value");
+    del(tc, "tag&&d0&&t0");
+
+    for (j = 0; j < keys.size(); j++) {
+        byDocument[keys[j]] = get(tc, keys[j]);
+        del(tc, keys[j]);
+    }
+
+    for (j = 0; j < keys.size(); j++) {
+        std::string r;
+
+        task->exec(std::vector<std::string>(1, keys[j]));
+        r = get(tc, keys[j]);
+        if (keys[j] == "tag&&d0&&t0") continue;
+        if (r != byDocument[keys[j]] && diff++ < 5)
+            CHECK(0, "%s: document fill %s, per-key fill %s", keys[j].c_str(),
+                byDocument[keys[j]].c_str(), r.c_str());
+    }
+    CHECK(diff == 0, "%zu of %zu keys differ", diff, keys.size());
+    printf("[ok] %d random documents: %zu keys, each as the per-key fill stores it\n",
+        DOC_UIDS, keys.size());
+}
+
+/* Going over maxmemory halfway through a batch evicts none of its keys */
+static void checkBatchEviction(testTask *task) {
+    std::vector<std::string> misses, keys;
+    long long evicted = g_redisDB->stat_evictedkeys;
+    unsigned long long limit;
+    size_t j, present = 0;
+    char uid[32];
+
+    for (j = 0; j < EVICT_UIDS; j++) {
+        snprintf(uid, sizeof(uid), "e%zu", j);
+        knownUids.insert(uid);
+        addDocument(uid, 700);
+        misses.push_back(std::string("tag&&") + uid + "&&t1");
+        std::vector<std::string> derived = documentKeys(uid, uid);
+        keys.insert(keys.end(), derived.begin(), derived.end());
+    }
+
+    /* The batch stores some 100 bytes per key, the limit is hit early */
+    limit = zmalloc_used_memory()+4096;
+    g_redisDB->maxmemory = limit;
+    g_redisDB->maxmemory_policy = MAXMEMORY_ALLKEYS_LRU;
+    g_redisDB->async_fill_policy = ASYNC_FILL_DOCUMENT;
+    task->exec(misses);
+    g_redisDB->async_fill_policy = ASYNC_FILL_KEY;
+    g_redisDB->maxmemory = 0;
+
+    for (j = 0; j < keys.size(); j++) present += hasKey(keys[j]);
+    CHECK(zmalloc_used_memory() > limit, "the batch stayed under maxmemory");
+    CHECK(present == keys.size(), "%zu of the %zu keys of the batch left", present, keys.size());
+    CHECK(g_redisDB->stat_evictedkeys == evicted, "%lld keys evicted during the batch",
+        g_redisDB->stat_evictedkeys-evicted);
+    printf("[ok] a batch going over maxmemory keeps the %zu keys it stored\n", keys.size());
+}
+
+static void checkInfo(testClient *tc) {
+    std::string info = testCommand(tc, "INFO async_loader");
+    long long ekeys = g_redisDB->stat_async_exists_keys;
+    long long calls = g_redisDB->stat_async_exists_calls+g_redisDB->stat_async_mongo_queries;
+    char line[128];
+
+    snprintf(line, sizeof(line), "async_backend_calls:%lld\r\n", calls);
+    CHECK(info.find(line) != std::string::npos, "INFO lacks %s", line);
+    snprintf(line, sizeof(line), "async_keys_per_backend_call:%.2f\r\n", (double)ekeys/calls);
+    CHECK(info.find(line) != std::string::npos, "INFO lacks %s", line);
+    CHECK(info.find("roundtrips_saved") == std::string::npos, "INFO still models the savings");
+    printf("[ok] INFO: %lld keys served by %lld backend calls\n", ekeys, calls);
+}
+
+int main(int argc, char **argv) {
+    testClient *tc;
+    testTask *task;
+
+    testCreateServer(NULL);
+    tc = testConnect(CreateTinyRedisProc(g_redisDB));
+    task = new testTask;
+
+    knownUids.insert("u1");
+    knownUids.insert("u2");
+    knownUids.insert("u4");
+    addDocument("u1", 100);
+    addDocument("u2", 200);
+
+    /* First, while the batch's keys are the only ones to evict */
+    checkBatchEviction(task);
+    checkGrouping(task, tc);
+    checkFailedQuery(task, tc);
+    checkRedisDown(task, tc);
+    checkDocumentFill(task, tc);
+    checkInfo(tc);
+
+    delete task;
+    testDisconnect(tc);
+    return testReport();
+}
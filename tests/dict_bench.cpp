@@ -0,0 +1,242 @@
+/* Keyspace table layouts: the chained dict against open addressing.
+ *
+ * chained   dict.cpp as used for redisDb::d: a bucket array of pointers
+ *           to separately allocated dictEntry nodes.
+ * swiss     open addressing over the same dictEntry nodes, one control
+ *           byte per slot holding a 7-bit hash tag, 16 control bytes
+ *           compared at once, load kept under 7/8. This is the layout
+ *           that was tried for the keyspace and dropped.
+ * inline    the same probing with the key pointer, expire, value and
+ *           expire index links stored in the slot, no dictEntry at all.
+ *           One dependent miss less per lookup, but an entry moves on
+ *           every resize.
+ *
+ * For each layout: lookups/s of random existing keys, table bytes/key and
+ * total bytes/key (table and entries from zmalloc_used_memory, the sds
+ * keys shown apart). Only lookups are timed, the probing tables are
+ * insert only.
+ *
+ * ./tests/dict_bench [bench [max keys]]: 'make test' runs 100K keys,
+ * 'make bench' 1M, 10M and 100M (sizes that do not fit in the physical
+ * memory are skipped). */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "testhelp.h"
+
+#define GROUP 16
+#define CTRL_EMPTY 0x80
+
+static unsigned int keyHash(const void *key) {
+    return dictGenHashFunction(key, sdslen((sds)key));
+}
+
+static int keyCompare(void *privdata, const void *key1, const void *key2) {
+    return sdslen((sds)key1) == sdslen((sds)key2) &&
+        memcmp(key1, key2, sdslen((sds)key1)) == 0;
+}
+
+/* The keys belong to the benchmark, not to the dicts */
+static dictType benchDictType = {keyHash, NULL, NULL, keyCompare, NULL, NULL};
+
+/* --------------------------- Probing tables ------------------------------ */
+
+/* The keyspace needs the expire index links in every slot as well */
+typedef struct inlineSlot {
+    sds key;
+    int64_t expire;
+    void *val;
+    struct inlineSlot *wheel_next;
+    struct inlineSlot **wheel_pprev;
+} inlineSlot;
+
+typedef struct probeTable {
+    unsigned long size, mask, used;
+    uint8_t *ctrl;          /* size+GROUP, the first group mirrored at the end */
+    dictEntry **entries;    /* swiss */
+    inlineSlot *slots;      /* inline */
+} probeTable;
+
+/* Smallest power of two keeping 'n' under 7/8 of the slots */
+static unsigned long probeSize(unsigned long n) {
+    unsigned long size = GROUP;
+
+    while (n > size/8*7) size <<= 1;
+    return size;
+}
+
+static size_t probeTableBytes(probeTable *t) {
+    return t->size+GROUP + t->size*(t->entries ? sizeof(dictEntry*) : sizeof(inlineSlot));
+}
+
+static void probeInit(probeTable *t, unsigned long n, int inl) {
+    t->size = probeSize(n);
+    t->mask = t->size-1;
+    t->used = 0;
+    t->ctrl = (uint8_t*)zmalloc(t->size+GROUP);
+    memset(t->ctrl, CTRL_EMPTY, t->size+GROUP);
+    t->entries = inl ? NULL : (dictEntry**)zcalloc(t->size*sizeof(dictEntry*));
+    t->slots = inl ? (inlineSlot*)zcalloc(t->size*sizeof(inlineSlot)) : NULL;
+}
+
+static void probeFree(probeTable *t) {
+    zfree(t->ctrl);
+    zfree(t->entries);
+    zfree(t->slots);
+}
+
+/* Bit i set if ctrl[pos+i] == tag */
+static unsigned matchGroup(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+    unsigned m = 0;
+    int i;
+
+    for (i = 0; i < GROUP; i++) if (ctrl[i] == tag) m |= 1u << i;
+    return m;
+#endif
+}
+
+static void probeInsert(probeTable *t, sds key, dictEntry *de) {
+    unsigned int h = keyHash(key);
+    unsigned long pos = h & t->mask, step = 0;
+    uint8_t tag = (h >> 25) & 0x7f;
+
+    for (;;) {
+        unsigned m = matchGroup(t->ctrl+pos, CTRL_EMPTY);
+        if (m) {
+            unsigned long i = (pos + __builtin_ctz(m)) & t->mask;
+            t->ctrl[i] = tag;
+            if (i < GROUP) t->ctrl[t->size+i] = tag;
+            if (t->entries) {
+                t->entries[i] = de;
+            } else {
+                t->slots[i].key = key;
+                t->slots[i].expire = 0;
+                t->slots[i].val = key;
+                t->slots[i].wheel_next = NULL;
+                t->slots[i].wheel_pprev = NULL;
+            }
+            t->used++;
+            return;
+        }
+        step += GROUP;
+        pos = (pos + step) & t->mask;
+    }
+}
+
+static void *probeFind(probeTable *t, sds key) {
+    unsigned int h = keyHash(key);
+    unsigned long pos = h & t->mask, step = 0;
+    uint8_t tag = (h >> 25) & 0x7f;
+
+    for (;;) {
+        unsigned m = matchGroup(t->ctrl+pos, tag);
+        while (m) {
+            unsigned long i = (pos + __builtin_ctz(m)) & t->mask;
+            if (t->entries) {
+                if (keyCompare(NULL, t->entries[i]->key, key)) return t->entries[i];
+            } else {
+                if (keyCompare(NULL, t->slots[i].key, key)) return &t->slots[i];
+            }
+            m &= m-1;
+        }
+        if (matchGroup(t->ctrl+pos, CTRL_EMPTY)) return NULL;
+        step += GROUP;
+        pos = (pos + step) & t->mask;
+    }
+}
+
+/* -------------------------------- Runs ----------------------------------- */
+
+static void runSize(long n, long lookups) {
+    std::vector<sds> keys(n), probes(lookups);
+    size_t base, keybytes, entrybytes, bytes[3], table[3];
+    double rate[3];
+    const char *names[3] = {"chained", "swiss", "inline"};
+    probeTable pt[2];
+    dict *d;
+    unsigned seed = 7;
+    long i, found;
+    int l;
+
+    base = zmalloc_used_memory();
+    for (i = 0; i < n; i++) keys[i] = sdscatprintf(sdsempty(), "user:%ld:profile", i);
+    keybytes = zmalloc_used_memory()-base;
+    /* The probe keys are copies, as a lookup gets them from a client */
+    for (i = 0; i < lookups; i++) probes[i] = sdsdup(keys[rand_r(&seed) % n]);
+
+    base = zmalloc_used_memory();
+    d = dictCreate(&benchDictType, NULL);
+    for (i = 0; i < n; i++) dictAddRaw(d, keys[i]);
+    while (dictIsRehashing(d)) dictRehash(d, 1000);
+    bytes[0] = zmalloc_used_memory()-base;
+    table[0] = d->ht[0].size*sizeof(dictEntry*);
+    entrybytes = bytes[0]-table[0];
+
+    for (l = 0; l < 2; l++) {
+        base = zmalloc_used_memory();
+        probeInit(&pt[l], n, l);
+        for (i = 0; i < n; i++) {
+            dictEntry *de = l ? NULL : dictFind(d, keys[i]);
+            probeInsert(&pt[l], keys[i], de);
+        }
+        table[l+1] = probeTableBytes(&pt[l]);
+        bytes[l+1] = zmalloc_used_memory()-base + (l ? 0 : entrybytes);
+    }
+
+    for (l = 0; l < 3; l++) {
+        long long start = testUs();
+
+        found = 0;
+        for (i = 0; i < lookups; i++) {
+            void *r = l == 0 ? (void*)dictFind(d, probes[i]) : probeFind(&pt[l-1], probes[i]);
+            if (r) found++;
+        }
+        rate[l] = lookups*1e6/(testUs()-start);
+        CHECK(found == lookups, "%s found %ld of %ld keys", names[l], found, lookups);
+    }
+
+    /* Misses end at the first group with an empty slot */
+    for (l = 0; l < 2; l++) {
+        sds miss = sdsnew("user:missing:profile");
+        CHECK(probeFind(&pt[l], miss) == NULL, "%s found a missing key", names[l+1]);
+        sdsfree(miss);
+    }
+
+    for (l = 0; l < 3; l++) {
+        printf("[ok] %9ld keys %-7s %6.2fM lookups/s, table %5.1f B/key, "
+            "total %6.1f B/key (+%.1f sds)\n", n, names[l], rate[l]/1e6,
+            (double)table[l]/n, (double)bytes[l]/n, (double)keybytes/n);
+    }
+
+    probeFree(&pt[0]);
+    probeFree(&pt[1]);
+    dictRelease(d);
+    for (i = 0; i < n; i++) sdsfree(keys[i]);
+    for (i = 0; i < lookups; i++) sdsfree(probes[i]);
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    long max = bench ? (argc > 2 ? atol(argv[2]) : 100000000) : 100000;
+    long long mem = (long long)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+    long n;
+
+    zmalloc_enable_thread_safeness();
+    dictSetHashFunctionSeed(5381);
+
+    for (n = bench ? 1000000 : max; n <= max; n *= 10) {
+        /* About 200 bytes per key across the three layouts at once */
+        if ((long long)n*200 > mem) {
+            printf("[..] %ld keys skipped, needs about %lld MB\n", n, (long long)n*200>>20);
+            continue;
+        }
+        runSize(n, n < 10000000 ? n : 10000000);
+    }
+    return testReport();
+}
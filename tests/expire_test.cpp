@@ -0,0 +1,310 @@
+/* Expire index: the per-slot hierarchical timing wheel.
+ *
+ * Ordering: entries with random expires, from now to past the top level,
+ * are filed in a wheel while some are moved and deleted. The time then
+ * advances in random steps and twExpire() is drained with random batch
+ * sizes. Every entry must be handed out once, never before its expire and
+ * never later than the first drain after the end of its tick; moved
+ * entries at their last expire, deleted ones not at all.
+ *
+ * Maintenance: SET with and without a TTL, overwrite, DEL and EXPIRE go
+ * through the command path, then the slot's wheel must hold exactly the
+ * keys with a TTL, in expire order. Keys set with a short TTL must be
+ * removed by activeExpireCycle().
+ *
+ * Cost: memory of the index per key and the sweep cost per due key,
+ * against the O(keyspace) scan it replaces.
+ *
+ * ./tests/expire_test [bench [keys]] */
+
+#include "testhelp.h"
+
+#define DAY_MS (24LL*3600*1000)
+
+static unsigned int intHash(const void *key) {
+    uint64_t k = (uint64_t)(uintptr_t)key;
+
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (unsigned int)k;
+}
+
+/* Keys are integers stored in the key pointer */
+static dictType intDictType = {intHash, NULL, NULL, NULL, NULL, NULL};
+
+/* ----------------------------- Ordering ---------------------------------- */
+
+typedef struct sweepState {
+    dict *d;
+    long long now;          /* nowms of the running drain */
+    long long drained;      /* nowms of the last complete drain */
+    std::vector<long long> *expire; /* By key, 0 if not in the wheel */
+    std::vector<char> *handed;
+    long long count;
+} sweepState;
+
+static void sweepCallback(void *privdata, dictEntry *de) {
+    sweepState *st = (sweepState*)privdata;
+    long key = (long)(uintptr_t)dictGetKey(de);
+    long long when = dictGetExpire(de);
+
+    CHECK((*st->expire)[key] == when, "key %ld handed with expire %lld, set %lld",
+        key, when, (*st->expire)[key]);
+    CHECK(when <= st->now, "key %ld handed at %lld before its expire %lld",
+        key, st->now, when);
+    /* Handed out at the end of its tick at the latest */
+    CHECK((when+TW_TICK_MS-1)/TW_TICK_MS*TW_TICK_MS > st->drained,
+        "key %ld due at %lld missed by the drain at %lld", key, when, st->drained);
+    CHECK(!(*st->handed)[key], "key %ld handed twice", key);
+    (*st->handed)[key] = 1;
+    st->count++;
+    dictDeleteEntry(st->d, de);
+}
+
+static void testOrdering(long n, unsigned seed) {
+    /* Virtual time, a year ahead: a rehash step frees the entries that
+     * are expired in real time */
+    long long base = mstime() + 365*DAY_MS;
+    dict *d = dictCreate(&intDictType, NULL);
+    timeWheel *tw = twCreate(base);
+    std::vector<long long> expire(n+1, 0);
+    std::vector<char> handed(n+1, 0);
+    std::vector<dictEntry*> entries(n+1, NULL);
+    long long expected = 0, horizon = 0;
+    sweepState st;
+    long key;
+
+    for (key = 1; key <= n; key++) {
+        dictEntry *de = dictAddRaw(d, (void*)(uintptr_t)key);
+        long long r = rand_r(&seed);
+        long long when;
+
+        /* Mostly within the lower levels, some parked past the top one */
+        switch (r % 4) {
+        case 0: when = base + r % 40000; break;
+        case 1: when = base + r % (2*3600*1000); break;
+        case 2: when = base + r % (3*DAY_MS); break;
+        default: when = base + r % (40*DAY_MS); break;
+        }
+        dictSetExpireAt(d, de, when);
+        twAdd(tw, de);
+        expire[key] = when;
+        entries[key] = de;
+    }
+
+    /* Move and delete some of them */
+    for (key = 1; key <= n; key += 7) {
+        if (key % 2) {
+            long long when = base + rand_r(&seed) % (20*DAY_MS);
+            dictSetExpireAt(d, entries[key], when);
+            twAdd(tw, entries[key]);
+            expire[key] = when;
+        } else {
+            dictDeleteEntry(d, entries[key]);
+            expire[key] = 0;
+        }
+    }
+    CHECK(dictExpires(d) == dictSize(d), "expires %lu of %lu entries",
+        dictExpires(d), dictSize(d));
+    for (key = 1; key <= n; key++) {
+        if (expire[key]) expected++;
+        if (expire[key] > horizon) horizon = expire[key];
+    }
+
+    st.d = d;
+    st.now = base;
+    st.drained = base-1;
+    st.expire = &expire;
+    st.handed = &handed;
+    st.count = 0;
+    while (st.now <= horizon + TW_TICK_MS) {
+        unsigned long max = 1 + rand_r(&seed) % 64;
+
+        st.now += 1 + rand_r(&seed) % 20000;
+        while (twExpire(tw, st.now, max, sweepCallback, &st) == max);
+        st.drained = st.now;
+    }
+
+    CHECK(st.count == expected, "handed %lld of %lld entries", st.count, expected);
+    CHECK(dictSize(d) == 0, "%lu entries left in the dict", dictSize(d));
+    for (key = 1; key <= n; key++) {
+        if (expire[key] && !handed[key]) {
+            CHECK(0, "key %ld with expire %lld never handed", key, expire[key]);
+            break;
+        }
+    }
+    twRelease(tw);
+    dictRelease(d);
+    printf("[ok] wheel ordering, %ld entries over 40 days, %lld handed out\n", n, expected);
+}
+
+/* ---------------------------- Maintenance -------------------------------- */
+
+/* Bucket twAdd() files an expire in, while tw->cur did not move */
+static dictEntry **expectedBucket(timeWheel *tw, long long expire) {
+    long long t = (expire + TW_TICK_MS - 1) / TW_TICK_MS, delta;
+    int level;
+
+    if (t < tw->cur) t = tw->cur;
+    delta = t - tw->cur;
+    for (level = 0; level < TW_LEVELS-1; level++)
+        if (delta < (1LL << (TW_BITS*(level+1)))) break;
+    if (delta >= (1LL << (TW_BITS*TW_LEVELS)))
+        t = tw->cur + (1LL << (TW_BITS*TW_LEVELS)) - 1;
+    return &tw->buckets[level][(t >> (TW_BITS*level)) & TW_MASK];
+}
+
+/* Keys indexed in the wheel, in expire order. Each one must be in the
+ * bucket of its current expire. */
+static std::vector<std::string> wheelKeys(timeWheel *tw) {
+    std::vector<std::pair<long long,std::string> > found;
+    std::vector<std::string> keys;
+    int level, j;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (j = 0; j < TW_SLOTS; j++) {
+            dictEntry *de;
+            for (de = tw->buckets[level][j]; de; de = de->wheel_next) {
+                CHECK(expectedBucket(tw, dictGetExpire(de)) == &tw->buckets[level][j],
+                    "%s filed in level %d bucket %d, not at its expire",
+                    (sds)dictGetKey(de), level, j);
+                found.push_back(std::make_pair((long long)dictGetExpire(de),
+                    std::string((sds)dictGetKey(de))));
+            }
+        }
+    }
+    std::sort(found.begin(), found.end());
+    for (j = 0; j < (int)found.size(); j++) keys.push_back(found[j].second);
+    return keys;
+}
+
+static void testMaintenance(TinyRedisProc *proc) {
+    testClient *tc = testConnect(proc);
+    int slot = keyHashSlot("{wheel}", 7);
+    redisDb *db = &g_redisDB->db[slot];
+    std::vector<std::string> keys;
+    long long expired, start;
+    int j;
+
+    CHECK(testCommand(tc, "SET a{wheel} v PX 50000") == TEST_OK, "SET PX");
+    CHECK(testCommand(tc, "SET b{wheel} v PX 60000") == TEST_OK, "SET PX");
+    CHECK(testCommand(tc, "SET c{wheel} v PX 70000") == TEST_OK, "SET PX");
+    /* As dictReplace() always did, an overwrite without a TTL keeps it */
+    CHECK(testCommand(tc, "SET b{wheel} v2") == TEST_OK, "overwrite without TTL");
+    CHECK(testCommand(tc, "DEL c{wheel}") == ":1\r\n", "DEL");
+    CHECK(testCommand(tc, "SET d{wheel} v") == TEST_OK, "SET");
+    CHECK(testCommand(tc, "EXPIRE d{wheel} 100") == ":1\r\n", "EXPIRE");
+    CHECK(testCommand(tc, "SET e{wheel} v EX 200") == TEST_OK, "SET EX");
+    CHECK(testCommand(tc, "SET e{wheel} v2 EX 10") == TEST_OK, "SET EX again");
+    CHECK(dictExpires(db->d) == 4, "%lu keys with an expire, want 4", dictExpires(db->d));
+
+    dbWriteLock(db);
+    keys = wheelKeys(db->wheel);
+    dbWriteUnlock(db);
+    CHECK(keys.size() == 4 && keys[0] == "e{wheel}" && keys[1] == "a{wheel}" &&
+        keys[2] == "b{wheel}" && keys[3] == "d{wheel}",
+        "wheel holds %zu keys, want e a b d", keys.size());
+
+    /* Real time. Not due while they are set: a rehash step run by the
+     * next SET would drop them without the active expire */
+    for (j = 0; j < 100; j++) {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "SET short:%d{wheel} v PX 1000", j);
+        testCommand(tc, cmd);
+    }
+    expired = g_redisDB->stat_expiredkeys;
+    start = mstime();
+    while (g_redisDB->stat_expiredkeys - expired < 100 && mstime()-start < 6000) {
+        usleep(10000);
+        activeExpireCycle(proc);
+    }
+    CHECK(g_redisDB->stat_expiredkeys - expired == 100, "%lld of 100 short TTL keys expired",
+        g_redisDB->stat_expiredkeys - expired);
+    CHECK(dictSize(db->d) == 4 && dictExpires(db->d) == 4,
+        "slot left with %lu keys, %lu with an expire", dictSize(db->d), dictExpires(db->d));
+    printf("[ok] wheel follows SET/overwrite/DEL/EXPIRE, active expire in %lld ms\n",
+        mstime()-start);
+    testDisconnect(tc);
+}
+
+/* -------------------------------- Cost ----------------------------------- */
+
+static void scanCallback(void *privdata, const dictEntry *de) {
+    long long *due = (long long*)privdata;
+
+    if (dictGetExpire(de) > 0 && dictGetExpire(de) <= due[0]) due[1]++;
+}
+
+static void countCallback(void *privdata, dictEntry *de) {
+    (*(long long*)privdata)++;
+}
+
+static void measureCost(long n) {
+    long long base = (mstime() + 365*DAY_MS) / TW_TICK_MS * TW_TICK_MS, now;
+    size_t used0, used1, used2;
+    dict *d;
+    timeWheel *tw;
+    long long start, add_us, sweep_us = 0, scan_us, due[2] = {0, 0}, handed = 0;
+    unsigned long cursor = 0;
+    unsigned seed = 1;
+    long key;
+    int ticks = 1000, t;
+
+    used0 = zmalloc_used_memory();
+    d = dictCreate(&intDictType, NULL);
+    for (key = 1; key <= n; key++) dictAddRaw(d, (void*)(uintptr_t)key);
+    used1 = zmalloc_used_memory();
+
+    tw = twCreate(base);
+    start = testUs();
+    for (key = 1; key <= n; key++) {
+        dictEntry *de = dictFind(d, (void*)(uintptr_t)key);
+        dictSetExpireAt(d, de, base + 1 + rand_r(&seed) % ((long long)ticks*TW_TICK_MS));
+        twAdd(tw, de);
+    }
+    add_us = testUs()-start;
+    used2 = zmalloc_used_memory();
+
+    /* One scan of the keyspace looking for due keys, what a sweep without
+     * the index costs per cycle */
+    due[0] = base + TW_TICK_MS;
+    start = testUs();
+    do {
+        cursor = dictScan(d, cursor, scanCallback, due);
+    } while (cursor);
+    scan_us = testUs()-start;
+
+    for (t = 1, now = base; t <= ticks; t++) {
+        now += TW_TICK_MS;
+        start = testUs();
+        twExpire(tw, now, ULONG_MAX, countCallback, &handed);
+        sweep_us += testUs()-start;
+    }
+    CHECK(handed == n, "sweep handed %lld of %ld keys", handed, n);
+
+    printf("[ok] %ld keys: dictEntry %zu bytes (16 for the wheel links), "
+        "dict %.1f B/key, wheel %zu B/slot, %+.2f B/key from setting expires\n",
+        n, sizeof(dictEntry), (double)(used1-used0)/n, sizeof(timeWheel),
+        ((double)used2-used1)/n);
+    printf("[ok] %ld keys: twAdd %.0f ns/key, sweep %.0f ns per due key, "
+        "full scan %.1f ms per cycle (%lld due of %ld)\n",
+        n, add_us*1e3/n, sweep_us*1e3/n, scan_us/1e3, due[1], n);
+
+    twRelease(tw);
+    dictRelease(d);
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    long n = bench ? (argc > 2 ? atol(argv[2]) : 10000000) : 200000;
+    TinyRedisProc *proc;
+
+    testCreateServer("compression no\n");
+    proc = CreateTinyRedisProc(g_redisDB);
+
+    testOrdering(bench ? 1000000 : 100000, 12345);
+    testMaintenance(proc);
+    measureCost(n);
+    return testReport();
+}
@@ -0,0 +1,219 @@
+/*
+ * InflightTable(single-flight表) 的正确性测试和缺失风暴压测.
+ *
+ * 1. 单线程语义: 重复Acquire被去重, 超时接管返回1, 原持有者过期的
+ *    Release不会删掉接管后的条目.
+ * 2. 争用: 多个线程反复抢同一小批key, 任一时刻每个key最多一个持有者.
+ * 3. 缺失风暴: 多个线程各自回填不同的key, 每个线程同时在途WINDOW个,
+ *    不应有任何一个被误判为重复; 同时统计原来按crc16(key)%65536的bitset
+ *    在同样的在途窗口下会误丢多少个, 以及吞吐.
+ *
+ * ./tests/inflight_test [bench]: bench时风暴为1000万个key, 否则100万.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "util/inflight.h"
+
+#define THREADS     4
+#define HOT_KEYS    8
+#define HOT_ROUNDS  200000
+#define WINDOW      1024
+#define MAX_AGE_MS  1000000
+
+uint16_t crc16(const char* buf, int len);
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[fail] %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+static uint64_t nowUs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void testSemantics()
+{
+    InflightTable t(4);
+
+    CHECK(t.Acquire("category&&1&&a", 100, 50) == 0, "first Acquire");
+    CHECK(t.Acquire("category&&1&&a", 120, 50) == -1, "second Acquire not deduplicated");
+    CHECK(t.Acquire("category&&1&&b", 120, 50) == 0, "another key deduplicated");
+    CHECK(t.Size() == 2, "size %llu, want 2", (unsigned long long)t.Size());
+
+    //超过maxAge的条目被接管, 原持有者随后的Release不生效
+    CHECK(t.Acquire("category&&1&&a", 151, 50) == 1, "stuck entry not taken over");
+    t.Release("category&&1&&a", 100);
+    CHECK(t.Acquire("category&&1&&a", 160, 50) == -1, "stale Release removed the new owner");
+    t.Release("category&&1&&a", 151);
+    CHECK(t.Acquire("category&&1&&a", 170, 50) == 0, "Release by the new owner failed");
+
+    //时钟回拨不会接管
+    CHECK(t.Acquire("category&&1&&b", 10, 50) == -1, "clock going back took over");
+
+    t.Release("category&&1&&a", 170);
+    t.Release("category&&1&&b", 120);
+    CHECK(t.Size() == 0, "size %llu after the releases", (unsigned long long)t.Size());
+    printf("[ok] dedup, stuck take over, stale release\n");
+}
+
+static InflightTable* hot = NULL;
+static uint32_t owners[HOT_KEYS];
+static uint64_t overlaps = 0, deduped = 0, acquired = 0;
+
+static void* hotWorker(void* arg)
+{
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    char key[32];
+
+    for (int i = 0; i < HOT_ROUNDS; i++)
+    {
+        int k = rand_r(&seed) % HOT_KEYS;
+        uint64_t ms = i + 1;
+
+        snprintf(key, sizeof(key), "tag&&%d&&x", k);
+        if (hot->Acquire(key, ms, MAX_AGE_MS) != 0)
+        {
+            __atomic_add_fetch(&deduped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_add_fetch(&owners[k], 1, __ATOMIC_ACQ_REL) != 1)
+            __atomic_add_fetch(&overlaps, 1, __ATOMIC_RELAXED);
+        if ((i & 15) == 0)
+            sched_yield();
+        __atomic_sub_fetch(&owners[k], 1, __ATOMIC_ACQ_REL);
+        hot->Release(key, ms);
+        __atomic_add_fetch(&acquired, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void testContention()
+{
+    pthread_t tids[THREADS];
+
+    hot = new InflightTable(64);
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&tids[i], NULL, hotWorker, (void*)(i + 1));
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(tids[i], NULL);
+
+    CHECK(overlaps == 0, "%llu times two owners of one key", (unsigned long long)overlaps);
+    CHECK(acquired + deduped == (uint64_t)THREADS * HOT_ROUNDS, "lost Acquire calls");
+    CHECK(hot->Size() == 0, "size %llu after the run", (unsigned long long)hot->Size());
+    delete hot;
+    printf("[ok] %d threads on %d keys: %llu fills, %llu deduplicated, never two owners\n",
+           THREADS, HOT_KEYS, (unsigned long long)acquired, (unsigned long long)deduped);
+}
+
+typedef struct StormArg
+{
+    InflightTable* table;
+    uint64_t       first, count;
+    uint64_t       refused;     //不同的key被判为重复
+    uint64_t       collided;    //原bitset会误丢的
+} StormArg;
+
+//原m_filter所有线程共用, 这里按crc16槽位记在途个数, 大于0即会被当成重复
+static uint16_t filter[0x10000];
+
+static void* stormWorker(void* arg)
+{
+    StormArg* a = (StormArg*)arg;
+    std::deque<std::string> window;
+    char key[48];
+
+    for (uint64_t i = a->first; i < a->first + a->count; i++)
+    {
+        snprintf(key, sizeof(key), "category&&%llu&&sports", (unsigned long long)i);
+        std::string k(key);
+        uint16_t slot = crc16(key, (int)k.size());
+
+        if (a->table->Acquire(k, 1, MAX_AGE_MS) != 0)
+            a->refused++;
+        if (__atomic_fetch_add(&filter[slot], 1, __ATOMIC_RELAXED) > 0)
+            a->collided++;
+        window.push_back(k);
+
+        if (window.size() == WINDOW)
+        {
+            const std::string& old = window.front();
+            a->table->Release(old, 1);
+            __atomic_sub_fetch(&filter[crc16(old.data(), (int)old.size())], 1, __ATOMIC_RELAXED);
+            window.pop_front();
+        }
+    }
+    for (size_t j = 0; j < window.size(); j++)
+    {
+        a->table->Release(window[j], 1);
+        __atomic_sub_fetch(&filter[crc16(window[j].data(), (int)window[j].size())], 1,
+                           __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void testStorm(uint64_t keys, uint32_t stripes)
+{
+    pthread_t tids[THREADS];
+    StormArg args[THREADS];
+    uint64_t refused = 0, collided = 0, start;
+    double secs;
+
+    InflightTable table(stripes);
+    start = nowUs();
+    for (int i = 0; i < THREADS; i++)
+    {
+        args[i].table = &table;
+        args[i].first = keys / THREADS * i;
+        args[i].count = keys / THREADS;
+        args[i].refused = args[i].collided = 0;
+        pthread_create(&tids[i], NULL, stormWorker, &args[i]);
+    }
+    for (int i = 0; i < THREADS; i++)
+    {
+        pthread_join(tids[i], NULL);
+        refused += args[i].refused;
+        collided += args[i].collided;
+    }
+    secs = (nowUs() - start) / 1e6;
+
+    CHECK(refused == 0, "%llu distinct keys refused as duplicates", (unsigned long long)refused);
+    CHECK(table.Size() == 0, "size %llu after the storm", (unsigned long long)table.Size());
+    printf("[ok] storm of %llu keys, %d x %d in flight, %u stripes: %.2fM Acquire+Release/s, "
+           "0 refused (crc16 bitset: %llu)\n", (unsigned long long)keys, THREADS, WINDOW,
+           stripes, keys / secs / 1e6, (unsigned long long)collided);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t keys = (argc > 1 && !strcmp(argv[1], "bench")) ? 10000000 : 1000000;
+
+    testSemantics();
+    testContention();
+    testStorm(keys, 1);
+    testStorm(keys, 64);
+
+    if (failures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/* Keyless commands ("n" flag) run without a slot lock.
+ *
+ * getDBIndex() maps the commands without keys to the config slot 0x4000.
+ * Another thread holds that slot's write lock for a while; the keyless
+ * commands must reply at once, alone and inside a pipeline, while CLUSTER
+ * SLOTS, keyless but not flagged, still waits for the lock.
+ *
+ * ./tests/keyless_test */
+
+#include "testhelp.h"
+
+#define HOLD_MS 1000
+
+static redisDb *config_db;
+static int holding;
+
+static void *holdThread(void *arg) {
+    dbWriteLock(config_db);
+    __atomic_store_n(&holding,1,__ATOMIC_RELEASE);
+    usleep(HOLD_MS*1000);
+    dbWriteUnlock(config_db);
+    return NULL;
+}
+
+static void holdConfigSlot(pthread_t *tid) {
+    __atomic_store_n(&holding,0,__ATOMIC_RELEASE);
+    pthread_create(tid, NULL, holdThread, NULL);
+    while (!__atomic_load_n(&holding,__ATOMIC_ACQUIRE)) usleep(100);
+}
+
+/* Run 'cmd' and return how long it took, its reply in 'reply' */
+static long long timedCommand(testClient *tc, const char *cmd, std::string *reply) {
+    long long start = mstime();
+
+    *reply = testCommand(tc, cmd);
+    return mstime()-start;
+}
+
+int main(int argc, char **argv) {
+    const char *keyless[] = {"INFO", "INFO server", "CLIENT COMPRESSION off",
+        "LATENCY HISTOGRAM", "LATENCY HISTOGRAM get info", "SLOWLOG GET", "SLOWLOG LEN"};
+    int nkeyless = sizeof(keyless)/sizeof(keyless[0]);
+    std::string reply;
+    std::vector<std::string> replies;
+    testClient *tc;
+    pthread_t tid;
+    long long ms;
+    int j;
+
+    testCreateServer(NULL);
+    tc = testConnect(CreateTinyRedisProc(g_redisDB));
+    config_db = &g_redisDB->db[0x4000];
+
+    for (j = 0; j < nkeyless; j++) {
+        struct redisCommand *cmd;
+        std::string name(keyless[j], strcspn(keyless[j], " "));
+        sds s = sdsnew(name.c_str());
+
+        cmd = lookupCommand(tc->c->proc, s);
+        sdsfree(s);
+        CHECK(cmd && cmd->firstkey == 0 && (cmd->flags & CMD_NOSLOT),
+            "%s is not flagged keyless", keyless[j]);
+    }
+
+    /* Alone */
+    holdConfigSlot(&tid);
+    for (j = 0; j < nkeyless; j++) {
+        ms = timedCommand(tc, keyless[j], &reply);
+        CHECK(reply.size() > 0 && reply[0] != '-', "%s failed: %s", keyless[j], reply.c_str());
+        CHECK(ms < HOLD_MS/2, "%s waited %lld ms for the config slot", keyless[j], ms);
+    }
+    pthread_join(tid, NULL);
+
+    /* Pipelined between keyed commands of other slots */
+    holdConfigSlot(&tid);
+    ms = mstime();
+    for (j = 0; j < nkeyless; j++) {
+        testAppend(tc, "SET a b");
+        testAppend(tc, keyless[j]);
+    }
+    testRun(tc);
+    replies.clear();
+    CHECK(testRead(tc, nkeyless*2, &replies) == nkeyless*2, "pipeline replies missing");
+    ms = mstime()-ms;
+    CHECK(ms < HOLD_MS/2, "pipeline waited %lld ms for the config slot", ms);
+    for (j = 0; j < (int)replies.size(); j++)
+        CHECK(replies[j][0] != '-', "pipelined reply %d: %s", j, replies[j].c_str());
+    pthread_join(tid, NULL);
+
+    /* Commands without keys and without the flag still take the lock */
+    holdConfigSlot(&tid);
+    ms = timedCommand(tc, "CLUSTER SLOTS", &reply);
+    pthread_join(tid, NULL);
+    CHECK(reply.size() > 0 && reply[0] == '*', "CLUSTER SLOTS: %s", reply.c_str());
+    CHECK(ms >= HOLD_MS/2, "CLUSTER SLOTS did not wait for the config slot (%lld ms)", ms);
+
+    /* and the wait is logged, under the config slot */
+    reply = testCommand(tc, "SLOWLOG GET 1");
+    CHECK(reply.find("CLUSTER") != std::string::npos &&
+        reply.find(":16384\r\n") != std::string::npos,
+        "CLUSTER SLOTS wait not in the slowlog: %s", reply.c_str());
+
+    printf("[ok] %d keyless commands do not wait for the config slot lock\n", nkeyless);
+    testDisconnect(tc);
+    return testReport();
+}
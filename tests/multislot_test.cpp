@@ -0,0 +1,255 @@
+/* Commands spanning slots: MGET, MSET, MSETNX, DEL and EXISTS.
+ *
+ * First the replies, in request order, for keys of many slots. Then
+ * writers MSET and DEL one group of keys of different slots, every time
+ * in a different key order, while readers MGET the group, in another
+ * order, from their own procs and threads. Every MGET must see one MSET
+ * or one DEL as a whole (all the values equal, or all nil), and nobody
+ * may stop: a wait longer than the testRead() timeout is a deadlock.
+ *
+ * Last, MGET of 100 random keys against 100 pipelined GETs.
+ *
+ * ./tests/multislot_test [bench] */
+
+#include "testhelp.h"
+
+#define GROUP_KEYS 256
+#define WRITERS 2
+#define READERS 2
+#define BENCH_KEYS 100000
+#define MGET_KEYS 100
+
+static std::string groupKey(int j) {
+    char buf[32];
+
+    /* No tag, the group spreads over up to GROUP_KEYS slots */
+    snprintf(buf, sizeof(buf), "group:%d", j);
+    return buf;
+}
+
+static void shuffle(std::vector<int>& v, unsigned *seed) {
+    for (int j = (int)v.size()-1; j > 0; j--)
+        std::swap(v[j], v[rand_r(seed) % (j+1)]);
+}
+
+static void checkReplies(testClient *tc) {
+    std::string expect;
+    char count[32];
+    int j;
+
+    for (j = 0; j < GROUP_KEYS; j++) {
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "%s v%d", groupKey(j).c_str(), j);
+        expect += " "; expect += buf;
+    }
+    CHECK(testCommand(tc, ("MSET" + expect).c_str()) == TEST_OK, "MSET across slots");
+    CHECK(testCommand(tc, ("MSETNX" + expect).c_str()) == ":0\r\n",
+        "MSETNX over existing keys");
+    CHECK(testCommand(tc, "MSETNX group:x{1} a group:x{2} b") == ":1\r\n",
+        "MSETNX of new keys");
+
+    expect = "*3\r\n" + testBulk("v5") + TEST_NIL + testBulk("v2");
+    CHECK(testCommand(tc, "MGET group:5 nokey group:2") == expect, "MGET order");
+    CHECK(testCommand(tc, "EXISTS group:1 group:1 group:9 nokey") == ":3\r\n",
+        "EXISTS counts repeated keys");
+    CHECK(testCommand(tc, "DEL group:3 group:x{1} group:x{2} nokey") == ":3\r\n",
+        "DEL across slots");
+    CHECK(testCommand(tc, "EXISTS group:3 group:x{1} group:4") == ":1\r\n",
+        "EXISTS after DEL");
+    expect = "DEL";
+    for (j = 0; j < GROUP_KEYS; j++) expect += " " + groupKey(j);
+    snprintf(count, sizeof(count), ":%d\r\n", GROUP_KEYS-1);
+    CHECK(testCommand(tc, expect.c_str()) == count, "DEL of the group");
+    printf("[ok] MSET/MSETNX/MGET/EXISTS/DEL across slots, replies in request order\n");
+}
+
+/* ------------------------------ Snapshots -------------------------------- */
+
+typedef struct threadArg {
+    testClient *tc;
+    int id;
+    long long until;
+    long long ops, torn, empty;
+} threadArg;
+
+static void *writerMain(void *arg) {
+    threadArg *ta = (threadArg*)arg;
+    std::vector<int> order(GROUP_KEYS);
+    unsigned seed = ta->id;
+    char val[32];
+    int j;
+
+    for (j = 0; j < GROUP_KEYS; j++) order[j] = j;
+    while (testUs() < ta->until) {
+        std::vector<std::string> args;
+        std::vector<const char*> argv;
+        int del = rand_r(&seed) % 8 == 0;
+
+        shuffle(order, &seed);
+        snprintf(val, sizeof(val), "w%d:%lld", ta->id, ta->ops);
+        args.push_back(del ? "DEL" : "MSET");
+        for (j = 0; j < GROUP_KEYS; j++) {
+            args.push_back(groupKey(order[j]));
+            if (!del) args.push_back(val);
+        }
+        for (j = 0; j < (int)args.size(); j++) argv.push_back(args[j].c_str());
+        testAppendArgv(ta->tc, (int)argv.size(), &argv[0], NULL);
+        testRun(ta->tc);
+        if (testRead(ta->tc, 1, NULL) != 1) {
+            CHECK(0, "writer %d stuck in %s", ta->id, args[0].c_str());
+            break;
+        }
+        ta->ops++;
+    }
+    return NULL;
+}
+
+static void *readerMain(void *arg) {
+    threadArg *ta = (threadArg*)arg;
+    std::vector<int> order(GROUP_KEYS);
+    unsigned seed = ta->id;
+    int j;
+
+    for (j = 0; j < GROUP_KEYS; j++) order[j] = j;
+    while (testUs() < ta->until) {
+        std::vector<std::string> args, r;
+        std::vector<const char*> argv;
+        std::string bulk;
+        const char *p;
+        int same = 1;
+
+        shuffle(order, &seed);
+        args.push_back("MGET");
+        for (j = 0; j < GROUP_KEYS/2; j++) args.push_back(groupKey(order[j]));
+        for (j = 0; j < (int)args.size(); j++) argv.push_back(args[j].c_str());
+        testAppendArgv(ta->tc, (int)argv.size(), &argv[0], NULL);
+        testRun(ta->tc);
+        if (testRead(ta->tc, 1, &r) != 1) {
+            CHECK(0, "reader %d stuck in MGET", ta->id);
+            break;
+        }
+
+        /* Every element must equal the first one */
+        p = strchr(r[0].c_str(), '\n')+1;
+        for (j = 0; j < GROUP_KEYS/2; j++) {
+            size_t l = testReplyLen(p, strlen(p));
+            std::string e(p, l);
+
+            if (j == 0) bulk = e;
+            else if (e != bulk) same = 0;
+            p += l;
+        }
+        if (!same) ta->torn++;
+        if (bulk == TEST_NIL) ta->empty++;
+        ta->ops++;
+    }
+    return NULL;
+}
+
+static void checkSnapshots(std::vector<testClient*>& clients, long long run_us) {
+    pthread_t tids[WRITERS+READERS];
+    threadArg args[WRITERS+READERS];
+    long long writes = 0, reads = 0, torn = 0, empty = 0;
+    int j;
+
+    for (j = 0; j < WRITERS+READERS; j++) {
+        args[j].tc = clients[j];
+        args[j].id = j+1;
+        args[j].until = testUs()+run_us;
+        args[j].ops = args[j].torn = args[j].empty = 0;
+        pthread_create(&tids[j], NULL, j < WRITERS ? writerMain : readerMain, &args[j]);
+    }
+    for (j = 0; j < WRITERS+READERS; j++) {
+        pthread_join(tids[j], NULL);
+        if (j < WRITERS) writes += args[j].ops;
+        else reads += args[j].ops;
+        torn += args[j].torn;
+        empty += args[j].empty;
+    }
+    CHECK(writes > 0 && reads > 0, "%lld writes, %lld reads", writes, reads);
+    CHECK(torn == 0, "%lld of %lld MGETs saw a partial MSET or DEL", torn, reads);
+    printf("[ok] %d writers, %d readers on %d keys: %lld MSET/DEL, %lld MGET "
+        "(%lld empty), none torn\n", WRITERS, READERS, GROUP_KEYS, writes, reads, empty);
+}
+
+/* -------------------------------- Bench ---------------------------------- */
+
+static void benchMget(testClient *tc, long long run_us) {
+    std::vector<std::string> keys(MGET_KEYS), r;
+    std::vector<long long> lat[2];
+    long long ops[2] = {0, 0}, us[2] = {0, 0};
+    unsigned seed = 1;
+    char buf[32];
+    int mode, j;
+
+    for (j = 0; j < BENCH_KEYS; j++) {
+        snprintf(buf, sizeof(buf), "bench:%d", j);
+        const char *argv[3] = {"SET", buf, "value"};
+        testAppendArgv(tc, 3, argv, NULL);
+        if (j % 1000 == 999) {
+            testRun(tc);
+            CHECK(testRead(tc, 1000, NULL) == 1000, "preload stalled at %d", j);
+        }
+    }
+
+    for (mode = 0; mode < 2; mode++) {
+        long long start = testUs();
+
+        while (testUs()-start < run_us) {
+            std::vector<const char*> argv;
+            long long t = testUs();
+            int n = mode ? MGET_KEYS : 1;
+
+            for (j = 0; j < MGET_KEYS; j++) {
+                snprintf(buf, sizeof(buf), "bench:%d", rand_r(&seed) % BENCH_KEYS);
+                keys[j] = buf;
+            }
+            if (mode == 0) {
+                argv.push_back("MGET");
+                for (j = 0; j < MGET_KEYS; j++) argv.push_back(keys[j].c_str());
+                testAppendArgv(tc, (int)argv.size(), &argv[0], NULL);
+            } else {
+                for (j = 0; j < MGET_KEYS; j++) {
+                    const char *get[2] = {"GET", keys[j].c_str()};
+                    testAppendArgv(tc, 2, get, NULL);
+                }
+            }
+            testRun(tc);
+            r.clear();
+            if (testRead(tc, n, &r) != n) {
+                CHECK(0, "%s did not reply", mode ? "GET pipeline" : "MGET");
+                return;
+            }
+            lat[mode].push_back(testUs()-t);
+            ops[mode]++;
+        }
+        us[mode] = testUs()-start;
+        CHECK(r.size() && r.back().find("value") != std::string::npos,
+            "%s returned %s", mode ? "GET" : "MGET", r.size() ? r.back().c_str() : "nothing");
+    }
+
+    for (mode = 0; mode < 2; mode++) {
+        printf("[ok] %-18s %9.0f keys/s, p50 %4lld us p99 %4lld us per %d keys\n",
+            mode ? "100 pipelined GETs" : "MGET of 100 keys",
+            ops[mode]*MGET_KEYS*1e6/us[mode], testPercentile(lat[mode], 50),
+            testPercentile(lat[mode], 99), MGET_KEYS);
+    }
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    std::vector<testClient*> clients;
+    int j;
+
+    testCreateServer(NULL);
+    for (j = 0; j < WRITERS+READERS; j++)
+        clients.push_back(testConnect(CreateTinyRedisProc(g_redisDB)));
+
+    checkReplies(clients[0]);
+    checkSnapshots(clients, bench ? 5000000 : 1000000);
+    benchMget(clients[0], bench ? 3000000 : 200000);
+
+    for (j = 0; j < WRITERS+READERS; j++) testDisconnect(clients[j]);
+    return testReport();
+}
@@ -0,0 +1,200 @@
+/* Pipelined batches: reply order across slots and GET throughput by depth.
+ *
+ * Two procs, one with pipeline-batch 128 and one with pipeline-batch 1
+ * (every command through processCommand(), the old path). The same random
+ * pipelines of mixed commands run on both, over keys of a few hash tags so
+ * that same-slot runs, slot changes, cross-slot MGET/DEL, keyless commands
+ * and errors all follow each other, and in chunks that do not line up with
+ * the batch size. The replies must be the same, byte for byte and in order.
+ *
+ * Then GET/s at pipeline depths 1, 16, 128 and 1024, batched and not, with
+ * the GETs of a pipeline in one slot (the keys of one {uid}) or spread over
+ * all of them.
+ *
+ * ./tests/pipeline_test [bench] */
+
+#include "testhelp.h"
+
+#define TAGS 4
+#define KEYS_PER_TAG 8
+#define HOT_TAGS 64
+#define HOT_KEYS 1024
+#define SPREAD_KEYS 100000
+
+static std::string keyName(const char *prefix, int tag, int k) {
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%s:{t%d}:%d", prefix, tag, k);
+    return buf;
+}
+
+/* A random command over the keys of 'prefix' */
+static std::string randomCommand(const char *prefix, unsigned *seed, int i) {
+    int tag = rand_r(seed) % TAGS, k = rand_r(seed) % KEYS_PER_TAG;
+    std::string key = keyName(prefix, tag, k);
+    std::string other = keyName(prefix, (tag+1) % TAGS, k);
+    char val[32];
+
+    snprintf(val, sizeof(val), "v%d", i);
+    switch (rand_r(seed) % 16) {
+    case 0: return "SET " + key + " " + val;
+    case 1: return "SETNX " + key + " " + val;
+    case 2: return "APPEND " + key + " " + val;
+    case 3: return "STRLEN " + key;
+    case 4: return "EXISTS " + key;
+    case 5: return "DEL " + key;
+    case 6: return "HSET " + key + " f " + val;
+    case 7: return "HGET " + key + " f";
+    case 8: return "MGET " + key + " " + other;
+    case 9: return "DEL " + key + " " + other;
+    case 10: return "NOSUCHCOMMAND " + key;
+    case 11: return "GET";
+    case 12: return "CLIENT COMPRESSION off";
+    default: return "GET " + key;
+    }
+}
+
+/* Run 'n' random commands in pipelines of random depths */
+static void runMixed(testClient *tc, const char *prefix, unsigned seed, int n,
+                     std::vector<std::string> *replies)
+{
+    int i = 0;
+
+    while (i < n) {
+        int depth = 1 + rand_r(&seed) % 300, j;
+
+        if (depth > n-i) depth = n-i;
+        for (j = 0; j < depth; j++, i++) {
+            std::string cmd = randomCommand(prefix, &seed, i);
+            testAppend(tc, cmd.c_str());
+        }
+        testRun(tc);
+        if (testRead(tc, depth, replies) != depth) {
+            CHECK(0, "%s: a pipeline of %d did not reply", prefix, depth);
+            return;
+        }
+    }
+}
+
+static void checkOrder(testClient *batched, testClient *plain, int n) {
+    std::vector<std::string> rb, rp;
+    TinyRedisProc *proc = batched->c->proc;
+    long long runs = proc->stat_batch_runs, cmds = proc->stat_batch_commands;
+    size_t j;
+
+    runMixed(batched, "b", 1, n, &rb);
+    runMixed(plain, "p", 1, n, &rp);
+    CHECK(rb.size() == rp.size(), "%zu batched replies, %zu plain", rb.size(), rp.size());
+    for (j = 0; j < rb.size() && j < rp.size(); j++) {
+        if (rb[j] != rp[j]) {
+            CHECK(0, "reply %zu: batched %s, plain %s", j, rb[j].c_str(), rp[j].c_str());
+            break;
+        }
+    }
+    CHECK(proc->stat_batch_runs > runs, "no same-slot run in %d commands", n);
+    CHECK(plain->c->proc->stat_batch_runs == 0, "pipeline-batch 1 ran batches");
+    printf("[ok] %d mixed commands: same replies, %lld runs of %.1f commands on average\n",
+        n, proc->stat_batch_runs-runs,
+        (double)(proc->stat_batch_commands-cmds)/(proc->stat_batch_runs-runs));
+}
+
+/* A pipeline of 128 GETs of one slot takes its lock once */
+static void checkOneHold(testClient *tc) {
+    TinyRedisProc *proc = tc->c->proc;
+    long long runs = proc->stat_batch_runs, cmds = proc->stat_batch_commands;
+    std::vector<std::string> replies;
+    int j;
+
+    for (j = 0; j < g_redisDB->pipeline_batch; j++) {
+        std::string cmd = "GET " + keyName("hot", 0, j % HOT_KEYS);
+        testAppend(tc, cmd.c_str());
+    }
+    testRun(tc);
+    CHECK(testRead(tc, j, &replies) == j, "one slot pipeline did not reply");
+    CHECK(proc->stat_batch_runs == runs+1 && proc->stat_batch_commands == cmds+j,
+        "%d GETs of one slot took %lld lock holds", j, proc->stat_batch_runs-runs);
+    CHECK(replies.size() && replies[0] == testBulk("value"), "GET returned %s",
+        replies.size() ? replies[0].c_str() : "nothing");
+}
+
+static void preload(testClient *tc, const char *prefix, int tags, int keys) {
+    int t, k, n = 0;
+
+    for (t = 0; t < tags; t++) {
+        for (k = 0; k < keys; k++) {
+            std::string cmd = "SET " + keyName(prefix, t, k) + " value";
+            testAppend(tc, cmd.c_str());
+            if (++n == 1000) {
+                testRun(tc);
+                CHECK(testRead(tc, n, NULL) == n, "preload of %s stalled", prefix);
+                n = 0;
+            }
+        }
+    }
+    testRun(tc);
+    CHECK(testRead(tc, n, NULL) == n, "preload of %s stalled", prefix);
+}
+
+/* GET/s at 'depth', one tag per pipeline if 'hot', any key otherwise */
+static double getRate(testClient *tc, int depth, int hot, long long run_us) {
+    std::vector<std::string> replies;
+    long long start = testUs(), ops = 0;
+    unsigned seed = depth;
+    int j;
+
+    while (testUs()-start < run_us) {
+        int tag = rand_r(&seed) % HOT_TAGS;
+
+        for (j = 0; j < depth; j++) {
+            std::string key = hot ? keyName("hot", tag, rand_r(&seed) % HOT_KEYS) :
+                keyName("spread", rand_r(&seed) % SPREAD_KEYS, 0);
+            const char *argv[2] = {"GET", key.c_str()};
+            testAppendArgv(tc, 2, argv, NULL);
+        }
+        testRun(tc);
+        replies.clear();
+        if (testRead(tc, depth, &replies) != depth) {
+            CHECK(0, "GET pipeline of %d did not reply", depth);
+            break;
+        }
+        CHECK(replies[0] == testBulk("value"), "GET returned %s", replies[0].c_str());
+        ops += depth;
+    }
+    return ops*1e6/(testUs()-start);
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    int depths[4] = {1, 16, 128, 1024};
+    long long run_us = bench ? 2000000 : 100000;
+    testClient *batched, *plain;
+    int j, hot;
+
+    testCreateServer("pipeline-batch 128\n");
+    batched = testConnect(CreateTinyRedisProc(g_redisDB));
+    g_redisDB->pipeline_batch = 1;
+    plain = testConnect(CreateTinyRedisProc(g_redisDB));
+    g_redisDB->pipeline_batch = 128;
+
+    checkOrder(batched, plain, bench ? 200000 : 20000);
+
+    /* HOT_KEYS keys in each of HOT_TAGS tags, and one key in each of
+     * SPREAD_KEYS tags */
+    preload(batched, "hot", HOT_TAGS, HOT_KEYS);
+    preload(batched, "spread", SPREAD_KEYS, 1);
+    checkOneHold(batched);
+
+    for (hot = 1; hot >= 0; hot--) {
+        for (j = 0; j < 4; j++) {
+            double rb = getRate(batched, depths[j], hot, run_us);
+            double rp = getRate(plain, depths[j], hot, run_us);
+
+            printf("[ok] depth %4d, %s: batched %9.0f GET/s, plain %9.0f GET/s, %.2fx\n",
+                depths[j], hot ? "one slot " : "all slots", rb, rp, rp > 0 ? rb/rp : 0);
+        }
+    }
+
+    testDisconnect(batched);
+    testDisconnect(plain);
+    return testReport();
+}
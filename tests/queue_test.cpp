@@ -0,0 +1,162 @@
+/*
+ * MpmcQue/SpscQue 的并发正确性测试.
+ *
+ * 多个生产者各自推入一段不重叠的序号, 多个消费者并发弹出, 最后检查每个
+ * 序号恰好被取到一次; SPSC 额外检查弹出顺序与推入顺序一致. 队列容量
+ * 故意取得很小, 让满/空两条路径被反复走到.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include "util/mpmcque.h"
+#include "util/spscque.h"
+
+#define PRODUCERS   4
+#define CONSUMERS   4
+#define PER_THREAD  200000
+#define TOTAL       ((uint64_t)PRODUCERS * PER_THREAD)
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[fail] %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static MpmcQue<uint64_t>* mq = NULL;
+static SpscQue<uint64_t>* sq = NULL;
+static uint32_t* seen = NULL;
+static uint64_t popped = 0;
+
+static void* mpmcProducer(void* arg)
+{
+    uint64_t base = (uint64_t)(uintptr_t)arg * PER_THREAD;
+
+    for (uint64_t i = 0; i < PER_THREAD; i++)
+    {
+        uint64_t v = base + i;
+        while (mq->Push(std::move(v)) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void* mpmcConsumer(void* arg)
+{
+    uint64_t v;
+
+    while (__atomic_load_n(&popped, __ATOMIC_RELAXED) < TOTAL)
+    {
+        if (mq->TryPop(v) != 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if (v < TOTAL)
+            __atomic_add_fetch(&seen[v], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&popped, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void testMpmc()
+{
+    pthread_t prod[PRODUCERS], cons[CONSUMERS];
+
+    mq = new MpmcQue<uint64_t>(64);
+    seen = (uint32_t*)calloc(TOTAL, sizeof(uint32_t));
+    popped = 0;
+
+    for (uintptr_t i = 0; i < CONSUMERS; i++)
+        pthread_create(&cons[i], NULL, mpmcConsumer, NULL);
+    for (uintptr_t i = 0; i < PRODUCERS; i++)
+        pthread_create(&prod[i], NULL, mpmcProducer, (void*)i);
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(prod[i], NULL);
+    for (int i = 0; i < CONSUMERS; i++)
+        pthread_join(cons[i], NULL);
+
+    CHECK(popped == TOTAL, "mpmc popped %llu, want %llu",
+          (unsigned long long)popped, (unsigned long long)TOTAL);
+    uint64_t bad = 0;
+    for (uint64_t i = 0; i < TOTAL; i++)
+        if (seen[i] != 1)
+            bad++;
+    CHECK(bad == 0, "mpmc %llu items not seen exactly once", (unsigned long long)bad);
+    CHECK(mq->Len() == 0, "mpmc queue not empty: %u", mq->Len());
+
+    uint64_t v;
+    CHECK(mq->TryPop(v) == -1, "mpmc TryPop on an empty queue succeeded");
+    for (uint32_t i = 0; i < mq->Size(); i++)
+    {
+        v = i;
+        CHECK(mq->Push(std::move(v)) == 0, "mpmc Push %u failed below capacity", i);
+    }
+    v = 0;
+    CHECK(mq->Push(std::move(v)) == -1, "mpmc Push on a full queue succeeded");
+
+    free(seen);
+    delete mq;
+    printf("[ok] mpmc %d producers x %d consumers, %llu items\n",
+           PRODUCERS, CONSUMERS, (unsigned long long)TOTAL);
+}
+
+static void* spscProducer(void* arg)
+{
+    for (uint64_t i = 0; i < TOTAL; i++)
+    {
+        uint64_t v = i;
+        while (sq->Push(std::move(v)) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void testSpsc()
+{
+    pthread_t prod;
+    uint64_t v, expect = 0, outOfOrder = 0;
+
+    sq = new SpscQue<uint64_t>(16);
+    pthread_create(&prod, NULL, spscProducer, NULL);
+    while (expect < TOTAL)
+    {
+        if (sq->TryPop(v) != 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if (v != expect)
+            outOfOrder++;
+        expect++;
+    }
+    pthread_join(prod, NULL);
+
+    CHECK(outOfOrder == 0, "spsc %llu items out of order", (unsigned long long)outOfOrder);
+    CHECK(sq->TryPop(v) == -1, "spsc TryPop on an empty queue succeeded");
+
+    delete sq;
+    printf("[ok] spsc %llu items in order\n", (unsigned long long)TOTAL);
+}
+
+int main()
+{
+    testMpmc();
+    testSpsc();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
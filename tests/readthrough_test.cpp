@@ -0,0 +1,219 @@
+/* Read-through GET: park on a miss, reply once the fill is done.
+ *
+ * ASyncTask::PushTask() is replaced by a hook that records the fills it is
+ * asked for and, like the single-flight table, refuses a second fill of a
+ * key already loading with -100. A fill is what ExecMongoTask() does: the
+ * key is SET (here by a client of another proc) and readThroughNotify() is
+ * called. The procs' event loops are run by hand to handle the wakeups and
+ * the deadline timer.
+ *
+ *  - a GET that misses replies nothing until the fill, then the value
+ *  - the GETs of one key on two procs share one fill
+ *  - the commands pipelined after a parked GET wait for it, in order
+ *  - a fill that fails wakes the clients with nil
+ *  - without a fill the GET replies nil at read-through-timeout
+ *  - a PushTask error replies nil at once, as does read-through no
+ *
+ * ./tests/readthrough_test */
+
+#include <set>
+#include <map>
+
+#include "testhelp.h"
+#include "readthrough.h"
+
+#define TIMEOUT_MS 300
+
+static std::set<std::string> loading;
+static std::map<std::string,int> pushes;
+
+static int pushTask(const char *key, size_t len, int slot) {
+    std::string k(key, len);
+
+    pushes[k]++;
+    if (k.compare(0, 5, "fail:") == 0) return -1;
+    if (loading.count(k)) return -100;
+    loading.insert(k);
+    return 0;
+}
+
+/* The fill of 'key' is done, with 'value' stored unless it is NULL */
+static void fill(testClient *filler, const char *key, const char *value) {
+    if (value) {
+        std::string cmd = std::string("SET ") + key + " " + value;
+        CHECK(testCommand(filler, cmd.c_str()) == TEST_OK, "%s", cmd.c_str());
+    }
+    loading.erase(key);
+    readThroughNotify(key, strlen(key));
+}
+
+/* Run the event loop of every proc once, without waiting */
+static void pump(void) {
+    for (int j = 0; j < g_redisDB->nprocs; j++)
+        aeProcessEvents(g_redisDB->procs[j]->el, AE_ALL_EVENTS|AE_DONT_WAIT);
+}
+
+/* Pump until 'tc' got 'n' replies, at most 'ms' */
+static int waitReplies(testClient *tc, int n, std::vector<std::string> *out, long long ms) {
+    long long deadline = mstime()+ms;
+    int got = 0;
+
+    while (got < n && mstime() <= deadline) {
+        pump();
+        got += testRead(tc, n-got, out, 0);
+        if (got < n) usleep(1000);
+    }
+    return got;
+}
+
+static void checkParkAndFill(testClient *a, testClient *filler) {
+    std::vector<std::string> r;
+    TinyRedisProc *proc = a->c->proc;
+    long long parked = proc->stat_readthrough_parked;
+
+    testAppend(a, "GET rt:one");
+    testRun(a);
+    CHECK(waitReplies(a, 1, &r, 50) == 0, "parked GET replied %s", r.size() ? r[0].c_str() : "");
+    CHECK(a->c->async_hold && proc->readthrough_waiting == 1, "GET miss not parked");
+    CHECK(pushes["rt:one"] == 1, "%d fills queued for rt:one", pushes["rt:one"]);
+    CHECK(proc->stat_readthrough_parked == parked+1, "parked not counted");
+
+    fill(filler, "rt:one", "loaded");
+    CHECK(waitReplies(a, 1, &r, 1000) == 1 && r[0] == testBulk("loaded"),
+        "GET after the fill: %s", r.size() ? r[0].c_str() : "no reply");
+    CHECK(!a->c->async_hold && proc->readthrough_waiting == 0, "client still parked");
+    printf("[ok] a GET miss waits for the fill and replies the loaded value\n");
+}
+
+static void checkSharedFill(std::vector<testClient*>& waiters, testClient *filler) {
+    long long filled = 0;
+    size_t j;
+
+    for (j = 0; j < waiters.size(); j++) {
+        testAppend(waiters[j], "GET rt:shared");
+        testRun(waiters[j]);
+    }
+    pump();
+    CHECK(pushes["rt:shared"] == (int)waiters.size() && loading.count("rt:shared"),
+        "GETs of rt:shared queued %d fills", pushes["rt:shared"]);
+    for (j = 0; j < waiters.size(); j++)
+        CHECK(waiters[j]->c->async_hold, "waiter %zu not parked", j);
+
+    fill(filler, "rt:shared", "once");
+    for (j = 0; j < waiters.size(); j++) {
+        std::vector<std::string> r;
+        CHECK(waitReplies(waiters[j], 1, &r, 1000) == 1 && r[0] == testBulk("once"),
+            "waiter %zu: %s", j, r.size() ? r[0].c_str() : "no reply");
+    }
+    for (int p = 0; p < g_redisDB->nprocs; p++)
+        filled += g_redisDB->procs[p]->stat_readthrough_filled;
+    CHECK(filled == (long long)waiters.size()+1, "%lld clients woken by fills", filled);
+    printf("[ok] %zu GETs on %d procs share one fill\n", waiters.size(), g_redisDB->nprocs);
+}
+
+static void checkPipeline(testClient *a, testClient *filler) {
+    std::vector<std::string> r;
+
+    testAppend(a, "GET rt:pipe");
+    testAppend(a, "SET rt:after 1");
+    testAppend(a, "GET rt:after");
+    testAppend(a, "GET rt:pipe");
+    testRun(a);
+    CHECK(waitReplies(a, 1, &r, 50) == 0, "a command after the parked GET replied first");
+    /* The client reads nothing more while parked */
+    testAppend(a, "STRLEN rt:pipe");
+    testRun(a);
+    CHECK(waitReplies(a, 1, &r, 20) == 0, "a command sent while parked replied first");
+
+    fill(filler, "rt:pipe", "v");
+    CHECK(waitReplies(a, 5, &r, 1000) == 5, "%zu of 5 replies after the fill", r.size());
+    if (r.size() == 5) {
+        CHECK(r[0] == testBulk("v") && r[1] == TEST_OK && r[2] == testBulk("1") &&
+            r[3] == testBulk("v") && r[4] == ":1\r\n", "pipeline replies out of order: "
+            "%s %s %s %s %s", r[0].c_str(), r[1].c_str(), r[2].c_str(), r[3].c_str(),
+            r[4].c_str());
+    }
+    printf("[ok] commands pipelined behind a parked GET run after it, in order\n");
+}
+
+static void checkFailedFill(testClient *a, testClient *filler) {
+    std::vector<std::string> r;
+
+    testAppend(a, "GET rt:missing");
+    testRun(a);
+    CHECK(waitReplies(a, 1, &r, 20) == 0, "parked GET replied");
+    fill(filler, "rt:missing", NULL);
+    CHECK(waitReplies(a, 1, &r, 1000) == 1 && r[0] == TEST_NIL,
+        "GET after a failed fill: %s", r.size() ? r[0].c_str() : "no reply");
+    printf("[ok] a fill that finds nothing wakes the GET with nil\n");
+}
+
+static void checkTimeout(testClient *a) {
+    std::vector<std::string> r;
+    TinyRedisProc *proc = a->c->proc;
+    long long timeouts = proc->stat_readthrough_timeouts, start = mstime(), ms;
+
+    testAppend(a, "GET rt:slow");
+    testRun(a);
+    CHECK(waitReplies(a, 1, &r, TIMEOUT_MS*3) == 1 && r[0] == TEST_NIL,
+        "GET without a fill: %s", r.size() ? r[0].c_str() : "no reply");
+    ms = mstime()-start;
+    CHECK(ms >= TIMEOUT_MS-1 && ms < TIMEOUT_MS*2, "nil after %lld ms, timeout %d ms",
+        ms, TIMEOUT_MS);
+    CHECK(proc->stat_readthrough_timeouts == timeouts+1, "timeout not counted");
+    CHECK(!a->c->async_hold && dictSize(proc->readthrough_keys) == 0,
+        "client still parked after the timeout");
+
+    /* The late fill finds nobody */
+    loading.erase("rt:slow");
+    readThroughNotify("rt:slow", 7);
+    pump();
+    printf("[ok] without a fill the GET replies nil after %lld ms\n", ms);
+}
+
+static void checkNoPark(testClient *a) {
+    std::string reply;
+
+    reply = testCommand(a, "GET fail:push");
+    CHECK(reply == TEST_NIL && !a->c->async_hold, "GET with a PushTask error: %s",
+        reply.c_str());
+
+    g_redisDB->readthrough = 0;
+    reply = testCommand(a, "GET rt:off");
+    CHECK(reply == TEST_NIL && pushes["rt:off"] == 1, "GET miss with read-through no: %s",
+        reply.c_str());
+    g_redisDB->readthrough = 1;
+    loading.erase("rt:off");
+    printf("[ok] a PushTask error or read-through no replies nil at once\n");
+}
+
+int main(int argc, char **argv) {
+    std::vector<testClient*> waiters;
+    TinyRedisProc *p1, *p2;
+    testClient *a, *filler;
+    char config[128];
+
+    snprintf(config, sizeof(config), "read-through yes\nread-through-timeout %d\n", TIMEOUT_MS);
+    testCreateServer(config);
+    testPushTaskHook = pushTask;
+    p1 = CreateTinyRedisProc(g_redisDB);
+    p2 = CreateTinyRedisProc(g_redisDB);
+    a = testConnect(p1);
+    filler = testConnect(p2);
+    waiters.push_back(a);
+    waiters.push_back(testConnect(p1));
+    waiters.push_back(testConnect(p2));
+
+    checkParkAndFill(a, filler);
+    checkSharedFill(waiters, filler);
+    checkPipeline(a, filler);
+    checkFailedFill(a, filler);
+    checkTimeout(a);
+    checkNoPark(a);
+
+    testDisconnect(waiters[2]);
+    testDisconnect(waiters[1]);
+    testDisconnect(filler);
+    testDisconnect(a);
+    return testReport();
+}
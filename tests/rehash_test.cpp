@@ -0,0 +1,117 @@
+/* Growing one slot from 0 to N keys: write latency with the ReHasher.
+ *
+ * One client SETs N keys of the same slot, one command at a time, and the
+ * latency of every SET (run + reply) is recorded. The slot grows through
+ * every power of two on the way. Two runs, each on a fresh slot:
+ *
+ * background  activerehashing yes, the ReHasher thread picks the slot up
+ *             from rehash_dirty and moves buckets in dbRehashStep() holds
+ *             of rehash-hold-us.
+ * inline      activerehashing no, only the bucket moved by each dictAdd()
+ *             and dictFind() under the writer's lock, the old behaviour.
+ *
+ * Both must end with all N keys readable and the dict done rehashing (the
+ * inline run is finished by hand), and the ReHasher must only take the
+ * slot lock in the first one.
+ *
+ * ./tests/rehash_test [bench [keys]]: 'make bench' grows to 10M keys. */
+
+#include "rehasher.h"
+#include "testhelp.h"
+
+typedef struct growResult {
+    std::vector<long long> lat;
+    long long us;
+} growResult;
+
+static void growSlot(testClient *tc, const char *tag, long n, growResult *r) {
+    long long start = testUs();
+    char key[64];
+    long i;
+
+    r->lat.clear();
+    r->lat.reserve(n);
+    for (i = 0; i < n; i++) {
+        const char *argv[3] = {"SET", key, "v"};
+        long long t = testUs();
+
+        snprintf(key, sizeof(key), "k:%ld{%s}", i, tag);
+        testAppendArgv(tc, 3, argv, NULL);
+        testRun(tc);
+        if (testRead(tc, 1, NULL) != 1) {
+            CHECK(0, "SET %s did not reply", key);
+            break;
+        }
+        r->lat.push_back(testUs()-t);
+    }
+    r->us = testUs()-start;
+}
+
+static void checkSlot(testClient *tc, redisDb *db, const char *tag, long n) {
+    char cmd[64];
+    long i;
+
+    CHECK((long)dictSize(db->d) == n, "slot %d holds %lu keys, want %ld",
+        db->id, dictSize(db->d), n);
+    CHECK(!dictIsRehashing(db->d), "slot %d still rehashing", db->id);
+    CHECK(dictSlots(db->d) >= (unsigned long)n, "slot %d: %lu buckets for %ld keys",
+        db->id, dictSlots(db->d), n);
+    for (i = 0; i < n; i += n/1000+1) {
+        snprintf(cmd, sizeof(cmd), "EXISTS k:%ld{%s}", i, tag);
+        if (testCommand(tc, cmd) != ":1\r\n") {
+            CHECK(0, "k:%ld{%s} lost", i, tag);
+            break;
+        }
+    }
+}
+
+static void report(const char *name, long n, growResult *r) {
+    printf("[ok] %-10s %ld SETs in %.2fs: p50 %lld us p99 %lld us p999 %lld us max %lld us\n",
+        name, n, r->us/1e6, testPercentile(r->lat, 50), testPercentile(r->lat, 99),
+        testPercentile(r->lat, 99.9), testPercentile(r->lat, 100));
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    long n = bench ? (argc > 2 ? atol(argv[2]) : 10000000) : 300000;
+    testClient *tc;
+    ReHasher rehasher;
+    redisDb *db;
+    growResult r;
+    long long locks, us;
+
+    testCreateServer("activerehashing yes\nrehash-hold-us 100\n");
+    tc = testConnect(CreateTinyRedisProc(g_redisDB));
+
+    /* background */
+    rehasher.init(g_redisDB);
+    if (rehasher.start() != 0) {
+        fprintf(stderr, "can not start the ReHasher\n");
+        return 1;
+    }
+    db = &g_redisDB->db[keyHashSlot("bg", 2)];
+    growSlot(tc, "bg", n, &r);
+    /* Let the ReHasher finish the last resize */
+    for (int j = 0; j < 5000 && dictIsRehashing(db->d); j++) usleep(1000);
+    rehasher.stop();
+    pthread_join(rehasher.getid(), NULL);
+    checkSlot(tc, db, "bg", n);
+    locks = g_redisDB->stat_rehash_locks;
+    us = g_redisDB->stat_rehash_us;
+    CHECK(locks > 0, "the ReHasher never took the slot lock");
+    report("background", n, &r);
+    printf("[ok] %-10s %lld rehash holds, %.1f us on average (rehash-hold-us %d)\n",
+        "", locks, locks ? (double)us/locks : 0, g_redisDB->rehash_hold_us);
+
+    /* inline */
+    g_redisDB->activerehashing = 0;
+    db = &g_redisDB->db[keyHashSlot("fg", 2)];
+    growSlot(tc, "fg", n, &r);
+    CHECK(g_redisDB->stat_rehash_locks == locks, "ReHasher ran while disabled");
+    while (dictIsRehashing(db->d)) dictRehash(db->d, 1000);
+    checkSlot(tc, db, "fg", n);
+    report("inline", n, &r);
+
+    testDisconnect(tc);
+    return testReport();
+}
@@ -0,0 +1,152 @@
+/* Scatter/gather reply path: GET and MGET of 1 KB, 16 KB and 256 KB values.
+ *
+ * write() and writev() are interposed to count the syscalls and bytes the
+ * server sends to the client, the replies are checked byte for byte and
+ * the latency of a whole command (run + read the reply) is measured.
+ *
+ * ./tests/reply_test [bench] */
+
+#include <dlfcn.h>
+#include <sys/uio.h>
+
+#include "testhelp.h"
+
+#define MGET_KEYS 8
+
+static int count_fd = -1;
+static long long syscalls, sent;
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+    static ssize_t (*real)(int, const void*, size_t) = NULL;
+    ssize_t n;
+
+    if (!real) real = (ssize_t (*)(int, const void*, size_t))dlsym(RTLD_NEXT, "write");
+    n = real(fd, buf, count);
+    if (fd == count_fd) {
+        syscalls++;
+        if (n > 0) sent += n;
+    }
+    return n;
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    static ssize_t (*real)(int, const struct iovec*, int) = NULL;
+    ssize_t n;
+
+    if (!real) real = (ssize_t (*)(int, const struct iovec*, int))dlsym(RTLD_NEXT, "writev");
+    n = real(fd, iov, iovcnt);
+    if (fd == count_fd) {
+        syscalls++;
+        if (n > 0) sent += n;
+    }
+    return n;
+}
+
+static std::string valueOf(int key, size_t len) {
+    std::string v(len, 'a' + key % 26);
+
+    /* Both ends differ per key, a misplaced chunk would show */
+    snprintf(&v[0], len, "%d:", key);
+    v[len-1] = 'A' + key % 26;
+    return v;
+}
+
+static void runSize(testClient *tc, size_t len, int iters) {
+    std::vector<std::string> keys, values;
+    std::vector<long long> lat_get, lat_mget;
+    std::string expect_mget;
+    long long get_calls, get_bytes, mget_calls, mget_bytes;
+    char hdr[32];
+    int j, i;
+
+    for (j = 0; j < MGET_KEYS; j++) {
+        char key[64];
+        snprintf(key, sizeof(key), "value:%zu:%d", len, j);
+        keys.push_back(key);
+        values.push_back(valueOf(j, len));
+
+        const char *argv[3] = {"SET", key, values[j].c_str()};
+        size_t lens[3] = {3, strlen(key), len};
+        testAppendArgv(tc, 3, argv, lens);
+        testRun(tc);
+        CHECK(testRead(tc, 1, NULL) == 1, "SET of %zu bytes did not reply", len);
+    }
+    snprintf(hdr, sizeof(hdr), "*%d\r\n", MGET_KEYS);
+    expect_mget = hdr;
+    for (j = 0; j < MGET_KEYS; j++) expect_mget += testBulk(values[j]);
+
+    /* GET */
+    syscalls = sent = 0;
+    for (i = 0; i < iters; i++) {
+        std::vector<std::string> r;
+        const char *argv[2] = {"GET", keys[i % MGET_KEYS].c_str()};
+        long long start = testUs();
+
+        testAppendArgv(tc, 2, argv, NULL);
+        testRun(tc);
+        if (testRead(tc, 1, &r) != 1) {
+            CHECK(0, "GET of %zu bytes did not reply", len);
+            return;
+        }
+        lat_get.push_back(testUs()-start);
+        CHECK(r[0] == testBulk(values[i % MGET_KEYS]), "GET of %zu bytes: wrong reply", len);
+    }
+    get_calls = syscalls; get_bytes = sent;
+
+    /* MGET */
+    syscalls = sent = 0;
+    for (i = 0; i < iters; i++) {
+        std::vector<std::string> r;
+        std::vector<const char*> argv;
+        long long start = testUs();
+
+        argv.push_back("MGET");
+        for (j = 0; j < MGET_KEYS; j++) argv.push_back(keys[j].c_str());
+        testAppendArgv(tc, (int)argv.size(), &argv[0], NULL);
+        testRun(tc);
+        if (testRead(tc, 1, &r) != 1) {
+            CHECK(0, "MGET of %zu bytes did not reply", len);
+            return;
+        }
+        lat_mget.push_back(testUs()-start);
+        CHECK(r[0] == expect_mget, "MGET of %zu bytes: wrong reply", len);
+    }
+    mget_calls = syscalls; mget_bytes = sent;
+
+    CHECK(get_bytes == (long long)testBulk(values[0]).size()*iters,
+        "GET of %zu bytes: sent %lld bytes", len, get_bytes);
+    CHECK(mget_bytes == (long long)expect_mget.size()*iters,
+        "MGET of %zu bytes: sent %lld bytes", len, mget_bytes);
+    /* Header, value and CRLF go out together, and an MGET that fits the
+     * per-event limit in one writev. */
+    CHECK(get_calls <= iters || len > NET_MAX_WRITES_PER_EVENT,
+        "GET of %zu bytes: %lld syscalls for %d replies", len, get_calls, iters);
+    if (expect_mget.size() <= NET_MAX_WRITES_PER_EVENT)
+        CHECK(mget_calls == iters, "MGET of %zu bytes: %lld syscalls for %d replies",
+            len, mget_calls, iters);
+
+    printf("[ok] %6zu B values: GET  %8.0f B/syscall p50 %4lld us p99 %4lld us\n",
+        len, (double)get_bytes/get_calls,
+        testPercentile(lat_get, 50), testPercentile(lat_get, 99));
+    printf("[ok] %6zu B values: MGET %8.0f B/syscall p50 %4lld us p99 %4lld us (%d keys)\n",
+        len, (double)mget_bytes/mget_calls,
+        testPercentile(lat_mget, 50), testPercentile(lat_mget, 99), MGET_KEYS);
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    size_t sizes[3] = {1024, 16*1024, 256*1024};
+    testClient *tc;
+    int j;
+
+    /* Values must go out as stored */
+    testCreateServer("compression no\n");
+    tc = testConnect(CreateTinyRedisProc(g_redisDB));
+    count_fd = tc->c->fd;
+
+    for (j = 0; j < 3; j++)
+        runSize(tc, sizes[j], bench ? 20000 : (sizes[j] > 65536 ? 50 : 500));
+
+    testDisconnect(tc);
+    return testReport();
+}
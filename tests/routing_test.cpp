@@ -0,0 +1,239 @@
+/* Command routing: getDBIndex() against the key array it replaced.
+ *
+ * refGetDBIndex() is the routing as it was, through getKeysFromCommand()
+ * and its zmalloc'd array of argv positions. For every command of the
+ * table, at every arity it accepts up to a few extra arguments, and with
+ * all the arguments in one slot, in two slots or each in its own slot,
+ * getDBIndex() must return the same slot (or -2, or 0x4000 without keys).
+ *
+ * Then the cost of routing a GET, old and new, and of a whole pipelined
+ * GET, in instructions where the kernel lets us count them
+ * (perf_event_open) and in nanoseconds always.
+ *
+ * ./tests/routing_test [bench] */
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "testhelp.h"
+
+#define EXTRA_ARGS 6
+#define PIPELINE 128
+
+/* ------------------------------ Reference -------------------------------- */
+
+static int *refGetKeysFromCommand(struct redisCommand *cmd, int argc, int *numkeys) {
+    int j, i = 0, last, *keys;
+
+    if (cmd->firstkey == 0) {
+        *numkeys = 0;
+        return NULL;
+    }
+    last = cmd->lastkey;
+    if (last < 0) last = argc+last;
+    keys = (int*)zmalloc(sizeof(int)*((last - cmd->firstkey)+1));
+    for (j = cmd->firstkey; j <= last; j += cmd->keystep) keys[i++] = j;
+    *numkeys = i;
+    return keys;
+}
+
+static int refGetDBIndex(struct redisCommand *cmd, robj **argv, int argc) {
+    int i, slot = -1, *keyindex, numkeys;
+
+    keyindex = refGetKeysFromCommand(cmd, argc, &numkeys);
+    for (i = 0; i < numkeys; i++) {
+        robj *thiskey = argv[keyindex[i]];
+        int thisslot = keyHashSlot((const char*)thiskey->ptr, sdslen((sds)thiskey->ptr));
+
+        if (slot >= 0 && thisslot != slot) {
+            slot = -2;
+            break;
+        }
+        slot = thisslot;
+    }
+    if (numkeys == 0) slot = 0x4000;
+    if (keyindex) zfree(keyindex);
+    return slot;
+}
+
+/* ------------------------------- Counters -------------------------------- */
+
+/* Instructions retired by this thread in user space, -1 if not available */
+static int perfOpen(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long perfRead(int fd) {
+    long long count = 0;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+    return count;
+}
+
+typedef struct cost {
+    long long n, ins, ns;
+} cost;
+
+static void costPrint(const char *name, cost *c, int perf) {
+    if (perf)
+        printf("[ok] %-22s %7.1f instructions %7.1f ns\n", name, (double)c->ins/c->n,
+            (double)c->ns/c->n);
+    else
+        printf("[ok] %-22s %7.1f ns\n", name, (double)c->ns/c->n);
+}
+
+/* -------------------------------- Checks --------------------------------- */
+
+static robj **makeArgv(const char *name, int argc, int tags, int variant) {
+    robj **argv = (robj**)zmalloc(sizeof(robj*)*argc);
+    char buf[64];
+    int j;
+
+    argv[0] = createStringObject(name, strlen(name));
+    for (j = 1; j < argc; j++) {
+        /* variant 0: one tag, 1: two tags, 2: one tag per argument */
+        int tag = variant == 0 ? 0 : (variant == 1 ? j % 2 : j);
+
+        snprintf(buf, sizeof(buf), "arg:%d:{t%d}", j, tag % tags);
+        argv[j] = createStringObject(buf, strlen(buf));
+    }
+    return argv;
+}
+
+static void freeArgv(robj **argv, int argc) {
+    for (int j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+}
+
+static void checkRouting(TinyRedisProc *proc) {
+    dictIterator *di = dictGetIterator(g_redisDB->commands);
+    dictEntry *de;
+    int commands = 0, cases = 0;
+
+    while ((de = dictNext(di)) != NULL) {
+        struct redisCommand *cmd = (struct redisCommand*)dictGetVal(de);
+        int min = cmd->arity > 0 ? cmd->arity : -cmd->arity;
+        int max = cmd->arity > 0 ? cmd->arity : min+EXTRA_ARGS;
+
+        CHECK(lookupCommand(proc, (sds)dictGetKey(de)) == cmd, "lookup of %s", cmd->name);
+        CHECK(((cmd->flags & CMD_SINGLE_KEY) != 0) ==
+            (cmd->firstkey > 0 && cmd->firstkey == cmd->lastkey),
+            "%s: CMD_SINGLE_KEY does not match its key spec", cmd->name);
+        for (int argc = min > 1 ? min : 1; argc <= max; argc++) {
+            for (int variant = 0; variant < 3; variant++) {
+                robj **argv = makeArgv(cmd->name, argc, 64, variant);
+                int want = refGetDBIndex(cmd, argv, argc);
+                int got = getDBIndex(NULL, cmd, argv, argc);
+
+                CHECK(got == want, "%s with %d arguments (variant %d): slot %d, want %d",
+                    cmd->name, argc, variant, got, want);
+                freeArgv(argv, argc);
+                cases++;
+            }
+        }
+        commands++;
+    }
+    dictReleaseIterator(di);
+    printf("[ok] %d commands, %d argument lists: same slots as the key array routing\n",
+        commands, cases);
+}
+
+/* A command lands in the slot its key hashes to */
+static void checkDispatch(testClient *tc) {
+    const char *keys[3] = {"plain", "user:{42}:name", "{}empty-tag"};
+
+    for (int j = 0; j < 3; j++) {
+        std::string cmd = std::string("SET ") + keys[j] + " v";
+        redisDb *db = &g_redisDB->db[keyHashSlot(keys[j], strlen(keys[j]))];
+        sds key = sdsnew(keys[j]);
+
+        CHECK(testCommand(tc, cmd.c_str()) == TEST_OK, "%s", cmd.c_str());
+        CHECK(dictFind(db->d, key) != NULL, "%s not in slot %d", keys[j], db->id);
+        sdsfree(key);
+    }
+    printf("[ok] SET stores the key in the slot it hashes to\n");
+}
+
+/* --------------------------------- Cost ---------------------------------- */
+
+static void routeCost(long long n, int fd, int old, cost *c) {
+    struct redisCommand *cmd;
+    robj **argv = makeArgv("get", 2, 1, 0);
+    sds name = sdsnew("get");
+    long long start, ins;
+    volatile int sink = 0;
+
+    cmd = (struct redisCommand*)dictFetchValue(g_redisDB->commands, name);
+    sdsfree(name);
+    ins = perfRead(fd);
+    start = testUs();
+    for (long long i = 0; i < n; i++)
+        sink += old ? refGetDBIndex(cmd, argv, 2) : getDBIndex(NULL, cmd, argv, 2);
+    c->ns = (testUs()-start)*1000;
+    c->ins = perfRead(fd)-ins;
+    c->n = n;
+    freeArgv(argv, 2);
+}
+
+static void getCost(testClient *tc, long long n, int fd, cost *c) {
+    long long ins = 0, ns = 0, done;
+
+    CHECK(testCommand(tc, "SET route:key value") == TEST_OK, "SET route:key");
+    for (done = 0; done < n; done += PIPELINE) {
+        long long start, i0;
+
+        for (int j = 0; j < PIPELINE; j++) testAppend(tc, "GET route:key");
+        /* Only the server side: parse, route, lock, run, reply */
+        i0 = perfRead(fd);
+        start = testUs();
+        testRun(tc);
+        handleClientsWithPendingWrites(tc->c->proc);
+        ns += testUs()-start;
+        ins += perfRead(fd)-i0;
+        if (testRead(tc, PIPELINE, NULL) != PIPELINE) {
+            CHECK(0, "GET pipeline did not reply");
+            break;
+        }
+    }
+    c->ns = ns*1000;
+    c->ins = ins;
+    c->n = done;
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    long long n = bench ? 20000000 : 1000000;
+    int fd;
+    testClient *tc;
+    cost old, cur, get;
+
+    testCreateServer(NULL);
+    tc = testConnect(CreateTinyRedisProc(g_redisDB));
+
+    checkRouting(tc->c->proc);
+    checkDispatch(tc);
+
+    fd = perfOpen();
+    if (fd < 0) printf("[..] no instruction counter (%s), time only\n", strerror(errno));
+    routeCost(n, fd, 1, &old);
+    routeCost(n, fd, 0, &cur);
+    getCost(tc, n/10, fd, &get);
+    costPrint("route GET, key array", &old, fd >= 0);
+    costPrint("route GET, key spec", &cur, fd >= 0);
+    costPrint("pipelined GET", &get, fd >= 0);
+    CHECK(cur.ns < old.ns, "routing with the key spec is not cheaper: %lld ns, %lld ns before",
+        cur.ns, old.ns);
+    if (fd >= 0) close(fd);
+
+    testDisconnect(tc);
+    return testReport();
+}
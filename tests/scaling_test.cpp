@@ -0,0 +1,125 @@
+/* GET throughput with 1..N workers.
+ *
+ * Every worker thread owns one proc and one client, like a Worker with its
+ * event loop, and runs pipelined GETs of random preloaded keys through
+ * processInputBuffer() for a fixed time. The keys spread over all the slots,
+ * so the workers only meet on the slot locks and the allocator. The replies
+ * are checked against the values that were set.
+ *
+ * ./tests/scaling_test [bench] */
+
+#include "testhelp.h"
+
+#define PIPELINE 64
+
+static long long nkeys;
+static long long run_us;
+
+typedef struct workerArg {
+    testClient *tc;
+    unsigned seed;
+    long long ops;
+} workerArg;
+
+static void keyName(char *buf, size_t len, long long i) {
+    snprintf(buf, len, "key:%lld", i);
+}
+
+static std::string valueOf(long long i) {
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "value:%020lld", i);
+    return buf;
+}
+
+static void *workerMain(void *arg) {
+    workerArg *wa = (workerArg*)arg;
+    long long start = testUs();
+    long long idx[PIPELINE];
+    std::vector<std::string> replies;
+    char key[64];
+    int j;
+
+    while (testUs()-start < run_us) {
+        for (j = 0; j < PIPELINE; j++) {
+            const char *argv[2] = {"GET", key};
+            idx[j] = rand_r(&wa->seed) % nkeys;
+            keyName(key, sizeof(key), idx[j]);
+            testAppendArgv(wa->tc, 2, argv, NULL);
+        }
+        testRun(wa->tc);
+        replies.clear();
+        if (testRead(wa->tc, PIPELINE, &replies) != PIPELINE) {
+            CHECK(0, "worker got %zu of %d replies", replies.size(), PIPELINE);
+            break;
+        }
+        /* Checking every reply would measure the check. */
+        CHECK(replies[0] == testBulk(valueOf(idx[0])),
+            "GET key:%lld returned %s", idx[0], replies[0].c_str());
+        wa->ops += PIPELINE;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxw = bench ? (int)(ncpu > 1 ? ncpu : 2) : 4;
+    std::vector<testClient*> clients;
+    double base = 0;
+    char key[64];
+    int w, j;
+
+    nkeys = bench ? 1000000 : 100000;
+    run_us = bench ? 3000000 : 200000;
+
+    testCreateServer(NULL);
+    for (j = 0; j < maxw; j++) {
+        TinyRedisProc *proc = CreateTinyRedisProc(g_redisDB);
+        if (!proc) {
+            fprintf(stderr, "CreateTinyRedisProc failed\n");
+            return 1;
+        }
+        clients.push_back(testConnect(proc));
+    }
+
+    for (long long i = 0; i < nkeys; i++) {
+        std::string v = valueOf(i);
+        const char *args[3] = {"SET", key, v.c_str()};
+        keyName(key, sizeof(key), i);
+        testAppendArgv(clients[0], 3, args, NULL);
+        if (i % 1000 == 999 || i == nkeys-1) {
+            int n = i % 1000 + 1;
+            testRun(clients[0]);
+            CHECK(testRead(clients[0], n, NULL) == n, "preload stalled at %lld", i);
+        }
+    }
+
+    printf("[..] %lld keys, pipeline %d, %ld cpus\n", nkeys, PIPELINE, ncpu);
+    for (w = 1; w <= maxw; w = (w*2 > maxw && w < maxw) ? maxw : w*2) {
+        std::vector<pthread_t> tids(w);
+        std::vector<workerArg> args(w);
+        long long ops = 0, start = testUs();
+        double rate;
+
+        for (j = 0; j < w; j++) {
+            args[j].tc = clients[j];
+            args[j].seed = j+1;
+            args[j].ops = 0;
+            pthread_create(&tids[j], NULL, workerMain, &args[j]);
+        }
+        for (j = 0; j < w; j++) {
+            pthread_join(tids[j], NULL);
+            ops += args[j].ops;
+        }
+        CHECK(ops > 0, "%d workers did no GET", w);
+
+        rate = ops*1e6/(testUs()-start);
+        if (w == 1) base = rate;
+        printf("[ok] %2d workers: %10.0f GET/s, %.2fx of one worker\n",
+            w, rate, base > 0 ? rate/base : 0);
+    }
+
+    for (j = 0; j < maxw; j++) testDisconnect(clients[j]);
+    return testReport();
+}
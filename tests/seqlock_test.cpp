@@ -0,0 +1,225 @@
+/* Lock free optimistic reads against writers on the same slot.
+ *
+ * Stress: writer threads SET, overwrite and DEL a few keys of one slot with
+ * values of a single repeated letter whose length depends on the letter,
+ * so every overwrite frees and reallocates. Reader threads GET and EXISTS
+ * the same keys with lockfree-reads on: a reply must be nil or a whole
+ * value, never a torn or freed one.
+ *
+ * Throughput: 90% GET / 10% SET of random keys over all the slots, from 1
+ * to 32 threads, with lockfree-reads on and off (the slot rwlock).
+ *
+ * ./tests/seqlock_test [bench] */
+
+#include "testhelp.h"
+
+#define HOT_KEYS 8
+#define PIPELINE 16
+
+static std::string hot[HOT_KEYS];
+static int stop_flag;
+
+static size_t letterLen(char l) {
+    return 1 + ((l-'a')*331) % 3000;
+}
+
+typedef struct threadArg {
+    testClient *tc;
+    unsigned seed;
+    int write_pct;      /* Mixed phase only */
+    long long nkeys;    /* Mixed phase only */
+    long long ops;
+} threadArg;
+
+static void *stressWriter(void *arg) {
+    threadArg *ta = (threadArg*)arg;
+    std::vector<std::string> replies;
+
+    while (!__atomic_load_n(&stop_flag,__ATOMIC_RELAXED)) {
+        int j;
+
+        for (j = 0; j < PIPELINE; j++) {
+            const std::string& key = hot[rand_r(&ta->seed) % HOT_KEYS];
+            if (rand_r(&ta->seed) % 8 == 0) {
+                const char *argv[2] = {"DEL", key.c_str()};
+                testAppendArgv(ta->tc, 2, argv, NULL);
+            } else {
+                char l = 'a' + rand_r(&ta->seed) % 26;
+                std::string v(letterLen(l), l);
+                const char *argv[3] = {"SET", key.c_str(), v.c_str()};
+                testAppendArgv(ta->tc, 3, argv, NULL);
+            }
+        }
+        testRun(ta->tc);
+        replies.clear();
+        CHECK(testRead(ta->tc, PIPELINE, &replies) == PIPELINE, "writer stalled");
+        ta->ops += PIPELINE;
+    }
+    return NULL;
+}
+
+/* A GET reply must be nil or one of the values the writers store. */
+static int validValue(const std::string& r) {
+    size_t hdr, len;
+    char l;
+
+    if (r == TEST_NIL) return 1;
+    if (r[0] != '$') return 0;
+    hdr = r.find("\r\n")+2;
+    len = r.size()-hdr-2;
+    l = r[hdr];
+    if (l < 'a' || l > 'z' || len != letterLen(l)) return 0;
+    return r.find_first_not_of(l, hdr) == hdr+len;
+}
+
+static void *stressReader(void *arg) {
+    threadArg *ta = (threadArg*)arg;
+    std::vector<std::string> replies;
+
+    while (!__atomic_load_n(&stop_flag,__ATOMIC_RELAXED)) {
+        int j;
+
+        for (j = 0; j < PIPELINE; j++) {
+            const std::string& key = hot[j % HOT_KEYS];
+            const char *argv[2] = {j < HOT_KEYS ? "GET" : "EXISTS", key.c_str()};
+            testAppendArgv(ta->tc, 2, argv, NULL);
+        }
+        testRun(ta->tc);
+        replies.clear();
+        if (testRead(ta->tc, PIPELINE, &replies) != PIPELINE) {
+            CHECK(0, "reader stalled");
+            break;
+        }
+        for (j = 0; j < PIPELINE; j++) {
+            if (j < HOT_KEYS) {
+                CHECK(validValue(replies[j]), "torn GET reply '%.40s' (%zu bytes)",
+                    replies[j].c_str(), replies[j].size());
+            } else {
+                CHECK(replies[j] == ":0\r\n" || replies[j] == ":1\r\n",
+                    "bad EXISTS reply '%s'", replies[j].c_str());
+            }
+        }
+        ta->ops += PIPELINE;
+    }
+    return NULL;
+}
+
+static void *mixedThread(void *arg) {
+    threadArg *ta = (threadArg*)arg;
+    char key[64];
+
+    while (!__atomic_load_n(&stop_flag,__ATOMIC_RELAXED)) {
+        int j;
+
+        for (j = 0; j < PIPELINE; j++) {
+            snprintf(key, sizeof(key), "key:%lld", (long long)(rand_r(&ta->seed) % ta->nkeys));
+            if ((int)(rand_r(&ta->seed) % 100) < ta->write_pct) {
+                const char *argv[3] = {"SET", key, "0123456789abcdef0123456789abcdef"};
+                testAppendArgv(ta->tc, 3, argv, NULL);
+            } else {
+                const char *argv[2] = {"GET", key};
+                testAppendArgv(ta->tc, 2, argv, NULL);
+            }
+        }
+        testRun(ta->tc);
+        if (testRead(ta->tc, PIPELINE, NULL) != PIPELINE) {
+            CHECK(0, "mixed thread stalled");
+            break;
+        }
+        ta->ops += PIPELINE;
+    }
+    return NULL;
+}
+
+/* Run 'n' threads of 'fn' (the first 'nwriters' with 'wfn') for 'us' */
+static long long runThreads(std::vector<testClient*>& clients, int n,
+        void *(*fn)(void*), int nwriters, void *(*wfn)(void*),
+        long long nkeys, long long us, long long *wops)
+{
+    std::vector<pthread_t> tids(n);
+    std::vector<threadArg> args(n);
+    long long ops = 0;
+    int j;
+
+    stop_flag = 0;
+    for (j = 0; j < n; j++) {
+        args[j].tc = clients[j];
+        args[j].seed = j*7919+1;
+        args[j].write_pct = 10;
+        args[j].nkeys = nkeys;
+        args[j].ops = 0;
+        pthread_create(&tids[j], NULL, j < nwriters ? wfn : fn, &args[j]);
+    }
+    usleep(us);
+    __atomic_store_n(&stop_flag,1,__ATOMIC_RELAXED);
+    for (j = 0; j < n; j++) {
+        pthread_join(tids[j], NULL);
+        if (j < nwriters) { if (wops) *wops += args[j].ops; }
+        else ops += args[j].ops;
+    }
+    return ops;
+}
+
+int main(int argc, char **argv) {
+    int bench = testIsBench(argc, argv);
+    int maxthreads = bench ? 32 : 4;
+    long long nkeys = bench ? 1000000 : 10000;
+    long long us = bench ? 2000000 : 300000;
+    std::vector<testClient*> clients;
+    int slot, j;
+
+    testCreateServer("lockfree-reads yes\n");
+    for (j = 0; j < maxthreads; j++)
+        clients.push_back(testConnect(CreateTinyRedisProc(g_redisDB)));
+
+    /* Stress on one slot */
+    slot = 1234;
+    for (j = 0; j < HOT_KEYS; j++) {
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "hot%d", j);
+        hot[j] = testKeyInSlot(prefix, slot);
+    }
+    {
+        long long wops = 0, rops;
+        unsigned long long seq0 = g_redisDB->db[slot].seq;
+        int n = bench ? 8 : 4;
+
+        rops = runThreads(clients, n, stressReader, n/2, stressWriter, 0,
+            bench ? 5000000 : 500000, &wops);
+        CHECK(rops > 0 && wops > 0, "no progress: %lld reads, %lld writes", rops, wops);
+        CHECK(g_redisDB->db[slot].seq > seq0 && !(g_redisDB->db[slot].seq & 1),
+            "slot seq %llu after %lld writes", (unsigned long long)g_redisDB->db[slot].seq, wops);
+        for (j = 0; j < maxthreads; j++)
+            CHECK(g_redisDB->procs[j]->reading == NULL, "proc %d left reading set", j);
+        printf("[ok] %d readers x %d writers on slot %d, %lld reads, %lld writes\n",
+            n-n/2, n/2, slot, rops, wops);
+    }
+
+    /* Mixed throughput */
+    for (long long i = 0; i < nkeys; i += 1000) {
+        int n = 0;
+        for (long long k = i; k < i+1000 && k < nkeys; k++, n++) {
+            char key[64];
+            const char *args[3] = {"SET", key, "0123456789abcdef0123456789abcdef"};
+            snprintf(key, sizeof(key), "key:%lld", k);
+            testAppendArgv(clients[0], 3, args, NULL);
+        }
+        testRun(clients[0]);
+        CHECK(testRead(clients[0], n, NULL) == n, "preload stalled at %lld", i);
+    }
+    printf("[..] 90%% GET / 10%% SET over %lld keys, ops/s\n", nkeys);
+    for (int n = 1; n <= maxthreads; n *= 2) {
+        long long ops[2];
+
+        for (j = 0; j < 2; j++) {
+            g_redisDB->lockfree_reads = !j;
+            ops[j] = runThreads(clients, n, mixedThread, 0, NULL, nkeys, us, NULL);
+            CHECK(ops[j] > 0, "%d threads did nothing", n);
+        }
+        printf("[ok] %2d threads: lockfree %10.0f, rwlock %10.0f (%.2fx)\n", n,
+            ops[0]*1e6/us, ops[1]*1e6/us, ops[1] ? (double)ops[0]/ops[1] : 0);
+    }
+
+    for (j = 0; j < maxthreads; j++) testDisconnect(clients[j]);
+    return testReport();
+}
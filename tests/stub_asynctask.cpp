@@ -0,0 +1,17 @@
+/* The tiny-redis objects only need ASyncTask::PushTask() from the icache
+ * side. The tests link this instead of asynctask.o, which would pull in the
+ * Mongo and redis clients. Only the static member is declared here, the
+ * symbol is the same as the one of asynctask.h. */
+
+#include <stddef.h>
+
+class ASyncTask {
+public:
+    static int PushTask(const char* key, size_t len, int slot);
+};
+
+int (*testPushTaskHook)(const char *key, size_t len, int slot) = NULL;
+
+int ASyncTask::PushTask(const char* key, size_t len, int slot) {
+    return testPushTaskHook ? testPushTaskHook(key, len, slot) : 0;
+}
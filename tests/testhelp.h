@@ -0,0 +1,252 @@
+/* Helpers shared by the tests that run commands against the tiny-redis
+ * objects linked in-process (see the Makefile 'test' target).
+ *
+ * A test creates the TinyRedisDB and its procs from the main thread, like
+ * main() does, then connects clients over a socketpair: the server side is
+ * a regular client of the proc, the test reads the replies from the other
+ * end. Commands go through processInputBuffer(), so parsing, routing,
+ * locking and the reply path are the ones the server runs.
+ *
+ * Each test is a single translation unit, so everything here is static inline. */
+
+#ifndef __TESTHELP_H__
+#define __TESTHELP_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "server.h"
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[fail] %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        __atomic_add_fetch(&test_failures,1,__ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+/* Exit code of main() */
+static inline int testReport(void) {
+    if (test_failures) {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return 1;
+    }
+    return 0;
+}
+
+/* Monotonic microseconds, for the measurements */
+static inline long long testUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/* p-th percentile (0..100) of 'v', which is sorted in place */
+static inline long long testPercentile(std::vector<long long>& v, double p) {
+    size_t idx;
+
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    idx = (size_t)(p/100*(v.size()-1));
+    return v[idx];
+}
+
+/* 'make bench' runs the tests as "<test> bench": full sizes and longer
+ * runs instead of the quick ones of 'make test'. */
+static inline int testIsBench(int argc, char **argv) {
+    return argc > 1 && !strcmp(argv[1], "bench");
+}
+
+/* Set by the test to see the misses that GET hands to the async fill,
+ * see stub_asynctask.cpp. Returns what ASyncTask::PushTask() would. */
+extern int (*testPushTaskHook)(const char *key, size_t len, int slot);
+
+/* ---------------------------- Server side -------------------------------- */
+
+/* Create g_redisDB with 'config' applied on top of the defaults, the same
+ * directives as the config file. */
+static inline TinyRedisDB *testCreateServer(const char *config) {
+    g_redisDB = CreateTinyRedisDB();
+    if (config) {
+        sds s = sdsnew(config);
+        loadServerConfigFromString(s);
+        sdsfree(s);
+    }
+    return g_redisDB;
+}
+
+/* A key in 'slot': "<prefix>{<tag>}" where the tag is searched so that
+ * the key hashes to 'slot'. */
+static inline std::string testKeyInSlot(const char *prefix, int slot) {
+    char buf[128];
+
+    for (unsigned i = 0; ; i++) {
+        snprintf(buf, sizeof(buf), "%s{%u}", prefix, i);
+        const char *tag = strchr(buf, '{');
+        if ((int)keyHashSlot(tag+1, strlen(tag+1)-1) == slot) return buf;
+    }
+}
+
+/* ---------------------------- Client side -------------------------------- */
+
+typedef struct testClient {
+    client *c;          /* Server side, a client of 'proc' */
+    int peer;           /* Our end of the socketpair */
+    std::string in;     /* Read from 'peer', not parsed yet */
+} testClient;
+
+static inline testClient *testConnect(TinyRedisProc *proc) {
+    int fds[2];
+    testClient *tc;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    tc = new testClient;
+    tc->c = createClient(fds[0], proc);
+    tc->peer = fds[1];
+    fcntl(tc->peer, F_SETFL, fcntl(tc->peer, F_GETFL) | O_NONBLOCK);
+    return tc;
+}
+
+static inline void testDisconnect(testClient *tc) {
+    freeClient(tc->c);
+    close(tc->peer);
+    delete tc;
+}
+
+/* Append one command to the query buffer of the client, RESP encoded */
+static inline void testAppendArgv(testClient *tc, int argc, const char **argv, const size_t *lens) {
+    client *c = tc->c;
+    int j;
+
+    c->querybuf = sdscatprintf(c->querybuf, "*%d\r\n", argc);
+    for (j = 0; j < argc; j++) {
+        size_t len = lens ? lens[j] : strlen(argv[j]);
+        c->querybuf = sdscatprintf(c->querybuf, "$%zu\r\n", len);
+        c->querybuf = sdscatlen(c->querybuf, argv[j], len);
+        c->querybuf = sdscatlen(c->querybuf, "\r\n", 2);
+    }
+}
+
+/* Same with the arguments separated by spaces, e.g. "SET foo bar" */
+static inline void testAppend(testClient *tc, const char *cmdline) {
+    std::vector<std::string> args;
+    std::vector<const char*> argv;
+    const char *p = cmdline;
+
+    while (*p) {
+        const char *e = strchr(p, ' ');
+        if (!e) e = p+strlen(p);
+        if (e > p) args.push_back(std::string(p, e-p));
+        p = *e ? e+1 : e;
+    }
+    for (size_t j = 0; j < args.size(); j++) argv.push_back(args[j].c_str());
+    testAppendArgv(tc, (int)argv.size(), &argv[0], NULL);
+}
+
+/* Length of the RESP reply at the start of 's', 0 if not complete yet */
+static inline size_t testReplyLen(const char *s, size_t len) {
+    const char *nl = (const char*)memchr(s, '\n', len);
+    size_t hdr;
+    long long n;
+
+    if (!nl) return 0;
+    hdr = nl-s+1;
+    n = strtoll(s+1, NULL, 10);
+    switch (s[0]) {
+    case '+': case '-': case ':':
+        return hdr;
+    case '$':
+        if (n < 0) return hdr;
+        return len >= hdr+n+2 ? hdr+n+2 : 0;
+    case '*': {
+        size_t off = hdr;
+        for (long long j = 0; j < n; j++) {
+            size_t l = testReplyLen(s+off, len-off);
+            if (l == 0) return 0;
+            off += l;
+        }
+        return off;
+    }
+    default:
+        fprintf(stderr, "bad reply: %.*s\n", (int)len, s);
+        exit(1);
+    }
+}
+
+/* Flush the replies of the client and collect 'n' of them from the peer.
+ * Returns how many were read before 'timeout_ms'. */
+static inline int testRead(testClient *tc, int n, std::vector<std::string> *out, long long timeout_ms = 5000) {
+    long long deadline = mstime()+timeout_ms;
+    int got = 0;
+    char buf[65536];
+
+    /* What beforeSleep() does, then keep flushing what did not fit in the
+     * socket buffer while we read. */
+    handleClientsWithPendingWrites(tc->c->proc);
+    while (got < n) {
+        size_t l;
+
+        while (got < n && (l = testReplyLen(tc->in.data(), tc->in.size())) != 0) {
+            if (out) out->push_back(tc->in.substr(0, l));
+            tc->in.erase(0, l);
+            got++;
+        }
+        if (got == n) break;
+
+        if (clientHasPendingReplies(tc->c)) writeToClient(tc->c->fd, tc->c, 0);
+        ssize_t nread = read(tc->peer, buf, sizeof(buf));
+        if (nread > 0) {
+            tc->in.append(buf, nread);
+        } else if (mstime() > deadline) {
+            break;
+        } else if (nread < 0 && errno == EAGAIN) {
+            usleep(100);
+        }
+    }
+    return got;
+}
+
+/* Run what was appended with testAppend*() */
+static inline void testRun(testClient *tc) {
+    processInputBuffer(tc->c);
+}
+
+/* Run one command and return its reply, "" on timeout */
+static inline std::string testCommand(testClient *tc, const char *cmdline) {
+    std::vector<std::string> r;
+
+    testAppend(tc, cmdline);
+    testRun(tc);
+    if (testRead(tc, 1, &r) != 1) return "";
+    return r[0];
+}
+
+/* RESP of a bulk string reply */
+static inline std::string testBulk(const std::string& s) {
+    char hdr[32];
+
+    snprintf(hdr, sizeof(hdr), "$%zu\r\n", s.size());
+    return hdr+s+"\r\n";
+}
+
+#define TEST_NIL "$-1\r\n"
+#define TEST_OK "+OK\r\n"
+
+#endif